@@ -70,16 +70,21 @@
 #include "DR_protocol.h"
 #include "read_input_script_file.h" //this means that it requires math.h (that header has NAN)
 #include "string_double.h"
+#include "crc32c.h"
+#include "restart_delta.h"
 
 
 #define IDSIZE sizeof(struct ID_struct)
 #define INTSIZE sizeof(int)
 
-#define COMPRESS_RESTART true
+// the restart is sent as it is so that the server can send the next one as a delta against it (HaveRestart);
+// deflating it costs far more CPU than the delta and the server can then only send whole restarts
+#define COMPRESS_RESTART false
 
 unsigned int do_compress2(int ifd, char *ocp);
 void do_uncompress2(int total, char *icp, int ofd);
 void sendFile(int sockfd, char *filename, enum command_enum command, bool compress);
+void sendRestartFile(int sockfd, char *filename);
 int sendBinFile(int sockfd, char *filename, enum command_enum command);
 void sendCrdFile(int sockfd, char *filename, enum command_enum command);
 void sendJID(int sockfd, float jid);
@@ -90,6 +95,7 @@ void send_NextNonInteracting(int sockfd);
 enum command_enum readCommand(int socketfd);
 void receiveFile(int sockfd, char *fileName, int fileSize);
 void receiveFileUncompressed(int sockfd, char *fileName, int fileSize);
+void receiveRestartDelta(int sockfd, char *fileName, char *baseFileName, int fileSize);
 void receiveParCHARMM(int sockfd, struct ID_struct *ID, int fileSize);
 void read4K(int sockfd, void *buff, int nbytes);
 
@@ -113,6 +119,7 @@ int main(int argc, char *argv[]){
 		showUsage(argv[0]);
 		exit(1);
 	}
+	crc32c_init();
 	sscanf(argv[4],"%d",&tcs);
         sscanf(argv[5],"%d",&jid);
 	if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
@@ -239,7 +246,11 @@ int main(int argc, char *argv[]){
 			fprintf(stderr,"crd file sent\n"); //##DEBUG
 			fprintf(stderr,"sending rst file\n"); //##DEBUG
 			if(nni==1){
-				sendFile(sockfd,rstFileName,TakeRestartFile,COMPRESS_RESTART);     //send restart file
+				if(COMPRESS_RESTART){
+					sendFile(sockfd,rstFileName,TakeRestartFile,true);     //send restart file
+				}else{
+					sendRestartFile(sockfd,rstFileName);     //send restart file; the next restart may come as a delta against it
+				}
 				fprintf(stderr,"rst file sent\n"); //##DEBUG
 			}else{
 				//send indication of next NNI
@@ -253,7 +264,7 @@ int main(int argc, char *argv[]){
 	bool done=false;
 	char oneKbuff[1024];
 	int  readFileSize,oneK=1024;
-	//command_enum {ReplicaID, TakeThisFile, TakeRestartFile, TakeSampleData, TakeMoveEnergyData, TakeSimulationParameters, TakeCoordinateData, TakeTCS, TakeJID, NextNonInteracting, Exit, Snapshot, InvalidCommand};
+	//command_enum {ReplicaID, TakeThisFile, TakeRestartFile, TakeSampleData, TakeMoveEnergyData, TakeSimulationParameters, TakeCoordinateData, TakeTCS, TakeJID, NextNonInteracting, HaveRestart, TakeRestartDelta, Exit, Snapshot, LogLevel, InvalidCommand};
 	while(!done){
 		fprintf(stderr,"trying to get a command\n"); //##DEBUG
 		command=readCommand(sockfd);
@@ -305,6 +316,13 @@ int main(int argc, char *argv[]){
 				}
 				fprintf(stderr,"wrote restart file to file [%s]\n",IDrstFileName); //##DEBUG
 				break;
+			case TakeRestartDelta: //against the restart file that was sent
+				fprintf(stderr,"received TakeRestartDelta command\n"); //##DEBUG
+				new_replica_number=-1;
+				read4K(sockfd,&readFileSize,INTSIZE);
+				receiveRestartDelta(sockfd,IDrstFileName,rstFileName,readFileSize);
+				fprintf(stderr,"wrote restart file to file [%s]\n",IDrstFileName); //##DEBUG
+				break;
 			//case TakeSampleData:
 				//break;
 			case TakeMoveEnergyData: //uncompressed
@@ -570,6 +588,44 @@ void sendFile(int sockfd, char *filename, enum command_enum command, bool compre
 }
 
 
+// sends the restart file uncompressed with TakeRestartFile, after telling the server that this client holds it
+// (HaveRestart). The file is read once; its crc32c is taken from the same buffer that is sent
+void sendRestartFile(int sockfd, char *filename){
+	struct restart_held_struct held;
+	unsigned int size=sizeof(held);
+	char cmd[KEY_SIZE+COMMAND_SIZE+sizeof(unsigned int)];
+	unsigned char *buffer;
+	int fd;
+
+	fd=open(filename,O_RDONLY);
+	if(fd==-1){
+		fprintf(stderr,"cannot open %s\n",filename);
+		exit(1);
+	}
+	held.size=lseek(fd,0,SEEK_END);
+	lseek(fd,0,SEEK_SET);
+	if((buffer=(unsigned char *)malloc(held.size+1))==NULL){
+		fprintf(stderr,"cannot allocate memory for %s\n",filename);
+		exit(1);
+	}
+	read4K(fd,buffer,held.size);
+	close(fd);
+	held.crc=crc32c(buffer,held.size);
+
+	memcpy(cmd,COMMAND_KEY,KEY_SIZE);
+	cmd[COMMAND_LOCATION]=HaveRestart;
+	memcpy(cmd+KEY_SIZE+COMMAND_SIZE,&size,sizeof(size));
+	write(sockfd,cmd,sizeof(cmd));
+	write(sockfd,&held,sizeof(held));
+
+	cmd[COMMAND_LOCATION]=TakeRestartFile;
+	memcpy(cmd+KEY_SIZE+COMMAND_SIZE,&held.size,sizeof(held.size));
+	write(sockfd,cmd,sizeof(cmd));
+	write(sockfd,buffer,held.size);
+	free(buffer);
+}
+
+
 enum command_enum readCommand(int sockfd){
 	char buff[KEY_SIZE+COMMAND_SIZE];
 	read4K(sockfd,buff,KEY_SIZE+COMMAND_SIZE);
@@ -613,6 +669,64 @@ void receiveFileUncompressed(int sockfd, char *fileName, int fileSize){
 }
 
 
+// rebuilds the restart file fileName from a TakeRestartDelta against baseFileName, the restart file that was sent
+void receiveRestartDelta(int sockfd, char *fileName, char *baseFileName, int fileSize){
+	struct restart_delta_struct header;
+	unsigned char *delta, *base, *restart;
+	int fd;
+	unsigned int base_size;
+
+	if(fileSize<(int)sizeof(header)){
+		fprintf(stderr,"invalid restart delta of %d bytes\n",fileSize);
+		exit(1);
+	}
+	read4K(sockfd,&header,sizeof(header));
+	fileSize-=sizeof(header);
+	delta=(unsigned char *)malloc(fileSize+1);
+	restart=(unsigned char *)malloc(header.size+1);
+	base=(unsigned char *)malloc(header.base_size+1);
+	if(delta==NULL || restart==NULL || base==NULL){
+		fprintf(stderr,"cannot allocate memory for the restart delta\n");
+		exit(1);
+	}
+	read4K(sockfd,delta,fileSize);
+	fprintf(stderr,"received restart delta, size is: %d\n",fileSize); //##DEBUG
+
+	fd=open(baseFileName,O_RDONLY);
+	if(fd==-1){
+		fprintf(stderr,"cannot open %s\n",baseFileName);
+		exit(1);
+	}
+	base_size=lseek(fd,0,SEEK_END);
+	lseek(fd,0,SEEK_SET);
+	if(base_size!=header.base_size){
+		fprintf(stderr,"restart delta is against %u bytes but %s has %u bytes\n",header.base_size,baseFileName,base_size);
+		exit(1);
+	}
+	read4K(fd,base,base_size);
+	close(fd);
+	if(crc32c(base,base_size)!=header.base_crc){
+		fprintf(stderr,"restart delta is not against %s\n",baseFileName);
+		exit(1);
+	}
+	if(!restart_delta_decode(delta,fileSize,base,base_size,restart,header.size) || crc32c(restart,header.size)!=header.crc){
+		fprintf(stderr,"restart delta is corrupt\n");
+		exit(1);
+	}
+
+	fd=open(fileName,O_WRONLY|O_CREAT|O_TRUNC,0644);
+	if(fd==-1){
+		fprintf(stderr,"cannot open %s\n",fileName);
+		exit(1);
+	}
+	write(fd,restart,header.size);
+	close(fd);
+	free(delta);
+	free(base);
+	free(restart);
+}
+
+
 char *stringCat(char *d, const char *s){
 	int len=strlen(s);
 	for(int i=0; i<len; ++i)
@@ -60,8 +60,9 @@ int main(int argc, char *argv[])
   int sockfd; 
   struct sockaddr_in their_addr; // connector's address information 
 
-  if (argc != 4) {
-    fprintf(stderr,"Usage: %s IP-address port EXIT | SNAPSHOT\n",argv[0]);
+  if (argc != 4 && !(argc == 5 && strcmp(argv[3],"LOGLEVEL")==0)) {
+    fprintf(stderr,"Usage: %s IP-address port EXIT | SNAPSHOT | LOGLEVEL level\n",argv[0]);
+    fprintf(stderr,"       LOGLEVEL 0 logs errors only, 1 leaves out the per-move details, 2 logs everything\n");
     exit(1);
   }
 
@@ -101,6 +102,16 @@ int main(int argc, char *argv[])
     write(sockfd,cmd,sz);
     exit(1);
   }
+  else if(strcmp(argv[3],"LOGLEVEL")==0){
+    int level=atoi(argv[4]);
+    int sz=KEY_SIZE+COMMAND_SIZE+sizeof(level);
+    char cmd[sz];
+    memcpy(cmd,COMMAND_KEY2,KEY_SIZE);
+    cmd[COMMAND_LOCATION]=LogLevel;
+    memcpy(cmd+KEY_SIZE+COMMAND_SIZE,&level,sizeof(level));
+    write(sockfd,cmd,sz);
+    exit(1);
+  }
   exit(1);
   
 
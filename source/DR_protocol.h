@@ -57,22 +57,33 @@
 // TakeCoordinateData,         |---------|---------.....---------|
 //                              FILE SIZE     COORDINATE FILE
 //
+// HaveRestart                 |---------|---------------------|
+//                              FILE SIZE  restart_held_struct
+//   - sent before TakeRestartFile by a client that holds the restart file it sends, uncompressed. The server
+//     may then send the next restart as TakeRestartDelta against it
+//
+// TakeRestartDelta            |---------|----------------------|---------.....---------|
+//                              FILE SIZE  restart_delta_struct   DELTA (restart_delta.h)
+//
 // NextNonInteracting          ||
 //   - this is a note that the data will now be sent for the next non-interacting sampling 
 //     within the same simulation system
 // Exit or Snapshot            ||
 //
+// LogLevel,                   |---------|
+//                              LOG LEVEL (int)
+//
 // values of Exit and greater require the even more secret command
 // 
 
 #define PROTOCOL_VERSION_SIZE 4
-#define PROTOCOL_VERSION 5
+#define PROTOCOL_VERSION 6
 #define COMMAND_KEY  "REG COMMANDo"
 #define COMMAND_KEY2 "SECRET CMDos" // this must be the same size as COMMAND_KEY
 #define KEY_SIZE sizeof(COMMAND_KEY)
 #define KEY_LOCATION 0
 
-enum command_enum {ReplicaID, TakeThisFile, TakeRestartFile, TakeSampleData, TakeMoveEnergyData, TakeSimulationParameters, TakeCoordinateData, TakeTCS, TakeJID, NextNonInteracting, Exit, Snapshot, InvalidCommand};
+enum command_enum {ReplicaID, TakeThisFile, TakeRestartFile, TakeSampleData, TakeMoveEnergyData, TakeSimulationParameters, TakeCoordinateData, TakeTCS, TakeJID, NextNonInteracting, HaveRestart, TakeRestartDelta, Exit, Snapshot, LogLevel, InvalidCommand};
 #define COMMAND_SIZE 1
 #define COMMAND_LOCATION (KEY_LOCATION+KEY_SIZE)
 
@@ -87,3 +98,17 @@ struct ID_struct
 	unsigned int sequence_number;
 };
 
+struct restart_held_struct
+{
+	unsigned int size;
+	unsigned int crc;              //crc32c of the restart file
+};
+
+struct restart_delta_struct
+{
+	unsigned int size;             //of the restart file
+	unsigned int crc;              //crc32c of the restart file
+	unsigned int base_size;        //as given by HaveRestart
+	unsigned int base_crc;
+};
+
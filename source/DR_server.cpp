@@ -4,7 +4,7 @@
  *
  *  Distributed Replica manages a series of simulations that separately sample phase space
  *  and coordinates their efforts under the Distributed Replica Potential Energy Function.
- *  See, for example T. Rodinger, P.L. Howell, and R. Poms, "Distributed Replica Sampling"    
+ *  See, for example T. Rodinger, P.L. Howell, and R. Pom�s, "Distributed Replica Sampling"    
  *  J. Chem. Theory Comput., 2:725 (2006).
  *
  *  Distributed Replica is free software: you can redistribute it and/or modify
@@ -58,9 +58,14 @@
 
 *******************************************************************************************************************/
 
-#define SNAPSHOT_VERSION 2.0
+// Snapshots are written in the sectioned format of SNAPSHOT_VERSION. Files of LEGACY_SNAPSHOT_VERSION (and 1.0
+// for runs without vRE) are still loaded.
+#define SNAPSHOT_VERSION 3.0
+#define LEGACY_SNAPSHOT_VERSION 2.0
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <math.h>
 #include <time.h>
@@ -76,9 +81,13 @@
 #include <strings.h>
 #include <pthread.h>
 #include <sys/statvfs.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <signal.h>
 
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -86,6 +95,11 @@
 #include "force_database_class.h"
 #include "read_input_script_file.h"
 #include "vre.h"
+#include "nominal_grid.h"
+#include "crc32c.h"
+#include "wham.h"
+#include "restart_store.h"
+#include "restart_delta.h"
 
 #include <netinet/in.h>
 #if defined(__ICC)
@@ -111,11 +125,25 @@
 #define MOBILITY_CHECK_SECONDS 600
 #define MAX_FAILURES_FOR_SUBMISSION 1000
 
-//BUFFER_SIZE should be at least MAX_FILENAME_SIZE+1
-#define BUFFER_SIZE 4096  
 //REPLICA_MICRODIVISIONS is for continuous boltzmann jumping; this should be an odd nummber
 #define REPLICA_MICRODIVISIONS 51 
 
+//The connection reactor in wait_for_clients() gathers each client's upload without blocking, then hands it
+//to a pool of CLIENT_WORKER_THREADS that run client_interaction(). If the oldest queued client has waited
+//CLIENT_QUEUE_STALL_SECONDS, one more worker is started, up to CLIENT_WORKER_THREADS_MAX; the extra workers exit
+//once they find the queue empty. Workers parked in drop_one_old_node() do not count against either number, since
+//the client that they wait for needs a free worker to check in.
+#define CLIENT_WORKER_THREADS 8
+#define CLIENT_WORKER_THREADS_MAX 64
+#define CLIENT_QUEUE_STALL_SECONDS 2
+//a client that sends nothing for this long is handed over as is and will fail on the short read
+#define CLIENT_IDLE_TIMEOUT_SECONDS 600
+#define EPOLL_MAX_EVENTS 256
+//initial size of the per-connection receive buffer, on top of the largest restart file seen; it grows as needed
+#define CLIENT_INPUT_CHUNK 65536
+//client socket buffers are raised to hold the largest restart file seen, up to this many bytes
+#define CLIENT_SOCKET_BUFFER_MAX (64*1024*1024)
+
 #define USER_RESPONSIBILITY_STRING "I_TAKE_RESPONSIBILITY"
 #define currentProgrammerName "Chris Neale"
 #define currentProgrammerEmail "chris.neale@utoronto.ca"
@@ -124,6 +152,8 @@ const char *DEFINED_START_POS_FILE = "./switchStart.txt";
 
 enum simulation_status_enum {Running, DiskAlmostFull, Finished, AllottedTimeOver};
 enum energy_cancellation_status_enum {Disabled, Pending, Active, Active_and_Printed};
+// LogMoves adds the per-move VRE_INFO and MEOW lines
+enum log_level_enum {LogErrors, LogNormal, LogMoves};
 
 struct server_option_struct{
 	bool loadSnapshot;
@@ -134,8 +164,9 @@ struct server_option_struct{
 	int mobile_timeClientStarted;
 	char logdir[500];
 	int verbose;
+	int log_level;
 };
-#define DEFAULT_SERVER_OPTION_STRUCT {false,"",false,"","  ",0,"",0}
+#define DEFAULT_SERVER_OPTION_STRUCT {false,"",false,"","  ",0,"",0,LogMoves}
 
 struct server_variable_struct{
 	char working_directory[200];
@@ -163,35 +194,130 @@ struct node_struct{
 };
 
 struct client_bundle{
-	//used to pass variables to wait_for_clients(), then client_interaction() via pthread_create()
+	//used to pass variables to wait_for_clients(), then client_interaction() via the client queue
 	struct client_struct* client;
 	struct server_option_struct *opt;
 	struct server_variable_struct *var;
 	struct script_struct *script;
 	struct node_struct *node;
+	struct client_bundle *prev;   //pending connection list in wait_for_clients(), then the client queue
+	struct client_bundle *next;
 };
 
 class force_database_class *force_database;
 
+struct drpe_struct{
+	//scratch space for replica_potential() and replica_potential_trial(); guarded by the replica_mutex
+	int N;                //number of replicas in the trial set, or 0 if there is none
+	int allocated;
+	float *x;             //sorted, linearized positions
+	double *y_prefix;     //y_prefix[k] is the sum of x[i]-i over i<k
+	double y2_sum;        //sum of (x[i]-i)^2
+	double x_sum;
+};
+struct drpe_struct drpe={0,0,NULL,NULL,0.0,0.0};
+
+struct nominal_grid_struct nominal_grid;   //index over script->replica[].w_nominal, built in main()
+
+struct jump_kernel_struct{
+	//scratch space for the Boltzmann and continuous jumps, one entry per trial position; guarded by the replica_mutex
+	int allocated;
+	double *w;            //trial positions
+	double *p;            //dimensionless energies, then unnormalized Boltzmann weights
+	double *cdf;          //cumulative weight up to and including each trial position
+	double *cdf_reach;    //running maximum of cdf, searched instead of cdf when cdf is not monotone
+};
+struct jump_kernel_struct jump_kernel={0,NULL,NULL,NULL,NULL};
+
 struct client_struct{
 	int fd;
 	struct timeval time;
-	char *ptr;
-	char log[10000];
+	char *ptr;                   //end of the log text; append with client_printf()
+	char *log;                   //the log text, inside log_buffer
+	char *log_buffer;            //from acquire_client_log(); handed over by log_client_entry()
+	size_t log_allocated;
+	bool log_has_error;          //set by client_error_printf(); the log is then kept at every log level
 	char ip[50];
+	unsigned char *in;           //everything the client sent, gathered by wait_for_clients()
+	unsigned int in_size;
+	unsigned int in_allocated;
+	unsigned int in_read;        //position of read_bytes_from_socket() in in[]
+	unsigned int in_parsed;      //position of client_request_complete() in in[]
+	bool version_checked;
+	int nni_received;
+	time_t last_activity;
 };
 
 #define MESSAGE_GLOBALVAR_LENGTH 10000               //reduce with caution. There is no overflow test
-char logFile_globalVar[10];
+char logFile_globalVar[520];                         //-d directory (up to 500) + title + ".log"
 // The replica_mutex is also used to control access to the node structure
 pthread_mutex_t replica_mutex;
+// replica_data_mutex[i%REPLICA_DATA_LOCK_SHARDS] guards the bulk data of replica[i]: restart, presence and atom.
+// Restart and coordinate commits take only these, never the replica_mutex. If both are needed, take the
+// replica_mutex first and then the shards in increasing order (see lock_all_replica_data()).
+#define REPLICA_DATA_LOCK_SHARDS 64
+pthread_mutex_t replica_data_mutex[REPLICA_DATA_LOCK_SHARDS];
+// replica_restart[i] is the restart of replica i in the restart store (NULL until it has one) and is guarded like
+// the rest of its bulk data; script->replica[i].restart only keeps the size
+struct restart_recipe_struct **replica_restart=NULL;
+// snapshot_mutex only guards snapshot.busy; see struct snapshot_struct
+pthread_mutex_t snapshot_mutex;
+pthread_cond_t snapshot_cond;
+// log_mutex is only used while the log writer is not running (see log_entry())
 pthread_mutex_t log_mutex;
 pthread_mutex_t queue_mutex;
 pthread_mutex_t database_mutex;
-pthread_mutex_t vre_mutex;
+pthread_mutex_t client_queue_mutex;
+pthread_cond_t client_queue_cond;
+
+struct client_bundle *client_queue_head=NULL;
+struct client_bundle *client_queue_tail=NULL;
+int Nclient_workers=0;
+int Nclient_workers_parked=0;   //of Nclient_workers, those waiting in drop_one_old_node()
 
 char months[12][4]={"Jan","Feb","Mar","Apr","May","Jun","Jul","Aug","Sep","Oct","Nov","Dec"};
 
+// Log entries are formatted by the thread that logs them and queued on log_ring, a bounded lock-free ring with
+// many producers and one consumer: the log writer thread, which keeps the log file open and writes whatever is
+// queued with one writev() per batch. Slot i is free for the producer that claims position p when its sequence
+// is p, and holds an entry for the writer when its sequence is p+1.
+#define LOG_RING_SIZE 4096                      //must be a power of 2
+#define LOG_WRITER_BATCH 256                    //at most IOV_MAX
+#define LOG_WRITER_SLEEP_MICROSECONDS 20000     //how long the writer sleeps when the ring is empty
+#define LOG_FLUSH_TIMEOUT_SECONDS 10
+
+struct log_record_struct{
+	char *entry;                    //the text to write, time stamp included
+	char *buffer;                   //what to release once it is written
+	size_t allocated;               //0 if buffer came from format_log_entry(), else the size of a client log buffer
+};
+
+struct log_slot_struct{
+	volatile unsigned long sequence;
+	struct log_record_struct record;
+};
+struct log_slot_struct log_ring[LOG_RING_SIZE];
+volatile unsigned long log_ring_head=0;         //next position the writer takes; only the writer changes it
+volatile unsigned long log_ring_tail=0;         //next position a producer claims
+volatile bool log_writer_running=false;
+volatile bool log_writer_stop=false;
+pthread_t log_writer_handle;
+int log_fd=-1;
+// entries above log_level are not written; DR_commander LOGLEVEL changes it while the server runs
+volatile int log_level=LogMoves;
+
+// Each client builds its log in a buffer from this pool (see client_printf()). The buffer keeps LOG_STAMP_RESERVE
+// bytes in front of the text so that the time stamp can be put there and the whole buffer handed to the log
+// writer, which puts it back in the pool once it is written.
+#define CLIENT_LOG_INITIAL_SIZE 16384
+#define CLIENT_LOG_POOL_SIZE 64         //idle buffers kept for reuse
+#define CLIENT_LOG_KEEP_SIZE (1<<20)    //buffers that grew beyond this are freed instead
+#define LOG_STAMP_RESERVE 64
+char *client_log_pool[CLIENT_LOG_POOL_SIZE];
+size_t client_log_pool_allocated[CLIENT_LOG_POOL_SIZE];
+int Nclient_log_pool=0;
+pthread_mutex_t client_log_pool_mutex;
+
 float circularCancelLow, circularCancelHigh;
 float newCircularCancelLow, newCircularCancelHigh;
 
@@ -207,21 +333,8 @@ double sqr(double x){
 	return(x*x);
 }
 
-// Appends the given text to the log file
-// code here is used to specify the file descriptor of the connected client (specifying -1 prints no code)
-void append_log_entry(int code, const char *entry){
+int open_log_file(void){
 	int fd;
-	time_t t;
-	struct tm *tt;
-	char time_string[40];
-	int writecheck;
-
-	pthread_mutex_lock(&log_mutex);
-
-	t=time(NULL);
-	tt=localtime(&t);
-	if(code<0) sprintf(time_string,"[%s/%.2d/%.4d %.2d:%.2d:%.2d] ",months[tt->tm_mon],tt->tm_mday,tt->tm_year+1900,tt->tm_hour,tt->tm_min,tt->tm_sec);
-	else       sprintf(time_string,"[%s/%.2d/%.4d %.2d:%.2d:%.2d] <%d> ",months[tt->tm_mon],tt->tm_mday,tt->tm_year+1900,tt->tm_hour,tt->tm_min,tt->tm_sec,code);
 
 	if( (fd=open(logFile_globalVar,O_WRONLY|O_CREAT|O_APPEND, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH))==-1 ){
 		perror("log file");
@@ -230,23 +343,221 @@ void append_log_entry(int code, const char *entry){
 		exit(1);
 	}
 	fchmod(fd,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	return(fd);
+}
 
-	// we catch the variable to avoid compiler warnings, but its just a log file so who cares...
-	writecheck=write(fd,time_string,strlen(time_string));
-	writecheck=write(fd,entry,strlen(entry));
+// writes the time stamp, and code if it is not negative, into stamp; returns its length (less than LOG_STAMP_RESERVE)
+int format_log_stamp(int code, char *stamp){
+	time_t t;
+	struct tm tt;
+
+	t=time(NULL);
+	localtime_r(&t,&tt);
+	if(code<0) return(sprintf(stamp,"[%s/%.2d/%.4d %.2d:%.2d:%.2d] ",months[tt.tm_mon],tt.tm_mday,tt.tm_year+1900,tt.tm_hour,tt.tm_min,tt.tm_sec));
+	else       return(sprintf(stamp,"[%s/%.2d/%.4d %.2d:%.2d:%.2d] <%d> ",months[tt.tm_mon],tt.tm_mday,tt.tm_year+1900,tt.tm_hour,tt.tm_min,tt.tm_sec,code));
+}
+
+// returns a malloc()ed copy of entry behind its time stamp
+char *format_log_entry(int code, const char *entry){
+	char stamp[LOG_STAMP_RESERVE];
+	size_t stamp_length,entry_length;
+	char *text;
+
+	stamp_length=format_log_stamp(code,stamp);
+	entry_length=strlen(entry);
+	if( (text=(char *)malloc(stamp_length+entry_length+1))==NULL ){
+		fprintf(stderr,"Error: cannot allocate memory for a log entry\n");
+		fflush(stderr);
+		exit(1);
+	}
+	memcpy(text,stamp,stamp_length);
+	memcpy(text+stamp_length,entry,entry_length+1);
+	return(text);
+}
+
+// writes one formatted entry straight to the log file; used when the log writer is not running
+void write_log_entry_now(const char *text){
+	int fd;
+	int writecheck;
 
+	pthread_mutex_lock(&log_mutex);
+	fd=open_log_file();
+	// we catch the variable to avoid compiler warnings, but its just a log file so who cares...
+	writecheck=write(fd,text,strlen(text));
 	close(fd);
-	
 	pthread_mutex_unlock(&log_mutex);
 }
 
+// puts a client log buffer back in the pool, or frees it
+void release_client_log(char *buffer, size_t allocated){
+	if(buffer==NULL) return;
+	if(allocated<=CLIENT_LOG_KEEP_SIZE){
+		pthread_mutex_lock(&client_log_pool_mutex);
+		if(Nclient_log_pool<CLIENT_LOG_POOL_SIZE){
+			client_log_pool[Nclient_log_pool]=buffer;
+			client_log_pool_allocated[Nclient_log_pool]=allocated;
+			Nclient_log_pool++;
+			buffer=NULL;
+		}
+		pthread_mutex_unlock(&client_log_pool_mutex);
+	}
+	free(buffer);
+}
+
+void release_log_record(struct log_record_struct *record){
+	if(record->allocated>0) release_client_log(record->buffer,record->allocated);
+	else free(record->buffer);
+}
+
+// queues a record for the log writer; waits if the ring is full
+void push_log_ring(const struct log_record_struct *record){
+	unsigned long position;
+	long difference;
+	struct log_slot_struct *slot;
+
+	position=log_ring_tail;
+	while(1){
+		slot=&log_ring[position&(LOG_RING_SIZE-1)];
+		difference=(long)(slot->sequence-position);
+		if(difference==0){
+			if(__sync_bool_compare_and_swap(&log_ring_tail,position,position+1)) break;
+		}else if(difference<0){
+			usleep(1000); // the writer has not emptied this slot yet
+		}
+		position=log_ring_tail;
+	}
+	slot->record=*record;
+	__sync_synchronize();
+	slot->sequence=position+1;
+}
+
+// takes up to max records off the ring; only the log writer (or stop_log_writer() after it) may call this
+int pop_log_ring(struct log_record_struct *record, int max){
+	int n=0;
+	struct log_slot_struct *slot;
+
+	while(n<max){
+		slot=&log_ring[log_ring_head&(LOG_RING_SIZE-1)];
+		if(slot->sequence!=log_ring_head+1) break;
+		__sync_synchronize();
+		record[n++]=slot->record;
+		__sync_synchronize();
+		slot->sequence=log_ring_head+LOG_RING_SIZE;
+		log_ring_head++;
+	}
+	return(n);
+}
+
+void write_log_batch(struct log_record_struct *record, int n){
+	struct iovec iov[LOG_WRITER_BATCH];
+
+	if(n<=0) return;
+	for(int i=0;i<n;i++){
+		iov[i].iov_base=record[i].entry;
+		iov[i].iov_len=strlen(record[i].entry);
+	}
+	if( writev(log_fd,iov,n)==-1 ) perror("log file");
+	for(int i=0;i<n;i++) release_log_record(&record[i]);
+}
+
+void *log_writer(void *arg){
+	struct log_record_struct record[LOG_WRITER_BATCH];
+	int n;
+
+	while(1){
+		n=pop_log_ring(record,LOG_WRITER_BATCH);
+		if(n>0){
+			write_log_batch(record,n);
+			continue;
+		}
+		if(log_writer_stop) break;
+		usleep(LOG_WRITER_SLEEP_MICROSECONDS);
+	}
+	return(NULL);
+}
+
+// waits until everything queued so far has been written; registered with atexit() so that error_quit() loses nothing
+void flush_log(void){
+	unsigned long target=log_ring_tail;
+	time_t start=time(NULL);
+
+	if(!log_writer_running || pthread_equal(pthread_self(),log_writer_handle)) return;
+	while((long)(log_ring_head-target)<0 && time(NULL)-start<LOG_FLUSH_TIMEOUT_SECONDS) usleep(1000);
+}
+
+void start_log_writer(void){
+	for(unsigned long i=0;i<LOG_RING_SIZE;i++){
+		log_ring[i].sequence=i;
+		log_ring[i].record.entry=log_ring[i].record.buffer=NULL;
+		log_ring[i].record.allocated=0;
+	}
+	log_ring_head=log_ring_tail=0;
+	log_writer_stop=false;
+	log_fd=open_log_file();
+	__sync_synchronize();
+	if(pthread_create(&log_writer_handle,NULL,log_writer,NULL)!=0){
+		// entries keep going straight to the file
+		perror("pthread_create failed for the log writer");
+		close(log_fd);
+		return;
+	}
+	log_writer_running=true;
+	atexit(flush_log);
+}
+
+void stop_log_writer(void){
+	struct log_record_struct record[LOG_WRITER_BATCH];
+	int n;
+
+	if(!log_writer_running) return;
+	log_writer_stop=true;
+	pthread_join(log_writer_handle,NULL);
+	log_writer_running=false;
+	__sync_synchronize();
+	// anything queued while the writer was finishing
+	while((n=pop_log_ring(record,LOG_WRITER_BATCH))>0) write_log_batch(record,n);
+	close(log_fd);
+}
+
+// hands a formatted record to the log writer, or writes it now if the writer is not running
+void queue_log_record(struct log_record_struct *record){
+	if(log_writer_running){
+		push_log_ring(record);
+	}else{
+		write_log_entry_now(record->entry);
+		release_log_record(record);
+	}
+}
+
+// Appends the given text to the log file if level is at or below the current log_level
+// code here is used to specify the file descriptor of the connected client (specifying -1 prints no code)
+void log_entry(int level, int code, const char *entry){
+	struct log_record_struct record;
+
+	if(level>log_level) return;
+	record.entry=record.buffer=format_log_entry(code,entry);
+	record.allocated=0;
+	queue_log_record(&record);
+}
+
+// Appends the given text to the log file
+// code here is used to specify the file descriptor of the connected client (specifying -1 prints no code)
+void append_log_entry(int code, const char *entry){
+	log_entry(LogNormal,code,entry);
+}
+
+// Appends the given error text to the log file; unlike append_log_entry(), this is kept at every log level
+void append_error_entry(int code, const char *entry){
+	log_entry(LogErrors,code,entry);
+}
+
 // prints an error message to the log file and exits. If a log file has not been defined yet, the message goes to stdout
 void error_warning(const char *error_message){
 	char message[MESSAGE_GLOBALVAR_LENGTH];
 
 	sprintf(message,"Error ERROR error: %s\n",error_message);
 	if(logFile_globalVar[0]!=0)
-		append_log_entry(-1,message);
+		log_entry(LogErrors,-1,message);
 	perror(message);
 	fflush(stderr);
 }
@@ -256,6 +567,113 @@ void error_quit(const char *error_message){
 	exit(1);
 }
 
+// gives the client a log buffer from the pool, or a new one
+void acquire_client_log(struct client_struct *client){
+	client->log_buffer=NULL;
+	pthread_mutex_lock(&client_log_pool_mutex);
+	if(Nclient_log_pool>0){
+		Nclient_log_pool--;
+		client->log_buffer=client_log_pool[Nclient_log_pool];
+		client->log_allocated=client_log_pool_allocated[Nclient_log_pool];
+	}
+	pthread_mutex_unlock(&client_log_pool_mutex);
+	if(client->log_buffer==NULL){
+		client->log_allocated=CLIENT_LOG_INITIAL_SIZE;
+		if( (client->log_buffer=(char *)malloc(client->log_allocated))==NULL ) error_quit("cannot allocate memory for a client log");
+	}
+	client->log=client->ptr=client->log_buffer+LOG_STAMP_RESERVE;
+	client->ptr[0]=0;
+	client->log_has_error=false;
+}
+
+// makes room for at least needed bytes of log text (including the terminating 0)
+void grow_client_log(struct client_struct *client, size_t needed){
+	size_t used=client->ptr-client->log;
+	size_t allocated=client->log_allocated;
+	char *buffer;
+
+	while(allocated<LOG_STAMP_RESERVE+needed) allocated*=2;
+	if( (buffer=(char *)realloc(client->log_buffer,allocated))==NULL ) error_quit("cannot allocate memory for a client log");
+	client->log_buffer=buffer;
+	client->log_allocated=allocated;
+	client->log=client->log_buffer+LOG_STAMP_RESERVE;
+	client->ptr=client->log+used;
+}
+
+// appends to the client's log, which grows as needed
+void client_vprintf(struct client_struct *client, const char *format, va_list args){
+	va_list copy;
+	size_t room;
+	int n;
+
+	while(1){
+		room=client->log_buffer+client->log_allocated-client->ptr;
+		va_copy(copy,args);
+		n=vsnprintf(client->ptr,room,format,copy);
+		va_end(copy);
+		if(n<0) return;
+		if((size_t)n<room){
+			client->ptr+=n;
+			return;
+		}
+		grow_client_log(client,(client->ptr-client->log)+n+1);
+	}
+}
+
+void client_printf(struct client_struct *client, const char *format, ...){
+	va_list args;
+
+	va_start(args,format);
+	client_vprintf(client,format,args);
+	va_end(args);
+}
+
+// like client_printf(), but the client's whole log is then written even at log level LogErrors
+void client_error_printf(struct client_struct *client, const char *format, ...){
+	va_list args;
+
+	client->log_has_error=true;
+	va_start(args,format);
+	client_vprintf(client,format,args);
+	va_end(args);
+}
+
+// hands the client's whole log to the log writer without copying it; the client no longer has a log afterwards
+void log_client_entry(int code, struct client_struct *client){
+	struct log_record_struct record;
+	char stamp[LOG_STAMP_RESERVE];
+	int stamp_length;
+
+	if(client->log_buffer==NULL) return;
+	record.buffer=client->log_buffer;
+	record.allocated=client->log_allocated;
+	client->log_buffer=client->log=client->ptr=NULL;
+	if((client->log_has_error?LogErrors:LogNormal)>log_level){
+		release_client_log(record.buffer,record.allocated);
+		return;
+	}
+	stamp_length=format_log_stamp(code,stamp);
+	record.entry=record.buffer+LOG_STAMP_RESERVE-stamp_length;
+	memcpy(record.entry,stamp,stamp_length);
+	queue_log_record(&record);
+}
+
+void lock_replica_data(int replicaN){
+	pthread_mutex_lock(&replica_data_mutex[replicaN%REPLICA_DATA_LOCK_SHARDS]);
+}
+
+void unlock_replica_data(int replicaN){
+	pthread_mutex_unlock(&replica_data_mutex[replicaN%REPLICA_DATA_LOCK_SHARDS]);
+}
+
+void lock_all_replica_data(void){
+	for(int i=0;i<REPLICA_DATA_LOCK_SHARDS;i++) pthread_mutex_lock(&replica_data_mutex[i]);
+}
+
+void unlock_all_replica_data(void){
+	for(int i=REPLICA_DATA_LOCK_SHARDS-1;i>=0;i--) pthread_mutex_unlock(&replica_data_mutex[i]);
+}
+
 //YUPYUPYUP
 
 int findRepByNode(const struct script_struct *script, int nodeSlot){
@@ -366,73 +784,744 @@ int saveVREtoFile(const char *fnam,int Nreplicas){
 	return 0;
 }
 
-// Saves a snapshot of the state of the distributed replica simulation to a file
-// The snapshot contains the coordinate positions of all replicas, their current sequence number,
-// a restart file, and the averaged coordinates at each discrete replica position.
-// Also save vRE structure.
-char * save_snapshot(const struct script_struct *script, const struct server_variable_struct *var, const struct server_option_struct *opt){
-	//CN moved the replica mutex lock to something that must be done outside of this routine -- necessary for mobile server
-	static char filename[30];
-	int fd;
-	unsigned int size;
-	float version=SNAPSHOT_VERSION;
-	
-	append_log_entry(-1,"Saving a state snapshot\n");
+// reports, for each nominal position, how full the vRE lists are and how many values could not be kept
+void log_vre_counts(const struct script_struct *script){
+	char message[200];
+	long int nstored,nsecondary,ndropped,nevicted,nrecycled;
+
+	for(int i=0;i<script->Nreplicas;i++){
+		get_vre_counts(i,&nstored,&nsecondary,&ndropped,&nevicted,&nrecycled);
+		sprintf(message,"vRE nominal %d: %ld stored, %ld secondary; %ld dropped, %ld evicted, %ld secondary recycled\n",i,nstored,nsecondary,ndropped,nevicted,nrecycled);
+		append_log_entry(-1,message);
+	}
+}
+
+// Online WHAM for the cancellation energies of Umbrella runs (CANCELLATIONMETHOD WHAM). Each umbrella force F that
+// a client sends gives its sampled position x=w+F/force. Replicas are not held at the nominal positions, so the
+// windows of WHAM are the bins of a grid on which the nominal positions are bin centres: the client threads add x to
+// the histogram of the grid and count the sample against the bin of the w it was sampled at, which is all that WHAM
+// needs. The cancellation solver thread copies both and solves WHAM without any lock. The free energy of the
+// umbrella at each nominal position then follows from the PMF, and all of the cancellation energies, -(A[i]-A[0]) in
+// kcal/mol, are set in one go under the replica_mutex.
+#define CANCELLATION_WHAM_BINS_PER_WINDOW 10
+#define CANCELLATION_WHAM_MARGIN_WINDOWS 2     //grid beyond the first and last nominal positions (not circular)
+
+struct cancellation_wham_struct{
+	bool active;
+	int Nbins;
+	double min;                     //lower edge of the grid
+	double bin_width;
+	double *count;                  //histogram of the sampled positions; guarded by the replica_mutex
+	unsigned long long *Nk;         //samples taken with the umbrella in each bin; guarded by the replica_mutex
+	unsigned long long Nsamples;    //guarded by the replica_mutex
+};
+struct cancellation_wham_struct cancellation_wham={false,0,0.0,0.0,NULL,NULL,0};
+volatile bool cancellation_solver_running=false;
+volatile bool cancellation_solver_stop=false;
+pthread_t cancellation_solver_handle;
+
+void free_cancellation_wham(void){
+	delete[] cancellation_wham.count;
+	delete[] cancellation_wham.Nk;
+	cancellation_wham.count=NULL;
+	cancellation_wham.Nk=NULL;
+	cancellation_wham.Nsamples=0;
+	cancellation_wham.active=false;
+}
 
-	sprintf(filename,"%s.%d.snapshot",opt->title,(int)time(NULL));
-	if( (fd=open(filename, O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH))==-1 ) error_quit("cannot open file for writing");
+// Multi-round force integration cancellation (CANCELLATIONROUNDS). The accumulators of the replicas are reset after
+// each round, so every round estimates the cancellation energies from its own runs, with standard errors from the
+// sums of squares of the per-run averages. A round that agrees with the adopted energies to within
+// CANCELLATION_ROUND_AGREEMENT standard errors at every nominal position is combined with them by inverse variance;
+// one that disagrees replaces them if it is the more precise and is rejected otherwise. Rounds go on until the
+// script's number of rounds or error tolerance is reached. Everything here is guarded by the replica_mutex.
+#define CANCELLATION_ROUND_AGREEMENT 3.0
+
+struct cancellation_rounds_struct{
+	bool active;
+	int Nreplicas;
+	int round;                      //rounds concluded so far
+	bool collecting;                //a further round is being accumulated
+	double *sum_of_squares;         //of the per-run averages of the current round; [2*replica+ligand]
+	double *energy;                 //the adopted cancellation energies
+	double *error;                  //and their standard errors
+};
+struct cancellation_rounds_struct cancellation_rounds={false,0,0,false,NULL,NULL,NULL};
+
+void free_cancellation_rounds(void){
+	delete[] cancellation_rounds.sum_of_squares;
+	delete[] cancellation_rounds.energy;
+	delete[] cancellation_rounds.error;
+	cancellation_rounds.sum_of_squares=NULL;
+	cancellation_rounds.energy=NULL;
+	cancellation_rounds.error=NULL;
+	cancellation_rounds.Nreplicas=0;
+	cancellation_rounds.round=0;
+	cancellation_rounds.collecting=false;
+	cancellation_rounds.active=false;
+}
 
-	size=script->Nreplicas*sizeof(struct replica_struct);
+struct snapshot_vre_struct{
+	//copy of one vRE list; capacity is in entries
+	long int nallocated;
+	long int nlastused;
+	long int nrecyclepush;
+	long int capacity;
+	void *data;
+};
 
-	if( write(fd,&version,sizeof(version))!=sizeof(version) ) error_quit("cannot write to file");
-	if( write(fd,&(script->Nreplicas),sizeof(script->Nreplicas))!=sizeof(script->Nreplicas) ) error_quit("cannot write to file");
-	if( write(fd,&(var->Natoms),sizeof(var->Natoms))!=sizeof(var->Natoms) ) error_quit("cannot write to file");
+struct snapshot_replica_struct{
+	//the snapshot's own view of the bulk data of one replica
+	struct restart_recipe_struct *restart;   //a reference to the replica's restart at the last capture
+	bool restart_dirty;         //a new restart was committed since the last capture
+	bool dirty;                 //atom or presence changed since the last capture
+	struct atom_struct *atom;   //copies, refreshed only when dirty
+	unsigned int *presence;
+	unsigned int version;       //counts the captures that refreshed atom and presence
+	//where write_snapshot() last wrote them in full: the snapshot file and the offset of the SectionAtoms header
+	unsigned int written_version;
+	char written_in[30];
+	off_t written_at;
+};
 
-	if( write(fd,script->replica,size)!=size ) error_quit("cannot write to file");
+struct snapshot_struct{
+	//the state captured by capture_snapshot() under the locks and written by write_snapshot() without them.
+	//The dirty flags are guarded by the replica data locks, busy by the snapshot_mutex.
+	//Everything else belongs to whoever set busy.
+	int Nreplicas;
+	int Natoms;
+	int atom_allocated;         //Natoms that the atom copies were allocated for
+	bool vre;
+	struct replica_struct *replica;
+	struct snapshot_replica_struct *data;
+	struct snapshot_vre_struct *primary;
+	struct snapshot_vre_struct *secondary;
+	char filename[30];
+	bool busy;
+	int Nrecaptured;            //replicas whose atom or presence had to be copied at the last capture
+	int Nrestarts;              //replicas with a new restart at the last capture
+	unsigned int Nwritten;      //snapshot files written; every SNAPSHOT_FULL_INTERVAL-th has no references
+	struct cancellation_wham_struct cancellation;   //copy of cancellation_wham, when that is active
+	struct cancellation_rounds_struct rounds;       //copy of cancellation_rounds, when that is active
+};
+struct snapshot_struct snapshot={0,0,0,false,NULL,NULL,NULL,NULL,"",false,0,0,0,{false,0,0.0,0.0,NULL,NULL,0},{false,0,0,false,NULL,NULL,NULL}};
+
+// must be called before any client can commit data; every replica starts out dirty
+void allocate_snapshot(const struct script_struct *script){
+	snapshot.Nreplicas=script->Nreplicas;
+	snapshot.vre=(script->replica_move_type==vRE);
+	snapshot.replica=new replica_struct[script->Nreplicas];
+	snapshot.data=new snapshot_replica_struct[script->Nreplicas];
 	for(int i=0;i<script->Nreplicas;i++){
-		size=script->replica[i].restart.data_size;
-		if( write(fd,script->replica[i].restart.data,size)!=size ) error_quit("cannot write to file");
+		snapshot.data[i].restart=NULL;
+		snapshot.data[i].restart_dirty=true;
+		snapshot.data[i].dirty=true;
+		snapshot.data[i].atom=NULL;
+		snapshot.data[i].presence=new unsigned int[N_PRESENCE_BITS/32];
+		snapshot.data[i].version=0;
+		snapshot.data[i].written_version=0;
+		snapshot.data[i].written_in[0]='\0';
+		snapshot.data[i].written_at=0;
+	}
+	if(snapshot.vre){
+		snapshot.primary=new snapshot_vre_struct[script->Nreplicas];
+		snapshot.secondary=new snapshot_vre_struct[script->Nreplicas];
+		memset(snapshot.primary,0,script->Nreplicas*sizeof(struct snapshot_vre_struct));
+		memset(snapshot.secondary,0,script->Nreplicas*sizeof(struct snapshot_vre_struct));
+	}
+	snapshot.cancellation=cancellation_wham;
+	if(cancellation_wham.active){
+		snapshot.cancellation.count=new double[cancellation_wham.Nbins];
+		snapshot.cancellation.Nk=new unsigned long long[cancellation_wham.Nbins];
+	}
+	snapshot.rounds=cancellation_rounds;
+	if(cancellation_rounds.active){
+		snapshot.rounds.sum_of_squares=new double[2*cancellation_rounds.Nreplicas];
+		snapshot.rounds.energy=new double[cancellation_rounds.Nreplicas];
+		snapshot.rounds.error=new double[cancellation_rounds.Nreplicas];
+	}
+}
 
-		size=var->Natoms*sizeof(struct atom_struct);
-		if( write(fd,script->replica[i].atom,size)!=size ) error_quit("cannot write to file");
+void free_snapshot(void){
+	lock_all_replica_data();
+	for(int i=0;i<snapshot.Nreplicas;i++){
+		restart_store_release(snapshot.data[i].restart);
+		delete[] snapshot.data[i].atom;
+		delete[] snapshot.data[i].presence;
+	}
+	if(snapshot.vre){
+		for(int i=0;i<snapshot.Nreplicas;i++){
+			free(snapshot.primary[i].data);
+			free(snapshot.secondary[i].data);
+		}
+		delete[] snapshot.primary;
+		delete[] snapshot.secondary;
+	}
+	if(snapshot.cancellation.active){
+		delete[] snapshot.cancellation.count;
+		delete[] snapshot.cancellation.Nk;
+		snapshot.cancellation.active=false;
+	}
+	if(snapshot.rounds.active){
+		delete[] snapshot.rounds.sum_of_squares;
+		delete[] snapshot.rounds.energy;
+		delete[] snapshot.rounds.error;
+		snapshot.rounds.active=false;
+	}
+	delete[] snapshot.replica;
+	delete[] snapshot.data;
+	snapshot.data=NULL;
+	snapshot.Nreplicas=0;
+	unlock_all_replica_data();
+}
 
-		size=N_PRESENCE_BITS/8;
-		if( write(fd,script->replica[i].presence,size)!=size ) error_quit("cannot write to file");
+// called with the replica data lock of replicaN on
+void snapshot_mark_restart_dirty(int replicaN){
+	if(snapshot.data!=NULL) snapshot.data[replicaN].restart_dirty=true;
+}
+
+// called with the replica data lock of replicaN on
+void snapshot_mark_dirty(int replicaN){
+	if(snapshot.data!=NULL) snapshot.data[replicaN].dirty=true;
+}
+
+void copy_snapshot_vre(struct snapshot_vre_struct *copy, long int nallocated, long int nlastused, const void *data, size_t item_size){
+	copy->nallocated=nallocated;
+	copy->nlastused=nlastused;
+	if(nlastused+1>copy->capacity){
+		copy->capacity=nallocated;
+		if(copy->capacity<nlastused+1) copy->capacity=nlastused+1;
+		free(copy->data);
+		if((copy->data=malloc(copy->capacity*item_size))==NULL) error_quit("unable to allocate memory for the vRE snapshot copy");
 	}
+	if(nlastused>=0) memcpy(copy->data,data,(nlastused+1)*item_size);
+}
 
-	if(script->replica_move_type==vRE){
+// Takes a consistent copy of the state into snapshot. Restarts are shared rather than copied, and the averaged
+// coordinates and presence bits are only copied for replicas that changed since the last capture.
+// must be called with the replica_mutex on and snapshot.busy set by the caller
+void capture_snapshot(const struct script_struct *script, const struct server_variable_struct *var, const struct server_option_struct *opt){
+	struct restart_recipe_struct **retired=new restart_recipe_struct*[script->Nreplicas];
+	int Nretired=0;
+	bool all_dirty;
+
+	lock_all_replica_data();
+	sprintf(snapshot.filename,"%s.%d.snapshot",opt->title,(int)time(NULL));
+	memcpy(snapshot.replica,script->replica,script->Nreplicas*sizeof(struct replica_struct));
+
+	all_dirty=(snapshot.atom_allocated!=var->Natoms);
+	if(all_dirty){
+		for(int i=0;i<script->Nreplicas;i++){
+			delete[] snapshot.data[i].atom;
+			snapshot.data[i].atom=(var->Natoms>0)?new atom_struct[var->Natoms]:NULL;
+		}
+		snapshot.atom_allocated=var->Natoms;
+	}
+	snapshot.Natoms=var->Natoms;
+	snapshot.Nrecaptured=0;
+	snapshot.Nrestarts=0;
+	for(int i=0;i<script->Nreplicas;i++){
+		if(snapshot.data[i].restart_dirty){
+			retired[Nretired++]=snapshot.data[i].restart;
+			snapshot.data[i].restart=restart_store_share(replica_restart[i]);
+			snapshot.data[i].restart_dirty=false;
+			snapshot.Nrestarts++;
+		}
+		if(snapshot.data[i].dirty || all_dirty){
+			if(var->Natoms>0) memcpy(snapshot.data[i].atom,script->replica[i].atom,var->Natoms*sizeof(struct atom_struct));
+			memcpy(snapshot.data[i].presence,script->replica[i].presence,N_PRESENCE_BITS/8);
+			snapshot.data[i].dirty=false;
+			snapshot.data[i].version++;
+			snapshot.Nrecaptured++;
+		}
+	}
+	unlock_all_replica_data();
+
+	if(snapshot.cancellation.active){
+		memcpy(snapshot.cancellation.count,cancellation_wham.count,cancellation_wham.Nbins*sizeof(double));
+		memcpy(snapshot.cancellation.Nk,cancellation_wham.Nk,cancellation_wham.Nbins*sizeof(unsigned long long));
+		snapshot.cancellation.Nsamples=cancellation_wham.Nsamples;
+	}
+	if(snapshot.rounds.active){
+		memcpy(snapshot.rounds.sum_of_squares,cancellation_rounds.sum_of_squares,2*cancellation_rounds.Nreplicas*sizeof(double));
+		memcpy(snapshot.rounds.energy,cancellation_rounds.energy,cancellation_rounds.Nreplicas*sizeof(double));
+		memcpy(snapshot.rounds.error,cancellation_rounds.error,cancellation_rounds.Nreplicas*sizeof(double));
+		snapshot.rounds.round=cancellation_rounds.round;
+		snapshot.rounds.collecting=cancellation_rounds.collecting;
+	}
+
+	if(snapshot.vre){
 		long int nallocated,nlastused,nrecyclepush;
 		float *val;
 		struct vre_item_struct *item;
 
 		for(int i=0;i<script->Nreplicas;i++){
 			save_vre_pointers(i,&nallocated,&nlastused,&item);
-			if( write(fd,&nallocated,sizeof(nallocated))!=sizeof(nallocated) ) error_quit("cannot write to file -- vre nallocated");
-			if( write(fd,&nlastused,sizeof(nlastused))!=sizeof(nlastused) ) error_quit("cannot write to file -- vre nlastused");
-			if( write(fd,item,sizeof(struct vre_item_struct)*(nlastused+1))!=sizeof(struct vre_item_struct)*(nlastused+1) ) error_quit("cannot write to file -- vre item");
-		}
-		for(int i=0;i<script->Nreplicas;i++){
+			copy_snapshot_vre(&snapshot.primary[i],nallocated,nlastused,item,sizeof(struct vre_item_struct));
 			save_secvre_pointers(i,&nallocated,&nlastused,&nrecyclepush,&val);
-			if( write(fd,&nallocated,sizeof(nallocated))!=sizeof(nallocated) ) error_quit("cannot write to file -- vre secondary nallocated");
-			if( write(fd,&nlastused,sizeof(nlastused))!=sizeof(nlastused) ) error_quit("cannot write to file -- vre secondary nlastused");
-			if( write(fd,&nrecyclepush,sizeof(nrecyclepush))!=sizeof(nrecyclepush) ) error_quit("cannot write to file -- vre secondary nrecyclepush");
-			if( write(fd,val,sizeof(float)*(nlastused+1))!=sizeof(float)*(nlastused+1) ) error_quit("cannot write to file -- vre secondary val");
+			copy_snapshot_vre(&snapshot.secondary[i],nallocated,nlastused,val,sizeof(float));
+			snapshot.secondary[i].nrecyclepush=nrecyclepush;
+		}
+		log_vre_counts(script);
+	}
+
+	for(int i=0;i<Nretired;i++) restart_store_release(retired[i]);
+	delete[] retired;
+}
+
+// Sectioned snapshot file (SNAPSHOT_VERSION 3.0):
+//   snapshot_file_header
+//   sections, each a snapshot_section_header followed by length bytes of payload:
+//     SectionReplicas       Nreplicas snapshot_replica_record
+//     SectionRestartChunk k one chunk of restart data, numbered k=0,1,... in the order written; each distinct chunk
+//                           of the restart store is written once, before the first recipe that uses it
+//     SectionRestartRecipe i uint32 numbers of the chunks that make up the restart of replica i, in order
+//     SectionAtoms i        Natoms atom_struct of replica i
+//     SectionPresence i     N_PRESENCE_BITS/8 bytes of replica i; always right after SectionAtoms i
+//     SectionReplicaDataRef i  snapshot_reference_record: instead of SectionAtoms i and SectionPresence i when they
+//                           have not changed since an earlier snapshot, which holds them at the given offset
+//     SectionVREPrimary i   int64 nallocated, int64 nlastused, nlastused+1 vre_item_struct   (vRE runs only)
+//     SectionVRESecondary i int64 nallocated, int64 nlastused, int64 nrecyclepush, nlastused+1 float
+//     SectionCancellationWHAM  int64 Nbins, double min, double bin_width, Nbins uint64 samples per umbrella bin,
+//                           Nbins double histogram   (CANCELLATIONMETHOD WHAM only)
+//     SectionCancellationRounds  int64 Nreplicas, int64 round, int64 collecting, Nreplicas double adopted energies,
+//                           Nreplicas double their errors, 2*Nreplicas double sums of squares   (CANCELLATIONROUNDS only)
+//   SectionEnd, with no payload
+// Snapshots of earlier versions of this program have SectionRestart i, the whole restart of replica i, instead of
+// the chunks and recipes; it is still read. References only point at sections written in full, never at another
+// reference, and every SNAPSHOT_FULL_INTERVAL-th snapshot has none, so a snapshot needs no files older than the
+// last one written in full; the log names the snapshots that each one refers to.
+// Every header and payload carries a CRC32C. The file is written under a temporary name, synced and then
+// renamed, so a snapshot file either is complete or does not exist. Readers skip section types they do not know, but
+// that does not make the restart chunks compatible: a server from before them skips sections 9 and 10, finds no
+// restarts and quits with "the snapshot is missing replica data". The same goes for section 11.
+#define SNAPSHOT_MAGIC "DRss"
+#define SNAPSHOT_SECTION_VERSION 1
+#define SNAPSHOT_FULL_INTERVAL 10
+enum snapshot_section_enum {SectionEnd=0,SectionReplicas=1,SectionRestart=2,SectionAtoms=3,SectionPresence=4,SectionVREPrimary=5,SectionVRESecondary=6,SectionCancellationWHAM=7,SectionCancellationRounds=8,SectionRestartChunk=9,SectionRestartRecipe=10,SectionReplicaDataRef=11};
+
+struct snapshot_file_header{
+	float version;                //first, as in the old format, so that older servers refuse the file
+	char magic[4];
+	int Nreplicas;
+	int Natoms;
+	int replica_move_type;
+	unsigned int crc;             //of the fields above
+};
+
+struct snapshot_section_header{
+	unsigned int type;
+	unsigned int version;         //layout of this section type
+	int index;                    //replica or nominal position; -1 for global sections
+	unsigned int crc;             //of the payload
+	unsigned long long length;    //of the payload in bytes
+};
+
+struct snapshot_replica_record{
+	//the parts of replica_struct that a snapshot restores; no pointers
+	double cancellation_accumulator[2];
+	float w;
+	float w_nominal;
+	float w_start;
+	float w2_nominal;
+	float w_sorted;
+	float force;
+	float cancellation_energy;
+	unsigned int sequence_number;
+	unsigned int sample_count;
+	unsigned int sampling_runs;
+	unsigned int sampling_steps;
+	unsigned int last_activity_time;
+	unsigned int start_time_on_current_node;
+	unsigned int restart_size;
+	int nodeSlot;
+	unsigned short cancellation_count;
+	char status;
+	char unused;
+};
+
+struct snapshot_reference_record{
+	char filename[32];            //an earlier snapshot in the same directory
+	unsigned long long offset;    //of the SectionAtoms header in that file
+};
+
+#define SNAPSHOT_MAX_PIECES 4
+
+// writes one section made of up to SNAPSHOT_MAX_PIECES pieces of payload
+void write_snapshot_section(int fd, unsigned int type, int index, int Npieces, const void **piece, const size_t *piece_size){
+	struct snapshot_section_header section;
+	struct iovec iov[SNAPSHOT_MAX_PIECES+1];
+	uint32_t crc=CRC32C_START;
+	size_t total;
+
+	section.type=type;
+	section.version=SNAPSHOT_SECTION_VERSION;
+	section.index=index;
+	section.length=0;
+	for(int i=0;i<Npieces;i++){
+		crc=crc32c_update(crc,piece[i],piece_size[i]);
+		section.length+=piece_size[i];
+		iov[i+1].iov_base=(void *)piece[i];
+		iov[i+1].iov_len=piece_size[i];
+	}
+	section.crc=crc32c_final(crc);
+	iov[0].iov_base=&section;
+	iov[0].iov_len=sizeof(section);
+	total=sizeof(section)+section.length;
+	if( writev(fd,iov,Npieces+1)!=(ssize_t)total ) error_quit("cannot write snapshot section to file");
+}
+
+void write_snapshot_buffer(int fd, unsigned int type, int index, const void *data, size_t size){
+	write_snapshot_section(fd,type,index,1,&data,&size);
+}
+
+// Writes the captured state to snapshot.filename; no lock is needed.
+// Unless full is set, replicas whose coordinate data is unchanged refer to the snapshot that last wrote it
+void write_snapshot(bool full){
+	int fd;
+	char tmpname[40];
+	char message[400];
+	struct snapshot_file_header header;
+	struct snapshot_replica_record *record;
+	const void *piece[SNAPSHOT_MAX_PIECES];
+	size_t piece_size[SNAPSHOT_MAX_PIECES];
+	uint32_t *number;
+	unsigned int Nchunks=0;
+	unsigned long long chunk_bytes=0, restart_bytes=0;
+	size_t Nstored;
+	unsigned long long stored_bytes, referenced_bytes, Nrecipes;
+	int Nreferences=0;
+	char oldest[30]="";
+
+	if(snapshot.Nwritten%SNAPSHOT_FULL_INTERVAL==0) full=true;
+	sprintf(tmpname,"%s.tmp",snapshot.filename);
+	if( (fd=open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH))==-1 ) error_quit("cannot open file for writing");
+
+	memset(&header,0,sizeof(header));
+	header.version=SNAPSHOT_VERSION;
+	memcpy(header.magic,SNAPSHOT_MAGIC,4);
+	header.Nreplicas=snapshot.Nreplicas;
+	header.Natoms=snapshot.Natoms;
+	header.replica_move_type=snapshot.vre?vRE:MoveTypeUndefined;
+	header.crc=crc32c(&header,offsetof(struct snapshot_file_header,crc));
+	if( write(fd,&header,sizeof(header))!=sizeof(header) ) error_quit("cannot write to file");
+
+	record=new snapshot_replica_record[snapshot.Nreplicas];
+	memset(record,0,snapshot.Nreplicas*sizeof(struct snapshot_replica_record));
+	for(int i=0;i<snapshot.Nreplicas;i++){
+		const struct replica_struct *r=&snapshot.replica[i];
+		record[i].cancellation_accumulator[0]=r->cancellation_accumulator[0];
+		record[i].cancellation_accumulator[1]=r->cancellation_accumulator[1];
+		record[i].w=r->w;
+		record[i].w_nominal=r->w_nominal;
+		record[i].w_start=r->w_start;
+		record[i].w2_nominal=r->w2_nominal;
+		record[i].w_sorted=r->w_sorted;
+		record[i].force=r->force;
+		record[i].cancellation_energy=r->cancellation_energy;
+		record[i].sequence_number=r->sequence_number;
+		record[i].sample_count=r->sample_count;
+		record[i].sampling_runs=r->sampling_runs;
+		record[i].sampling_steps=r->sampling_steps;
+		record[i].last_activity_time=r->last_activity_time;
+		record[i].start_time_on_current_node=r->start_time_on_current_node;
+		record[i].restart_size=r->restart.data_size;
+		record[i].nodeSlot=r->nodeSlot;
+		record[i].cancellation_count=r->cancellation_count;
+		record[i].status=r->status;
+	}
+	write_snapshot_buffer(fd,SectionReplicas,-1,record,snapshot.Nreplicas*sizeof(struct snapshot_replica_record));
+	delete[] record;
+
+	// the mark of a chunk is its number plus one once it is written; only the snapshot writer uses marks
+	for(int i=0;i<snapshot.Nreplicas;i++){
+		const struct restart_recipe_struct *restart=snapshot.data[i].restart;
+		int Nrecipe=(restart!=NULL)?restart->Nchunks:0;
+
+		number=new uint32_t[Nrecipe+1];
+		for(int k=0;k<Nrecipe;k++){
+			struct restart_chunk_struct *c=restart->chunk[k];
+			if(c->mark==0){
+				c->mark=++Nchunks;
+				write_snapshot_buffer(fd,SectionRestartChunk,c->mark-1,c->data,c->size);
+				chunk_bytes+=c->size;
+			}
+			number[k]=c->mark-1;
+		}
+		if(restart!=NULL) restart_bytes+=restart->size;
+		write_snapshot_buffer(fd,SectionRestartRecipe,i,number,Nrecipe*sizeof(uint32_t));
+		delete[] number;
+		struct snapshot_replica_struct *d=&snapshot.data[i];
+		// a snapshot taken within the same second replaces the file, so it can not be referred to
+		if(!full && d->written_version==d->version && d->written_in[0]!='\0' && strcmp(d->written_in,snapshot.filename)!=0 && access(d->written_in,R_OK)==0){
+			struct snapshot_reference_record reference;
+			memset(&reference,0,sizeof(reference));
+			strcpy(reference.filename,d->written_in);
+			reference.offset=d->written_at;
+			write_snapshot_buffer(fd,SectionReplicaDataRef,i,&reference,sizeof(reference));
+			// the names end in the time of the capture, so the smallest is the oldest file needed
+			if(oldest[0]=='\0' || strcmp(d->written_in,oldest)<0) strcpy(oldest,d->written_in);
+			Nreferences++;
+		}else{
+			if( (d->written_at=lseek(fd,0,SEEK_CUR))==(off_t)-1 ) error_quit("cannot find the position in the snapshot file");
+			write_snapshot_buffer(fd,SectionAtoms,i,d->atom,snapshot.Natoms*sizeof(struct atom_struct));
+			write_snapshot_buffer(fd,SectionPresence,i,d->presence,N_PRESENCE_BITS/8);
+			strcpy(d->written_in,snapshot.filename);
+			d->written_version=d->version;
+		}
+	}
+	for(int i=0;i<snapshot.Nreplicas;i++){
+		if(snapshot.data[i].restart==NULL) continue;
+		for(int k=0;k<snapshot.data[i].restart->Nchunks;k++) snapshot.data[i].restart->chunk[k]->mark=0;
+	}
+
+	if(snapshot.vre){
+		struct snapshot_vre_struct *copy;
+		int64_t count[3];
+
+		for(int i=0;i<snapshot.Nreplicas;i++){
+			copy=&snapshot.primary[i];
+			count[0]=copy->nallocated;
+			count[1]=copy->nlastused;
+			piece[0]=count;      piece_size[0]=2*sizeof(int64_t);
+			piece[1]=copy->data; piece_size[1]=sizeof(struct vre_item_struct)*(copy->nlastused+1);
+			write_snapshot_section(fd,SectionVREPrimary,i,2,piece,piece_size);
+		}
+		for(int i=0;i<snapshot.Nreplicas;i++){
+			copy=&snapshot.secondary[i];
+			count[0]=copy->nallocated;
+			count[1]=copy->nlastused;
+			count[2]=copy->nrecyclepush;
+			piece[0]=count;      piece_size[0]=3*sizeof(int64_t);
+			piece[1]=copy->data; piece_size[1]=sizeof(float)*(copy->nlastused+1);
+			write_snapshot_section(fd,SectionVRESecondary,i,2,piece,piece_size);
 		}
 		//FOR DEBUGGING PURPOSES ONLY
 		//char saveName[30];
 		//sprintf(saveName,"VRE_saved.txt");
-		//saveVREtoFile(saveName,script->Nreplicas);
+		//saveVREtoFile(saveName,snapshot.Nreplicas);
+	}
+	if(snapshot.cancellation.active){
+		int64_t Nbins=snapshot.cancellation.Nbins;
+		double range[2];
+
+		range[0]=snapshot.cancellation.min;
+		range[1]=snapshot.cancellation.bin_width;
+		piece[0]=&Nbins;                      piece_size[0]=sizeof(Nbins);
+		piece[1]=range;                       piece_size[1]=sizeof(range);
+		piece[2]=snapshot.cancellation.Nk;    piece_size[2]=Nbins*sizeof(unsigned long long);
+		piece[3]=snapshot.cancellation.count; piece_size[3]=Nbins*sizeof(double);
+		write_snapshot_section(fd,SectionCancellationWHAM,-1,4,piece,piece_size);
+	}
+	if(snapshot.rounds.active){
+		int64_t state[3];
+
+		state[0]=snapshot.rounds.Nreplicas;
+		state[1]=snapshot.rounds.round;
+		state[2]=snapshot.rounds.collecting;
+		piece[0]=state;                          piece_size[0]=sizeof(state);
+		piece[1]=snapshot.rounds.energy;         piece_size[1]=state[0]*sizeof(double);
+		piece[2]=snapshot.rounds.error;          piece_size[2]=state[0]*sizeof(double);
+		piece[3]=snapshot.rounds.sum_of_squares; piece_size[3]=2*state[0]*sizeof(double);
+		write_snapshot_section(fd,SectionCancellationRounds,-1,4,piece,piece_size);
+	}
+	write_snapshot_section(fd,SectionEnd,-1,0,piece,piece_size);
+
+	if( fsync(fd)!=0 ) error_quit("cannot sync the snapshot file");
+	close(fd);
+	if( rename(tmpname,snapshot.filename)!=0 ) error_quit("cannot rename the snapshot file");
+	// the rename itself must reach the disk before the snapshot is announced (e.g. to a new mobile server)
+	if( (fd=open(".",O_RDONLY))!=-1 ){
+		fsync(fd);
+		close(fd);
+	}
+	snapshot.Nwritten++;
+	sprintf(message,"Snapshot %s written; %d of %d replicas had new coordinate data and %d had new restart data\n",snapshot.filename,snapshot.Nrecaptured,snapshot.Nreplicas,snapshot.Nrestarts);
+	append_log_entry(-1,message);
+	if(Nreferences>0){
+		sprintf(message,"Snapshot %s refers to earlier snapshots for the coordinate data of %d replicas; it needs the snapshots from %s on\n",snapshot.filename,Nreferences,oldest);
+		append_log_entry(-1,message);
 	}
+	restart_store_usage(&Nstored,&stored_bytes,&referenced_bytes,&Nrecipes);
+	sprintf(message,"Snapshot restarts: %llu bytes written as %u distinct chunks of %llu bytes; the restart store holds %llu bytes of %llu restarts in %lu chunks of %llu bytes\n",restart_bytes,Nchunks,chunk_bytes,referenced_bytes,Nrecipes,(unsigned long)Nstored,stored_bytes);
+	append_log_entry(-1,message);
+}
 
-	close(fd);
-	return (filename);
+void release_snapshot(void){
+	pthread_mutex_lock(&snapshot_mutex);
+	snapshot.busy=false;
+	pthread_cond_broadcast(&snapshot_cond);
+	pthread_mutex_unlock(&snapshot_mutex);
+}
+
+void *snapshot_writer(void *arg){
+	write_snapshot(false);
+	release_snapshot();
+	return(NULL);
 }
 
-//Loads a snapshot of the state of the distributed replica simulation from a file
+// Saves a snapshot of the state of the distributed replica simulation to a file and returns its name
 // The snapshot contains the coordinate positions of all replicas, their current sequence number,
 // a restart file, and the averaged coordinates at each discrete replica position.
-// Also load vRE structure.
-void load_snapshot(char *filename, struct script_struct *script, struct server_variable_struct *var){
+// Also save vRE structure.
+// Waits for any background snapshot to finish first. The file stands on its own (no references to earlier
+// snapshots), since it is what a mobile server or the next run starts from.
+char * save_snapshot(const struct script_struct *script, const struct server_variable_struct *var, const struct server_option_struct *opt){
+	//CN moved the replica mutex lock to something that must be done outside of this routine -- necessary for mobile server
+	append_log_entry(-1,"Saving a state snapshot\n");
+
+	pthread_mutex_lock(&snapshot_mutex);
+	while(snapshot.busy) pthread_cond_wait(&snapshot_cond,&snapshot_mutex);
+	snapshot.busy=true;
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	capture_snapshot(script,var,opt);
+	write_snapshot(true);
+	release_snapshot();
+	return(snapshot.filename);
+}
+
+// Like save_snapshot(), but the file is written by a background thread once the state has been captured.
+// Returns false, without doing anything, if the previous snapshot is still being written.
+// must be called with the replica_mutex on
+bool start_background_snapshot(const struct script_struct *script, const struct server_variable_struct *var, const struct server_option_struct *opt){
+	pthread_t writer_handle;
+
+	pthread_mutex_lock(&snapshot_mutex);
+	if(snapshot.busy){
+		pthread_mutex_unlock(&snapshot_mutex);
+		return(false);
+	}
+	snapshot.busy=true;
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	append_log_entry(-1,"Saving a state snapshot in the background\n");
+	capture_snapshot(script,var,opt);
+	if(pthread_create(&writer_handle,NULL,snapshot_writer,NULL)!=0){
+		error_warning("pthread_create failed for the snapshot writer; writing the snapshot now");
+		write_snapshot(false);
+		release_snapshot();
+		return(true);
+	}
+	if(pthread_detach(writer_handle)!=0){
+		error_warning("pthread_detach failed for the snapshot writer");
+	}
+	return(true);
+}
+
+// Records for the force database are queued by the client threads (under the database_mutex) and appended by
+// the database writer thread, at most DATABASE_BATCH_RECORDS at a time, with one write and one update of the
+// record count per batch. A record waits at most DATABASE_BATCH_SECONDS before it is written.
+#define DATABASE_BATCH_RECORDS 256
+#define DATABASE_BATCH_SECONDS 1
+#define DATABASE_QUEUE_MAX_RECORDS 4096         //clients wait for the writer beyond this
+#define DATABASE_WRITER_SLEEP_MICROSECONDS 20000
+
+struct database_queue_struct{
+	unsigned char *records;
+	unsigned int Nrecords;
+	unsigned int allocated;                 //in records
+};
+struct database_queue_struct database_queue={NULL,0,0};  //filled under the database_mutex
+struct database_queue_struct database_batch={NULL,0,0};  //written by the database writer
+unsigned int database_record_size=0;
+int database_sync_interval=0;
+volatile bool database_writer_running=false;
+volatile bool database_writer_stop=false;
+pthread_t database_writer_handle;
+
+void *database_writer(void *arg){
+	struct database_queue_struct swap;
+	time_t last_write=time(NULL);
+	time_t last_sync=time(NULL);
+	bool stop;
+
+	while(1){
+		stop=database_writer_stop;
+		pthread_mutex_lock(&database_mutex);
+		if(database_queue.Nrecords==0 || (!stop && database_queue.Nrecords<DATABASE_BATCH_RECORDS && time(NULL)-last_write<DATABASE_BATCH_SECONDS)){
+			pthread_mutex_unlock(&database_mutex);
+			if(stop) break;
+			usleep(DATABASE_WRITER_SLEEP_MICROSECONDS);
+			continue;
+		}
+		swap=database_queue;
+		database_queue=database_batch;
+		database_batch=swap;
+		pthread_mutex_unlock(&database_mutex);
+
+		force_database->append_records(database_batch.records,database_batch.Nrecords);
+		database_batch.Nrecords=0;
+		last_write=time(NULL);
+		if(database_sync_interval>=0 && last_write-last_sync>=database_sync_interval){
+			force_database->sync();
+			last_sync=last_write;
+		}
+	}
+	return(NULL);
+}
+
+// Without the writer, records are written directly as before
+void start_database_writer(const struct script_struct *script){
+	database_record_size=force_database->get_record_size();
+	database_sync_interval=script->database_sync_interval;
+	database_writer_stop=false;
+	if(pthread_create(&database_writer_handle,NULL,database_writer,NULL)!=0){
+		error_warning("pthread_create failed for the database writer; records will be written directly");
+		return;
+	}
+	database_writer_running=true;
+}
+
+// Writes whatever is queued; must be called before the force_database is closed
+void stop_database_writer(void){
+	if(!database_writer_running) return;
+	database_writer_stop=true;
+	pthread_join(database_writer_handle,NULL);
+	pthread_mutex_lock(&database_mutex);
+	database_writer_running=false;
+	force_database->append_records(database_queue.records,database_queue.Nrecords);
+	database_queue.Nrecords=0;
+	pthread_mutex_unlock(&database_mutex);
+	if(database_sync_interval>=0) force_database->sync();
+	free(database_queue.records);
+	free(database_batch.records);
+	database_queue.records=database_batch.records=NULL;
+	database_queue.allocated=database_batch.allocated=0;
+}
+
+// Queues the record that has been put together in the force_database; must be called with the database_mutex on
+void queue_database_record(void){
+	unsigned char *p;
+
+	if(!database_writer_running){
+		force_database->write_record();
+		return;
+	}
+	while(database_queue.Nrecords>=DATABASE_QUEUE_MAX_RECORDS && database_writer_running){
+		pthread_mutex_unlock(&database_mutex);
+		usleep(DATABASE_WRITER_SLEEP_MICROSECONDS);
+		pthread_mutex_lock(&database_mutex);
+	}
+	if(database_queue.Nrecords==database_queue.allocated){
+		p=(unsigned char *)realloc(database_queue.records,(size_t)(database_queue.allocated+DATABASE_BATCH_RECORDS)*database_record_size);
+		if(p==NULL) error_quit("cannot allocate memory for the database queue");
+		database_queue.records=p;
+		database_queue.allocated+=DATABASE_BATCH_RECORDS;
+	}
+	if(force_database->take_record(database_queue.records+(size_t)database_queue.Nrecords*database_record_size)) database_queue.Nrecords++;
+}
+
+// puts a restart read from a snapshot in the restart store as the restart of replicaN
+void load_snapshot_restart(int replicaN, const unsigned char *data, unsigned int size, struct script_struct *script){
+	if(size>0 && (replica_restart[replicaN]=restart_store_add(data,size))==NULL) error_quit("unable to allocate memory for the restart data");
+	script->replica[replicaN].restart.data=NULL;
+	script->replica[replicaN].restart.data_size=size;
+	script->replica[replicaN].restart.allocated_memory=0;
+}
+
+// Loads a snapshot written before the sectioned format (LEGACY_SNAPSHOT_VERSION, or 1.0 without vRE)
+void load_legacy_snapshot(char *filename, struct script_struct *script, struct server_variable_struct *var){
 	int fd;
 	unsigned int size;
 	int Nreplicas_in_snapshot;
@@ -441,16 +1530,16 @@ void load_snapshot(char *filename, struct script_struct *script, struct server_v
 	unsigned int sampling_runs;
 	char message[MESSAGE_GLOBALVAR_LENGTH];
 	
-	sprintf(message,"Loading state snapshot: %s\n", filename);
+	sprintf(message,"Loading state snapshot in the old format: %s\n", filename);
 	append_log_entry(-1,message);
 
 	if( (fd=open(filename,O_RDONLY))==-1 ) error_quit("cannot open file for reading");
 	if( read(fd,&version,sizeof(version))!=sizeof(version) ) error_quit("cannot read from file");
-	if(version!=SNAPSHOT_VERSION){
-		if(!(script->replica_move_type!=vRE && version==1.0 && SNAPSHOT_VERSION==2.0)){
+	if(version!=LEGACY_SNAPSHOT_VERSION){
+		if(!(script->replica_move_type!=vRE && version==1.0)){
 			error_quit("this program cannot read this version of the snapshot"); 
 		}
-		append_log_entry(-1,"ERROR error Error: The current SNAPSHOT_VERSION is 2.0, and your snapshot is version 1.0. However, you are not using vRE so this is allowed. Note: use at your own risk!!! (talk to Chris Neale if you want some assistance here).\n");
+		append_error_entry(-1,"ERROR error Error: The old snapshot format is version 2.0, and your snapshot is version 1.0. However, you are not using vRE so this is allowed. Note: use at your own risk!!! (talk to Chris Neale if you want some assistance here).\n");
 	}
 	if( read(fd,&Nreplicas_in_snapshot,sizeof(Nreplicas_in_snapshot))!=sizeof(Nreplicas_in_snapshot) ) error_quit("cannot read from file");
 	if(Nreplicas_in_snapshot!=script->Nreplicas) error_quit("number of replicas in the snapshot and in script file don't match"); 
@@ -476,60 +1565,402 @@ void load_snapshot(char *filename, struct script_struct *script, struct server_v
 		
 		size=script->replica[i].restart.data_size;
 		printf("allocating memory with size %u\n",size); //##DEBUG
-		script->replica[i].restart.data=new unsigned char[size];
-		script->replica[i].restart.allocated_memory=script->replica[i].restart.data_size;
-		if( read(fd,script->replica[i].restart.data,size)!=size ) error_quit("cannot read from file");
+		unsigned char *restart=new unsigned char[size];
+		if( read(fd,restart,size)!=size ) error_quit("cannot read from file");
+		load_snapshot_restart(i,restart,size,script);
+		delete[] restart;
 
 		size=var->Natoms*sizeof(struct atom_struct);
 		printf("allocating memory with size %u\n",size); //##DEBUG
 		script->replica[i].atom=new atom_struct[var->Natoms];
 		if( read(fd,script->replica[i].atom,size)!=size ) error_quit("cannot read from file");
 
-		size=N_PRESENCE_BITS/8;
-		printf("allocating memory with size %u\n",size); //##DEBUG
-		script->replica[i].presence=new unsigned int[N_PRESENCE_BITS/32];
-		if( read(fd,script->replica[i].presence,size)!=size ) error_quit("cannot read from file");
+		size=N_PRESENCE_BITS/8;
+		printf("allocating memory with size %u\n",size); //##DEBUG
+		script->replica[i].presence=new unsigned int[N_PRESENCE_BITS/32];
+		if( read(fd,script->replica[i].presence,size)!=size ) error_quit("cannot read from file");
+	}
+
+	if(script->replica_move_type==vRE){
+		long int *nallocated,*nlastused, *nrecyclepush;
+		float **val;
+		struct vre_item_struct **item;
+		long int snapshotAllocated;   // the allocation of the server that wrote the snapshot; ours stays as it is
+
+		for(int i=0;i<script->Nreplicas;i++){
+			load_vre_pointers(i,&nallocated,&nlastused,&item);
+			if(read(fd,&snapshotAllocated,sizeof(snapshotAllocated))!=sizeof(snapshotAllocated) ) error_quit("cannot read from file");
+			if(read(fd,nlastused,sizeof(*nlastused))!=sizeof(*nlastused) ) error_quit("cannot read from file");
+			if(growVRE_primary(i,*nlastused+1,true)!=0) error_quit("Loading in a vRE structure for which memory is not available.");
+			if(read(fd,*item,sizeof(struct vre_item_struct)*(*nlastused+1))!=sizeof(struct vre_item_struct)*(*nlastused+1) ) error_quit("cannot read from file");
+		}
+		for(int i=0;i<script->Nreplicas;i++){
+			load_secvre_pointers(i,&nallocated,&nlastused,&nrecyclepush,&val);
+			if(read(fd,&snapshotAllocated,sizeof(snapshotAllocated))!=sizeof(snapshotAllocated) ) error_quit("cannot read from file");
+			if(read(fd,nlastused,sizeof(*nlastused))!=sizeof(*nlastused) ) error_quit("cannot read from file");
+			if(growVRE_secondary(i,*nlastused+1,true)!=0) error_quit("Loading in a vRE structure for which memory is not available.");
+			if(read(fd,nrecyclepush,sizeof(*nrecyclepush))!=sizeof(*nrecyclepush) ) error_quit("cannot read from file");
+			if(read(fd,*val,sizeof(float)*(*nlastused+1))!=sizeof(float)*(*nlastused+1) ) error_quit("cannot read from file");
+		}
+		indexVREruns(script->Nreplicas);
+		//FOR DEBUGGING PURPOSES ONLY
+		//char saveName[30];
+		//sprintf(saveName,"VRE_loaded.txt");
+		//saveVREtoFile(saveName,script->Nreplicas);
+	}
+	close(fd);
+}
+
+// fills in the replica data allocations that the sectioned format restores
+void load_snapshot_replicas(const struct snapshot_replica_record *record, struct script_struct *script){
+	unsigned int sampling_runs;
+
+	if(script->replica==NULL){ 
+		//CN wonders why this does not invoke an error_quit
+		script->replica=new replica_struct[script->Nreplicas];
+	}
+	for(int i=0;i<script->Nreplicas;i++){
+		struct replica_struct *r=&script->replica[i];
+		// we want to keep the quantity from the script file, not the one in the snapshot
+		sampling_runs=r->sampling_runs;
+		r->cancellation_accumulator[0]=record[i].cancellation_accumulator[0];
+		r->cancellation_accumulator[1]=record[i].cancellation_accumulator[1];
+		r->w=record[i].w;
+		r->w_nominal=record[i].w_nominal;
+		r->w_start=record[i].w_start;
+		r->w2_nominal=record[i].w2_nominal;
+		r->w_sorted=record[i].w_sorted;
+		r->force=record[i].force;
+		r->cancellation_energy=record[i].cancellation_energy;
+		r->sequence_number=record[i].sequence_number;
+		r->sample_count=record[i].sample_count;
+		r->sampling_runs=sampling_runs;
+		r->sampling_steps=record[i].sampling_steps;
+		r->last_activity_time=record[i].last_activity_time;
+		r->start_time_on_current_node=record[i].start_time_on_current_node;
+		r->restart.data=NULL;
+		r->restart.data_size=record[i].restart_size;
+		r->restart.allocated_memory=0;
+		r->atom=NULL;
+		r->nodeSlot=record[i].nodeSlot;
+		r->cancellation_count=record[i].cancellation_count;
+		r->status=record[i].status;
+		if( (r->status=='S') || (r->status=='R') ) r->status='N';
+		printf("Reading replica %d, status: %c , sample_count: %u ,  sampling_runs: %u\n",i,r->status,r->sample_count,r->sampling_runs); //##DEBUG
+	}
+}
+
+// checks a SectionAtoms or SectionPresence payload and loads it into replica r
+void load_snapshot_replica_data(struct replica_struct *r, unsigned int type, const unsigned char *payload, unsigned long long length, int Natoms){
+	if(type==SectionAtoms){
+		if( length!=Natoms*sizeof(struct atom_struct) || r->atom!=NULL ) error_quit("the snapshot has a bad coordinate section");
+		r->atom=new atom_struct[Natoms];
+		memcpy(r->atom,payload,length);
+	}else{
+		if( length!=N_PRESENCE_BITS/8 ) error_quit("the snapshot has a bad presence section");
+		if( r->presence==NULL ) r->presence=new unsigned int[N_PRESENCE_BITS/32];
+		memcpy(r->presence,payload,length);
+	}
+}
+
+struct snapshot_mapping{
+	char name[32];
+	const unsigned char *map;
+	size_t size;
+};
+
+// maps the earlier snapshot 'name', which is in the directory of the snapshot 'filename', and checks its header
+void map_referenced_snapshot(const char *filename, const char *name, struct snapshot_mapping *m){
+	char path[PATH_MAX];
+	const char *slash=strrchr(filename,'/');
+	struct snapshot_file_header header;
+	struct stat st;
+	char message[MESSAGE_GLOBALVAR_LENGTH];
+	int fd;
+
+	if( strchr(name,'/')!=NULL ) error_quit("the snapshot refers to a file outside its directory");
+	snprintf(path,sizeof(path),"%.*s%s",(slash!=NULL)?(int)(slash-filename+1):0,filename,name);
+	if( (fd=open(path,O_RDONLY))==-1 || fstat(fd,&st)!=0 || st.st_size<(off_t)sizeof(header) ){
+		sprintf(message,"the snapshot refers to %s for coordinate data, which cannot be read",path);
+		error_quit(message);
+	}
+	if( (m->map=(const unsigned char *)mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0))==MAP_FAILED ) error_quit("cannot map the snapshot file");
+	close(fd);
+	memcpy(&header,m->map,sizeof(header));
+	if( header.version!=SNAPSHOT_VERSION || memcmp(header.magic,SNAPSHOT_MAGIC,4)!=0 || header.crc!=crc32c(&header,offsetof(struct snapshot_file_header,crc)) ){
+		sprintf(message,"the snapshot refers to %s for coordinate data, which is not a snapshot of this format",path);
+		error_quit(message);
+	}
+	strcpy(m->name,name);
+	m->size=st.st_size;
+}
+
+// the payload of the section at offset of a mapped snapshot, or NULL if it runs past the end or fails its CRC32C
+const unsigned char *snapshot_section_at(const struct snapshot_mapping *m, unsigned long long offset, struct snapshot_section_header *section){
+	if( offset<sizeof(struct snapshot_file_header) || offset>m->size || m->size-offset<sizeof(*section) ) return(NULL);
+	memcpy(section,m->map+offset,sizeof(*section));
+	if( section->length>m->size-offset-sizeof(*section) ) return(NULL);
+	if( section->crc!=crc32c(m->map+offset+sizeof(*section),section->length) ) return(NULL);
+	return(m->map+offset+sizeof(*section));
+}
+
+// Loads a snapshot of the state of the distributed replica simulation from a file
+// The snapshot contains the coordinate positions of all replicas, their current sequence number,
+// a restart file, and the averaged coordinates at each discrete replica position.
+// Also load vRE structure.
+// The file is mapped and every section is checked against its CRC32C before anything is used.
+void load_snapshot(char *filename, struct script_struct *script, struct server_variable_struct *var){
+	int fd;
+	struct stat st;
+	const unsigned char *map;
+	size_t offset;
+	struct snapshot_file_header header;
+	struct snapshot_section_header section;
+	const unsigned char *payload;
+	bool have_replicas=false, have_end=false;
+	int Nrestart=0, Natoms_sections=0, Npresence=0, Nprimary=0, Nsecondary=0;
+	bool vre=(script->replica_move_type==vRE);
+	char message[MESSAGE_GLOBALVAR_LENGTH];
+	const unsigned char **chunk=NULL;   //the restart chunks read so far, still in the mapped file
+	unsigned int *chunk_size=NULL;
+	unsigned int Nchunks=0, chunk_allocated=0;
+	struct snapshot_mapping *referenced=NULL;   //earlier snapshots that SectionReplicaDataRef points into
+	int Nreferenced=0;
+
+	if( (fd=open(filename,O_RDONLY))==-1 ) error_quit("cannot open file for reading");
+	if( fstat(fd,&st)!=0 ) error_quit("cannot stat the snapshot file");
+	if( st.st_size<(off_t)sizeof(header) ){
+		close(fd);
+		load_legacy_snapshot(filename,script,var);
+		return;
+	}
+	if( (map=(const unsigned char *)mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0))==MAP_FAILED ) error_quit("cannot map the snapshot file");
+	close(fd);
+	memcpy(&header,map,sizeof(header));
+	if(header.version!=SNAPSHOT_VERSION){
+		munmap((void *)map,st.st_size);
+		load_legacy_snapshot(filename,script,var);
+		return;
 	}
 
-	if(script->replica_move_type==vRE){
-		long int *nallocated,*nlastused, *nrecyclepush;
-		float **val;
-		struct vre_item_struct **item;
-		long int vreAllocated;
+	sprintf(message,"Loading state snapshot: %s\n", filename);
+	append_log_entry(-1,message);
 
-		vreAllocated=getVREallocationLevel(script->Nreplicas);
-		for(int i=0;i<script->Nreplicas;i++){
-			load_vre_pointers(i,&nallocated,&nlastused,&item);
-			if(read(fd,nallocated,sizeof(*nallocated))!=sizeof(*nallocated) ) error_quit("cannot read from file");
-			if(read(fd,nlastused,sizeof(*nlastused))!=sizeof(*nlastused) ) error_quit("cannot read from file");
-			if(*nlastused>=vreAllocated) error_quit("Loading in a vRE structure for which memory is not available.");
-			if(read(fd,*item,sizeof(struct vre_item_struct)*(*nlastused+1))!=sizeof(struct vre_item_struct)*(*nlastused+1) ) error_quit("cannot read from file");
+	if( memcmp(header.magic,SNAPSHOT_MAGIC,4)!=0 || header.crc!=crc32c(&header,offsetof(struct snapshot_file_header,crc)) ) error_quit("the snapshot header is corrupt");
+	if(header.Nreplicas!=script->Nreplicas) error_quit("number of replicas in the snapshot and in script file don't match"); 
+	if(vre && header.replica_move_type!=vRE) error_quit("this run uses vRE but the snapshot has no vRE data");
+	var->Natoms=header.Natoms;
+
+	for(offset=sizeof(header);!have_end;offset+=sizeof(section)+section.length){
+		if( st.st_size-offset<sizeof(section) ) error_quit("the snapshot file is truncated");
+		memcpy(&section,map+offset,sizeof(section));
+		if( section.length>st.st_size-offset-sizeof(section) ) error_quit("the snapshot file is truncated");
+		payload=map+offset+sizeof(section);
+		if( section.crc!=crc32c(payload,section.length) ){
+			sprintf(message,"snapshot section of type %u (index %d) fails its checksum",section.type,section.index);
+			error_quit(message);
 		}
-		vreAllocated=getSECVREallocationLevel(script->Nreplicas);
-		for(int i=0;i<script->Nreplicas;i++){
-			load_secvre_pointers(i,&nallocated,&nlastused,&nrecyclepush,&val);
-			if(read(fd,nallocated,sizeof(*nallocated))!=sizeof(*nallocated) ) error_quit("cannot read from file");
-			if(read(fd,nlastused,sizeof(*nlastused))!=sizeof(*nlastused) ) error_quit("cannot read from file");
-			if(*nlastused>=vreAllocated) error_quit("Loading in a vRE structure for which memory is not available.");
-			if(read(fd,nrecyclepush,sizeof(*nrecyclepush))!=sizeof(*nrecyclepush) ) error_quit("cannot read from file");
-			if(read(fd,*val,sizeof(float)*(*nlastused+1))!=sizeof(float)*(*nlastused+1) ) error_quit("cannot read from file");
+		if( section.type>SectionReplicaDataRef ) continue;  // written by a newer server; not needed here
+		if( section.version!=SNAPSHOT_SECTION_VERSION ){
+			sprintf(message,"snapshot section of type %u has layout version %u, which this program cannot read",section.type,section.version);
+			error_quit(message);
+		}
+		bool global_section=(section.type==SectionEnd || section.type==SectionReplicas || section.type==SectionCancellationWHAM || section.type==SectionCancellationRounds || section.type==SectionRestartChunk);
+		if( !global_section ){
+			if( !have_replicas ) error_quit("the snapshot has replica data before the replica section");
+			if( section.index<0 || section.index>=script->Nreplicas ) error_quit("the snapshot has a section for a replica that does not exist");
+		}
+		struct replica_struct *r=global_section?NULL:&script->replica[section.index];
+
+		switch(section.type){
+			case SectionEnd:
+				have_end=true;
+				break;
+			case SectionReplicas:
+				if( section.length!=script->Nreplicas*sizeof(struct snapshot_replica_record) ) error_quit("the snapshot replica section has the wrong size");
+				load_snapshot_replicas((const struct snapshot_replica_record *)payload,script);
+				have_replicas=true;
+				break;
+			case SectionRestart:
+				if( section.length!=r->restart.data_size || replica_restart[section.index]!=NULL ) error_quit("the snapshot has a bad restart section");
+				load_snapshot_restart(section.index,payload,section.length,script);
+				Nrestart++;
+				break;
+			case SectionRestartChunk:
+				if( section.index!=(int)Nchunks || section.length==0 || section.length>RESTART_CHUNK_MAX ) error_quit("the snapshot has a bad restart chunk");
+				if(Nchunks==chunk_allocated){
+					chunk_allocated=(chunk_allocated==0)?1024:2*chunk_allocated;
+					chunk=(const unsigned char **)realloc(chunk,chunk_allocated*sizeof(const unsigned char *));
+					chunk_size=(unsigned int *)realloc(chunk_size,chunk_allocated*sizeof(unsigned int));
+					if(chunk==NULL || chunk_size==NULL) error_quit("unable to allocate memory for the restart chunks of the snapshot");
+				}
+				chunk[Nchunks]=payload;
+				chunk_size[Nchunks++]=section.length;
+				break;
+			case SectionRestartRecipe:{
+				const uint32_t *number=(const uint32_t *)payload;
+				unsigned long long size=0;
+				unsigned char *restart;
+
+				if( section.length%sizeof(uint32_t)!=0 || replica_restart[section.index]!=NULL ) error_quit("the snapshot has a bad restart recipe");
+				for(size_t k=0;k<section.length/sizeof(uint32_t);k++){
+					if(number[k]>=Nchunks) error_quit("the snapshot has a restart recipe with a chunk that it does not have");
+					size+=chunk_size[number[k]];
+				}
+				if( size!=r->restart.data_size ) error_quit("the snapshot has a restart recipe of the wrong size");
+				restart=new unsigned char[size];
+				size=0;
+				for(size_t k=0;k<section.length/sizeof(uint32_t);k++){
+					memcpy(restart+size,chunk[number[k]],chunk_size[number[k]]);
+					size+=chunk_size[number[k]];
+				}
+				load_snapshot_restart(section.index,restart,size,script);
+				delete[] restart;
+				Nrestart++;
+				break;
+			}
+			case SectionAtoms:
+				load_snapshot_replica_data(r,section.type,payload,section.length,var->Natoms);
+				Natoms_sections++;
+				break;
+			case SectionPresence:
+				load_snapshot_replica_data(r,section.type,payload,section.length,var->Natoms);
+				Npresence++;
+				break;
+			case SectionReplicaDataRef:{
+				struct snapshot_reference_record reference;
+				struct snapshot_section_header atoms, presence;
+				const unsigned char *atoms_payload, *presence_payload;
+				int k;
+
+				if( section.length!=sizeof(reference) ) error_quit("the snapshot has a bad reference section");
+				memcpy(&reference,payload,sizeof(reference));
+				reference.filename[sizeof(reference.filename)-1]='\0';
+				for(k=0;k<Nreferenced && strcmp(referenced[k].name,reference.filename)!=0;k++);
+				if(k==Nreferenced){
+					referenced=(struct snapshot_mapping *)realloc(referenced,(Nreferenced+1)*sizeof(struct snapshot_mapping));
+					if(referenced==NULL) error_quit("unable to allocate memory for the snapshots referred to");
+					map_referenced_snapshot(filename,reference.filename,&referenced[Nreferenced++]);
+				}
+				atoms_payload=snapshot_section_at(&referenced[k],reference.offset,&atoms);
+				presence_payload=(atoms_payload==NULL)?NULL:snapshot_section_at(&referenced[k],reference.offset+sizeof(atoms)+atoms.length,&presence);
+				if( presence_payload==NULL || atoms.type!=SectionAtoms || presence.type!=SectionPresence || atoms.index!=section.index || presence.index!=section.index || atoms.version!=SNAPSHOT_SECTION_VERSION || presence.version!=SNAPSHOT_SECTION_VERSION ){
+					sprintf(message,"the snapshot refers to coordinate data of replica %d in %s that is not there",section.index,reference.filename);
+					error_quit(message);
+				}
+				load_snapshot_replica_data(r,atoms.type,atoms_payload,atoms.length,var->Natoms);
+				load_snapshot_replica_data(r,presence.type,presence_payload,presence.length,var->Natoms);
+				Natoms_sections++;
+				Npresence++;
+				break;
+			}
+			case SectionVREPrimary:
+			case SectionVRESecondary:
+				if(!vre) break;
+				{
+					int64_t count[3];
+					long int *nallocated,*nlastused,*nrecyclepush;
+					size_t Ncount=(section.type==SectionVREPrimary)?2:3;
+					size_t item_size=(section.type==SectionVREPrimary)?sizeof(struct vre_item_struct):sizeof(float);
+
+					if( section.length<Ncount*sizeof(int64_t) ) error_quit("the snapshot has a bad vRE section");
+					memcpy(count,payload,Ncount*sizeof(int64_t));
+					if( count[1]<-1 || section.length!=Ncount*sizeof(int64_t)+(count[1]+1)*item_size ) error_quit("the snapshot has a bad vRE section");
+					// the allocation of the server that wrote the snapshot (count[0]) is not used; ours grows to fit
+					if(section.type==SectionVREPrimary){
+						struct vre_item_struct **item;
+						load_vre_pointers(section.index,&nallocated,&nlastused,&item);
+						if(growVRE_primary(section.index,count[1]+1,true)!=0) error_quit("Loading in a vRE structure for which memory is not available.");
+						*nlastused=count[1];
+						memcpy(*item,payload+Ncount*sizeof(int64_t),(count[1]+1)*item_size);
+						Nprimary++;
+					}else{
+						float **val;
+						load_secvre_pointers(section.index,&nallocated,&nlastused,&nrecyclepush,&val);
+						if(growVRE_secondary(section.index,count[1]+1,true)!=0) error_quit("Loading in a vRE structure for which memory is not available.");
+						*nlastused=count[1];
+						*nrecyclepush=count[2];
+						memcpy(*val,payload+Ncount*sizeof(int64_t),(count[1]+1)*item_size);
+						Nsecondary++;
+					}
+				}
+				break;
+			case SectionCancellationWHAM:
+				// kept as it is; allocate_cancellation_wham() decides whether it still fits the run
+				{
+					int64_t Nbins;
+					double range[2];
+					size_t head=sizeof(Nbins)+sizeof(range);
+
+					if( section.length<head ) error_quit("the snapshot has a bad WHAM cancellation section");
+					memcpy(&Nbins,payload,sizeof(Nbins));
+					memcpy(range,payload+sizeof(Nbins),sizeof(range));
+					if( Nbins<1 || section.length!=head+Nbins*(sizeof(unsigned long long)+sizeof(double)) ) error_quit("the snapshot has a bad WHAM cancellation section");
+					free_cancellation_wham();
+					cancellation_wham.Nbins=Nbins;
+					cancellation_wham.min=range[0];
+					cancellation_wham.bin_width=range[1];
+					cancellation_wham.Nk=new unsigned long long[Nbins];
+					cancellation_wham.count=new double[Nbins];
+					memcpy(cancellation_wham.Nk,payload+head,Nbins*sizeof(unsigned long long));
+					memcpy(cancellation_wham.count,payload+head+Nbins*sizeof(unsigned long long),Nbins*sizeof(double));
+					cancellation_wham.Nsamples=0;
+					for(int k=0;k<Nbins;k++) cancellation_wham.Nsamples+=cancellation_wham.Nk[k];
+				}
+				break;
+			case SectionCancellationRounds:
+				// kept as it is; allocate_cancellation_rounds() decides whether the run still uses it
+				{
+					int64_t state[3];
+					size_t N=script->Nreplicas;
+
+					if( section.length!=sizeof(state)+4*N*sizeof(double) ) error_quit("the snapshot has a bad cancellation rounds section");
+					memcpy(state,payload,sizeof(state));
+					if( state[0]!=script->Nreplicas || state[1]<0 ) error_quit("the snapshot has a bad cancellation rounds section");
+					free_cancellation_rounds();
+					cancellation_rounds.Nreplicas=N;
+					cancellation_rounds.round=state[1];
+					cancellation_rounds.collecting=(state[2]!=0);
+					cancellation_rounds.energy=new double[N];
+					cancellation_rounds.error=new double[N];
+					cancellation_rounds.sum_of_squares=new double[2*N];
+					memcpy(cancellation_rounds.energy,payload+sizeof(state),N*sizeof(double));
+					memcpy(cancellation_rounds.error,payload+sizeof(state)+N*sizeof(double),N*sizeof(double));
+					memcpy(cancellation_rounds.sum_of_squares,payload+sizeof(state)+2*N*sizeof(double),2*N*sizeof(double));
+				}
+				break;
 		}
-		//FOR DEBUGGING PURPOSES ONLY
-		//char saveName[30];
-		//sprintf(saveName,"VRE_loaded.txt");
-		//saveVREtoFile(saveName,script->Nreplicas);
 	}
-	close(fd);
+	munmap((void *)map,st.st_size);
+	free(chunk);
+	free(chunk_size);
+	for(int k=0;k<Nreferenced;k++) munmap((void *)referenced[k].map,referenced[k].size);
+	free(referenced);
+
+	if( !have_replicas || Nrestart!=script->Nreplicas || Natoms_sections!=script->Nreplicas || Npresence!=script->Nreplicas ) error_quit("the snapshot is missing replica data");
+	if( vre ){
+		if( Nprimary!=script->Nreplicas || Nsecondary!=script->Nreplicas ) error_quit("the snapshot is missing vRE data");
+		indexVREruns(script->Nreplicas);
+	}
+	printf("Read in initial snapshot data, Nreplicas: %u   Natoms: %u\n",script->Nreplicas,var->Natoms); //##DEBUG
 }
 
 //frees all memory used to store replica information
 void free_all_replicas(struct script_struct *script){
 	for(int i=0;i<script->Nreplicas;i++){
-		delete[] script->replica[i].restart.data;
+		restart_store_release(replica_restart[i]);
 		delete[] script->replica[i].atom;
 		delete[] script->replica[i].presence;
 	}
 	delete[] script->replica;
+	delete[] replica_restart;
+	replica_restart=NULL;
+}
+
+// must be called before a snapshot is loaded or any client connects
+void allocate_replica_restarts(const struct script_struct *script){
+	replica_restart=new restart_recipe_struct*[script->Nreplicas];
+	for(int i=0;i<script->Nreplicas;i++) replica_restart[i]=NULL;
 }
 
 // For now basically checks that the received restart file has a size greater than zero
@@ -537,82 +1968,103 @@ unsigned char check_restart_file_integrity(struct client_struct *client, struct
 	if(restart.data_size>0){
 		return(1);
 	}else{
-		client->ptr+=sprintf(client->ptr,"Restart data fails integrity check; size is %u\n",restart.data_size);
+		client_error_printf(client,"Restart data fails integrity check; size is %u\n",restart.data_size);
 		return(0);
 	}
 }
 	
-// Accepts the given restart file as the latest restart file for the specified replica
-void commit_restart_file(int replicaN, struct buffer_struct *restart, struct script_struct *script){
-	printf("commit_restart_file: freeing memory at: %p\n",script->replica[replicaN].restart.data); //##DEBUG
-	delete[] script->replica[replicaN].restart.data;
-	script->replica[replicaN].restart=*restart;
-	printf("comitted restart file now at: %p\n",script->replica[replicaN].restart.data); //##DEBUG
+// Puts a received restart file in the restart store, where the chunks that it shares with other restarts are kept
+// once; they are copied straight from client->in (see receive_file()). This is the costly part of accepting a
+// restart, so it is done before any lock is taken. returns NULL if no restart file was received
+struct restart_recipe_struct *store_restart_file(struct buffer_struct *restart){
+	struct restart_recipe_struct *stored;
+
+	if(restart->data==NULL) return(NULL);
+	if( (stored=restart_store_add(restart->data,restart->data_size))==NULL ) error_quit("unable to allocate memory for the restart data");
 	restart->data=NULL;
 	restart->data_size=0;
 	restart->allocated_memory=0;
+	return(stored);
+}
+
+// Accepts the given stored restart file as the latest restart file for the specified replica and takes it from *restart
+// returns the previous restart, which the caller must restart_store_release() (outside of any lock)
+struct restart_recipe_struct *commit_restart_file(int replicaN, struct restart_recipe_struct **restart, struct script_struct *script){
+	struct restart_recipe_struct *retired;
+
+	lock_replica_data(replicaN);
+	retired=replica_restart[replicaN];
+	replica_restart[replicaN]=*restart;
+	script->replica[replicaN].restart.data_size=(*restart!=NULL)?(*restart)->size:0;
+	snapshot_mark_restart_dirty(replicaN);
+	unlock_replica_data(replicaN);
+	printf("comitted restart file at: %p, retiring %p\n",(void *)*restart,(void *)retired); //##DEBUG
+	*restart=NULL;
+	return(retired);
+}
+
+// Allocates the averaged coordinates of every replica the first time that coordinate data arrives
+// must be called with the replica_mutex on, before any commit_coordinate_data()
+void allocate_coordinate_averages(struct buffer_struct *coordinate_v, const struct script_struct *script, struct server_variable_struct *var){
+	int i;
+
+	if(var->Natoms!=0) return;
+	printf("Natoms is 0, therefore we need to allocate memory for the first time\n");   //##DEBUG
+	lock_all_replica_data();
+	var->Natoms=coordinate_v->data_size/sizeof(float)/3; // 3 coordinates per atom
+	printf("Natoms is now %d\n",var->Natoms);                                                //##DEBUG
+	
+	for(i=0;i<script->Nreplicas;i++){
+		script->replica[i].atom=new atom_struct[var->Natoms];
+		printf("Replica %d: memory successfully allocated\n",i);                    //##DEBUG
+		memset(script->replica[i].atom,0,var->Natoms*sizeof(struct atom_struct));
+		printf("%d bytes filled with zeros\n",(int)(var->Natoms*sizeof(struct atom_struct)));   //##DEBUG
+	}	
+	unlock_all_replica_data();
 }
 
 // Averages the given coordinate file into the master coordinate file for the given replica
-void commit_coordinate_data(int replicaN, int bin_number, struct buffer_struct *coordinate_v, const struct script_struct *script, struct server_variable_struct *var){
+// sequence_number is that of the run that produced the coordinates. Only the replica data locks are used.
+void commit_coordinate_data(int replicaN, unsigned int sequence_number, int bin_number, struct buffer_struct *coordinate_v, const struct script_struct *script, const struct server_variable_struct *var){
 	unsigned int address;
 	unsigned char bit;
 	unsigned int presence;
 	float *coordinate=(float*)(coordinate_v->data);
 	int i;
 
-	if(var->Natoms==0){
-		printf("Natoms is 0, therefore we need to allocate memory for the first time\n");   //##DEBUG
-		var->Natoms=coordinate_v->data_size/sizeof(float)/3; // 3 coordinates per atom
-		printf("Natoms is now %d\n",var->Natoms);                                                //##DEBUG
-		
-		for(i=0;i<script->Nreplicas;i++){
-			script->replica[i].atom=new atom_struct[var->Natoms];
-			printf("Replica %d: memory successfully allocated\n",i);                    //##DEBUG
-			memset(script->replica[i].atom,0,var->Natoms*sizeof(struct atom_struct));
-			printf("%d bytes filled with zeros\n",(int)(var->Natoms*sizeof(struct atom_struct)));   //##DEBUG
-		}	
-	}	
-
 	printf("--------> committing coordinate data for replica %d, bin: %d\n",replicaN, bin_number); //##DEBUG
 	
-	bit=script->replica[replicaN].sequence_number&31;
-	address=script->replica[replicaN].sequence_number>>5;
+	bit=sequence_number&31;
+	address=sequence_number>>5;
 	
-	printf("calculating presence location: sequence_number: %u   address: %u   bit: %hhu\n",script->replica[replicaN].sequence_number, address, bit); //##DEBUG
+	printf("calculating presence location: sequence_number: %u   address: %u   bit: %hhu\n",sequence_number, address, bit); //##DEBUG
+	lock_replica_data(replicaN);
 	presence=script->replica[replicaN].presence[address];
+	script->replica[replicaN].presence[address]=presence|(1<<bit);
+	snapshot_mark_dirty(replicaN);
+	unlock_replica_data(replicaN);
 	
-	printf("current presence: %u\n",presence); //##DEBUG
+	printf("previous presence: %u\n",presence); //##DEBUG
 	
 	if( ((presence>>bit)&1)==0 ){
 		printf("the presence bit was 0\n"); //##DEBUG
 
-		if(coordinate_v->data_size/sizeof(float)/3==var->Natoms) // this condition will be false only on one very rare circumstance: when one or more corrupt coordinate files are received before the Natoms variable has been updated with the correct number
+		if(coordinate_v->data_size/sizeof(float)/3==var->Natoms){ // this condition will be false only on one very rare circumstance: when one or more corrupt coordinate files are received before the Natoms variable has been updated with the correct number
+			lock_replica_data(bin_number);
 			for(i=0;i<var->Natoms;i++){
 				script->replica[bin_number].atom[i].x+=coordinate[i*3+0];
 				script->replica[bin_number].atom[i].y+=coordinate[i*3+1];
 				script->replica[bin_number].atom[i].z+=coordinate[i*3+2];
 				script->replica[bin_number].atom[i].weight++;
 			}
+			snapshot_mark_dirty(bin_number);
+			unlock_replica_data(bin_number);
+		}
 
 		printf("new atoms 0 data: %lf %lf %lf  %u\n",script->replica[bin_number].atom[0].x,script->replica[bin_number].atom[0].y,script->replica[bin_number].atom[0].z,script->replica[bin_number].atom[0].weight); //##DEBUG
-
-		presence|=(1<<bit);
-		script->replica[replicaN].presence[address]=presence;
-		printf("new presence: %u\n",presence); //##DEBUG
 	}
 }
 
-// Makes a duplicate copy of the given restart data
-void copy_restart_data(struct buffer_struct *destination, struct buffer_struct *source){
-	printf("copy_restart_data: destination pointer is: %p\n",destination->data);  //##DEBUG
-	unsigned int size=source->data_size;
-	destination->data_size=size;
-	destination->allocated_memory=size;
-	destination->data=new unsigned char[size];
-	memcpy(destination->data,source->data,size);
-}
-
 // choses the best replica to run next such as to minimize network trafic
 // this algorithm chooses the replica with the lowest sequence number, however, if more than one replica
 // have the same lowest sequence number then preference will be given to the replica that just ran on that Node,
@@ -663,7 +2115,7 @@ int drop_one_old_node(struct client_struct *client, const struct script_struct *
 	}
 	age=time(NULL)-otime;
 	// decide if it is old enough (currently, only allow stoppage if at least script->cycleClients of the allocated time has been used)
-	client->ptr+=sprintf(client->ptr,"DUMP: Considering dump of age %d based on Nodetime %d and eval %d \n", age,script->node_time, (int)ceil((double)(script->node_time)*script->cycleClients));
+	client_printf(client,"DUMP: Considering dump of age %d based on Nodetime %d and eval %d \n", age,script->node_time, (int)ceil((double)(script->node_time)*script->cycleClients));
 	if(age>(int)ceil((double)(script->node_time)*script->cycleClients)){
 		// it's old enough, so change its clock to cause it to termiante early.
 		node[onode].awaitingDump=true;
@@ -673,13 +2125,20 @@ int drop_one_old_node(struct client_struct *client, const struct script_struct *
 		onode=-1;
 	}
 	if(onode!=-1){
-		// wait for the dumped replica to finish its communication by other methods
+		// wait for the dumped replica to finish its communication by other methods; meanwhile this worker's slot
+		// in the pool is free for the client_interaction() of that replica
 		pthread_mutex_unlock(&replica_mutex);
+		pthread_mutex_lock(&client_queue_mutex);
+		Nclient_workers_parked++;
+		pthread_mutex_unlock(&client_queue_mutex);
 		while(node[onode].active && node[onode].awaitingDump){
 			//node[onode].awaitingDump is necessary because a different node could pick this one up (that would deadlock this one)
 			sleep(1);
 			fprintf(stderr,"drop_one_old_node (WAITING): Waiting for node[%d] (ip=%s) to become inactive.\n",onode, node[onode].ip);fflush(stderr);
 		}
+		pthread_mutex_lock(&client_queue_mutex);
+		Nclient_workers_parked--;
+		pthread_mutex_unlock(&client_queue_mutex);
 		pthread_mutex_lock(&replica_mutex);
 		//no need to node[onode].awaitingDump=false because that is done in connection to a new node
 	}
@@ -700,7 +2159,7 @@ unsigned char check_energy_file_integrity(struct client_struct *client, struct b
 	if(energy.data_size==expected_file_size){
 		return(1);
 	}else{
-		client->ptr+=sprintf(client->ptr,"Energy data fails integrity check; expected size is %u; acutal size is %u\n",expected_file_size,energy.data_size);
+		client_error_printf(client,"Energy data fails integrity check; expected size is %u; acutal size is %u\n",expected_file_size,energy.data_size);
 		return(0);
 	}
 }
@@ -726,7 +2185,7 @@ unsigned char check_sample_file_integrity(struct client_struct *client, struct b
 	if(sample.data_size==expected_file_size){
 		return(1);
 	}else{
-		client->ptr+=sprintf(client->ptr,"Sample data fails integrity check; expected size is %u; acutal size is %u\n",expected_file_size,sample.data_size);
+		client_error_printf(client,"Sample data fails integrity check; expected size is %u; acutal size is %u\n",expected_file_size,sample.data_size);
 		return(0);
 	}
 }
@@ -751,7 +2210,7 @@ unsigned char check_coordinate_file_integrity(struct client_struct *client, stru
 	} //##DEBUG
 	
 	if( (coordinate.data_size==0) || ( (coordinate.data_size!=expected_file_size) && (var->Natoms!=0) ) ){
-		client->ptr+=sprintf(client->ptr,"Coordinate data fails integrity check; expected size is %u; acutal size is %u\n",expected_file_size,coordinate.data_size);
+		client_error_printf(client,"Coordinate data fails integrity check; expected size is %u; acutal size is %u\n",expected_file_size,coordinate.data_size);
 		return(0);
 	}
 	
@@ -763,9 +2222,7 @@ float replica_linearizing_function(float w, const struct script_struct *script){
 	int i;
 	float fraction;
 	
-	for(i=0;i<script->Nreplicas;i++){
-		if(w<script->replica[i].w_nominal) break;
-	}
+	i=nominal_grid_upper(&nominal_grid,w);
 		
 	if(i==0) i++;
 	if(i==script->Nreplicas) i--;
@@ -774,34 +2231,100 @@ float replica_linearizing_function(float w, const struct script_struct *script){
 	return((float)(i-1)+fraction);
 }
 
+int compare_floats(const void *a, const void *b){
+	float fa=*(const float *)a;
+	float fb=*(const float *)b;
+	return( (fa>fb)-(fa<fb) );
+}
+
+// the DRPE sums ((x_i-x_j)-(i-j))^2 over all pairs of sorted, linearized positions x_i.
+// With y_i=x_i-i this is sum_ij (y_i-y_j)^2 = 2*N*sum(y_i^2) - 2*sum(y_i)^2
+double replica_potential_from_sums(int N, double y_sum, double y2_sum, double x_sum, const struct script_struct *script){
+	double E_total;
+	double w_nominal_sum=((double)N-1.0)/2*N; 
+	//this is really the sum over i from 0 to Nreplicas-1 of replica_linearizing_function(replica[i].w_nominal)
+	//it's just faster to calculate this way
+
+	E_total=(2.0*(double)N*y2_sum-2.0*y_sum*y_sum)*script->replica_potential_scalar1;
+	E_total+=sqr(x_sum-w_nominal_sum)*script->replica_potential_scalar2;
+	return(E_total);
+}
+
+// make sure the drpe scratch space can hold N positions
+void allocate_drpe(int N){
+	if(drpe.allocated>=N) return;
+	if(drpe.x!=NULL) delete[] drpe.x;
+	if(drpe.y_prefix!=NULL) delete[] drpe.y_prefix;
+	drpe.x=new float[N];
+	drpe.y_prefix=new double[N+1];
+	drpe.allocated=N;
+}
+
+// sorts the first n entries of drpe.x and accumulates the sums over them
+void sort_drpe(int n){
+	int i;
+	double y;
+
+	qsort(drpe.x,n,sizeof(float),compare_floats);
+	drpe.y_prefix[0]=0.0;
+	drpe.y2_sum=0.0;
+	drpe.x_sum=0.0;
+	for(i=0;i<n;i++){
+		y=(double)drpe.x[i]-(double)i;
+		drpe.y_prefix[i+1]=drpe.y_prefix[i]+y;
+		drpe.y2_sum+=y*y;
+		drpe.x_sum+=drpe.x[i];
+	}
+}
+
 // calculates the potential of replica districution. ie. this comupted the DRPE (see the paper)
+// must be called with replica_mutex held since it uses the shared drpe scratch space
 double replica_potential(const struct script_struct *script){
+	int i;
+
+	allocate_drpe(script->Nreplicas);
+	// linearizing is monotonic, so sorting the linearized values is the same as sorting w
+	for(i=0;i<script->Nreplicas;i++){
+		drpe.x[i]=replica_linearizing_function(script->replica[i].w,script);
+	}
+	sort_drpe(script->Nreplicas);
+	for(i=0;i<script->Nreplicas;i++){
+		script->replica[i].w_sorted=drpe.x[i];
+	}
+	drpe.N=0;  // the scratch space now holds all replicas, not a trial set
+
+	return(replica_potential_from_sums(script->Nreplicas,drpe.y_prefix[script->Nreplicas],drpe.y2_sum,drpe.x_sum,script));
+}
+
+// the original O(N^2) evaluation of the DRPE; the reference for replica_potential_trial() in tests/test_drpe.cpp
+double replica_potential_pairwise(const struct script_struct *script){
 	int i,j;
 	double E_total;
 	float swap_temp;
+	float *w_sorted=new float[script->Nreplicas];
 
 	for(i=0;i<script->Nreplicas;i++){
-		script->replica[i].w_sorted=script->replica[i].w;
+		w_sorted[i]=script->replica[i].w;
 	}
 
 	for(i=0;i<script->Nreplicas-1;i++){
 		for(j=i+1;j<script->Nreplicas;j++){
-			if(script->replica[i].w_sorted>script->replica[j].w_sorted){
-				swap_temp=script->replica[i].w_sorted;
-				script->replica[i].w_sorted=script->replica[j].w_sorted;
-				script->replica[j].w_sorted=swap_temp;
+			if(w_sorted[i]>w_sorted[j]){
+				swap_temp=w_sorted[i];
+				w_sorted[i]=w_sorted[j];
+				w_sorted[j]=swap_temp;
 			}
 		}
 	}
 
 	for(i=0;i<script->Nreplicas;i++){
-		script->replica[i].w_sorted=replica_linearizing_function(script->replica[i].w_sorted,script);
+		w_sorted[i]=replica_linearizing_function(w_sorted[i],script);
 	}
 
 	E_total=0.0;
 	for(i=0;i<script->Nreplicas;i++){
 		for(j=0;j<script->Nreplicas;j++){
-			E_total+=pow((double)(script->replica[i].w_sorted-script->replica[j].w_sorted)-(double)(i-j),2.0);
+			E_total+=pow((double)(w_sorted[i]-w_sorted[j])-(double)(i-j),2.0);
 		}
 	}
 
@@ -809,17 +2332,57 @@ double replica_potential(const struct script_struct *script){
 
 	double w_sum=0.0;
 	double w_nominal_sum=((double)script->Nreplicas-1.0)/2*script->Nreplicas; 
-	//this is really the sum over i from 0 to Nreplicas-1 of replica_linearizing_function(replica[i].w_nominal)
-	//it's just faster to calculate this way
 	for(i=0;i<script->Nreplicas;i++){
-		w_sum+=script->replica[i].w_sorted;
+		w_sum+=w_sorted[i];
 	}
 
 	E_total+=pow(w_sum-w_nominal_sum,2.0)*script->replica_potential_scalar2;
+	delete[] w_sorted;
 	
 	return(E_total);
 }
 
+// prepares to evaluate the DRPE for trial positions of replicaN: the other replicas are
+// linearized and sorted once, so that each call to replica_potential_trial() is O(log N)
+// must be called with replica_mutex held since it uses the shared drpe scratch space
+void begin_replica_potential_trials(int replicaN, const struct script_struct *script){
+	int i,n;
+
+	allocate_drpe(script->Nreplicas);
+	n=0;
+	for(i=0;i<script->Nreplicas;i++){
+		if(i==replicaN) continue;
+		drpe.x[n++]=replica_linearizing_function(script->replica[i].w,script);
+	}
+	sort_drpe(n);
+	drpe.N=script->Nreplicas;
+}
+
+// the DRPE that replica_potential() would return if the replica passed to
+// begin_replica_potential_trials() were at 'w' and all other replicas were unchanged
+double replica_potential_trial(float w, const struct script_struct *script){
+	int lo,hi,mid;
+	int n=drpe.N-1;
+	double v,tail,y_sum,y2_sum;
+
+	if(drpe.N!=script->Nreplicas) error_quit("replica_potential_trial() called without begin_replica_potential_trials()");
+
+	v=replica_linearizing_function(w,script);
+	// the trial position is inserted at rank lo; the other replicas from lo onwards move up one rank
+	lo=0;
+	hi=n;
+	while(lo<hi){
+		mid=(lo+hi)/2;
+		if(drpe.x[mid]<v) lo=mid+1;
+		else hi=mid;
+	}
+	tail=(double)(n-lo);
+	y_sum=drpe.y_prefix[n]-tail+(v-(double)lo);
+	y2_sum=drpe.y2_sum-2.0*(drpe.y_prefix[n]-drpe.y_prefix[lo])+tail+sqr(v-(double)lo);
+
+	return(replica_potential_from_sums(drpe.N,y_sum,y2_sum,drpe.x_sum+v,script));
+}
+
 // determine where we will attempt to move to next given that we currently are at 'w'
 float calculate_monte_carlo_move(float w, const struct script_struct *script){
 	int i;
@@ -827,9 +2390,7 @@ float calculate_monte_carlo_move(float w, const struct script_struct *script){
 	double fraction;
 	double circReturn;
 
-	for(i=0;i<script->Nreplicas;i++){
-		if(w<script->replica[i].w_nominal) break;
-	}
+	i=nominal_grid_upper(&nominal_grid,w);
 
 	if(i==0) i++;
 	else if(i==script->Nreplicas) i--;
@@ -870,31 +2431,7 @@ float calculate_monte_carlo_move(float w, const struct script_struct *script){
 
 // determine which discrete nominal coordinate position 'w' is closes to
 int find_bin_from_w(double w, const struct script_struct *script){
-	double left_space, right_space;
-	double left_limit, right_limit;
-	int i;
-
-	if(script->Nreplicas==1) return(0);
-
-	for(i=0;i<script->Nreplicas;i++){
-		if(i>0){
-			left_space=script->replica[i].w_nominal-script->replica[i-1].w_nominal;
-		}
-		if(i<script->Nreplicas-1){
-			right_space=script->replica[i+1].w_nominal-script->replica[i].w_nominal;
-		}
-		if(i==0){
-			left_space=right_space;
-		}else if(i==script->Nreplicas-1){
-			right_space=left_space;
-		}
-		
-		left_limit=script->replica[i].w_nominal-left_space*0.5;
-		right_limit=script->replica[i].w_nominal+right_space*0.5;
-		
-		if( (w>=left_limit) && (w<=right_limit) ) return(i);
-	}
-	return(-1);
+	return(nominal_grid_bin(&nominal_grid,w));
 }
 
 // determine where the given replica will move to next using the Monte Carlo move scheme
@@ -923,42 +2460,39 @@ float determine_new_replica_position_monte_carlo_or_vre(struct client_struct *cl
 
 	if(script->replica_move_type==vRE){
 		if(script->replica[replicaN].sequence_number>=script->vRE_initial_noSave){
-			pthread_mutex_lock(&vre_mutex);
 			pushVRE(old_bin,replicaN,energy_data[0]);
-			pthread_mutex_unlock(&vre_mutex);
 		}else{
-			client->ptr+=sprintf(client->ptr,"Not storing value for later use as a virtual move for the first %ld steps in vRE\n",script->vRE_initial_noSave);
+			client_printf(client,"Not storing value for later use as a virtual move for the first %ld steps in vRE\n",script->vRE_initial_noSave);
 		}
 		if(script->replica[replicaN].sequence_number<script->vRE_initial_noMoves){
-			client->ptr+=sprintf(client->ptr,"Not allowing movement for the first %ld steps in vRE\n",script->vRE_initial_noMoves);
+			client_printf(client,"Not allowing movement for the first %ld steps in vRE\n",script->vRE_initial_noMoves);
 			return(old_coor);
 		}
 	}
 
 	if(new_bin<var->min_running_replica || new_bin>var->max_running_replica){
-		client->ptr+=sprintf(client->ptr,"Move rejected because it crosses a suspend boundary, keeping coordinate: %lf\n",old_coor);
+		client_printf(client,"Move rejected because it crosses a suspend boundary, keeping coordinate: %lf\n",old_coor);
 		return(old_coor);
 	}
 		
-	old_DRPE=replica_potential(script);
+	begin_replica_potential_trials(replicaN,script);
+	old_DRPE=replica_potential_trial(old_coor,script);
+	new_DRPE=replica_potential_trial(new_coor,script);
 	script->replica[replicaN].w=new_coor;
-	new_DRPE=replica_potential(script);
 	DRPE_change=new_DRPE-old_DRPE;
 		
 	new_cancellation=script->replica[new_bin].cancellation_energy;
 	old_cancellation=script->replica[old_bin].cancellation_energy;
 
 	if(script->replica_move_type==vRE){
-		pthread_mutex_lock(&vre_mutex);
 		vrecheck=popVRE(new_bin,replicaN,&vrepop,&vresource);
 		//fprintf(stderr,"RECEIVED POP: %f\n",vrepop);
-		pthread_mutex_unlock(&vre_mutex);
 		if(vrecheck!=0){
-			client->ptr+=sprintf(client->ptr,"VRE_INFO:(noMove) the vre structure has no values. Move not allowed. Keeping coordinate: %lf\n",old_coor);
+			if(log_level>=LogMoves) client_printf(client,"VRE_INFO:(noMove) the vre structure has no values. Move not allowed. Keeping coordinate: %lf\n",old_coor);
 			script->replica[replicaN].w=old_coor;
 			return(old_coor);
 		}
-		client->ptr+=sprintf(client->ptr,"VRE_INFO:(replica,nominal,value)_real_then_virtual %d %lf %f %d %lf %f\n",replicaN,old_coor,energy_data[0],vresource,new_coor,vrepop);
+		if(log_level>=LogMoves) client_printf(client,"VRE_INFO:(replica,nominal,value)_real_then_virtual %d %lf %f %d %lf %f\n",replicaN,old_coor,energy_data[0],vresource,new_coor,vrepop);
 	}
 
 
@@ -972,7 +2506,7 @@ float determine_new_replica_position_monte_carlo_or_vre(struct client_struct *cl
 		system_energy_change*=var->beta;
 		DRPE_change*=var->beta;
 		total_energy_change=DRPE_change+system_energy_change;      // energies here are dimensionless
-		client->ptr+=sprintf(client->ptr,"[system change, cancellation_change, DRPE change, total change]: %lf %lf %lf %lf\n",system_energy_change,new_cancellation-old_cancellation,DRPE_change,total_energy_change);
+		client_printf(client,"[system change, cancellation_change, DRPE change, total change]: %lf %lf %lf %lf\n",system_energy_change,new_cancellation-old_cancellation,DRPE_change,total_energy_change);
 	}else if(script->coordinate_type==Temperature){
 		system_energy_change=(new_coor-old_coor)*energy_data[0];
 		if(script->replica_move_type==vRE){
@@ -998,7 +2532,7 @@ float determine_new_replica_position_monte_carlo_or_vre(struct client_struct *cl
 		// CN says INCORRECT: system_energy_change=0.5*script->replica[replicaN].force*(sqr(newdist)-sqr(olddist));
 		system_energy_change=0.5*(script->replica[new_bin].force*sqr(newdist) - script->replica[old_bin].force*sqr(olddist));
 
-client->ptr+=sprintf(client->ptr,"MEOW: real pos %f energy %f ",exact_coordinate_position,system_energy_change);
+if(log_level>=LogMoves) client_printf(client,"MEOW: real pos %f energy %f ",exact_coordinate_position,system_energy_change);
 
 		if(script->replica_move_type==vRE){
 			newdist=(double)vrepop-old_coor;
@@ -1011,7 +2545,7 @@ client->ptr+=sprintf(client->ptr,"MEOW: real pos %f energy %f ",exact_coordinate
 			}
 			system_energy_change+=0.5*(script->replica[old_bin].force*sqr(newdist) - script->replica[new_bin].force*sqr(olddist));
 
-client->ptr+=sprintf(client->ptr," -- virtual pos %f energy %f\n",vrepop,0.5*(script->replica[old_bin].force*sqr(newdist) - script->replica[new_bin].force*sqr(olddist)));
+if(log_level>=LogMoves) client_printf(client," -- virtual pos %f energy %f\n",vrepop,0.5*(script->replica[old_bin].force*sqr(newdist) - script->replica[new_bin].force*sqr(olddist)));
 
 		}
 
@@ -1019,54 +2553,134 @@ client->ptr+=sprintf(client->ptr," -- virtual pos %f energy %f\n",vrepop,0.5*(sc
 		system_energy_change*=var->beta;
 		DRPE_change*=var->beta;
 		total_energy_change=DRPE_change+system_energy_change;      // energies here are dimensionless
-		client->ptr+=sprintf(client->ptr,"[system change, cancellation_change, DRPE change, total change]: %lf %lf %lf %lf\n",system_energy_change,new_cancellation-old_cancellation,DRPE_change,total_energy_change);
+		client_printf(client,"[system change, cancellation_change, DRPE change, total change]: %lf %lf %lf %lf\n",system_energy_change,new_cancellation-old_cancellation,DRPE_change,total_energy_change);
 	}
 
 	probability=exp(-total_energy_change);
-	client->ptr+=sprintf(client->ptr,"Attempting monte carlo move ( %f to %f ) using these dimensionless quantities: [system change, DRPE change, total change, probability]: %lf %lf %lf %lf\n",old_coor,new_coor,system_energy_change,DRPE_change,total_energy_change,probability);
+	client_printf(client,"Attempting monte carlo move ( %f to %f ) using these dimensionless quantities: [system change, DRPE change, total change, probability]: %lf %lf %lf %lf\n",old_coor,new_coor,system_energy_change,DRPE_change,total_energy_change,probability);
 	
 	random_number=drand48();
 	if(probability>random_number){
-		client->ptr+=sprintf(client->ptr,"Move accepted, new coordinate: %lf\n",new_coor);
+		client_printf(client,"Move accepted, new coordinate: %lf\n",new_coor);
 		return(new_coor);
 	}else{
-		client->ptr+=sprintf(client->ptr,"Move rejected, keeping coordinate: %lf\n",old_coor);
+		client_printf(client,"Move rejected, keeping coordinate: %lf\n",old_coor);
 		script->replica[replicaN].w=old_coor;
 		return(old_coor);
 	}
 }
 
+// make sure the jump kernel scratch space can hold M trial positions, rounded up to a multiple of 4 for boltzmann_weights()
+void allocate_jump_kernel(int M){
+	M=(M+3)&~3;
+	if(jump_kernel.allocated>=M) return;
+	if(jump_kernel.w!=NULL){
+		delete[] jump_kernel.w;
+		delete[] jump_kernel.p;
+		delete[] jump_kernel.cdf;
+		delete[] jump_kernel.cdf_reach;
+	}
+	jump_kernel.w=new double[M];
+	jump_kernel.p=new double[M];
+	jump_kernel.cdf=new double[M];
+	jump_kernel.cdf_reach=new double[M];
+	jump_kernel.allocated=M;
+}
+
+// exp(x) for x<=0 without branches or library calls, so that the loop in boltzmann_weights() vectorizes.
+// x=n*ln2+r with |r|<=ln2/2; exp(r) is its Taylor series to r^12 (relative error below 5e-16), evaluated
+// in a short dependency chain, and 2^n is built in the exponent bits in two steps so that results below
+// 2^-1022 underflow the way exp() does. For n<-1100 (x<-762 or so) the result is masked to exactly 0.
+inline double exp_nonpositive(double x){
+	const double shift=6755399441055744.0;                  // 1.5*2^52: adding it rounds to an integer held in the low bits
+	const unsigned long long shift_bits=0x4338000000000000ULL;
+	unsigned long long bits, keep;
+	double kd, r, r2, r4, e, y;
+
+	kd=x*1.4426950408889634+shift;
+	memcpy(&bits,&kd,sizeof(bits));
+	kd-=shift;
+	r=x-kd*6.93147180369123816490e-01-kd*1.90821492927058770002e-10;
+	r2=r*r;
+	r4=r2*r2;
+	e=(1.0+r)+r2*(1.0/2+r*(1.0/6))+r4*((1.0/24+r*(1.0/120))+r2*(1.0/720+r*(1.0/5040)))
+		+r4*r4*((1.0/40320+r*(1.0/362880))+r2*(1.0/3628800+r*(1.0/39916800))+r4*(1.0/479001600));
+	bits-=shift_bits;                // n
+	keep=((bits+1100)>>63)-1;        // all ones unless n<-1100, which includes the huge x given to stopped replicas
+	bits=(bits+1023+537)<<52;        // 2^(n+537)
+	memcpy(&y,&bits,sizeof(y));
+	y*=e*2.2227587494850775e-162;    // 2^-537
+	memcpy(&bits,&y,sizeof(bits));
+	bits&=keep;
+	memcpy(&y,&bits,sizeof(y));
+	return(y);
+}
+
+// replaces the M dimensionless energies in p[] by exp(-(p-min(p))) and returns their sum.
+// Shifting by the minimum keeps the largest weight at 1, so nothing overflows.
+// p[] must have room for M rounded up to a multiple of 4 (see allocate_jump_kernel()): with a trip count
+// the compiler knows to be a multiple of the vector width, the exp loop is vectorized at -O2 with no scalar tail
+double boltzmann_weights(double *p, int M){
+	int k;
+	int Mpadded=(M+3)&~3;
+	double energy_min=p[0];
+	double sum=0.0;
+
+	for(k=1;k<M;k++) energy_min=(p[k]<energy_min)?p[k]:energy_min;
+	for(k=M;k<Mpadded;k++) p[k]=energy_min;
+	for(k=0;k<Mpadded;k++) p[k]=exp_nonpositive(energy_min-p[k]);
+	for(k=0;k<M;k++) sum+=p[k];
+	return(sum);
+}
+
+// the first k in [first,M) for which cdf_reach[k]>=r, or M if there is none
+int search_cdf(const double *cdf_reach, int first, int M, double r){
+	int lo=first;
+	int hi=M;
+	int mid;
+
+	while(lo<hi){
+		mid=(lo+hi)/2;
+		if(cdf_reach[mid]>=r) hi=mid;
+		else lo=mid+1;
+	}
+	return(lo);
+}
+
 // determine where the given replica will move to next using the Boltzmann jumping scheme
 // energy data contains the required data to do the move attempt, see comments below
 float determine_new_replica_position_boltzmann_jump(struct client_struct *client, int replicaN, const float *energy_data, const struct script_struct *script, const struct server_variable_struct *var){
 	int i;
+	int N=script->Nreplicas;
 	double new_coor, old_coor;
-	double DRPE, system_energy, probability;
-	float total_energy[script->Nreplicas];
-	float energy_min;
+	double DRPE, system_energy;
 	double random_number;
 	double probability_sum;
+	double *p, *cdf;
 
 	old_coor=script->replica[replicaN].w;
 
-	energy_min=1e20;		
-	for(i=0;i<script->Nreplicas;i++){
+	allocate_jump_kernel(N);
+	p=jump_kernel.p;
+	cdf=jump_kernel.cdf;
+
+	begin_replica_potential_trials(replicaN,script);
+	for(i=0;i<N;i++){
 		if(i<var->min_running_replica || i>var->max_running_replica){
-			total_energy[i]=1e20;
+			p[i]=1e20;
 		}else{
 			new_coor=script->replica[i].w_nominal;
-			script->replica[replicaN].w=new_coor;
-			DRPE=replica_potential(script);
+			DRPE=replica_potential_trial(new_coor,script);
 			
 			if(script->coordinate_type==Spatial){
 				system_energy=energy_data[i];
 				system_energy+=script->replica[i].cancellation_energy;
-				total_energy[i]=var->beta*(DRPE+system_energy);
+				p[i]=var->beta*(DRPE+system_energy);
 			}else if(script->coordinate_type==Temperature){
 				system_energy=energy_data[0];   
 				// for temperature space simulations, the first item in the array is the system energy
 				system_energy+=script->replica[i].cancellation_energy;
-				total_energy[i]=DRPE+new_coor*system_energy;
+				p[i]=DRPE+new_coor*system_energy;
 			}else{ // "Umbrella" simulation
 				double exact_coordinate_position=energy_data[0];  
 				//for umbrealla simulations, the first item in the array is the exact 
@@ -1074,47 +2688,36 @@ float determine_new_replica_position_boltzmann_jump(struct client_struct *client
 				//CN says INCORRECT: system_energy=0.5*script->replica[replicaN].force*sqr(exact_coordinate_position-new_coor);
 				system_energy=0.5*script->replica[i].force*sqr(exact_coordinate_position-new_coor);
 				system_energy+=script->replica[i].cancellation_energy;
-				total_energy[i]=var->beta*(DRPE+system_energy);
+				p[i]=var->beta*(DRPE+system_energy);
 			}
 		}
-		if(total_energy[i]<energy_min) energy_min=total_energy[i];
-	}
-
-	for(i=0;i<script->Nreplicas;i++){
-		total_energy[i]-=energy_min;
-		fprintf(stderr,"energy after shifting: %lf\n",total_energy[i]); //##DEBUG
-	}
-
-	probability_sum=0.0;			
-	for(i=0;i<script->Nreplicas;i++){
-		probability=exp(-total_energy[i]);
-		probability_sum+=probability;
-		total_energy[i]=probability;   // total_energy now contains the probabilities
-		fprintf(stderr,"probability[%d]=%lf\n",i,probability); //##DEBUG
 	}
 
-	for(i=0;i<script->Nreplicas;i++){
-		total_energy[i]/=probability_sum;  // normalize the probability distribution
+	// the weights are left unnormalized; the random number is scaled to their sum instead
+	probability_sum=boltzmann_weights(p,N);
+	cdf[0]=p[0];
+	for(i=1;i<N;i++){
+		cdf[i]=cdf[i-1]+p[i];
 	}
 
-	client->ptr+=sprintf(client->ptr,"Boltzmann jump possibilities:");
-	for(i=0;i<script->Nreplicas;i++){
-		if(total_energy[i]>0.001){
-			client->ptr+=sprintf(client->ptr," (%d:%0.3f)",i,total_energy[i]);
+	client_printf(client,"Boltzmann jump possibilities:");
+	for(i=0;i<N;i++){
+		if(p[i]>0.001*probability_sum){
+			client_printf(client," (%d:%0.3f)",i,p[i]/probability_sum);
 		}
 	}
-	*(client->ptr++)='\n';
+	client_printf(client,"\n");
 
-	probability_sum=0.0;
-	random_number=drand48();
-	for(i=0;i<script->Nreplicas;i++){
-		probability=total_energy[i];
-		probability_sum+=probability;
-		if(probability_sum>=random_number) break;
+	random_number=drand48()*probability_sum;
+	// the weights are non-negative, so cdf[] is its own running maximum
+	i=search_cdf(cdf,0,N,random_number);
+	if(i==N){
+		// rounding left the total just short of random_number; take the last position that has any weight
+		for(i=N-1;i>0 && p[i]==0.0;i--);
 	}
 
 	fprintf(stderr,"random_number=%lf\n",random_number); //##DEBUG
-	fprintf(stderr,"Probability sum: %0.20lf\n",probability_sum); //##DEBUG
+	fprintf(stderr,"Probability sum: %0.20lf\n",cdf[i]); //##DEBUG
 
 
 	new_coor=script->replica[i].w_nominal;
@@ -1122,9 +2725,9 @@ float determine_new_replica_position_boltzmann_jump(struct client_struct *client
 
 	double jump_distance=fabs(new_coor-old_coor);
 	if(jump_distance<0.0001){
-		client->ptr+=sprintf(client->ptr,"Boltzmann jump was unproductive\n");
+		client_printf(client,"Boltzmann jump was unproductive\n");
 	}else{
-		client->ptr+=sprintf(client->ptr,"Boltzmann jump to new coordinate: %lf (distance of %lf)\n",new_coor,jump_distance);
+		client_printf(client,"Boltzmann jump to new coordinate: %lf (distance of %lf)\n",new_coor,jump_distance);
 	}
 
 	return(new_coor);
@@ -1132,24 +2735,29 @@ float determine_new_replica_position_boltzmann_jump(struct client_struct *client
 
 // determine where the given replica will move to next using the Boltzmann jumping scheme in a continuous space
 // energy data contains the required data to do the move attempt, see comments below
+// The Boltzmann weight is evaluated at REPLICA_MICRODIVISIONS trial positions around each nominal position
+// and treated as piecewise linear between them; the new position is drawn from that density
 float determine_new_replica_position_continuous(struct client_struct *client, int replicaN, const float *energy_data, const struct script_struct *script, const struct server_variable_struct *var){
-	int i,ii,j;
-	int bin;
-	int index;
+	int i,ii,j,k;
+	int M=script->Nreplicas*REPLICA_MICRODIVISIONS;
 	float left_w;
 	float right_w;
 	float division;
-	double right_micro_w,left_micro_w;
 	float old_coor, new_coor;
-	double DRPE, system_energy, cancellation_energy, total_dimensionless_energy, probability;
+	double DRPE, system_energy, cancellation_energy;
 	double random_number=drand48();
-	double total_energy[script->Nreplicas*REPLICA_MICRODIVISIONS];
+	double probability_sum;
+	double *w, *p, *cdf, *cdf_reach;
 
 	old_coor=script->replica[replicaN].w;
-	
-	double probability_sum=0.0;
-	float energy_min=1.0e20;
 
+	allocate_jump_kernel(M);
+	w=jump_kernel.w;
+	p=jump_kernel.p;
+	cdf=jump_kernel.cdf;
+	cdf_reach=jump_kernel.cdf_reach;
+
+	begin_replica_potential_trials(replicaN,script);
 	for(i=0;i<script->Nreplicas;i++){
 		ii=i;
 		if(ii>=script->Nreplicas-1) ii--;
@@ -1162,18 +2770,14 @@ float determine_new_replica_position_continuous(struct client_struct *client, in
 		float cancellation_energy_division=(right_cancellation_energy-left_cancellation_energy)/REPLICA_MICRODIVISIONS;
 
 		for(j=0;j<REPLICA_MICRODIVISIONS;j++){
-			index=i*REPLICA_MICRODIVISIONS+j;			
-
-			fprintf(stderr,"new_coor=%f\n",new_coor); //##DEBUG
+			k=i*REPLICA_MICRODIVISIONS+j;
+			new_coor=script->replica[i].w_nominal+(j-(REPLICA_MICRODIVISIONS-1)/2)*division;
+			w[k]=new_coor;
 
 			if( (i<var->min_running_replica) || (i>var->max_running_replica) ){
-				total_energy[index]=1e20;
+				p[k]=1e20;
 			}else{
-				new_coor=script->replica[i].w_nominal+(j-(REPLICA_MICRODIVISIONS-1)/2)*division;
-				script->replica[replicaN].w=new_coor;
-				DRPE=replica_potential(script);
-				fprintf(stderr,"DRPE: %lf\n",DRPE); //##DEBUG			
-
+				DRPE=replica_potential_trial(new_coor,script);
 				cancellation_energy=script->replica[i].cancellation_energy+(j-(REPLICA_MICRODIVISIONS-1)/2)*cancellation_energy_division;
 				
 				if(script->coordinate_type==Umbrella){
@@ -1183,126 +2787,70 @@ float determine_new_replica_position_continuous(struct client_struct *client, in
 					//INCORRECT: system_energy=0.5*script->replica[replicaN].force*sqr(exact_coordinate_position-new_coor);
 					//CN chose to correct the above line by simply applying the force to which the REPLICA_MICRODIVISION belongs, although interpolation is also possible
 					system_energy=0.5*script->replica[i].force*sqr(exact_coordinate_position-new_coor);
-					fprintf(stderr,"system_energy: %lf\tcancellation: %f\texact_coordinate_position %lf\tnew_coor %f\tscript->replica[i].force %f\n",system_energy, cancellation_energy,exact_coordinate_position,new_coor,script->replica[i].force); //##DEBUG
-					total_dimensionless_energy=var->beta*(DRPE+system_energy+cancellation_energy);
+					p[k]=var->beta*(DRPE+system_energy+cancellation_energy);
 				}else{
 					system_energy=energy_data[0];  
 					//for temperature space simulations, the first item in the array 
 					//is the system energy
-					fprintf(stderr,"system_energy: %lf   beta: %lf   cancellation: %f\n",system_energy, new_coor, cancellation_energy); //##DEBUG
-					total_dimensionless_energy=DRPE+new_coor*(system_energy+cancellation_energy);
+					p[k]=DRPE+new_coor*(system_energy+cancellation_energy);
 				}
-				if(total_dimensionless_energy<energy_min) energy_min=total_dimensionless_energy;
-				total_energy[index]=total_dimensionless_energy;
-				fprintf(stderr,"total_energy: %lf\n",total_energy[index]); //##DEBUG
 			}
 		}
 	}
 
-	for(i=0;i<script->Nreplicas;i++){
-		for(j=0;j<REPLICA_MICRODIVISIONS;j++){
-			index=i*REPLICA_MICRODIVISIONS+j;			
-			total_energy[index]-=energy_min;
-			fprintf(stderr,"total_energy after shifting: %lf\n",total_energy[index]); //##DEBUG
-		}
-	}
-
-	for(i=0;i<script->Nreplicas;i++){
-		for(j=0;j<REPLICA_MICRODIVISIONS;j++){
-			index=i*REPLICA_MICRODIVISIONS+j;			
-			probability=exp(-total_energy[index]);
-			total_energy[index]=probability;   // total_energy now contains the probabilities
-		}
-	}
-
-	unsigned char first=1;
-	for(i=0;i<script->Nreplicas;i++){
-		ii=i;
-		if(ii>=script->Nreplicas-1) ii--;
-		left_w=script->replica[ii].w_nominal;
-		right_w=script->replica[ii+1].w_nominal;
-		division=(right_w-left_w)/REPLICA_MICRODIVISIONS;
+	boltzmann_weights(p,M);
 
-		for(j=0;j<REPLICA_MICRODIVISIONS;j++){
-			index=i*REPLICA_MICRODIVISIONS+j;
-			right_micro_w=script->replica[i].w_nominal+(j-(REPLICA_MICRODIVISIONS-1)/2)*division;
-			if(!first){
-				probability=(right_micro_w-left_micro_w)*(total_energy[index-1]+total_energy[index])/2;
-				probability_sum+=probability;
-				fprintf(stderr,"left_micro_w: %lf   right_micro_w: %lf   probability: %lf\n",left_micro_w,right_micro_w,probability); //##DEBUG
-			}
-			left_micro_w=right_micro_w;
-			first=0;
-		}
+	// integrate the piecewise linear density with the trapezoid rule. Neighbouring groups of
+	// micro divisions can overlap when the nominal spacing grows, giving a negative area; only
+	// then is the running maximum built, so that the search finds the same first crossing as a linear scan
+	int monotone=1;
+	cdf[0]=0.0;
+	for(k=1;k<M;k++){
+		cdf[k]=cdf[k-1]+(w[k]-w[k-1])*(p[k-1]+p[k])/2;
+		monotone&=(cdf[k]>=cdf[k-1]);
 	}
-
-	for(i=0;i<script->Nreplicas;i++){
-		for(j=0;j<REPLICA_MICRODIVISIONS;j++){
-			index=i*REPLICA_MICRODIVISIONS+j;			
-			total_energy[index]/=probability_sum;  // normalize the probability distribution
-		}
+	if(monotone){
+		cdf_reach=cdf;
+	}else{
+		cdf_reach[0]=0.0;
+		for(k=1;k<M;k++) cdf_reach[k]=(cdf[k]>cdf_reach[k-1])?cdf[k]:cdf_reach[k-1];
 	}
+	// the density is left unnormalized; the random number is scaled to its integral instead
+	probability_sum=cdf[M-1];
+	random_number*=probability_sum;
 
 	fprintf(stderr,"random_number=%lf\n",random_number); //##DEBUG
 	fprintf(stderr,"Probability sum: %0.20lf\n",probability_sum); //##DEBUG
 
-	double probability_sum2=0.0;
-	first=1;
-	for(i=0;i<script->Nreplicas;i++){
-		ii=i;
-		if(ii>=script->Nreplicas-1) ii--;
-		left_w=script->replica[ii].w_nominal;
-		right_w=script->replica[ii+1].w_nominal;
-		division=(right_w-left_w)/REPLICA_MICRODIVISIONS;
+	k=search_cdf(cdf_reach,1,M,random_number);
+	if(k==M) k=M-1;
 
-		for(j=0;j<REPLICA_MICRODIVISIONS;j++){
-			index=i*REPLICA_MICRODIVISIONS+j;
-			right_micro_w=script->replica[i].w_nominal+(j-(REPLICA_MICRODIVISIONS-1)/2)*division;
-			if(!first){
-				probability=(right_micro_w-left_micro_w)*(total_energy[index-1]+total_energy[index])/2;
-				probability_sum2+=probability;
-				fprintf(stderr,"left_micro_w: %lf   right_micro_w: %lf   probability: %lf  probability_sum2: %lf   p1: %lf   p2: %lf\n",left_micro_w,right_micro_w,probability,probability_sum2,total_energy[index-1],total_energy[index]); //##DEBUG
-				if(probability_sum2>=random_number) goto done_loop;
-			}
-			left_micro_w=right_micro_w;
-			first=0;
-		}
-	}
-	done_loop:
-	double fraction=random_number-(probability_sum2-probability);
-	double m=((double)total_energy[index]-(double)total_energy[index-1])/(right_micro_w-left_micro_w);
-	double y_intercept=(double)total_energy[index-1]-m*left_micro_w;
-	//double x=11;
-	//double R=m*0.5*(x*x-left_micro_w*left_micro_w)+y_intercept*(x-left_micro_w);
-	//fprintf(stderr,"slope: %lf    y-intercept: %lf   R: %lf\n",m,y_intercept,R);
+	// invert the integral of the linear density between w[k-1] and w[k]
+	double left_micro_w=w[k-1];
+	double right_micro_w=w[k];
+	double fraction=random_number-cdf[k-1];
+	double m=(p[k]-p[k-1])/(right_micro_w-left_micro_w);
+	double y_intercept=p[k-1]-m*left_micro_w;
 	
 	double a=m*0.5;
 	double b=y_intercept;
 	double c=-m*0.5*left_micro_w*left_micro_w-y_intercept*left_micro_w-fraction;
-	new_coor=(-b+sqrt(b*b-4*a*c))/(2*a);
+	if(a==0.0){
+		new_coor=left_micro_w+fraction/b;  // flat density, so the integral is linear
+	}else{
+		new_coor=(-b+sqrt(b*b-4*a*c))/(2*a);
+	}
 	fprintf(stderr,"new_coor 1: %lf   new_coor 2: %lf\n",new_coor,(double)(-b-sqrt(b*b-4*a*c))/(2*a));  //##DEBUG
 
-	fprintf(stderr,"random_number: %lf   probability: %lf   fraction: %f   new_coor: %f\n",random_number,probability,fraction,new_coor); //##DEBUG
-
-	/* 
-	client->ptr+=sprintf(client->ptr,"Boltzmann jump possibilities:");
-
-	for(i=0;i<Nreplicas;i++)
-		if(total_energy[i]>0.001)
-			client->ptr+=sprintf(client->ptr," (%d:%0.3f)",i,total_energy[i]);
-	*(client->ptr++)='\n';
-	*/
+	fprintf(stderr,"random_number: %lf   probability: %lf   fraction: %f   new_coor: %f\n",random_number/probability_sum,(cdf[k]-cdf[k-1])/probability_sum,fraction,new_coor); //##DEBUG
 
 	script->replica[replicaN].w=new_coor;
 
 	double jump_distance=fabs(new_coor-old_coor);
 	//if(jump_distance<0.0001)
-	//	client->ptr+=sprintf(client->ptr,"Boltzmann jump was unproductive\n");
+	//	client_printf(client,"Boltzmann jump was unproductive\n");
 	//else
-	client->ptr+=sprintf(client->ptr,"Boltzmann jump to new beta: %lf (distance of %lf)\n",new_coor,jump_distance);
-
-	//fprintf(stderr,"i=%d\n",i); //##DEBUG
-	//fprintf(stderr,"Updating replica %u: to w: %f\n",script->replicaN,script->replica[script->replicaN].w); //##DEBUG
+	client_printf(client,"Boltzmann jump to new beta: %lf (distance of %lf)\n",new_coor,jump_distance);
 
 	return(new_coor);
 }
@@ -1319,7 +2867,7 @@ int execute(char *command, char quiet){
 	val=system(command);
 	if(val!=0){
 		sprintf(message,"ERROR: nonzero return value (%d) from system command: %s\n",val,command);
-		append_log_entry(-1,message);
+		append_error_entry(-1,message);
 	}
 	return val;
 }
@@ -1421,9 +2969,7 @@ double calculate_w2_from_w(double w, const struct script_struct *script){
 	if(script->Nreplicas==1) return(script->replica[0].w2_nominal);
 	if(script->Nligands<2) return(NAN);
 	
-	for(i=0;i<script->Nreplicas;i++){
-		if(w < script->replica[i].w_nominal) break;
-	}
+	i=nominal_grid_upper(&nominal_grid,w);
 	
 	if(i<1) i=1;
 	if(i>=script->Nreplicas) i=script->Nreplicas-1;
@@ -1451,7 +2997,7 @@ void check_termination_conditions(struct client_struct *client, const struct scr
 	//for(i=0;i<script->Nreplicas;i++) printf("test[%d]=%hhu\n",i,test[i]); //##DEBUG
 	for(i=script->min_unsuspended_replica;i<=script->max_unsuspended_replica;i++) test[i]=0;
 
-	//if(client!=NULL) for(i=0;i<script->Nreplicas;i++) client->ptr+=sprintf(client->ptr,"test[%d]=%hhu\n",i,test[i]); //##DEBUG
+	//if(client!=NULL) for(i=0;i<script->Nreplicas;i++) client_printf(client,"test[%d]=%hhu\n",i,test[i]); //##DEBUG
 	
 	for(i=0;i<script->Nreplicas;i++) if(test[i]!=1) break;
 	var->min_running_replica=i;
@@ -1461,13 +3007,13 @@ void check_termination_conditions(struct client_struct *client, const struct scr
 	for(i=0;i<script->Nreplicas;i++){
 		bin=find_bin_from_w(script->replica[i].w,script);
 		if( (bin<var->min_running_replica) || (bin>var->max_running_replica) ){
-			if(script->replica[i].status!='S') client->ptr+=sprintf(client->ptr,"Suspending replica %d\n", i);
+			if(script->replica[i].status!='S') client_printf(client,"Suspending replica %d\n", i);
 			script->replica[i].status='S';
 		}
 	}
 
 	if(opt->verbose!=0){
-		client->ptr+=sprintf(client->ptr,"Checking suspend conditions: current min/max running replicas are: %d/%d ; counts at these boundaries are: %u/%u\n", var->min_running_replica, var->max_running_replica, script->replica[var->min_running_replica].sample_count, script->replica[var->max_running_replica].sample_count);
+		client_printf(client,"Checking suspend conditions: current min/max running replicas are: %d/%d ; counts at these boundaries are: %u/%u\n", var->min_running_replica, var->max_running_replica, script->replica[var->min_running_replica].sample_count, script->replica[var->max_running_replica].sample_count);
 	}
 }
 
@@ -1527,74 +3073,210 @@ void check_for_crash(int replicaNinput, const struct script_struct *script, stru
 	pthread_mutex_unlock(&replica_mutex);
 }
 
-// if there are enough samples in each bin then compute the cancellation energy and activate the cancellation function
-void conditionally_activate_energy_cancellation(struct script_struct *script, struct server_variable_struct *var){
+// variance of the mean of the per-run averages of one nominal position and ligand in the current round; zero when
+// there are no cancellation rounds to keep the sums of squares
+double cancellation_average_variance(const struct script_struct *script, int i, int l){
+	double n=script->replica[i].cancellation_count;
+	double mean;
+	double variance;
+
+	if(!cancellation_rounds.active) return(0.0);
+	if(n<2) return(INFINITY);
+	mean=script->replica[i].cancellation_accumulator[l]/n;
+	variance=(cancellation_rounds.sum_of_squares[2*i+l]-n*mean*mean)/(n-1);
+	if(variance<0.0) variance=0.0;
+	return(variance/n);
+}
+
+// The cancellation energies that the accumulators give: the negative integral of the averaged forces (trapezoid rule)
+// for Spatial and Umbrella runs, the negative averaged energies otherwise. error gets their standard errors, which
+// take the per-run averages as independent and leave out the circular correction
+void estimate_energy_cancellation(const struct script_struct *script, double *energy, double *error){
 	int i;
-	double cancellation_energy[script->Nreplicas];
+	double average[script->Nreplicas];
+	double variance[script->Nreplicas];
 	char message[MESSAGE_GLOBALVAR_LENGTH];
 
 	for(i=0;i<script->Nreplicas;i++){
-		if(script->replica[i].cancellation_count<script->cancellation_threshold) break;
-	}
-	if(i<script->Nreplicas) return;
-
-	for(i=0;i<script->Nreplicas;i++){
-		script->replica[i].cancellation_energy=0.0;
+		energy[i]=0.0;
+		error[i]=0.0;
 	}
 
 	if(script->coordinate_type==Spatial||script->coordinate_type==Umbrella){
-		float dw;
-		double F, old_F;
-		double dE;
+		float dw=0.0;
+		float previous_dw;
+		double integral;
+		double integral_variance;   //of the completed terms of the trapezoid sum
 				
 		for(unsigned char l=0;l<script->Nligands;l++){
 			sprintf(message,"Forces have been averaged:\n");
 			append_log_entry(-1,message);
 			for(i=0;i<script->Nreplicas;i++){
-				cancellation_energy[i]=script->replica[i].cancellation_accumulator[l]/script->replica[i].cancellation_count;
-				sprintf(message,"N: %d\tFavg: %f\t(ligand): %d\n",i,cancellation_energy[i],l);
+				average[i]=script->replica[i].cancellation_accumulator[l]/script->replica[i].cancellation_count;
+				variance[i]=cancellation_average_variance(script,i,l);
+				sprintf(message,"N: %d\tFavg: %f\t(ligand): %d\n",i,average[i],l);
 				append_log_entry(-1,message);
 			}
 
-			old_F=cancellation_energy[0];
-			cancellation_energy[0]=0.0;
+			integral=0.0;
+			integral_variance=0.0;
+			previous_dw=0.0;
 			for(i=1;i<script->Nreplicas;i++){
 				if(l==0) dw=script->replica[i].w_nominal-script->replica[i-1].w_nominal;
 				else     dw=script->replica[i].w2_nominal-script->replica[i-1].w2_nominal;
-				F=cancellation_energy[i];
-				dE=-(F+old_F)/2*dw;
-				old_F=F;
-				cancellation_energy[i]=cancellation_energy[i-1]+dE;
-				script->replica[i].cancellation_energy-=cancellation_energy[i];
+				integral+=-(average[i]+average[i-1])/2*dw;
+				energy[i]-=integral;
+				integral_variance+=(previous_dw+dw)*(previous_dw+dw)/4*variance[i-1];
+				error[i]+=integral_variance+dw*dw/4*variance[i];
+				previous_dw=dw;
 			}
 		}
 		//Note: only works with one ligand
 		//Note: uses the final dw, which may not be correct (but it is for my alanine dipeptide run)
 		if(script->circular_replica_coordinate){
 			float temp;
-			temp=-((script->replica[script->Nreplicas-1].cancellation_accumulator[0]/script->replica[script->Nreplicas-1].cancellation_count)+(script->replica[0].cancellation_accumulator[0]/script->replica[0].cancellation_count))/2*dw;
+			temp=-(average[script->Nreplicas-1]+average[0])/2*dw;
 			circularCancelLow=-(0-temp);
-			circularCancelHigh=-(-script->replica[script->Nreplicas-1].cancellation_energy+temp);
+			circularCancelHigh=-(-energy[script->Nreplicas-1]+temp);
 			//Now extend the error over each frame
 			for(i=1;i<script->Nreplicas;i++){
-				sprintf(message,"TESTER: %d was %f ",i,script->replica[i].cancellation_energy);
+				sprintf(message,"TESTER: %d was %f ",i,energy[i]);
 				append_log_entry(-1,message);
-				script->replica[i].cancellation_energy-=(circularCancelHigh-0.0)*((float)i/(float)script->Nreplicas);
-				sprintf(message,"and now is %f\n",script->replica[i].cancellation_energy);
+				energy[i]-=(circularCancelHigh-0.0)*((float)i/(float)script->Nreplicas);
+				sprintf(message,"and now is %f\n",energy[i]);
 				append_log_entry(-1,message);
 			}
 			//This is just to output it for interest
-			temp=-((script->replica[script->Nreplicas-1].cancellation_accumulator[0]/script->replica[script->Nreplicas-1].cancellation_count)+(script->replica[0].cancellation_accumulator[0]/script->replica[0].cancellation_count))/2*dw;
 			newCircularCancelLow=-(0-temp);
-			newCircularCancelHigh=-(-script->replica[script->Nreplicas-1].cancellation_energy+temp);
+			newCircularCancelHigh=-(-energy[script->Nreplicas-1]+temp);
 		}
 	}else{
 		for(unsigned char l=0;l<script->Nligands;l++){
 			for(i=0;i<script->Nreplicas;i++){
-				cancellation_energy[i]=script->replica[i].cancellation_accumulator[l]/script->replica[i].cancellation_count;
-				script->replica[i].cancellation_energy-=cancellation_energy[i];
+				energy[i]-=script->replica[i].cancellation_accumulator[l]/script->replica[i].cancellation_count;
+				error[i]+=cancellation_average_variance(script,i,l);
+			}
+		}
+	}
+
+	for(i=0;i<script->Nreplicas;i++){
+		error[i]=sqrt(error[i]);
+	}
+}
+
+// Weighs the estimate of the round that just reached the threshold against the adopted cancellation energies, logs
+// the outcome and starts the next round unless the rounds are over
+void conclude_cancellation_round(struct script_struct *script, struct server_variable_struct *var, const double *energy, const double *error){
+	int i;
+	double largest_error=0.0;          //of the round
+	double largest_adopted_error=0.0;  //of the adopted energies before the round
+	double largest_deviation=0.0;      //between the two, in standard errors
+	double change=0.0;                 //root mean square change of the adopted energies
+	double deviation, weight, adopted_weight, combined;
+	const char *outcome;
+	char message[MESSAGE_GLOBALVAR_LENGTH];
+
+	cancellation_rounds.round++;
+	for(i=0;i<script->Nreplicas;i++){
+		if(error[i]>largest_error) largest_error=error[i];
+		if(cancellation_rounds.round==1) continue;
+		if(cancellation_rounds.error[i]>largest_adopted_error) largest_adopted_error=cancellation_rounds.error[i];
+		deviation=fabs(energy[i]-cancellation_rounds.energy[i]);
+		if(deviation>0.0){
+			deviation/=sqrt(error[i]*error[i]+cancellation_rounds.error[i]*cancellation_rounds.error[i]);
+			if(deviation>largest_deviation) largest_deviation=deviation;
+		}
+	}
+
+	if(cancellation_rounds.round==1 || largest_deviation<=CANCELLATION_ROUND_AGREEMENT){
+		outcome="combined with the adopted energies";
+		for(i=0;i<script->Nreplicas;i++){
+			if(cancellation_rounds.round==1 || cancellation_rounds.error[i]==INFINITY){
+				combined=energy[i];
+				cancellation_rounds.error[i]=error[i];
+			}else if(error[i]==0.0 || cancellation_rounds.error[i]==0.0){
+				// exact, as at the nominal position that the energies are measured from
+				combined=(error[i]==0.0)?energy[i]:cancellation_rounds.energy[i];
+				cancellation_rounds.error[i]=0.0;
+			}else{
+				weight=1.0/(error[i]*error[i]);
+				adopted_weight=1.0/(cancellation_rounds.error[i]*cancellation_rounds.error[i]);
+				combined=(weight*energy[i]+adopted_weight*cancellation_rounds.energy[i])/(weight+adopted_weight);
+				cancellation_rounds.error[i]=1.0/sqrt(weight+adopted_weight);
 			}
+			if(cancellation_rounds.round>1) change+=(combined-cancellation_rounds.energy[i])*(combined-cancellation_rounds.energy[i]);
+			cancellation_rounds.energy[i]=combined;
+		}
+	}else if(largest_error<largest_adopted_error){
+		outcome="adopted in place of the less precise energies that it disagrees with";
+		for(i=0;i<script->Nreplicas;i++){
+			change+=(energy[i]-cancellation_rounds.energy[i])*(energy[i]-cancellation_rounds.energy[i]);
+			cancellation_rounds.energy[i]=energy[i];
+			cancellation_rounds.error[i]=error[i];
+		}
+	}else{
+		outcome="rejected; it disagrees with the more precise adopted energies";
+	}
+	change=sqrt(change/script->Nreplicas);
+
+	largest_adopted_error=0.0;
+	for(i=0;i<script->Nreplicas;i++){
+		if(cancellation_rounds.error[i]>largest_adopted_error) largest_adopted_error=cancellation_rounds.error[i];
+	}
+	if(cancellation_rounds.round==1){
+		sprintf(message,"Cancellation round 1: at least %u runs per nominal position; largest standard error %f; adopted\n",script->cancellation_threshold,largest_error);
+	}else{
+		sprintf(message,"Cancellation round %d: at least %u runs per nominal position; largest standard error %f; largest deviation from the adopted energies %f standard errors; %s. The adopted energies changed by %f (rms) and have a largest standard error of %f\n",cancellation_rounds.round,script->cancellation_threshold,largest_error,largest_deviation,outcome,change,largest_adopted_error);
+	}
+	append_log_entry(-1,message);
+
+	cancellation_rounds.collecting=true;
+	if(script->cancellation_rounds>0 && (unsigned int)cancellation_rounds.round>=script->cancellation_rounds){
+		cancellation_rounds.collecting=false;
+		sprintf(message,"The cancellation energies are final after %d rounds\n",cancellation_rounds.round);
+		append_log_entry(-1,message);
+	}else if(script->cancellation_round_tolerance>0.0 && largest_adopted_error<=script->cancellation_round_tolerance){
+		cancellation_rounds.collecting=false;
+		sprintf(message,"The cancellation energies are final after %d rounds; their largest standard error is within the tolerance of %f\n",cancellation_rounds.round,script->cancellation_round_tolerance);
+		append_log_entry(-1,message);
+	}
+	for(i=0;i<script->Nreplicas;i++){
+		script->replica[i].cancellation_accumulator[0]=0.0;
+		script->replica[i].cancellation_accumulator[1]=0.0;
+		script->replica[i].cancellation_count=0;
+		cancellation_rounds.sum_of_squares[2*i]=0.0;
+		cancellation_rounds.sum_of_squares[2*i+1]=0.0;
+	}
+
+	if(change>0.0 || cancellation_rounds.round==1){
+		for(i=0;i<script->Nreplicas;i++){
+			script->replica[i].cancellation_energy=cancellation_rounds.energy[i];
 		}
+		var->energy_cancellation_status=Active;
+	}
+	script->replica_potential_scalar1=script->replica_potential_scalar1_after_threshold;
+	script->replica_potential_scalar2=script->replica_potential_scalar2_after_threshold;
+}
+
+// if there are enough samples in each bin then compute the cancellation energy and activate the cancellation function;
+// with cancellation rounds, this also concludes each later round
+void conditionally_activate_energy_cancellation(struct script_struct *script, struct server_variable_struct *var){
+	int i;
+	double energy[script->Nreplicas];
+	double error[script->Nreplicas];
+
+	for(i=0;i<script->Nreplicas;i++){
+		if(script->replica[i].cancellation_count<script->cancellation_threshold) break;
+	}
+	if(i<script->Nreplicas) return;
+
+	estimate_energy_cancellation(script,energy,error);
+	if(cancellation_rounds.active){
+		conclude_cancellation_round(script,var,energy,error);
+		return;
+	}
+	for(i=0;i<script->Nreplicas;i++){
+		script->replica[i].cancellation_energy=energy[i];
 	}
 
 	var->energy_cancellation_status=Active;
@@ -1627,43 +3309,323 @@ void print_energy_cancellation_summary(const struct script_struct *script, const
 	append_log_entry(-1,message);
 }
 
+// Sets up the cancellation rounds of the script. Rounds that were loaded from the snapshot carry on; a snapshot of a run
+// without them has no sums of squares, so the errors of a round that it already accumulated are unknown
+void allocate_cancellation_rounds(const struct script_struct *script){
+	char message[MESSAGE_GLOBALVAR_LENGTH];
+	int N=script->Nreplicas;
+
+	if(script->cancellation_rounds==1 || script->cancellation_threshold==0){
+		free_cancellation_rounds();
+		return;
+	}
+	cancellation_rounds.active=true;
+	if(cancellation_rounds.energy!=NULL){
+		sprintf(message,"Continuing the cancellation rounds of the snapshot after round %d\n",cancellation_rounds.round);
+		append_log_entry(-1,message);
+		return;
+	}
+	cancellation_rounds.Nreplicas=N;
+	cancellation_rounds.energy=new double[N]();
+	cancellation_rounds.error=new double[N]();
+	cancellation_rounds.sum_of_squares=new double[2*N]();
+	for(int i=0;i<N;i++){
+		if(script->replica[i].cancellation_count>0){
+			cancellation_rounds.sum_of_squares[2*i]=INFINITY;
+			cancellation_rounds.sum_of_squares[2*i+1]=INFINITY;
+		}
+	}
+}
+
+// Lays out the WHAM cancellation grid over the nominal positions; a histogram that was loaded from the snapshot is
+// continued if it has the same layout
+void allocate_cancellation_wham(const struct script_struct *script){
+	char message[MESSAGE_GLOBALVAR_LENGTH];
+	int Nbins;
+	double min, bin_width, spacing;
+
+	if(script->cancellation_method!=WHAMCancellation){
+		free_cancellation_wham();
+		return;
+	}
+	if(script->circular_replica_coordinate){
+		Nbins=CANCELLATION_WHAM_BINS_PER_WINDOW*script->Nreplicas;
+		bin_width=script->circular_equality_distance/Nbins;
+		min=script->replica[0].w_nominal-0.5*bin_width;
+	}else{
+		spacing=(script->replica[script->Nreplicas-1].w_nominal-script->replica[0].w_nominal)/(script->Nreplicas-1);
+		Nbins=CANCELLATION_WHAM_BINS_PER_WINDOW*(script->Nreplicas-1+2*CANCELLATION_WHAM_MARGIN_WINDOWS)+1;
+		bin_width=spacing/CANCELLATION_WHAM_BINS_PER_WINDOW;
+		min=script->replica[0].w_nominal-CANCELLATION_WHAM_MARGIN_WINDOWS*spacing-0.5*bin_width;
+	}
+
+	if(cancellation_wham.count!=NULL){
+		if(cancellation_wham.Nbins==Nbins && cancellation_wham.min==min && cancellation_wham.bin_width==bin_width){
+			cancellation_wham.active=true;
+			sprintf(message,"Continuing the WHAM cancellation histogram of the snapshot, which has %llu samples\n",cancellation_wham.Nsamples);
+			append_log_entry(-1,message);
+			return;
+		}
+		append_error_entry(-1,"ERROR error Error: the WHAM cancellation histogram of the snapshot does not fit the nominal positions; starting a new one\n");
+		free_cancellation_wham();
+	}
+	cancellation_wham.Nbins=Nbins;
+	cancellation_wham.min=min;
+	cancellation_wham.bin_width=bin_width;
+	cancellation_wham.count=new double[Nbins]();
+	cancellation_wham.Nk=new unsigned long long[Nbins]();
+	cancellation_wham.Nsamples=0;
+	cancellation_wham.active=true;
+}
+
+// the bin of the WHAM cancellation grid that holds x, or -1
+long cancellation_wham_bin(const struct script_struct *script, double x){
+	double period=script->circular_equality_distance;
+	long b;
+
+	if(script->circular_replica_coordinate) x-=period*floor((x-cancellation_wham.min)/period);
+	b=(long)floor((x-cancellation_wham.min)/cancellation_wham.bin_width);
+	if(b<0 || b>=cancellation_wham.Nbins) return(-1);
+	return(b);
+}
+
+// Adds the umbrella forces of one run that sampled at w to the WHAM cancellation histogram; samples beyond the grid,
+// or the whole run if w is, are left out. Must be called with the replica_mutex on
+void add_cancellation_wham_samples(const struct script_struct *script, double w, double force, const float *force_data){
+	long window, b;
+
+	if((window=cancellation_wham_bin(script,w))<0) return;
+	for(unsigned int i=0;i<script->Nsamples_per_run;i++){
+		if((b=cancellation_wham_bin(script,w+force_data[i]/force))<0) continue;
+		cancellation_wham.count[b]+=1.0;
+		cancellation_wham.Nk[window]++;
+		cancellation_wham.Nsamples++;
+	}
+}
+
+// Solves WHAM on a copy of the histogram as soon as every nominal position has reached the cancellation threshold,
+// and again every cancellation_update_interval seconds while new samples come in. The first solution activates the
+// energy cancellation as conditionally_activate_energy_cancellation() would; every solution is summarized in the log
+void *cancellation_solver(void *arg){
+	struct client_bundle *B=(struct client_bundle *)arg;
+	struct script_struct *script=B->script;
+	struct server_variable_struct *var=B->var;
+	struct umbrella_struct u;
+	char message[MESSAGE_GLOBALVAR_LENGTH];
+	int Nbins=cancellation_wham.Nbins;
+	int K=script->Nreplicas;
+	double *count, *f, *pmf, *t, *A;
+	unsigned long *Nk;
+	unsigned long long Nsamples, Nsolved=0;
+	time_t last_solution=0;
+	int i, b, n, iterations;
+	double d;
+	bool ready;
+
+	count=new double[Nbins];
+	pmf=new double[Nbins];
+	t=new double[Nbins];
+	f=new double[Nbins];
+	Nk=new unsigned long[Nbins];
+	A=new double[K];
+	u.K=Nbins;
+	u.center=new double[Nbins];
+	u.force=new double[Nbins];
+	for(b=0;b<Nbins;b++){
+		u.center[b]=cancellation_wham.min+(b+0.5)*cancellation_wham.bin_width;
+		u.force[b]=script->replica[0].force;
+	}
+	u.beta=var->beta;
+	u.circular=script->circular_replica_coordinate;
+	u.period=script->circular_equality_distance;
+	u.Nthreads=1;
+
+	while(!cancellation_solver_stop){
+		sleep(1);
+		pthread_mutex_lock(&replica_mutex);
+		ready=false;
+		if(cancellation_wham.Nsamples>Nsolved){
+			if(var->energy_cancellation_status==Pending){
+				for(i=0;i<K;i++){
+					if(script->replica[i].cancellation_count<script->cancellation_threshold) break;
+				}
+				ready=(i==K);
+			}else if(var->energy_cancellation_status!=Disabled){
+				ready=(time(NULL)-last_solution>=script->cancellation_update_interval);
+			}
+		}
+		if(ready){
+			memcpy(count,cancellation_wham.count,Nbins*sizeof(double));
+			for(b=0;b<Nbins;b++) Nk[b]=cancellation_wham.Nk[b];
+			Nsamples=Nsolved=cancellation_wham.Nsamples;
+		}
+		pthread_mutex_unlock(&replica_mutex);
+		if(!ready) continue;
+
+		last_solution=time(NULL);
+		if(solve_wham(&u,Nk,Nbins,u.center,count,f,pmf,&iterations)!=0){
+			sprintf(message,"ERROR error Error: WHAM did not converge on %llu samples; the cancellation energies were not changed\n",Nsamples);
+			append_error_entry(-1,message);
+			continue;
+		}
+		// A[i]=-kT ln(sum over x of exp(-(PMF(x)+umbrella at nominal position i)/kT))
+		for(i=0;i<K;i++){
+			for(b=n=0;b<Nbins;b++){
+				if(isnan(pmf[b])) continue;
+				d=u.center[b]-script->replica[i].w_nominal;
+				if(u.circular) d-=u.period*rint(d/u.period);
+				t[n++]=-var->beta*(pmf[b]+0.5*script->replica[i].force*d*d);
+			}
+			A[i]=-log_sum_exp(t,n)/var->beta;
+		}
+
+		pthread_mutex_lock(&replica_mutex);
+		for(i=0;i<K;i++) script->replica[i].cancellation_energy=-(A[i]-A[0]);
+		if(var->energy_cancellation_status==Pending){
+			script->replica_potential_scalar1=script->replica_potential_scalar1_after_threshold;
+			script->replica_potential_scalar2=script->replica_potential_scalar2_after_threshold;
+		}
+		var->energy_cancellation_status=Active;
+		pthread_mutex_unlock(&replica_mutex);
+		sprintf(message,"WHAM cancellation energies from %llu samples, converged in %d iterations\n",Nsamples,iterations);
+		append_log_entry(-1,message);
+	}
+
+	delete[] count;
+	delete[] pmf;
+	delete[] t;
+	delete[] f;
+	delete[] Nk;
+	delete[] A;
+	delete[] u.center;
+	delete[] u.force;
+	return(NULL);
+}
+
+// Without the solver thread the cancellation energies stay as they are
+void start_cancellation_solver(struct client_bundle *B){
+	if(!cancellation_wham.active) return;
+	cancellation_solver_stop=false;
+	if(pthread_create(&cancellation_solver_handle,NULL,cancellation_solver,B)!=0){
+		error_warning("pthread_create failed for the WHAM cancellation solver; the cancellation energies will not be updated");
+		return;
+	}
+	cancellation_solver_running=true;
+}
+
+void stop_cancellation_solver(void){
+	if(!cancellation_solver_running) return;
+	cancellation_solver_stop=true;
+	pthread_join(cancellation_solver_handle,NULL);
+	cancellation_solver_running=false;
+}
+
+// Largest restart file received or loaded so far. New client connections get receive buffers and socket buffers that
+// hold one, so that a restart comes in with few reads and goes out with one writev()
+volatile unsigned int largest_restart_size=0;
+bool socket_buffer_warning_given=false;   //only touched by wait_for_clients()
+
+void note_restart_size(unsigned int size){
+	unsigned int seen;
+
+	while( size>(seen=largest_restart_size) ){
+		if(__sync_bool_compare_and_swap(&largest_restart_size,seen,size)) break;
+	}
+}
+
+// Raises the send and receive buffers of a client socket to fit the largest restart file. They are never lowered,
+// as that would stop the kernel from tuning them itself
+void size_client_socket(int fd){
+	char message[MESSAGE_GLOBALVAR_LENGTH];
+	int option[2]={SO_SNDBUF,SO_RCVBUF};
+	int wanted, current;
+	socklen_t len;
+
+	if(largest_restart_size==0) return;
+	wanted=(largest_restart_size<CLIENT_SOCKET_BUFFER_MAX-CLIENT_INPUT_CHUNK)?largest_restart_size+CLIENT_INPUT_CHUNK:CLIENT_SOCKET_BUFFER_MAX;
+	for(int i=0;i<2;i++){
+		len=sizeof(current);
+		if( getsockopt(fd,SOL_SOCKET,option[i],&current,&len)!=0 || current>=wanted ) continue;
+		setsockopt(fd,SOL_SOCKET,option[i],&wanted,sizeof(wanted));
+		len=sizeof(current);
+		if( getsockopt(fd,SOL_SOCKET,option[i],&current,&len)==0 && current<wanted && !socket_buffer_warning_given ){
+			socket_buffer_warning_given=true;
+			sprintf(message,"ERROR error Error: the kernel limits client socket buffers to %d bytes, below the %d bytes wanted for restart files; raise net.core.wmem_max and net.core.rmem_max to transfer them faster\n",current,wanted);
+			append_error_entry(-1,message);
+		}
+	}
+}
+
+// Writes all of the pieces to a blocking socket, resuming after short writes
+// returns 1 on success, 0 if the write failed
+unsigned char write_all_to_socket(int fd, struct iovec *iov, int Npieces){
+	ssize_t written;
+
+	while(Npieces>0){
+		written=writev(fd,iov,Npieces);
+		if(written<0){
+			if(errno==EINTR) continue;
+			return(0);
+		}
+		while(Npieces>0 && (size_t)written>=iov->iov_len){
+			written-=iov->iov_len;
+			iov++;
+			Npieces--;
+		}
+		if(Npieces>0){
+			iov->iov_base=(char *)iov->iov_base+written;
+			iov->iov_len-=written;
+		}
+	}
+	return(1);
+}
+
 // read the specified number of byte from the given clients TCP/IP connection and put them into buffer
 // if this fails then write an appropriate error message into the log file
+// the reactor in wait_for_clients() has already gathered everything that the client sent before it waits for
+// our reply, so this only copies out of client->in; running short here means the client hung up or timed out
 unsigned char read_bytes_from_socket(struct client_struct *client, const char *failure_description, void *buff, unsigned int number_to_read){
-	int Nread;
-	int Nread_total=0;
-	unsigned int n=number_to_read;  //##DEBUG
-	
+	unsigned int available=client->in_size-client->in_read;
+
 	//printf("number to read is %u\n",number_to_read);  //##DEBUG
-	
-	do{
-		//printf("attempting to read %d bytes\n",number_to_read-Nread_total); //##DEBUG
-		Nread=read(client->fd, (char*)buff+Nread_total, number_to_read-Nread_total);
-		//printf("read returned %d bytes\n",Nread); //##DEBUG
-		Nread_total+=Nread;
-	}while( (Nread_total<number_to_read) && (Nread>0) );
-
-	if(Nread<=0){
-		client->ptr+=sprintf(client->ptr,"%s: failure reading %u bytes from the socket; read returned %d, errno is %d\n",failure_description, number_to_read, Nread, errno);
+
+	if(available<number_to_read){
+		client_error_printf(client,"%s: failure reading %u bytes from the socket; only %u bytes were received\n",failure_description, number_to_read, available);
+		client->in_read=client->in_size;
 		return(0);
 	}
-	//printf("read a total of %d ************\n",Nread_total); //##DEBUG
-	
-	
-	//for(int j=0;j<n;j++)                                 //##DEBUG
+	memcpy(buff,client->in+client->in_read,number_to_read);
+	client->in_read+=number_to_read;
+
+	//for(int j=0;j<number_to_read;j++)                    //##DEBUG
 	//	printf("%hhu ",((unsigned char*)buff)[j]);   //##DEBUG
 	//printf("\n");                                        //##DEBUG
-	
+
 	return(1);
 }
 
+// like read_bytes_from_socket(), but returns where the bytes are in client->in instead of copying them; NULL on failure
+const unsigned char *take_bytes_from_socket(struct client_struct *client, const char *failure_description, unsigned int number_to_read){
+	unsigned int available=client->in_size-client->in_read;
+	const unsigned char *bytes;
+
+	if(available<number_to_read){
+		client_error_printf(client,"%s: failure reading %u bytes from the socket; only %u bytes were received\n",failure_description, number_to_read, available);
+		client->in_read=client->in_size;
+		return(NULL);
+	}
+	bytes=client->in+client->in_read;
+	client->in_read+=number_to_read;
+	return(bytes);
+}
+
 // check to see if the server and client are suing the same protocol for communicating
 unsigned char check_protocol_version(struct client_struct *client){
 	unsigned int protocol_version;
 	
 	if(!read_bytes_from_socket(client, "Warning: cannot read protocol version", &protocol_version, PROTOCOL_VERSION_SIZE)) return(0);
 	if(protocol_version != PROTOCOL_VERSION){
-		client->ptr+=sprintf(client->ptr,"Warning: client and server protocol mismatch. Expecting: %u   Received: %u\n",PROTOCOL_VERSION,protocol_version);
+		client_printf(client,"Warning: client and server protocol mismatch. Expecting: %u   Received: %u\n",PROTOCOL_VERSION,protocol_version);
 		return(0);
 	}
 	return(1);
@@ -1681,12 +3643,12 @@ enum command_enum receive_key_and_command(struct client_struct *client){
 	command=(enum command_enum)buff[COMMAND_LOCATION];
 	if(command<Exit){
 		if( strncmp(buff+KEY_LOCATION,COMMAND_KEY,KEY_SIZE)!=0 ){
-			client->ptr+=sprintf(client->ptr,"Warning: the key did not match\n");
+			client_printf(client,"Warning: the key did not match\n");
 			return(InvalidCommand);
 		}
 	}else if(command<InvalidCommand){
 		if( strncmp(buff+KEY_LOCATION,COMMAND_KEY2,KEY_SIZE)!=0 ){
-			client->ptr+=sprintf(client->ptr,"Warning: attempted a restricted function without the correct key!\n");
+			client_printf(client,"Warning: attempted a restricted function without the correct key!\n");
 			return(InvalidCommand);
 		}
 	}else{
@@ -1697,95 +3659,81 @@ enum command_enum receive_key_and_command(struct client_struct *client){
 }
 
 // receive a file of the type specified by 'command' and place its contents into a buffer
+// The whole file is already in client->in (see client_request_complete()), so it is copied out in one piece.
+// A restart file is not copied: the buffer points into client->in, which outlives it (allocated_memory stays 0)
 unsigned char receive_file(struct client_struct *client, enum command_enum command, struct buffer_struct *data_buffer){
-	char buffer[BUFFER_SIZE];
-	int bytes_to_read;
-	int bytes_left_to_read;
-	int filename_size=-1;
-	int file_fd=-1;
+	int file_size;
+	const unsigned char *file;
+	int filename_size;
+	int file_fd;
+	ssize_t written;
 	
 	printf("Receiving file...\n");  //##DEBUG
 	
-	if(!read_bytes_from_socket(client, "Getting size of file", &bytes_left_to_read, sizeof(bytes_left_to_read))) return(0);
-
-	if( (command!=TakeThisFile) && (data_buffer->allocated_memory==0) )
-	{
-		data_buffer->data=new unsigned char[bytes_left_to_read];
-		data_buffer->allocated_memory=bytes_left_to_read;
-		printf("Allocating memory for file, size is: %d\n",bytes_left_to_read); //##DEBUG
+	if(!read_bytes_from_socket(client, "Getting size of file", &file_size, sizeof(file_size))) return(0);
+	if(file_size<0){
+		client_error_printf(client,"Invalid data size\n");
+		return(0);
 	}
-
-	//if(command==TakeRestartFile) printf("************* PRINTFING RESTART FILE FROM SOCKET ********************\n");	//##DEBUG
-
-	//int fd;	                                                            //##DEBUG
-	//if(command==TakeRestartFile){  //##DEBUG
-	//	if( (fd=open("RESTART_IN2",O_WRONLY|O_CREAT|O_TRUNC,0644))==-1 ) exit(1);   //##DEBUG
-	//}  //##DEBUG
-	//char *c=(char *)data_buffer->data;
-	
-	while(bytes_left_to_read>0){
-		//printf("%d bytes left to read\n",bytes_left_to_read);  //##DEBUG
-		bytes_to_read=(bytes_left_to_read<BUFFER_SIZE) ? bytes_left_to_read : BUFFER_SIZE;
-		if(!read_bytes_from_socket(client, "Getting file contents", buffer, bytes_to_read)) return(0);
-		
-		if( (command==TakeThisFile) && (file_fd==-1) ){
-			int i;
-			for(i=0;i<MAX_FILENAME_SIZE+1;i++)
-				if(buffer[i]==0) break;   // find null terminating character
-			if(i==MAX_FILENAME_SIZE+1) return(0);
-			filename_size=i;
-			//this for loop checks if there are any funny characters in the filename, 
-			//of course to prevent malicious attacks by hackers
-			for(i=0;i<filename_size;i++){ 
-				if( ((buffer[i]<'a') || (buffer[i]>'z')) && ((buffer[i]<'A') || (buffer[i]>'Z')) && 
-						(buffer[i]!='_') && (buffer[i]!='.') )
-				{
-					 return(0);
-				}
+	if((file=take_bytes_from_socket(client, "Getting file contents", file_size))==NULL) return(0);
+
+	if(command==TakeThisFile){
+		int i;
+		for(i=0;i<MAX_FILENAME_SIZE+1 && i<file_size;i++)
+			if(file[i]==0) break;   // find null terminating character
+		if(i==MAX_FILENAME_SIZE+1 || i==file_size) return(0);
+		filename_size=i;
+		//this for loop checks if there are any funny characters in the filename, 
+		//of course to prevent malicious attacks by hackers
+		for(i=0;i<filename_size;i++){ 
+			if( ((file[i]<'a') || (file[i]>'z')) && ((file[i]<'A') || (file[i]>'Z')) && 
+					(file[i]!='_') && (file[i]!='.') )
+			{
+				 return(0);
 			}
-			printf("writing to file: [%s]\n",buffer);  //##DEBUG
-			if( (file_fd=open(buffer,O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH))==-1 ) return(0);
-			fchmod(file_fd,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
-			filename_size++;  // the null character is considered part of the filename
-			bytes_left_to_read-=filename_size;
 		}
-		
-		//if(command==TakeRestartFile)     //##DEBUG
-		//	for(int j=0;j<bytes_to_read;j++) printf("%c",buffer[j]);   //##DEBUG
-		//write(fd,ptr-bytes_to_read,bytes_to_read);   //##DEBUG
-		//usleep(1000);
-		
-		if(command==TakeThisFile){
-			if( write(file_fd,buffer+filename_size,bytes_to_read)!=bytes_to_read){
-				client->ptr+=sprintf(client->ptr,"Error: cannot writing to file\n");
-				return(0);
-			}
-			filename_size=0; 
-		}else{
-			data_buffer->data_size+=bytes_to_read;
-			if( data_buffer->data_size > data_buffer->allocated_memory ){
-				client->ptr+=sprintf(client->ptr,"Invalid data size\n");
+		printf("writing to file: [%s]\n",file);  //##DEBUG
+		if( (file_fd=open((const char *)file,O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH))==-1 ) return(0);
+		fchmod(file_fd,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+		filename_size++;  // the null character is considered part of the filename
+		for(i=filename_size;i<file_size;i+=written){
+			if( (written=write(file_fd,file+i,file_size-i))<=0 ){
+				if(written<0 && errno==EINTR){
+					written=0;
+					continue;
+				}
+				client_error_printf(client,"Error: cannot writing to file\n");
+				close(file_fd);
 				return(0);
 			}
-			//printf("Read in %d bytes ***************\n",bytes_to_read); //##DEBUG
-			memcpy( data_buffer->data + data_buffer->data_size - bytes_to_read, buffer, bytes_to_read );
 		}
-		bytes_left_to_read-=bytes_to_read;
+		close(file_fd);
+		return(1);
 	}
-	if(file_fd!=-1) close(file_fd);
 
-	//if(command==TakeRestartFile) close(fd);  //##DEBUG
+	if(command==TakeRestartFile){
+		if(data_buffer->data!=NULL){
+			client_error_printf(client,"Invalid data size\n");
+			return(0);
+		}
+		data_buffer->data=(unsigned char *)file;
+		data_buffer->data_size=file_size;
+		note_restart_size(file_size);
+		return(1);
+	}
+	if(data_buffer->allocated_memory==0)
+	{
+		data_buffer->data=new unsigned char[file_size];
+		data_buffer->allocated_memory=file_size;
+		printf("Allocating memory for file, size is: %d\n",file_size); //##DEBUG
+	}
+	if( data_buffer->data_size+file_size > data_buffer->allocated_memory ){
+		client_error_printf(client,"Invalid data size\n");
+		return(0);
+	}
+	memcpy( data_buffer->data + data_buffer->data_size, file, file_size );
+	data_buffer->data_size+=file_size;
 
-	//if(command==TakeRestartFile){  //##DEBUG
-	//	int fd;	                                                            //##DEBUG
-	//	if(command==TakeRestartFile) //##DEBUG
-	//	{//##DEBUG
-	//		if( (fd=open("RESTART_OUT",O_WRONLY|O_CREAT|O_TRUNC,0644))==-1 ) exit(1);	//##DEBUG
-	//	}//##DEBUG
-	//	write(fd, data_buffer->data, data_buffer->data_size );  //##DEBUG
-	//	close(fd);  //##DEBUG
-	//}  //##DEBUG
-	
 	return(1);
 }
 
@@ -1857,14 +3805,14 @@ void send_simulation_parameters(struct client_struct *client, const struct repli
 		//script->Nsamesystem_uncoupled is not compatable with temperature
 		w=(float)1.0/(rep[0].w*BOLTZMANN_CONSTANT);
 		w2[0]=NAN;
-		client->ptr+=sprintf(client->ptr,"Sending simulation parameters: temperature=%0.1f; steps=%u; seed=%u\n", w, rep[0].sampling_steps, random_seed);
+		client_printf(client,"Sending simulation parameters: temperature=%0.1f; steps=%u; seed=%u\n", w, rep[0].sampling_steps, random_seed);
 	}else{
 		for(nni=0;nni<script->Nsamesystem_uncoupled;nni++){
 			w2[nni]=calculate_w2_from_w(rep[nni].w,script);
 			if(isnan(w2[nni])){
-				client->ptr+=sprintf(client->ptr,"Sending simulation parameters: coord: %f; steps: %u; seed: %u\n", rep[nni].w, rep[nni].sampling_steps, random_seed);
+				client_printf(client,"Sending simulation parameters: coord: %f; steps: %u; seed: %u\n", rep[nni].w, rep[nni].sampling_steps, random_seed);
 			}else{
-				client->ptr+=sprintf(client->ptr,"Sending simulation parameters: coord: %f; coord2: %f; steps: %u; seed: %u\n", rep[nni].w, w2[nni], rep[nni].sampling_steps, random_seed);
+				client_printf(client,"Sending simulation parameters: coord: %f; coord2: %f; steps: %u; seed: %u\n", rep[nni].w, w2[nni], rep[nni].sampling_steps, random_seed);
 			}
 		}
 	}
@@ -1942,52 +3890,88 @@ void send_simulation_parameters(struct client_struct *client, const struct repli
 	free(w2);free(new_w);
 }
 
-// send the restart file for the replica that is about to run to the given client
-void send_restart_file(int socket_fd, struct buffer_struct restart){
+// send the restart file for the replica that is about to run to the given client, header and chunks gathered by
+// writev() straight from the restart store, IOV_MAX pieces at a time
+void send_restart_file(int socket_fd, const struct restart_recipe_struct *restart){
 	char buffer[KEY_SIZE+COMMAND_SIZE+sizeof(unsigned int)];
-	int block_size;
-	int ptr;
-	char b[BUFFER_SIZE];
-	int writecheck;
+	int Npieces=(restart->Nchunks+1<IOV_MAX)?restart->Nchunks+1:IOV_MAX;
+	struct iovec *iov=new iovec[Npieces];
+	int k=0, n;
 
-	printf("Sending restart data, the size of the file is: %u\n",restart.data_size);  //##DEBUG
+	printf("Sending restart data, the size of the file is: %u\n",restart->size);  //##DEBUG
 
 	memcpy(buffer,COMMAND_KEY,sizeof(COMMAND_KEY));
 	buffer[KEY_SIZE]=TakeRestartFile;
-	*(unsigned int*)(buffer+KEY_SIZE+COMMAND_SIZE)=restart.data_size;
+	*(unsigned int*)(buffer+KEY_SIZE+COMMAND_SIZE)=restart->size;
 
-	//writecheck=write(socket_fd, buffer, sizeof(buffer));
-	// should catch like above, but I'll elave the warning as it should really be fixed
-	write(socket_fd, buffer, sizeof(buffer));
-	
-	printf("Sending TakeRestartFileHeader: %d bytes\n",(int)sizeof(buffer)); 		//##DEBUG
-	//int fd;	                                                        	    	//##DEBUG
-	//if( (fd=open("RESTART_IN",O_RDONLY))==-1 ) exit(1);					//##DEBUG
-	//printf("************** SENDING RESTART FILE FROM DATABASE *****************\n"); 	//##DEBUG
+	iov[0].iov_base=buffer;
+	iov[0].iov_len=sizeof(buffer);
+	n=1;
+	do{
+		for(;n<Npieces && k<restart->Nchunks;n++,k++){
+			iov[n].iov_base=restart->chunk[k]->data;
+			iov[n].iov_len=restart->chunk[k]->size;
+		}
+		// a failed send shows up on the client, which will not get its restart file
+		if(!write_all_to_socket(socket_fd,iov,n)) break;
+		n=0;
+	}while(k<restart->Nchunks);
+	delete[] iov;
+	printf("Sent TakeRestartFile: %d bytes of header and %u bytes of data in %d chunks\n",(int)sizeof(buffer),restart->size,restart->Nchunks); 		//##DEBUG
+}
 
-	block_size=BUFFER_SIZE;
-	for(ptr=0;ptr<restart.data_size;ptr+=block_size)
-	{
-		if(ptr+block_size>restart.data_size) block_size=restart.data_size-ptr;
-		//printf("Sending data chunk: %d bytes\n",block_size);             	//##DEBUG
-		//for(int j=0;j<block_size;j++)                                    	//##DEBUG
-		//	printf("%hhu ",((unsigned char*)restart.data+ptr)[j]);   	//##DEBUG
-		//printf("\n");                                                    	//##DEBUG
-		//read(fd,b,block_size);
-		//write(socket_fd, b, block_size);
-
-		//writecheck=write(socket_fd, (char*)restart.data+ptr, block_size);
-		// should catch like above, but I'll elave the warning as it should really be fixed
-		write(socket_fd, (char*)restart.data+ptr, block_size);
-		
-		//for(int j=0;j<block_size;j++) printf("%c",*((char*)restart.data+ptr+j));  //##DEBUG
-		
-		//write(fd,(char*)restart.data+ptr, block_size);	//##DEBUG
+// Sends the restart file as TakeRestartDelta against base, the restart that the client reported with HaveRestart.
+// The delta is made here, outside of any lock. returns the size of the delta, or 0 if the delta would not be
+// smaller than the restart (nothing is sent then, and the caller sends the whole file)
+unsigned int send_restart_delta(int socket_fd, const struct restart_recipe_struct *restart, const struct restart_recipe_struct *base, const struct restart_held_struct *held){
+	char buffer[KEY_SIZE+COMMAND_SIZE+sizeof(unsigned int)];
+	struct restart_delta_struct header;
+	unsigned char *data, *base_data, *delta;
+	unsigned int delta_size;
+	struct iovec iov[3];
+
+	data=(unsigned char *)malloc(restart->size);
+	base_data=(unsigned char *)malloc(base->size);
+	delta=(unsigned char *)malloc(restart_delta_bound(restart->size));
+	if(data==NULL || base_data==NULL || delta==NULL){
+		free(data);
+		free(base_data);
+		free(delta);
+		return(0);
+	}
+	restart_store_copy(restart,data);
+	restart_store_copy(base,base_data);
+	delta_size=restart_delta_encode(data,restart->size,base_data,base->size,delta);
+	if(delta_size+sizeof(header)>=restart->size){
+		free(data);
+		free(base_data);
+		free(delta);
+		return(0);
 	}
-	//close(fd);
+	header.size=restart->size;
+	header.crc=crc32c(data,restart->size);
+	header.base_size=held->size;
+	header.base_crc=held->crc;
+	free(data);
+	free(base_data);
+
+	memcpy(buffer,COMMAND_KEY,sizeof(COMMAND_KEY));
+	buffer[KEY_SIZE]=TakeRestartDelta;
+	*(unsigned int*)(buffer+KEY_SIZE+COMMAND_SIZE)=sizeof(header)+delta_size;
+	iov[0].iov_base=buffer;
+	iov[0].iov_len=sizeof(buffer);
+	iov[1].iov_base=&header;
+	iov[1].iov_len=sizeof(header);
+	iov[2].iov_base=delta;
+	iov[2].iov_len=delta_size;
+	// as in send_restart_file(), a failed send shows up on the client
+	write_all_to_socket(socket_fd,iov,3);
+	free(delta);
+	printf("Sent TakeRestartDelta: %u bytes of delta for %u bytes of restart\n",delta_size,restart->size);  //##DEBUG
+	return(delta_size);
 }
 
-// This function runs as a thread for each client that connects
+// This function runs on a client_worker() thread for each client once wait_for_clients() has received its data
 // Handles all interaction with the client:
 // receives replica ID, move energy data, sample data, coordinate data, restart file
 // checks the integrity of all the files that are received
@@ -2028,6 +4012,15 @@ void *client_interaction(struct client_bundle *B){
         // For a neally new node, there is nothing to write anyway, but also it won't have a message and so might lead to a segfault
 	bool newConnection=false;
 	bool unexpectedClient=false;
+	bool commit_coordinates=false;  //coordinate averaging and the restart hand-over are done after the replica_mutex comes off
+	bool copy_restart=false;
+	struct restart_recipe_struct *stored_restart=NULL;   //received, not yet committed
+	struct restart_recipe_struct *retired_restart=NULL;
+	struct restart_recipe_struct *send_restart=NULL;  //shared from the restart store, not copied
+	struct restart_held_struct held_restart;
+	bool held_restart_reported=false;
+	struct restart_recipe_struct *delta_base=NULL;    //the restart that the client holds, if it matches held_restart
+	unsigned int delta_size=0;
 
 	//CN wonders if there is a way to avoid allocating this memory every time.
 	energy=(buffer_struct *)malloc(B->script->Nsamesystem_uncoupled*sizeof(buffer_struct));
@@ -2085,14 +4078,14 @@ void *client_interaction(struct client_bundle *B){
 		case ReplicaID:
 			printf("ReplicaID command received\n");  //##DEBUG
 			if(nni!=0){
-				B->client->ptr+=sprintf(B->client->ptr,"Programming error: replica ID received on other than the first NNI\n");
+				client_error_printf(B->client,"Programming error: replica ID received on other than the first NNI\n");
 				break;
 			}
 			receive_replica_ID(B->client, &replicaN[0], &current_replica[0].sequence_number,B->opt,B->script);
 			old_replicaN[0]=replicaN[0];
 			if(replicaN[0]>=0){
 				client_status=Communicating;
-				B->client->ptr+=sprintf(B->client->ptr,"Replica ID received: %2sw%d.%u\n",B->opt->title,replicaN[nni],current_replica[nni].sequence_number);
+				client_printf(B->client,"Replica ID received: %2sw%d.%u\n",B->opt->title,replicaN[nni],current_replica[nni].sequence_number);
 				//ReplicaID is only sent for the first nni so we need to fill in some values that we know to be true
 				for(i=1;i<B->script->Nsamesystem_uncoupled;i++){
 					old_replicaN[i]=replicaN[i]=replicaN[0]+i; // we enforce that they are consecutively numbered (rep# not W)
@@ -2100,12 +4093,12 @@ void *client_interaction(struct client_bundle *B){
 				}
 			}
 			else if(replicaN[nni]==-2){
-				B->client->ptr+=sprintf(B->client->ptr,"A Node has just been occupied\n");
+				client_printf(B->client,"A Node has just been occupied\n");
 				decrement_Nreserved_queue_slots(B->var);
 				client_status=NewNode;
 				newConnection=true;
 			}else{
-				B->client->ptr+=sprintf(B->client->ptr,"Warning: invalid replica ID received\n");
+				client_printf(B->client,"Warning: invalid replica ID received\n");
 			}
 			break;
 		case TakeTCS:
@@ -2114,8 +4107,23 @@ void *client_interaction(struct client_bundle *B){
 				client_status=Communicating;
 				// tcs gets sent around as a float since there are already routines for sending floats
 				if(B->opt->verbose){
-					B->client->ptr+=sprintf(B->client->ptr,"This client started running (in seconds) : %d\n",(int)*((float*)(tcs->data)));  
+					client_printf(B->client,"This client started running (in seconds) : %d\n",(int)*((float*)(tcs->data)));  
+				}
+			}
+			break;
+		case HaveRestart:
+			{
+				int size;
+				if(!read_bytes_from_socket(B->client, "Warning: reading size of held restart", &size, sizeof(size))) break;
+				if(size!=sizeof(held_restart)){
+					client_printf(B->client,"Warning: HaveRestart of %d bytes was received; it must be %d bytes\n",size,(int)sizeof(held_restart));
+					take_bytes_from_socket(B->client, "Warning: skipping held restart", (size>0)?size:0);
+					break;
 				}
+				if(!read_bytes_from_socket(B->client, "Warning: reading held restart", &held_restart, sizeof(held_restart))) break;
+				// only the restart of the first nni is ever sent back
+				if(nni==0) held_restart_reported=true;
+				client_status=Communicating;
 			}
 			break;
 		case TakeJID:
@@ -2124,7 +4132,7 @@ void *client_interaction(struct client_bundle *B){
 				client_status=Communicating;
 				// jid gets sent around as a float since there are already routines for sending floats
 				if(B->opt->verbose){
-					B->client->ptr+=sprintf(B->client->ptr,"This client is running as JOB: %d\n",(int)*((float*)(jid->data)));
+					client_printf(B->client,"This client is running as JOB: %d\n",(int)*((float*)(jid->data)));
 				}
 			}
 			break;
@@ -2133,32 +4141,32 @@ void *client_interaction(struct client_bundle *B){
 			if(receive_file(B->client, command, NULL)){
 				client_status=Communicating;
 				if(B->opt->verbose){	
-					B->client->ptr+=sprintf(B->client->ptr,"A file was successfully received and written to disk\n");
+					client_printf(B->client,"A file was successfully received and written to disk\n");
 				}
 			}
 			break;
 		case TakeMoveEnergyData:
 			printf("TakeMoveEnergyData command received\n");  //##DEBUG
 			if(B->script->replica_move_type==NoMoves){
-				B->client->ptr+=sprintf(B->client->ptr,"Client attempting to send energy data but we aren't attempting moves along the coordinate\n");
+				client_printf(B->client,"Client attempting to send energy data but we aren't attempting moves along the coordinate\n");
 				break;
 			}
 			if(receive_file(B->client, command, &energy[nni])){
 				client_status=Communicating;
 				if(B->opt->verbose){
-					B->client->ptr+=sprintf(B->client->ptr,"Energy data was successfully received\n");
+					client_printf(B->client,"Energy data was successfully received\n");
 				}
 			}
 			break;
 		case TakeSampleData:
 			printf("TakeSampleData command received\n");  //##DEBUG
 			if(!B->script->need_sample_data){
-				B->client->ptr+=sprintf(B->client->ptr,"Client attempting to send sample data but we don't want it\n");
+				client_printf(B->client,"Client attempting to send sample data but we don't want it\n");
 				break;
 			}
 			//need typecast to compare to NsampleOrAdditional (can be = -1)
 			if(NsampleOrAdditional>=(int)B->script->Nadditional_data){
-				B->client->ptr+=sprintf(B->client->ptr,"Client attempting to send additional data but we don't want it\n");
+				client_printf(B->client,"Client attempting to send additional data but we don't want it\n");
 				fprintf(stderr,"NsampleOrAdditional=%d and Nadditional_data=%d\n",NsampleOrAdditional,B->script->Nadditional_data);
 				break;
 			}
@@ -2174,13 +4182,13 @@ void *client_interaction(struct client_bundle *B){
 				client_status=Communicating;
 				if(B->opt->verbose){
 					if(NsampleOrAdditional==-1){
-						B->client->ptr+=sprintf(B->client->ptr,"A sample data file was successfully received\n");
+						client_printf(B->client,"A sample data file was successfully received\n");
 					}else{
-						B->client->ptr+=sprintf(B->client->ptr,"An additional data file was successfully received\n");
+						client_printf(B->client,"An additional data file was successfully received\n");
 					}
 				}
 				//for(i=0;i<B->script->Nsamples_per_run;i++){
-				//	B->client->ptr+=sprintf(B->client->ptr,"CN LOOKEY %f\n",((float *)sampleOrAdditional->data)[i]);
+				//	client_printf(B->client,"CN LOOKEY %f\n",((float *)sampleOrAdditional->data)[i]);
 				//}
 	
 			}
@@ -2189,7 +4197,7 @@ void *client_interaction(struct client_bundle *B){
 		case TakeCoordinateData:
 			printf("TakeCoordinateData command received\n");  //##DEBUG
 			if(!B->script->need_coordinate_data){
-				B->client->ptr+=sprintf(B->client->ptr,"Client attempting to send coordinate data but we don't want it\n");
+				client_printf(B->client,"Client attempting to send coordinate data but we don't want it\n");
 				break;
 			}
 			if( receive_file(B->client, command, &coordinate[nni]) && 
@@ -2197,7 +4205,7 @@ void *client_interaction(struct client_bundle *B){
 			{
 				client_status=Communicating;
 				if(B->opt->verbose){
-					B->client->ptr+=sprintf(B->client->ptr,"A coordinate data file was successfully received\n");
+					client_printf(B->client,"A coordinate data file was successfully received\n");
 				}
 			}
 			break;
@@ -2208,14 +4216,14 @@ void *client_interaction(struct client_bundle *B){
 				break;
 			}
 			if(B->opt->verbose){
-				B->client->ptr+=sprintf(B->client->ptr,"A restart file or indication of NextNonInteracting was successfully received\n");
+				client_printf(B->client,"A restart file or indication of NextNonInteracting was successfully received\n");
 			}
 			if(replicaN[nni]<0) break;
 			if(command==TakeRestartFile && !check_restart_file_integrity(B->client, current_replica[nni].restart)) break;
 			if( B->script->need_sample_data && !check_sample_file_integrity(B->client, sample[nni], 0, B->script) ) break;
 			if( B->script->need_sample_data && B->script->Nadditional_data>0){
 				if((int)B->script->Nadditional_data!=NsampleOrAdditional){
-					B->client->ptr+=sprintf(B->client->ptr,"Expected %d additional data files, but only found %d\n",B->script->Nadditional_data,NsampleOrAdditional);
+					client_printf(B->client,"Expected %d additional data files, but only found %d\n",B->script->Nadditional_data,NsampleOrAdditional);
 					break;
 				}
 				for(ai=0; ai<B->script->Nadditional_data; ai++){
@@ -2227,7 +4235,7 @@ void *client_interaction(struct client_bundle *B){
 			if(nni+1==B->script->Nsamesystem_uncoupled){
 				client_status=ReplicaFinished;
 				if(B->opt->verbose){
-					B->client->ptr+=sprintf(B->client->ptr,"All integrity checks passed\n");
+					client_printf(B->client,"All integrity checks passed\n");
 				}
 			}else{
 				client_status=Communicating;
@@ -2239,25 +4247,48 @@ void *client_interaction(struct client_bundle *B){
 		case Exit:
 			printf("Exit command received\n");  //##DEBUG
 			B->var->simulation_status=Finished;
-			B->client->ptr+=sprintf(B->client->ptr,"Exit command was received; DR_server will exit\n");
+			client_printf(B->client,"Exit command was received; DR_server will exit\n");
 			break;
 		case Snapshot:
 			B->var->save_snapshot_now=true;
-			B->client->ptr+=sprintf(B->client->ptr,"Snapshot command was received; DR_server will write out a snapshot\n");
+			client_printf(B->client,"Snapshot command was received; DR_server will write out a snapshot\n");
+			break;
+		case LogLevel:
+			{
+				int level;
+				if(!read_bytes_from_socket(B->client, "Warning: reading log level", &level, sizeof(level))) break;
+				if(level<LogErrors || level>LogMoves){
+					client_printf(B->client,"Warning: log level %d was requested; it must be from %d to %d\n",level,LogErrors,LogMoves);
+					break;
+				}
+				log_level=level;
+				client_printf(B->client,"LogLevel command was received; the log level is now %d\n",level);
+			}
 			break;
 		default:
-			B->client->ptr+=sprintf(B->client->ptr,"Warning: an unknown command was received from the client\n");
+			client_printf(B->client,"Warning: an unknown command was received from the client\n");
 		}
 	};
 
 	if(replicaN[nni]!=-2 && nni+1!=B->script->Nsamesystem_uncoupled){
 		// When replicaN[nni]==-2, it is a new replica and only sends the replicaID
-		B->client->ptr+=sprintf(B->client->ptr,"Only received information for %d noninteracting copies from the client but there should be %d.\n",nni+1,B->script->Nsamesystem_uncoupled);
+		client_printf(B->client,"Only received information for %d noninteracting copies from the client but there should be %d.\n",nni+1,B->script->Nsamesystem_uncoupled);
 		client_status=Error;
 	}
 	//nni will now become a general purpose index of B->script->Nsamesystem_uncoupled in for loops
 
+	// only the restart of the first nni is kept; it is chunked before any lock and committed if the job is accepted
+	if(client_status==ReplicaFinished){
+		// the restart that was just received is the base of a delta if it is the one the client says it holds
+		bool held=held_restart_reported && current_replica[0].restart.data!=NULL && current_replica[0].restart.data_size==held_restart.size &&
+			crc32c(current_replica[0].restart.data,current_replica[0].restart.data_size)==held_restart.crc;
+		stored_restart=store_restart_file(&current_replica[0].restart);
+		if(held) delta_base=restart_store_share(stored_restart);
+	}
+
 	//fprintf(stderr,"Trying to get a lock after first comm round\n");fflush(stderr);    //CN FIND PROBLEM 
+	// Global section: replica status, sequence numbers, the DRPE-dependent move, termination checks and node
+	// assignment. Everything that scales with the restart or coordinate size is done after it, under the replica data locks.
 	pthread_mutex_lock(&replica_mutex);
 	node_just_reanimated=0;
 	switch(client_status)
@@ -2265,13 +4296,13 @@ void *client_interaction(struct client_bundle *B){
 	case ReplicaFinished:
 		for(nni=0;nni<B->script->Nsamesystem_uncoupled;nni++){
 			if(B->script->replica[replicaN[nni]].status!='R'){
-				B->client->ptr+=sprintf(B->client->ptr,"Warning: this replica is apparently not running, what's going on?\n");
+				client_printf(B->client,"Warning: this replica is apparently not running, what's going on?\n");
 				client_status=Error;
 				unexpectedClient=true;
 				break; //only breaks for loop
 			}
 			if(current_replica[nni].sequence_number!=B->script->replica[replicaN[nni]].sequence_number){
-				B->client->ptr+=sprintf(B->client->ptr,"Warning: the sequence number for this job is invalid\n");
+				client_printf(B->client,"Warning: the sequence number for this job is invalid\n");
 				client_status=Error;
 				unexpectedClient=true;
 				break; //only breaks for loop
@@ -2283,7 +4314,7 @@ void *client_interaction(struct client_bundle *B){
 			}
 			//leave unexpectedClient=true because I don't want to write any of this to the database
 			client_status=NewNode;
-			B->client->ptr+=sprintf(B->client->ptr,"This run ALLOWS REQUEUEING of resurected Nodes, this will occur now...\n");
+			client_printf(B->client,"This run ALLOWS REQUEUEING of resurected Nodes, this will occur now...\n");
 			// must set replicaN[0]=-1 or else it will double submit the job that it had previously
 			replicaN[0]=-1;
 			node_just_reanimated=1;
@@ -2295,7 +4326,7 @@ void *client_interaction(struct client_bundle *B){
 				save_sample_data_sequence_number[nni]=B->script->replica[replicaN[nni]].sequence_number;
 				save_sample_data_w[nni]=B->script->replica[replicaN[nni]].w;
 				bin[nni]=find_bin_from_w(B->script->replica[replicaN[nni]].w,B->script);
-				if(B->var->energy_cancellation_status==Pending){
+				if(B->var->energy_cancellation_status==Pending || cancellation_rounds.collecting){
 					if(B->script->coordinate_type==Spatial||B->script->coordinate_type==Umbrella){
 						for(l=0;l<B->script->Nligands;l++){
 							average=0.0;
@@ -2305,38 +4336,46 @@ void *client_interaction(struct client_bundle *B){
 							}
 							average/=B->script->Nsamples_per_run;
 							B->script->replica[bin[nni]].cancellation_accumulator[l]+=average;
+							if(cancellation_rounds.active) cancellation_rounds.sum_of_squares[2*bin[nni]+l]+=average*average;
 						}
 					}else{
-						B->script->replica[bin[nni]].cancellation_accumulator[0]+=*((float*)(energy[nni].data));
+						average=*((float*)(energy[nni].data));
+						B->script->replica[bin[nni]].cancellation_accumulator[0]+=average;
+						if(cancellation_rounds.active) cancellation_rounds.sum_of_squares[2*bin[nni]]+=average*average;
 					}
 					B->script->replica[bin[nni]].cancellation_count++;
 				}
+				if(cancellation_wham.active && B->var->energy_cancellation_status!=Disabled){
+					add_cancellation_wham_samples(B->script,save_sample_data_w[nni],B->script->replica[replicaN[nni]].force,(float*)sample[nni].data);
+				}
 			}
 			//Intentionally moved this outside of the above for-loop
-			if(B->var->energy_cancellation_status==Pending){
+			//the cancellation_solver() activates WHAM cancellation
+			if((B->var->energy_cancellation_status==Pending || cancellation_rounds.collecting) && !cancellation_wham.active){
+				bool was_pending=(B->var->energy_cancellation_status==Pending);
 				conditionally_activate_energy_cancellation(B->script,B->var);
-				if(B->var->energy_cancellation_status==Active){
-					B->client->ptr+=sprintf(B->client->ptr,"The energy cancellation feature has been activated; please stand by for a summary\n");
+				if(was_pending && B->var->energy_cancellation_status==Active){
+					client_printf(B->client,"The energy cancellation feature has been activated; please stand by for a summary\n");
 				}
 			}
 	
 			//only commit restart file for first nni
-			commit_restart_file(replicaN[0],&current_replica[0].restart,B->script);
-			printf("Just out of commit pointer is: %p\n",current_replica[0].restart.data);  //##DEBUG
+			retired_restart=commit_restart_file(replicaN[0],&stored_restart,B->script);
 		
+			commit_coordinates=true;
 			for(nni=0;nni<B->script->Nsamesystem_uncoupled;nni++){	
-				if(coordinate[nni].data!=NULL) commit_coordinate_data(replicaN[nni],bin[nni],&coordinate[nni],B->script,B->var);
+				if(coordinate[nni].data!=NULL) allocate_coordinate_averages(&coordinate[nni],B->script,B->var);
 				if(B->opt->verbose){
 					if(B->script->coordinate_type==Temperature){
-						B->client->ptr+=sprintf(B->client->ptr,"Bin %d at temperature %0.1f will be incremented\n", bin[nni], (float)1.0/(B->script->replica[replicaN[nni]].w*BOLTZMANN_CONSTANT));
+						client_printf(B->client,"Bin %d at temperature %0.1f will be incremented\n", bin[nni], (float)1.0/(B->script->replica[replicaN[nni]].w*BOLTZMANN_CONSTANT));
 					}else{
-						B->client->ptr+=sprintf(B->client->ptr,"Bin %d at w %f will be incremented\n", bin[nni], B->script->replica[replicaN[nni]].w);
+						client_printf(B->client,"Bin %d at w %f will be incremented\n", bin[nni], B->script->replica[replicaN[nni]].w);
 					}
 				}
 				B->script->replica[bin[nni]].sample_count++;
 				B->script->replica[replicaN[nni]].sequence_number++;
 				if(B->opt->verbose){
-					B->client->ptr+=sprintf(B->client->ptr,"Incrementing sequence number of replica %d to %hu\n", replicaN[nni], B->script->replica[replicaN[nni]].sequence_number);
+					client_printf(B->client,"Incrementing sequence number of replica %d to %hu\n", replicaN[nni], B->script->replica[replicaN[nni]].sequence_number);
 				}
 				if(B->script->replica_move_type==MonteCarlo||B->script->replica_move_type==vRE){
 					determine_new_replica_position_monte_carlo_or_vre(B->client, replicaN[nni], (float*)energy[nni].data,B->script,B->var);
@@ -2353,7 +4392,7 @@ void *client_interaction(struct client_bundle *B){
 			
 			node_time_running=time(NULL)-B->node[B->script->replica[replicaN[0]].nodeSlot].start_time;
 			if(B->opt->verbose){
-				B->client->ptr+=sprintf(B->client->ptr,"Node %s has been running for (seconds): %d\n",B->node[B->script->replica[replicaN[0]].nodeSlot].ip, node_time_running);
+				client_printf(B->client,"Node %s has been running for (seconds): %d\n",B->node[B->script->replica[replicaN[0]].nodeSlot].ip, node_time_running);
 			}
 		
 			check_termination_conditions(B->client,B->script,B->var,B->opt);
@@ -2362,13 +4401,13 @@ void *client_interaction(struct client_bundle *B){
 			}                                                                                          //##DEBUG
 
 			if(node_time_running<0){
-				B->client->ptr+=sprintf(B->client->ptr,"WARNING: negative runtime. There is some lack of synchronization in your clocks!\n");
+				client_printf(B->client,"WARNING: negative runtime. There is some lack of synchronization in your clocks!\n");
 			}else if(node_time_running>=B->script->node_time){
 				//Release the node -- cleanup will be done based on client_status=Error a bit later
 				if(B->script->replica[replicaN[0]].status=='R'){
 					B->script->replica[replicaN[0]].status='N';
 				}
-				B->client->ptr+=sprintf(B->client->ptr,"Time limit on Node exceeded; Node will be freed\n");
+				client_printf(B->client,"Time limit on Node exceeded; Node will be freed\n");
 				client_status=Error;
 				break;
 			}
@@ -2392,25 +4431,25 @@ void *client_interaction(struct client_bundle *B){
 			dumpnode=drop_one_old_node(B->client,B->script,B->node);
 			//fprintf(stderr,"finished trying to drop\n");fflush(stderr); //CN FIND PROBLEM 
 			if(dumpnode>=0){
-				B->client->ptr+=sprintf(B->client->ptr,"DUMP (part 1): Shut down node [%d] (IP=%s) to make room for a new job\n",dumpnode,B->node[dumpnode].ip);
+				client_printf(B->client,"DUMP (part 1): Shut down node [%d] (IP=%s) to make room for a new job\n",dumpnode,B->node[dumpnode].ip);
 				find_replica_to_run(&replicaN[0],B->script);
 				if(replicaN[0]>=0){
-					B->client->ptr+=sprintf(B->client->ptr,"DUMP (part 2): A new job should start using replica %d\n",replicaN[0]);
+					client_printf(B->client,"DUMP (part 2): A new job should start using replica %d\n",replicaN[0]);
 				}else{
-					B->client->ptr+=sprintf(B->client->ptr,"DUMP (part 2): Error: could not find a new job to run after dumping! (no action taken on error)\n");
+					client_error_printf(B->client,"DUMP (part 2): Error: could not find a new job to run after dumping! (no action taken on error)\n");
 				}
 			}else{
 				//if dumpnode<0 then the decision was to not dump any Nodes
-				B->client->ptr+=sprintf(B->client->ptr,"DUMP (part 0): A Node dump was considered, but was not enacted as it would not be efficient at this time.\n");
+				client_printf(B->client,"DUMP (part 0): A Node dump was considered, but was not enacted as it would not be efficient at this time.\n");
 			}
 		}
 
 		if(replicaN[0]<0 || B->var->simulation_status!=Running){
-			B->client->ptr+=sprintf(B->client->ptr,"No jobs to run at this time\n");
+			client_printf(B->client,"No jobs to run at this time\n");
 			if(B->var->simulation_status!=Running){
-				B->client->ptr+=sprintf(B->client->ptr,"  because simulation_status!=Running\n");
+				client_printf(B->client,"  because simulation_status!=Running\n");
 				if(B->var->simulation_status==DiskAlmostFull){
-					B->client->ptr+=sprintf(B->client->ptr,"    because simulation_status==DiskAlmostFull\n");
+					client_printf(B->client,"    because simulation_status==DiskAlmostFull\n");
 				}
 			}
 			client_status=Error;
@@ -2423,25 +4462,25 @@ void *client_interaction(struct client_bundle *B){
 		int myNewNodeSlot;
 
 		/*
-		B->client->ptr+=sprintf(B->client->ptr,"NODE: what node has ip %s ...\n",B->client->ip);
+		client_printf(B->client,"NODE: what node has ip %s ...\n",B->client->ip);
 		displayNodes(B->script,B->node);
 		*/
 
 		myNewNodeSlot=findNodeByIP(B->script, B->node, B->client->ip);
 
 		if(myNewNodeSlot>=0){
-			B->client->ptr+=sprintf(B->client->ptr,"NODE: found [%d] already active\n",myNewNodeSlot);
+			client_printf(B->client,"NODE: found [%d] already active\n",myNewNodeSlot);
 			connectNodeToReplica(&(B->script->replica[replicaN[0]].nodeSlot),myNewNodeSlot);
 		}else{
-			B->client->ptr+=sprintf(B->client->ptr,"NODE: didn't find one already active\n");
+			client_printf(B->client,"NODE: didn't find one already active\n");
 			// it's a new node
 			myNewNodeSlot = findInactiveNodeSlot(B->script, B->node);
 			if(myNewNodeSlot<0){
-				B->client->ptr+=sprintf(B->client->ptr,"NODE: can't find an inactive, dropping this client\n");
+				client_printf(B->client,"NODE: can't find an inactive, dropping this client\n");
 				client_status=Error;
 				break;
 			}
-			B->client->ptr+=sprintf(B->client->ptr,"NODE: picked up inactive node %d\n",myNewNodeSlot);
+			client_printf(B->client,"NODE: picked up inactive node %d\n",myNewNodeSlot);
 			obtainNode(&(B->node[myNewNodeSlot]),&(B->script->replica[replicaN[0]].nodeSlot),B->client->ip,myNewNodeSlot,(int)*((float*)(tcs->data)));
 		}
 
@@ -2458,7 +4497,7 @@ void *client_interaction(struct client_bundle *B){
 
 		//Again, this next check is only based on the first nni and we only use the restart for this first nni
 		if(node_just_reanimated || (replicaN[0]!=old_replicaN[0] && current_replica[0].sequence_number>0)){
-			copy_restart_data(&current_replica[0].restart,&(B->script->replica[replicaN[0]].restart));
+			copy_restart=true;
 		}
 		break;
 	} // end swtich
@@ -2483,6 +4522,20 @@ void *client_interaction(struct client_bundle *B){
 	
 	pthread_mutex_unlock(&replica_mutex);
 
+	// this client owns replicaN[0] (status 'R') so only a snapshot can touch its restart data in the meantime
+	if(copy_restart && client_status!=Error){
+		lock_replica_data(replicaN[0]);
+		send_restart=restart_store_share(replica_restart[replicaN[0]]);
+		unlock_replica_data(replicaN[0]);
+	}
+	if(commit_coordinates){
+		for(nni=0;nni<B->script->Nsamesystem_uncoupled;nni++){
+			if(coordinate[nni].data!=NULL) commit_coordinate_data(save_sample_data_replicaN[nni],save_sample_data_sequence_number[nni],bin[nni],&coordinate[nni],B->script,B->var);
+		}
+	}
+	restart_store_release(retired_restart);
+	restart_store_release(stored_restart);
+
 	for(nni=0;nni<B->script->Nsamesystem_uncoupled;nni++){
 		printf("freeing energy: pointer before is: %p\n",energy[nni].data);  //##DEBUG
 		delete[] energy[nni].data;
@@ -2496,14 +4549,19 @@ void *client_interaction(struct client_bundle *B){
 	if(client_status!=Error){
 		//only send the replica ID of the first nni
 		send_replica_ID(B->client->fd, replicaN[0], current_replica[0].sequence_number,B->opt);
-		B->client->ptr+=sprintf(B->client->ptr,"Replica ID sent: %2sw%d.%u",B->opt->title,replicaN[0],current_replica[0].sequence_number);
+		client_printf(B->client,"Replica ID sent: %2sw%d.%u",B->opt->title,replicaN[0],current_replica[0].sequence_number);
 		//only send the restart of the first nni
-		if(current_replica[0].restart.data!=NULL){
-			send_restart_file(B->client->fd, current_replica[0].restart);
-			B->client->ptr+=sprintf(B->client->ptr,", restart file sent");
+		if(send_restart!=NULL){
+			if(delta_base!=NULL) delta_size=send_restart_delta(B->client->fd, send_restart, delta_base, &held_restart);
+			if(delta_size>0){
+				client_printf(B->client,", restart file sent as a delta of %u bytes",delta_size);
+			}else{
+				send_restart_file(B->client->fd, send_restart);
+				client_printf(B->client,", restart file sent");
+			}
 		}
 		
-		B->client->ptr[0]='\n'; B->client->ptr++;
+		client_printf(B->client,"\n");
 		for(nni=0;nni<B->script->Nsamesystem_uncoupled;nni++){
 			B->script->replica[replicaN[nni]].start_time_on_current_node=B->script->replica[replicaN[nni]].last_activity_time=time(NULL);
 		}
@@ -2533,42 +4591,39 @@ void *client_interaction(struct client_bundle *B){
 						 * int z;
 						 * float *p;
 						 * p=(float *)additional_data[ai].data;
-						 * B->client->ptr+=sprintf(B->client->ptr,"CN INFO\n");
+						 * client_printf(B->client,"CN INFO\n");
 						 * for(z=0; z<41; z++){
-						 * 	B->client->ptr+=sprintf(B->client->ptr,"%d\t%d\t%f\n",ai,z,p[z]);
+						 * 	client_printf(B->client,"%d\t%d\t%f\n",ai,z,p[z]);
 						 * }
 						 */
 					}else{
-						B->client->ptr+=sprintf(B->client->ptr,"Error: additional_data[%d][%d].data==NULL\n",nni,ai);
+						client_error_printf(B->client,"Error: additional_data[%d][%d].data==NULL\n",nni,ai);
 					}
 				}
-				force_database->write_record();
+				queue_database_record();
 			}
 		}
 		pthread_mutex_unlock(&database_mutex);
 		if(B->opt->verbose){
-			B->client->ptr+=sprintf(B->client->ptr,"Sample data saved to database\n");
+			client_printf(B->client,"Sample data saved to database\n");
 		}
 	}else{
 		if(B->opt->verbose){
 			if(newConnection){
-				B->client->ptr+=sprintf(B->client->ptr,"Sample data NOT saved to database -- it's a new connection so there is no data\n");
+				client_printf(B->client,"Sample data NOT saved to database -- it's a new connection so there is no data\n");
 			}else if (node_just_reanimated){
-				B->client->ptr+=sprintf(B->client->ptr,"Sample data NOT saved to database -- unexpected client (being resurected)\n");
+				client_printf(B->client,"Sample data NOT saved to database -- unexpected client (being resurected)\n");
 			}else if (unexpectedClient){
-				B->client->ptr+=sprintf(B->client->ptr,"Sample data NOT saved to database -- unexpected client (being released)\n");
+				client_printf(B->client,"Sample data NOT saved to database -- unexpected client (being released)\n");
 			}else{
-				B->client->ptr+=sprintf(B->client->ptr,"Sample data NOT saved to database -- message passing for Mobile server instead\n");
+				client_printf(B->client,"Sample data NOT saved to database -- message passing for Mobile server instead\n");
 			}
 		}
 	}
 
-
+	restart_store_release(send_restart);
+	restart_store_release(delta_base);
 	for(nni=0;nni<B->script->Nsamesystem_uncoupled;nni++){	
-		printf("freeing restart: pointer before is: %p\n",current_replica[nni].restart.data);  //##DEBUG
-		delete[] current_replica[nni].restart.data;
-		printf("freeing restart: pointer after is: %p\n",current_replica[nni].restart.data);  //##DEBUG
-
 		printf("freeing sample: pointer before is: %p\n",sample[nni].data);  //##DEBUG
 		delete[] sample[nni].data;
 		printf("freeing sample: pointer after is: %p\n",sample[nni].data);   //##DEBUG
@@ -2596,10 +4651,11 @@ void *client_interaction(struct client_bundle *B){
 
 	struct timeval t;
 	gettimeofday(&t,NULL);
-	B->client->ptr+=sprintf(B->client->ptr,"-  - --- Client interaction ends; time elapsed is %ld ms -------------------------------- -  -\n",(t.tv_sec-B->client->time.tv_sec)*1000+(t.tv_usec-B->client->time.tv_usec)/1000);
+	client_printf(B->client,"-  - --- Client interaction ends; time elapsed is %ld ms -------------------------------- -  -\n",(t.tv_sec-B->client->time.tv_sec)*1000+(t.tv_usec-B->client->time.tv_usec)/1000);
 	
-	append_log_entry(B->client->fd, B->client->log);
+	log_client_entry(B->client->fd,B->client);
 	
+	free(B->client->in);
 	delete B->client;
 	change_number_of_connected_clients(-1,B->var);
 	// B was created in the calling function
@@ -2608,14 +4664,198 @@ void *client_interaction(struct client_bundle *B){
 	return(NULL);
 }
 
-// This runs as a thread and simply listens on the port for incoming client connections
-// when a client connects, a thread is created for the new client and then this begins listening again on the port for further clients
+// Frames whatever has arrived from the client so far (see DR_protocol.h). Returns 1 once the client has sent
+// everything it will send before waiting for our reply, or once the stream can no longer be framed. In either
+// case client_interaction() then takes over and makes all of the real decisions, exactly as if it were reading the socket.
+unsigned char client_request_complete(struct client_struct *client, const struct script_struct *script){
+	unsigned int p=client->in_parsed;
+	unsigned int header=KEY_SIZE+COMMAND_SIZE;
+	unsigned int protocol_version;
+	enum command_enum command;
+	struct ID_struct ID;
+	int file_size;
+
+	if(!client->version_checked){
+		if(client->in_size<PROTOCOL_VERSION_SIZE) return(0);
+		memcpy(&protocol_version,client->in,PROTOCOL_VERSION_SIZE);
+		if(protocol_version!=PROTOCOL_VERSION) return(1);
+		client->version_checked=true;
+		p=client->in_parsed=PROTOCOL_VERSION_SIZE;
+	}
+
+	while(client->in_size-p>=header){
+		if( strncmp((char*)client->in+p+KEY_LOCATION,COMMAND_KEY,KEY_SIZE)!=0 && 
+		    strncmp((char*)client->in+p+KEY_LOCATION,COMMAND_KEY2,KEY_SIZE)!=0 ) return(1);
+		command=(enum command_enum)client->in[p+COMMAND_LOCATION];
+		switch(command)
+		{
+		case ReplicaID:
+			if(client->in_size-p<header+sizeof(ID)) return(0);
+			memcpy(&ID,client->in+p+header,sizeof(ID));
+			if(strncmp(ID.title,"**",2)==0) return(1);    // a new node sends nothing after its ID
+			p+=header+sizeof(ID);
+			break;
+		case TakeThisFile:
+		case TakeRestartFile:
+		case TakeSampleData:
+		case TakeMoveEnergyData:
+		case TakeSimulationParameters:
+		case TakeCoordinateData:
+		case TakeTCS:
+		case TakeJID:
+		case HaveRestart:
+			if(client->in_size-p<header+sizeof(file_size)) return(0);
+			memcpy(&file_size,client->in+p+header,sizeof(file_size));
+			if(file_size<0) return(1);
+			if(client->in_size-p<header+sizeof(file_size)+file_size){
+				// make sure the whole file fits so that the next read can take all of it
+				unsigned int need=p+header+sizeof(file_size)+file_size;
+				if(need>client->in_allocated){
+					unsigned char *in=(unsigned char *)realloc(client->in,need);
+					if(in==NULL) return(1);
+					client->in=in;
+					client->in_allocated=need;
+				}
+				client->in_parsed=p;
+				return(0);
+			}
+			p+=header+sizeof(file_size)+file_size;
+			if(command==TakeRestartFile && ++client->nni_received>=script->Nsamesystem_uncoupled) return(1);
+			break;
+		case NextNonInteracting:
+			p+=header;
+			if(++client->nni_received>=script->Nsamesystem_uncoupled) return(1);
+			break;
+		case LogLevel:
+			// the level follows the command; it ends the conversation like Exit and Snapshot
+			if(client->in_size-p<header+sizeof(int)) return(0);
+			return(1);
+		default:
+			// Exit, Snapshot and anything unknown end the conversation
+			return(1);
+		}
+	}
+	client->in_parsed=p;
+	return(0);
+}
+
+// Reads everything that is currently available on a non-blocking client socket into client->in
+// returns 0 if the client is still sending, 1 if it has hung up or the read failed
+unsigned char fill_client_buffer(struct client_struct *client){
+	int Nread;
+
+	while(1){
+		if(client->in_size==client->in_allocated){
+			unsigned char *in=(unsigned char *)realloc(client->in,client->in_allocated*2);
+			if(in==NULL) return(1);
+			client->in=in;
+			client->in_allocated*=2;
+		}
+		Nread=read(client->fd,client->in+client->in_size,client->in_allocated-client->in_size);
+		if(Nread>0){
+			client->in_size+=Nread;
+			client->last_activity=time(NULL);
+		}else if(Nread<0 && errno==EINTR){
+			continue;
+		}else if(Nread<0 && (errno==EAGAIN || errno==EWOULDBLOCK)){
+			return(0);
+		}else{
+			return(1);
+		}
+	}
+}
+
+// Each worker takes fully received clients from the queue and runs client_interaction() on them
+void *client_worker(void *arg){
+	struct client_bundle *B;
+
+	while(1){
+		pthread_mutex_lock(&client_queue_mutex);
+		if(client_queue_head==NULL && Nclient_workers-Nclient_workers_parked>CLIENT_WORKER_THREADS){
+			// started for a stall that is over
+			Nclient_workers--;
+			pthread_mutex_unlock(&client_queue_mutex);
+			return(NULL);
+		}
+		while(client_queue_head==NULL) pthread_cond_wait(&client_queue_cond,&client_queue_mutex);
+		B=client_queue_head;
+		client_queue_head=B->next;
+		if(client_queue_head==NULL) client_queue_tail=NULL;
+		pthread_mutex_unlock(&client_queue_mutex);
+
+		client_interaction(B);
+	}
+	return(NULL);
+}
+
+int start_client_worker(void){
+	pthread_t worker_handle;
+
+	if(pthread_create(&worker_handle,NULL,client_worker,NULL)!=0){
+		error_warning("pthread_create failed for a client worker in DR_server");
+		return(1);
+	}
+	if(pthread_detach(worker_handle)!=0){
+		error_warning("pthread_detach failed for a client worker");
+	}
+	pthread_mutex_lock(&client_queue_mutex);
+	Nclient_workers++;
+	pthread_mutex_unlock(&client_queue_mutex);
+	return(0);
+}
+
+// Whether the oldest queued client has waited long enough for one more worker, and the pool may have one;
+// Nfree gets the number of workers that are not parked in drop_one_old_node()
+bool client_queue_stalled(time_t now, int *Nfree){
+	bool stalled;
+
+	pthread_mutex_lock(&client_queue_mutex);
+	stalled=(client_queue_head!=NULL && now-client_queue_head->client->last_activity>=CLIENT_QUEUE_STALL_SECONDS);
+	*Nfree=Nclient_workers-Nclient_workers_parked;
+	pthread_mutex_unlock(&client_queue_mutex);
+	return(stalled && *Nfree<CLIENT_WORKER_THREADS_MAX);
+}
+
+// Stops watching the client and passes it to the worker pool. The socket goes back to blocking for the reply.
+void queue_client_for_interaction(int epoll_fd, struct client_bundle **pending, struct client_bundle *B){
+	int flags;
+
+	epoll_ctl(epoll_fd,EPOLL_CTL_DEL,B->client->fd,NULL);
+	flags=fcntl(B->client->fd,F_GETFL,0);
+	fcntl(B->client->fd,F_SETFL,flags&~O_NONBLOCK);
+
+	if(B->prev!=NULL) B->prev->next=B->next;
+	else              *pending=B->next;
+	if(B->next!=NULL) B->next->prev=B->prev;
+
+	B->client->last_activity=time(NULL);
+	B->prev=B->next=NULL;
+	pthread_mutex_lock(&client_queue_mutex);
+	if(client_queue_tail==NULL) client_queue_head=B;
+	else                        client_queue_tail->next=B;
+	client_queue_tail=B;
+	pthread_cond_signal(&client_queue_cond);
+	pthread_mutex_unlock(&client_queue_mutex);
+}
+
+// This runs as a thread and is the only thread that touches clients until they have sent everything.
+// New connections and client data are multiplexed with epoll; a client whose request is complete
+// (or which hung up, failed or timed out) is queued for the client_worker() pool.
 void *wait_for_clients(struct client_bundle *B){
 	struct sockaddr_in serv_addr;
 	struct sockaddr_in client_addr;
+	struct epoll_event ev;
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+	struct client_bundle *pending=NULL;
+	struct client_bundle *Blocal;
+	struct client_bundle *Bnext;
 	int server_sockfd;
-	pthread_t server_handle;
-	int pthread_failure=0;
+	int epoll_fd;
+	int Nevents;
+	int i,w;
+	int Nworkers;
+	time_t last_scan=0;
+	char message[MESSAGE_GLOBALVAR_LENGTH];
 
 	signal(SIGPIPE, SIG_IGN);
 
@@ -2624,63 +4864,107 @@ void *wait_for_clients(struct client_bundle *B){
 	serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
 	serv_addr.sin_port = htons(B->script->port);
 	if(bind(server_sockfd, (sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) error_quit("cannot bind socket");
-	if(listen(server_sockfd,100)<0) error_quit("cannot listen to socket");
+	if(listen(server_sockfd,SOMAXCONN)<0) error_quit("cannot listen to socket");
+	fcntl(server_sockfd,F_SETFL,fcntl(server_sockfd,F_GETFL,0)|O_NONBLOCK);
 
-	append_log_entry(-1,"Waiting for clients to connect...\n");
-	while(B->var->simulation_status!=Finished){
-		int len;
-		int client_sockfd;
-		unsigned int Nmoves=0;
+	if((epoll_fd=epoll_create(EPOLL_MAX_EVENTS))<0) error_quit("cannot create epoll instance");
+	ev.events=EPOLLIN;
+	ev.data.ptr=NULL;  // NULL marks the listening socket
+	if(epoll_ctl(epoll_fd,EPOLL_CTL_ADD,server_sockfd,&ev)<0) error_quit("cannot add listening socket to epoll");
 
-		len = sizeof(client_addr);
-		client_sockfd = accept(server_sockfd,(sockaddr *)&client_addr,(socklen_t *)&len);
+	for(w=0;w<CLIENT_WORKER_THREADS;w++){
+		if(start_client_worker()!=0) error_quit("unable to start the client worker threads");
+	}
 
+	append_log_entry(-1,"Waiting for clients to connect...\n");
+	while(B->var->simulation_status!=Finished){
+		Nevents=epoll_wait(epoll_fd,events,EPOLL_MAX_EVENTS,1000);
+		if(Nevents<0){
+			if(errno==EINTR) continue;
+			error_quit("epoll_wait failed in wait_for_clients()");
+		}
 		printf("simulation_status=%d\n",(int)B->var->simulation_status); //##DEBUG
-		if(B->var->simulation_status!=Finished){
-			printf("About to allocate memory\n"); //##DEBUG
-			struct client_struct* client_data=new struct client_struct;
-
-			printf("Allocated memory for client\n"); //##DEBUG
-
-			client_data->fd=client_sockfd;
-			gettimeofday(&client_data->time,NULL);
-			client_data->ptr=client_data->log;
-
-			printf("Added time of day to the clock\n"); //##DEBUG
-
-			change_number_of_connected_clients(+1,B->var);
-
-			printf("Number of connected clients increased\n"); //##DEBUG
-
-			sprintf(client_data->ip,"%s",inet_ntoa(client_addr.sin_addr));
-			client_data->ptr+=sprintf(client_data->ptr,"-  - --- Client has connected from IP address %s --- -  -\n",client_data->ip);
-
-			printf("Client has connected\n"); //##DEBUG
-
-			struct client_bundle* Blocal=new struct client_bundle;
-			Blocal->client=client_data;
-			Blocal->opt=B->opt;
-			Blocal->var=B->var;
-			Blocal->script=B->script;
-			Blocal->node=B->node;
-			//client_interaction() will delete Blocal
-			pthread_failure=0;
-			if(pthread_create(&server_handle,NULL, (void* (*)(void*))client_interaction, Blocal)!=0){
-				error_warning("pthread_create failed in DR_server");
-				pthread_failure=1;
+		if(B->var->simulation_status==Finished) break;
+
+		for(i=0;i<Nevents;i++){
+			if(events[i].data.ptr==NULL){
+				// accept everything that is waiting
+				while(1){
+					int len;
+					int client_sockfd;
+
+					len = sizeof(client_addr);
+					client_sockfd = accept(server_sockfd,(sockaddr *)&client_addr,(socklen_t *)&len);
+					if(client_sockfd<0) break;
+
+					struct client_struct* client_data=new struct client_struct;
+					client_data->fd=client_sockfd;
+					gettimeofday(&client_data->time,NULL);
+					acquire_client_log(client_data);
+					// room for a restart file from the start, so that it is not copied again as the buffer grows
+					client_data->in_allocated=CLIENT_INPUT_CHUNK+largest_restart_size;
+					client_data->in=(unsigned char *)malloc(client_data->in_allocated);
+					if(client_data->in==NULL) client_data->in_allocated=0;
+					client_data->in_size=client_data->in_read=client_data->in_parsed=0;
+					client_data->version_checked=false;
+					client_data->nni_received=0;
+					client_data->last_activity=time(NULL);
+
+					change_number_of_connected_clients(+1,B->var);
+
+					sprintf(client_data->ip,"%s",inet_ntoa(client_addr.sin_addr));
+					client_printf(client_data,"-  - --- Client has connected from IP address %s --- -  -\n",client_data->ip);
+
+					printf("Client has connected\n"); //##DEBUG
+
+					Blocal=new struct client_bundle;
+					Blocal->client=client_data;
+					Blocal->opt=B->opt;
+					Blocal->var=B->var;
+					Blocal->script=B->script;
+					Blocal->node=B->node;
+					Blocal->prev=NULL;
+					Blocal->next=pending;
+					if(pending!=NULL) pending->prev=Blocal;
+					pending=Blocal;
+					//client_interaction() will delete Blocal
+
+					fcntl(client_sockfd,F_SETFL,fcntl(client_sockfd,F_GETFL,0)|O_NONBLOCK);
+					size_client_socket(client_sockfd);
+					ev.events=EPOLLIN|EPOLLRDHUP;
+					ev.data.ptr=Blocal;
+					if(client_data->in==NULL || epoll_ctl(epoll_fd,EPOLL_CTL_ADD,client_sockfd,&ev)<0){
+						client_error_printf(client_data,"*** Client interaction from IP address %s aborted... unable to watch the connection.\n",client_data->ip);
+						queue_client_for_interaction(epoll_fd,&pending,Blocal);
+					}
+				}
 			}else{
-				if(pthread_detach(server_handle)!=0){
-					error_warning("pthread_detach failed");
-					pthread_failure=1;
+				Blocal=(struct client_bundle *)events[i].data.ptr;
+				if(fill_client_buffer(Blocal->client) || client_request_complete(Blocal->client,Blocal->script)){
+					queue_client_for_interaction(epoll_fd,&pending,Blocal);
+				}
+			}
+		}
+
+		if(time(NULL)-last_scan>=1){
+			last_scan=time(NULL);
+			for(Blocal=pending;Blocal!=NULL;Blocal=Bnext){
+				Bnext=Blocal->next;
+				if(last_scan-Blocal->client->last_activity>=CLIENT_IDLE_TIMEOUT_SECONDS){
+					client_printf(Blocal->client,"Client was idle for %d seconds\n",CLIENT_IDLE_TIMEOUT_SECONDS);
+					queue_client_for_interaction(epoll_fd,&pending,Blocal);
 				}
 			}
-			if(pthread_failure){
-				client_data->ptr+=sprintf(client_data->ptr,"*** Client interaction from IP address %s aborted... no thread for client_interaction().\n", inet_ntoa(client_addr.sin_addr));
+			// workers that block (drop_one_old_node() waits on another client) must not starve the queue
+			if(client_queue_stalled(last_scan,&Nworkers) && start_client_worker()==0){
+				sprintf(message,"Client queue stalled; the worker pool now has %d free threads\n",Nworkers+1);
+				append_log_entry(-1,message);
 			}
 		}
 	}
 	printf("server_sockfd is %d\n",server_sockfd);  //##DEBUG
 	close(server_sockfd);
+	close(epoll_fd);
 
 	return(NULL);
 }
@@ -2743,8 +5027,14 @@ void print_simulation_details(const struct script_struct *script, const struct s
 		append_log_entry(-1,message);
 		sprintf(message,"Virtual Replica Exchange (vRE) moves will not be recorded for the first %ld steps, we assume because you think that the starting structures are not properly equilibrated.\n",script->vRE_initial_noSave);
 		append_log_entry(-1,message);
-		sprintf(message,"Virtual Replica Exchange (vRE) secondary list has a length of %ld values at each nominal position.\n",script->vRE_secvre_size);
+		sprintf(message,"Virtual Replica Exchange (vRE) secondary list has a length of %ld values at each nominal position.\n",actual_numsaves_secondary);
 		append_log_entry(-1,message);
+		sprintf(message,"Virtual Replica Exchange (vRE) primary list holds up to %ld values at each nominal position; when it is full, new values are %s.\n",actual_numsaves_primary,(vre_eviction==EvictRandom)?"written over a random stored value":"dropped");
+		append_log_entry(-1,message);
+		if(vre_memory_limit>=0){
+			sprintf(message,"Virtual Replica Exchange (vRE) lists will use at most %ld MB in total.\n",vre_memory_limit/(1024*1024));
+			append_log_entry(-1,message);
+		}
 	}
 	sprintf(message,"A Node will be occupied for a maximum of %d seconds\n",script->node_time);
 	append_log_entry(-1,message);
@@ -2850,11 +5140,12 @@ void showUserResponsibility(const char *c){
 }
 
 void showUsage(const char *c){
-	fprintf(stderr,"Usage: %s tt.script [-stdv]\n",c);
+	fprintf(stderr,"Usage: %s tt.script [-stdvl]\n",c);
 	fprintf(stderr,"       -s [string] to restart from a snapshot (e.g. tt.283429.snapshot)\n");
 	fprintf(stderr,"       -t [integer] time server node started (for the mobile server)\n");
 	fprintf(stderr,"       -d [string] directory in which to put the log file (e.g. /dev/shm)\n");
 	fprintf(stderr,"       -v [integer] non-zero to have a more verbose log file\n");
+	fprintf(stderr,"       -l [integer] log level: 0 errors only, 1 no per-move details, 2 everything (default)\n");
 	fflush(stderr);
 }
 
@@ -2865,6 +5156,7 @@ int parseCommandLine(int argc, char * const argv[], struct server_option_struct
 	int gott=0;
 	int gotd=0;
 	int gotv=0;
+	int gotl=0;
 
 	if( (argc<2) ){
 		fprintf(stderr,"Error: the script filename was not provided\n");
@@ -2940,6 +5232,16 @@ int parseCommandLine(int argc, char * const argv[], struct server_option_struct
                         }
                         sscanf(argv[i],"%d",&(opt->verbose));
                         gotv=1;
+		}else if(argv[i-1][1]=='l'){
+			if(gotl){
+				fprintf(stderr,"Error: argument %s given multiple times.\n",argv[i-1]);
+				return 1;
+			}
+			if(sscanf(argv[i],"%d",&(opt->log_level))!=1 || opt->log_level<LogErrors || opt->log_level>LogMoves){
+				fprintf(stderr,"Error: the log level must be %d, %d or %d.\n",LogErrors,LogNormal,LogMoves);
+				return 1;
+			}
+			gotl=1;
 		}else{
 			fprintf(stderr,"Error: incorrect command line format. Command %s not understood.\n",argv[i-1]);
 			return 1;
@@ -2963,7 +5265,7 @@ int defineStartingPositions(struct script_struct *script){
 	ssf=fopen(DEFINED_START_POS_FILE,"r");
 	if(ssf==NULL){
 		sprintf(message,"Error: unable to open file %s in your working directory. You spedified DEFINE_STARTING_POSITIONS in the script file, so this file must exist.\n", DEFINED_START_POS_FILE);
-		append_log_entry(-1,message);
+		append_error_entry(-1,message);
 		return 1;
 	}
 	ssi=0;
@@ -2971,10 +5273,10 @@ int defineStartingPositions(struct script_struct *script){
 		if(ssi>=script->Nreplicas||sscanf(linein,"%d",&(ssray[ssi]))!=1){
 			if(ssi>=script->Nreplicas){
 				sprintf(message,"Error: Too many values in %s\n",DEFINED_START_POS_FILE);
-				append_log_entry(-1,message);
+				append_error_entry(-1,message);
 			}else{
 				sprintf(message,"Error: could not find value in %s -- could there be an empty or non-numeric line?\n",DEFINED_START_POS_FILE);
-				append_log_entry(-1,message);
+				append_error_entry(-1,message);
 			}
 			fclose(ssf);
 			free(ssray);
@@ -2985,7 +5287,7 @@ int defineStartingPositions(struct script_struct *script){
 	fclose(ssf);
 	if(ssi!=script->Nreplicas){
 		sprintf(message,"Error: Not enough values in %s\n",DEFINED_START_POS_FILE);
-		 append_log_entry(-1,message);
+		 append_error_entry(-1,message);
 	}
 	for(ssi=0;ssi<script->Nreplicas;ssi++){
 		script->replica[ssi].w=script->replica[ssray[ssi]].w_nominal;
@@ -3030,6 +5332,7 @@ int findClientForServer(struct script_struct *script, struct server_variable_str
 
 	// save a snapshot and call the forcedatabase destructor -- this will close it so that the new server can safely open it
 	snapshotname=save_snapshot(script,var,opt);
+	stop_database_writer();
 	delete force_database;
 
 	// send one node a message to become a new server and also sent it the name of the snapshot that it should use
@@ -3138,17 +5441,31 @@ int main(int argc, char *argv[]){
 
 	int s=time(NULL);
 	srand48(s);
+	crc32c_init();
+	restart_store_init();
+	allocate_replica_restarts(&script);
 	sprintf(message,"Seeding random number generator with %d\n",s);
 	append_log_entry(-1,message);
 
 	pthread_mutex_init(&replica_mutex,NULL);
+	for(i=0;i<REPLICA_DATA_LOCK_SHARDS;i++) pthread_mutex_init(&replica_data_mutex[i],NULL);
+	pthread_mutex_init(&snapshot_mutex,NULL);
+	pthread_cond_init(&snapshot_cond,NULL);
 	pthread_mutex_init(&log_mutex,NULL);
+	pthread_mutex_init(&client_log_pool_mutex,NULL);
+	log_level=opt.log_level;
+	start_log_writer();
 	pthread_mutex_init(&queue_mutex,NULL);
 	pthread_mutex_init(&database_mutex,NULL);
-	pthread_mutex_init(&vre_mutex,NULL);
+	pthread_mutex_init(&client_queue_mutex,NULL);
+	pthread_cond_init(&client_queue_cond,NULL);
 
 	if(script.replica_move_type==vRE){
 		set_secvre_size(script.vRE_secvre_size); //must be called before allocateVRE()
+		set_vre_size(script.vRE_primary_size);
+		set_vre_memory_limit(script.vRE_memory_limit);
+		set_vre_eviction(script.vRE_evict_random?EvictRandom:DropNewest);
+		set_vre_seed(s);
 		if(allocateVRE(script.Nreplicas,-1)!=0){
 			error_quit("unable to allocate memory for vRE structure\n");
 		}
@@ -3172,17 +5489,27 @@ int main(int argc, char *argv[]){
 	if(opt.loadSnapshot){
 		load_snapshot(opt.snapshotName,&script,&var);
 		printf("Snapshot loaded\n"); //##DEBUG
+		for(i=0;i<script.Nreplicas;i++){
+			note_restart_size(script.replica[i].restart.data_size);
+		}
 	}
 
 	for(tempi=0;tempi<script.Nreplicas; tempi++){
 		script.replica[tempi].cancellation_energy=temp[tempi];
 	}
 
+	// the snapshot carries its own w_nominal, so the grid can only be built now
+	allocate_nominal_grid(&nominal_grid,script.Nreplicas);
+	for(i=0;i<script.Nreplicas;i++){
+		nominal_grid.w[i]=script.replica[i].w_nominal;
+	}
+	index_nominal_grid(&nominal_grid);
+
 	struct client_struct *client=new client_struct;
-	client->ptr=client->log;
-	client->ptr+=sprintf(client->ptr,"Doing an initial check to see which replicas should be suspended...\n");
+	acquire_client_log(client);
+	client_printf(client,"Doing an initial check to see which replicas should be suspended...\n");
 	check_termination_conditions(client,&script,&var,&opt);
-	append_log_entry(-1,client->log);
+	log_client_entry(-1,client);
 	delete client;
 
 	force_database=new force_database_class(opt.title,0);
@@ -3196,14 +5523,25 @@ int main(int argc, char *argv[]){
 	db.Nenergies=0;
 	db.Nadditional_data=script.Nadditional_data;
 
+	if(force_database->is_columnar()) error_quit("the force database is in the columnar format; convert it back to rows with convert_force_database -r first");
 	if(!force_database->set_header_information(&db)) error_quit("the force database header has inapropriate parameters");
+	// a crash can leave records beyond the count in the header, or part of a record at the end
+	tempi=force_database->recover_number_of_records();
+	if((unsigned int)tempi!=force_database->get_number_of_records()){
+		sprintf(message,"ERROR error Error: the force database header counted %u records but the file holds %u complete records; using %u\n",(unsigned int)tempi,force_database->get_number_of_records(),force_database->get_number_of_records());
+		append_error_entry(-1,message);
+	}
+	force_database->open_index();
+	start_database_writer(&script);
 
 	sprintf(message,"The database file has been successfully opened or created: number of records: %u; number of ligands: %hhu; number of samples per run: %u; number of energy data per run: %u; number of additional data types: %u\n",force_database->get_number_of_records(),db.Nligands,db.Nforces,db.Nenergies,db.Nadditional_data);
 	append_log_entry(-1,message);
 
+	allocate_cancellation_wham(&script);
+	allocate_cancellation_rounds(&script);
 	if(script.cancellation_threshold>0){
 		var.energy_cancellation_status=Pending;
-		conditionally_activate_energy_cancellation(&script,&var);
+		if(!cancellation_wham.active && cancellation_rounds.round==0) conditionally_activate_energy_cancellation(&script,&var);
 		if(var.energy_cancellation_status==Active){
 			append_log_entry(-1,"The energy cancellation feature has been activated; please stand by for a summary\n");
 			if(var.simulation_status==Finished){
@@ -3216,6 +5554,17 @@ int main(int argc, char *argv[]){
 	for(tempi=0;tempi<script.Nreplicas; tempi++){
 		script.replica[tempi].cancellation_energy=temp[tempi];
 	}
+	// the energies that earlier cancellation rounds adopted survive a restart, unless the script gives its own
+	if(cancellation_rounds.round>0){
+		if(!script.loadedCancel){
+			for(tempi=0;tempi<script.Nreplicas; tempi++){
+				script.replica[tempi].cancellation_energy=cancellation_rounds.energy[tempi];
+			}
+		}
+		var.energy_cancellation_status=Active;
+		script.replica_potential_scalar1=script.replica_potential_scalar1_after_threshold;
+		script.replica_potential_scalar2=script.replica_potential_scalar2_after_threshold;
+	}
 
 	if(script.loadedCancel){
 		print_energy_cancellation_summary(&script,&var);
@@ -3261,12 +5610,15 @@ int main(int argc, char *argv[]){
 		start_time=this_server_start_time;
 	}
 
+	allocate_snapshot(&script);
+
 	struct client_bundle* B=new struct client_bundle;
 	B->client=(struct client_struct *)NULL;
 	B->opt=&opt;
 	B->var=&var;
 	B->script=&script;
 	B->node=node;
+	start_cancellation_solver(B);
 	if(pthread_create(&server_handle,NULL,(void* (*)(void*))wait_for_clients,B)!=0){
 		error_quit("pthread_create failed in DR_server Main. This is a top level error, simply try restarting your server.");
 	}
@@ -3318,15 +5670,18 @@ int main(int argc, char *argv[]){
 			var.save_snapshot_now=true;
 		}
 		if(var.save_snapshot_now){
+			// if the previous snapshot is still being written, try again on the next pass
 			pthread_mutex_lock(&replica_mutex);
-			save_snapshot(&script,&var,&opt);
+			if(start_background_snapshot(&script,&var,&opt)) var.save_snapshot_now=false;
 			pthread_mutex_unlock(&replica_mutex);
-			var.save_snapshot_now=false;
 		}
+		// the cancellation energies are changed under the replica_mutex, by clients or the cancellation_solver()
+		pthread_mutex_lock(&replica_mutex);
 		if(var.energy_cancellation_status==Active){
 			print_energy_cancellation_summary(&script,&var);
 			var.energy_cancellation_status=Active_and_Printed;
 		}
+		pthread_mutex_unlock(&replica_mutex);
 		if(script.allotted_time_for_server>0 && (time(NULL)-start_time>script.allotted_time_for_server)){
 			var.simulation_status=AllottedTimeOver;
 			sprintf(message,"Allotted server simulation time of %u seconds has been consumed. The run will now save a snapshot and exit\n",script.allotted_time_for_server);
@@ -3345,7 +5700,7 @@ int main(int argc, char *argv[]){
 		if(script.submit_jobs==true && var.nfailedsubinarow>MAX_FAILURES_FOR_SUBMISSION){
 			script.submit_jobs=false;
 			sprintf(message,"ERROR error Error: failed to submit a new client %d times in a row. Turning off submission.\n",MAX_FAILURES_FOR_SUBMISSION);
-			append_log_entry(-1,message);
+			append_error_entry(-1,message);
 		}
 
 		if(time(NULL)-last_node_display>=NODE_DISPLAY_SECONDS){
@@ -3358,24 +5713,32 @@ int main(int argc, char *argv[]){
 	}
 
 //	pthread_cancel(server_handle);
+	stop_cancellation_solver();
 
 	if(!skipFinalSnapshot){
 		pthread_mutex_lock(&replica_mutex);
 		save_snapshot(&script,&var,&opt);
 		pthread_mutex_unlock(&replica_mutex);
+		stop_database_writer();
 		delete force_database;
 	}
 
 	delete B;
+	free_snapshot();
+	free_cancellation_wham();
+	free_cancellation_rounds();
 	free_all_replicas(&script);
 
 	append_log_entry(-1,"======================- Session End -======================\n");
 
 	pthread_mutex_destroy(&replica_mutex);
+	pthread_mutex_destroy(&snapshot_mutex);
+	pthread_cond_destroy(&snapshot_cond);
+	stop_log_writer();
 	pthread_mutex_destroy(&log_mutex);
+	pthread_mutex_destroy(&client_log_pool_mutex);
 	pthread_mutex_destroy(&queue_mutex);
 	pthread_mutex_destroy(&database_mutex);
-	pthread_mutex_destroy(&vre_mutex);
 
 	return(0);
 }
@@ -43,19 +43,21 @@ using namespace std;
 #include <string.h>
 #include <math.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "force_database_class.h"
 #include "read_input_script_file.h"
+#include "nominal_grid.h"
+#include "wham.h"
 
 #define N_FORCE_POINTS 9  // this should be an odd number
 #define N_ENERGY_POINTS 101
 #define AVERAGING_WINDOW 10
 #define EQUILIBRATION_FRACTION 0.0 // this fraction of data is considered equilibration and is not taken into account in the average force calculation on page 1 and 2
-#define MAX_REPLICAS 1000
 #define MAX_FILENAME_LENGTH 30
-#define MAX_SEQUENCE_NUMBER 50000  //was 30000
 #define NUMVALUES 10  //number of values output to define the y-axis
 #define MAX_DATABASE_SIZE 2000000000
+#define FREE_ENERGY_BLOCKS 5  //the samples are split into this many blocks of sequence numbers for the WHAM/MBAR errors
 
 #define BOLTZMANN_CONSTANT (8.31451/4184.0)
 
@@ -159,8 +161,10 @@ struct analysis_option_struct{
 	int useExact;
 	float equilFraction;
 	int justwriteDatabase;
+	int Nthreads;
+	int freeEnergy;         //1 WHAM, 2 MBAR, 3 both
 };
-#define DEFAULT_ANALYSIS_OPTION_STRUCT {"",-1,0,1,"",0,0,1,1,0,1,1,EQUILIBRATION_FRACTION,0}
+#define DEFAULT_ANALYSIS_OPTION_STRUCT {"",-1,0,1,"",0,0,1,1,0,1,1,EQUILIBRATION_FRACTION,0,0,0}
 
 struct stats_struct{
 	unsigned int max_time;
@@ -172,7 +176,9 @@ struct stats_struct{
 
 struct nominal_struct{
 	float w[2];
+	float force;            //umbrella force constant from the FORCE column
 };
+struct nominal_grid_struct nominal_grid[2];   //index over nominal[].w[0] and nominal[].w[1]
 
 #if(N_FORCE_POINTS>(N_ENERGY_POINTS+AVERAGING_WINDOW))
 	#define GRAPH_ARRAY N_FORCE_POINTS
@@ -182,8 +188,8 @@ struct nominal_struct{
 
 struct graph_struct{
 	float w[2];
-	float replica_position[MAX_SEQUENCE_NUMBER];
-	float rc_position[MAX_SEQUENCE_NUMBER];
+	float *replica_position;        //[0 to max_sequence_number], rows of the matrix from allocate_positions()
+	float *rc_position;
 	double point[2][GRAPH_ARRAY];
 	double weight_sum[GRAPH_ARRAY];
 	double average[2];
@@ -191,6 +197,63 @@ struct graph_struct{
 	double samples;
 };
 
+// The plots that main() asks for each register an accumulator; run_analysis_pass() then makes one pass over
+// the sorted records. The records are cut into blocks of ANALYSIS_BLOCK_RECORDS and the threads take the blocks
+// in turn, each adding its block into its own analysis_part_struct. The parts are merged into the results
+// strictly in block order, so the floating point sums come out the same whatever the number of threads.
+#define ANALYSIS_BLOCK_RECORDS 32768
+#define ANALYSIS_MAX_THREADS 64
+
+struct analysis_pass_struct{
+	const struct database_struct *db;
+	const struct script_struct *script;
+	const struct analysis_option_struct *opt;
+	const struct nominal_struct *nominal;
+	struct stats_struct *stats;
+	struct graph_struct *graph;
+	unsigned int N_values_to_average;       //force samples per graph point
+	unsigned int Nsamples;                  //force samples per record, see samples_per_record()
+	int whichRC;
+	unsigned int equil_sequence_number;     //records before this are equilibration
+	unsigned int **sequenceDensity;
+	struct sampleDensity_struct *sampleDensity;
+	struct pmf_struct *pmf;
+	unsigned int whichData;
+	int have_sample_bounds;
+	float sample_min,sample_max;
+	int Nthreads;
+	struct umbrella_samples_struct *umbrella;
+};
+
+// The sampled values kept for WHAM and MBAR, in record order, with the window and the error block of each
+struct umbrella_samples_struct{
+	unsigned long N;
+	float *x;
+	int *window;
+	unsigned char *block;
+};
+
+// One thread's share of the results for the block it is working on; merged and cleared after every block
+struct analysis_part_struct{
+	double *weight_sum;             //[replica*N_FORCE_POINTS+time]
+	double *force_sum[2];           //weighted force, same layout as weight_sum
+	double *samples;                //[replica]
+	unsigned int *sequenceDensity;  //[replica*(Nreplicas+1)+bin]
+	unsigned int *sampleDensity;    //[replica*(sampleDensity->Ncol+1)+bin]
+	float *pmf_f;
+	unsigned int *pmf_n;
+	int have_sample;
+	float sample_min,sample_max;
+	struct umbrella_samples_struct umbrella;
+};
+
+struct accumulator_struct{
+	void (*record)(const struct analysis_pass_struct *pass, struct analysis_part_struct *part, const struct record_struct *r);
+	void (*merge)(struct analysis_pass_struct *pass, struct analysis_part_struct *part);
+	void (*finish)(struct analysis_pass_struct *pass);
+};
+#define MAX_ACCUMULATORS 5
+
 
 void showUsage(const char *c, const struct analysis_option_struct *opt);
 int parseCommandLine(int argc,char * const argv[], struct analysis_option_struct *opt);
@@ -211,24 +274,47 @@ void print_postscript_Pupdown(const struct pageinfo_struct *pageinfo,struct deta
 void showPlot(const struct plotinfo_struct *plot, const struct pageinfo_struct *page, const struct script_struct *script,const struct graph_struct *graph);
 int fileExists(const char *filename);
 signed char compare_records(struct record_struct *r1, struct record_struct *r2);
-void quicksort_database(struct database_struct *db, int left, int right);
+int sort_database(struct database_struct *db, int Nthreads);
 struct record_struct* rec(unsigned int record_number,const struct database_struct *db);
 int read_in_database(const struct analysis_option_struct *opt, const struct script_struct *script, struct database_struct *db, const struct nominal_struct *nominal);
-char get_next_force(float w[2], float force[2], float *rc, int whichRC, unsigned int *time, int *replica_number, unsigned short *sequence_number, const struct database_struct *db);
+unsigned int samples_per_record(const struct database_struct *db);
+int run_analysis_pass(struct analysis_pass_struct *pass, const struct accumulator_struct *acc, int Nacc);
+void sample_bounds_record(const struct analysis_pass_struct *pass, struct analysis_part_struct *part, const struct record_struct *r);
+void sample_bounds_merge(struct analysis_pass_struct *pass, struct analysis_part_struct *part);
+int column_sample_bounds(struct analysis_pass_struct *pass);
+int get_sample_bounds(struct analysis_pass_struct *pass, float *min, float *max);
 void get_data_statistics(struct stats_struct *stats, const struct database_struct *db);
-void condense_forces(unsigned int N_values_to_average, struct nominal_struct *nominal, struct graph_struct *graph, const struct script_struct *script, const analysis_option_struct *opt, struct stats_struct *stats, const struct database_struct *db);
+float *allocate_positions(struct graph_struct *graph, const struct script_struct *script, const struct stats_struct *stats);
+void condense_forces_begin(struct analysis_pass_struct *pass);
+void condense_forces_record(const struct analysis_pass_struct *pass, struct analysis_part_struct *part, const struct record_struct *r);
+void condense_forces_merge(struct analysis_pass_struct *pass, struct analysis_part_struct *part);
+void condense_forces_finish(struct analysis_pass_struct *pass);
 exact_struct * getExactFromFile(const char *title, exact_struct *exact, const struct script_struct *script);
 int getCancellationFromLog(const char *title, float *cancel, const struct script_struct *script);
-int find_bin_from_w(double w, int l, const struct nominal_struct *nominal, const struct script_struct *script);
+int find_bin_from_w(double w, int l, const struct script_struct *script);
 int round_up(float x);
 int round_down(float x);
 void rot_trans_regular(void);
 char *get_RGB_colour(int colour_num);
 void setup_regular(unsigned char *current_page);
-void calcSequenceDensity(unsigned int **sequenceDensity, const struct database_struct *db, const struct nominal_struct *nominal, const struct script_struct *script, const analysis_option_struct *opt, const struct stats_struct *stats);
-void getMinMaxSampleDensity(float *min, float *max, unsigned int whichData, unsigned int whichReplica, const struct database_struct *db, const struct nominal_struct *nominal, const struct script_struct *script);
-int calcSampleDensity(struct sampleDensity_struct *sd, unsigned int whichData, const struct graph_struct *graph, const struct database_struct *db, const struct nominal_struct *nominal, const struct script_struct *script, const struct analysis_option_struct *opt, const struct stats_struct *stats);
-int calcPMF(struct pmf_struct *pmf, unsigned int whichData, const struct graph_struct *graph, const struct database_struct *db, const struct nominal_struct *nominal, const struct script_struct *script, const struct analysis_option_struct *opt);
+void calcSequenceDensity_begin(struct analysis_pass_struct *pass);
+void calcSequenceDensity_record(const struct analysis_pass_struct *pass, struct analysis_part_struct *part, const struct record_struct *r);
+void calcSequenceDensity_merge(struct analysis_pass_struct *pass, struct analysis_part_struct *part);
+void calcSequenceDensity_finish(struct analysis_pass_struct *pass);
+int calcSampleDensity_begin(struct analysis_pass_struct *pass);
+void calcSampleDensity_record(const struct analysis_pass_struct *pass, struct analysis_part_struct *part, const struct record_struct *r);
+void calcSampleDensity_merge(struct analysis_pass_struct *pass, struct analysis_part_struct *part);
+void calcSampleDensity_finish(struct analysis_pass_struct *pass);
+int calcPMF_begin(struct analysis_pass_struct *pass);
+void calcPMF_record(const struct analysis_pass_struct *pass, struct analysis_part_struct *part, const struct record_struct *r);
+void calcPMF_merge(struct analysis_pass_struct *pass, struct analysis_part_struct *part);
+void calcPMF_finish(struct analysis_pass_struct *pass);
+int allocate_umbrella_samples(struct umbrella_samples_struct *u, unsigned long N);
+void free_umbrella_samples(struct umbrella_samples_struct *u);
+void umbrella_samples_record(const struct analysis_pass_struct *pass, struct analysis_part_struct *part, const struct record_struct *r);
+void umbrella_samples_merge(struct analysis_pass_struct *pass, struct analysis_part_struct *part);
+int solve_free_energies(int method, int block, const struct umbrella_struct *u, const struct umbrella_samples_struct *samples, const struct pmf_struct *pmf, float *x, double *f, double *p, int *iterations);
+int write_free_energies(int method, const struct analysis_option_struct *opt, const struct script_struct *script, const struct nominal_struct *nominal, const struct pmf_struct *pmf, const struct umbrella_samples_struct *samples);
 void setFont(unsigned int size);
 int floatEqual(float i,float j);
 void showFirstComboPageText(int px, int py);
@@ -239,7 +325,7 @@ void showSecondComboPageText(int px,int py);
 void showUsage(const char *c, const struct analysis_option_struct *opt){
 	printf("This program creates .ps graphs based on forcedatabase.\n");
 	//verbose option hidden from [list]
-	printf("Usage: %s tt.script [-lcdtfahme] > analysis.ps\n",c);
+	printf("Usage: %s tt.script [-lcdtfahmepw] > analysis.ps\n",c);
 	printf("       -l [int] sequence-number-limit; negative indicates no limit (default = %d)\n",opt->sequence_number_limit);
 	printf("       -c [int] plot cancellation data from tt.log file (default = %d)\n",opt->useCancellation);
 	printf("          ( =0) do not attempt\n");
@@ -258,6 +344,11 @@ void showUsage(const char *c, const struct analysis_option_struct *opt){
 	printf("          ( =0) do not discard\n");
 	printf("          (!=0) discard (useful for comparisons using DR_tester)\n");
 	printf("       -e [real] initial fraction of data to discard (default = %f)\n",opt->equilFraction);
+	printf("       -p [int] number of threads to sort and analyse with; zero uses every processor (default = %d)\n",opt->Nthreads);
+	printf("          (the results do not depend on the number of threads)\n");
+	printf("       -w [int] free energies of the umbrella windows along the -a data, written to tt.wham and tt.mbar (default = %d)\n",opt->freeEnergy);
+	printf("          ( =0) do not calculate\n");
+	printf("          ( =1) WHAM   ( =2) MBAR   ( =3) both\n");
 }
 
 int parseCommandLine(int argc,char * const argv[], struct analysis_option_struct *opt){
@@ -273,6 +364,8 @@ int parseCommandLine(int argc,char * const argv[], struct analysis_option_struct
 	int gotm=0;
 	int gote=0;
 	int gotj=0;
+	int gotp=0;
+	int gotw=0;
 
 	if( (argc<2) ){
 		fprintf(stderr,"Error: the script filename was not provided\n");
@@ -370,6 +463,20 @@ int parseCommandLine(int argc,char * const argv[], struct analysis_option_struct
 			}
 			opt->equilFraction=(float)atof(argv[i]);
 			gote=1;
+		}else if(argv[i-1][1]=='p'){
+			if(gotp){
+				fprintf(stderr,"Error: argument %s given multiple times.\n",argv[i-1]);
+				return 1;
+			}
+			opt->Nthreads=atoi(argv[i]);
+			gotp=1;
+		}else if(argv[i-1][1]=='w'){
+			if(gotw){
+				fprintf(stderr,"Error: argument %s given multiple times.\n",argv[i-1]);
+				return 1;
+			}
+			opt->freeEnergy=atoi(argv[i]);
+			gotw=1;
 		}else{
 			fprintf(stderr,"Error: incorrect command line format. Command %s not understood.\n",argv[i-1]);
 			return 1;
@@ -402,6 +509,22 @@ int checkOptions(struct analysis_option_struct *opt, const struct script_struct
 		fprintf(stderr,"Error: Can not *only* write the database when not writing the database at all.\n");
 		return 1;
 	}
+	if(opt->freeEnergy<0||opt->freeEnergy>3){
+		fprintf(stderr,"Error: -w must be 0 (none), 1 (WHAM), 2 (MBAR) or 3 (both)\n");
+		return 1;
+	}
+	if(opt->freeEnergy!=0 && (script->coordinate_type!=Umbrella || opt->additionalDataWithSampling<=0)){
+		fprintf(stderr,"Error: WHAM and MBAR need an umbrella simulation and the sampled value given with -a\n");
+		return 1;
+	}
+	if(opt->Nthreads<0){
+		fprintf(stderr,"Error: the number of threads must be >= 0 (0 is flag for using every processor)\n");
+		return 1;
+	}
+	if(opt->Nthreads==0){
+		opt->Nthreads=sysconf(_SC_NPROCESSORS_ONLN);
+		if(opt->Nthreads<1) opt->Nthreads=1;
+	}
 	return 0;
 }
 
@@ -424,6 +547,11 @@ int main(int argc, char *argv[]){
 	struct detailedBalance_struct *detailedBalance=(detailedBalance_struct *)NULL;
 	struct nominal_struct *nominal=(struct nominal_struct *)NULL;
 	struct graph_struct *graph=(struct graph_struct *)NULL;
+	float *positions=(float *)NULL;
+	struct analysis_pass_struct pass;
+	struct accumulator_struct accumulator[MAX_ACCUMULATORS];
+	int Naccumulators=0;
+	struct umbrella_samples_struct umbrella;
 
 	check=parseCommandLine(argc,argv,&opt);
 	if(check!=0){
@@ -435,7 +563,7 @@ int main(int argc, char *argv[]){
 	input_script->read_input_script_file(argv[1], &script);
 	delete input_script;
 
-	nominal=(struct nominal_struct *)malloc(MAX_REPLICAS*sizeof(nominal_struct));
+	nominal=(struct nominal_struct *)malloc(script.Nreplicas*sizeof(nominal_struct));
 	if(nominal==NULL){
 		fprintf(stderr,"Error: unable to allocate memory for nominal\n");
 		exit(1);
@@ -443,6 +571,18 @@ int main(int argc, char *argv[]){
 	for(i=0;i<script.Nreplicas;i++){
 		nominal[i].w[0]=script.replica[i].w_nominal;
 		nominal[i].w[1]=script.replica[i].w2_nominal;
+		nominal[i].force=script.replica[i].force;
+		if(opt.freeEnergy!=0 && !(script.replica[i].force>=0.0)){
+			fprintf(stderr,"Error: WHAM and MBAR need the force constant of every JOB from the FORCE column\n");
+			exit(1);
+		}
+	}
+	for(int l=0;l<2;l++){
+		allocate_nominal_grid(&nominal_grid[l],script.Nreplicas);
+		for(i=0;i<script.Nreplicas;i++){
+			nominal_grid[l].w[i]=nominal[i].w[l];
+		}
+		index_nominal_grid(&nominal_grid[l]);
 	}
 	delete[] script.replica;
 
@@ -465,7 +605,7 @@ int main(int argc, char *argv[]){
 		exit(0);
 	}
 
-	if(db.record[db.Nrecords-1]->replica_number-db.replica_offset>script.Nreplicas){
+	if(db.record[db.Nrecords-1]->replica_number-db.replica_offset>=script.Nreplicas){
 		fprintf(stderr,"Error: there are more replicas in the database than there are in the script file\n");
 		exit(1);
 	}
@@ -474,20 +614,19 @@ int main(int argc, char *argv[]){
 	get_data_statistics(&stats,&db);
 	fprintf(stderr,"Maximum force points found to be %u\n",stats.max_time);
 	fprintf(stderr,"Maximum sequence number found to be %u\n",stats.max_sequence_number);
-	if(stats.max_sequence_number>MAX_SEQUENCE_NUMBER){
-		fprintf(stderr,"Error: too many sequence numbers, %hu is the limit\n", (unsigned short)MAX_SEQUENCE_NUMBER);
-		exit(1);
-	}
 	
 	printf("%%!PS-Adobe-2.0\n%%%%Created by program analyse_force_database\n\n");
 
-	fprintf(stderr,"Reading data for force plots\n");
-	graph=(struct graph_struct *)malloc(MAX_REPLICAS*sizeof(graph_struct));
+	graph=(struct graph_struct *)malloc(script.Nreplicas*sizeof(graph_struct));
 	if(graph==NULL){
 		fprintf(stderr,"Error: unable to allocate memory for graph\n");
 		exit(1);
 	}
-	condense_forces(stats.max_time/N_FORCE_POINTS+1, nominal, graph, &script, &opt, &stats, &db);
+	positions=allocate_positions(graph,&script,&stats);
+	if(positions==NULL){
+		fprintf(stderr,"Error: unable to allocate memory for the positions of %u replicas over %u sequence numbers\n",script.Nreplicas,stats.max_sequence_number+1);
+		exit(1);
+	}
 
 	sequenceDensity=(unsigned int **)malloc((script.Nreplicas+1)*sizeof(unsigned int *));
 	if(sequenceDensity==NULL){
@@ -501,7 +640,34 @@ int main(int argc, char *argv[]){
 			exit(1);
 		}
 	}	
-	calcSequenceDensity(sequenceDensity,&db,nominal,&script,&opt,&stats);
+
+	pass.db=&db;
+	pass.script=&script;
+	pass.opt=&opt;
+	pass.nominal=nominal;
+	pass.stats=&stats;
+	pass.graph=graph;
+	pass.N_values_to_average=stats.max_time/N_FORCE_POINTS+1;
+	pass.Nsamples=samples_per_record(&db);
+	pass.whichRC=opt.additionalDataWithSampling;
+	pass.equil_sequence_number=(unsigned int)(opt.equilFraction*stats.max_sequence_number);
+	pass.sequenceDensity=sequenceDensity;
+	pass.sampleDensity=&sampleDensity;
+	pass.pmf=&pmf;
+	pass.whichData=opt.additionalDataWithSampling;
+	pass.have_sample_bounds=0;
+	pass.sample_min=pass.sample_max=0.0;
+	pass.Nthreads=opt.Nthreads;
+	pass.umbrella=(struct umbrella_samples_struct *)NULL;
+
+	condense_forces_begin(&pass);
+	accumulator[Naccumulators].record=condense_forces_record;
+	accumulator[Naccumulators].merge=condense_forces_merge;
+	accumulator[Naccumulators++].finish=condense_forces_finish;
+	calcSequenceDensity_begin(&pass);
+	accumulator[Naccumulators].record=calcSequenceDensity_record;
+	accumulator[Naccumulators].merge=calcSequenceDensity_merge;
+	accumulator[Naccumulators++].finish=calcSequenceDensity_finish;
 
 	if(opt.additionalDataWithSampling>0){
 		sampleDensity.b=(unsigned int **)malloc((script.Nreplicas+1)*sizeof(unsigned int *));
@@ -516,11 +682,14 @@ int main(int argc, char *argv[]){
 				exit(1);
 			}
 		}
-		check=calcSampleDensity(&sampleDensity,opt.additionalDataWithSampling,graph,&db,nominal,&script,&opt,&stats);
+		check=calcSampleDensity_begin(&pass);
 		if(check!=0){
-			fprintf(stderr,"Error: calcSampleDensity() returned non-zero\n");
+			fprintf(stderr,"Error: calcSampleDensity_begin() returned non-zero\n");
 			exit(check);
 		}
+		accumulator[Naccumulators].record=calcSampleDensity_record;
+		accumulator[Naccumulators].merge=calcSampleDensity_merge;
+		accumulator[Naccumulators++].finish=calcSampleDensity_finish;
 
 		pmf.f=(float *)malloc((pmf.Ncol+1)*sizeof(float));
 		if(pmf.f==NULL){
@@ -532,11 +701,41 @@ int main(int argc, char *argv[]){
 			fprintf(stderr,"Error: Unable to allocate memory for pmf.n\n");
 			exit(1);
 		}
-		check=calcPMF(&pmf,opt.additionalDataWithSampling,graph,&db,nominal,&script,&opt);
+		check=calcPMF_begin(&pass);
 		if(check!=0){
-			fprintf(stderr,"Error: calcPMF() returned non-zero\n");
+			fprintf(stderr,"Error: calcPMF_begin() returned non-zero\n");
 			exit(check);
 		}
+		accumulator[Naccumulators].record=calcPMF_record;
+		accumulator[Naccumulators].merge=calcPMF_merge;
+		accumulator[Naccumulators++].finish=calcPMF_finish;
+	}
+
+	if(opt.freeEnergy!=0){
+		if(allocate_umbrella_samples(&umbrella,(unsigned long)db.Nrecords*script.Nsamples_per_run)!=0) exit(1);
+		pass.umbrella=&umbrella;
+		accumulator[Naccumulators].record=umbrella_samples_record;
+		accumulator[Naccumulators].merge=umbrella_samples_merge;
+		accumulator[Naccumulators++].finish=NULL;
+	}
+
+	fprintf(stderr,"Reading data for force plots\n");
+	check=run_analysis_pass(&pass,accumulator,Naccumulators);
+	if(check!=0){
+		fprintf(stderr,"Error: run_analysis_pass() returned non-zero\n");
+		exit(check);
+	}
+
+	if(opt.freeEnergy!=0){
+		for(l=1;l<=2;l++){
+			if((opt.freeEnergy&l)==0) continue;
+			check=write_free_energies(l,&opt,&script,nominal,&pmf,&umbrella);
+			if(check!=0){
+				fprintf(stderr,"Error: write_free_energies() returned non-zero\n");
+				exit(check);
+			}
+		}
+		free_umbrella_samples(&umbrella);
 	}
 
 	if(opt.useCancellation){
@@ -694,8 +893,10 @@ int main(int argc, char *argv[]){
 		}
 	}
 
-	free(db.unsorted_record);
+	free_database_records(&db);
 	free(db.record);
+	free(positions);
+	free(graph);
 	free(cancel);
 }
 
@@ -1719,8 +1920,8 @@ void print_postscript_samplingOverlap(int whichData, const struct pageinfo_struc
 				continue;
 			}
 			//fprintf(stderr,"Putting w:%f val:%f in histo[%d][%d]\n",record[i]->w,record[i]->generic_data[j],find_bin_from_w(record[i]->w),(int)floor((record[i]->generic_data[j]-min)/binWidth));
-			++histo[find_bin_from_w(db->record[i]->w,0,nominal,script)][(int)floor((db->record[i]->generic_data[j]-min)/binWidth)];
-			++tot[find_bin_from_w(db->record[i]->w,0,nominal,script)];
+			++histo[find_bin_from_w(db->record[i]->w,0,script)][(int)floor((db->record[i]->generic_data[j]-min)/binWidth)];
+			++tot[find_bin_from_w(db->record[i]->w,0,script)];
 		}
 	}
 	for(i=0;i<script->Nreplicas; i++){
@@ -2067,31 +2268,133 @@ signed char compare_records(struct record_struct *r1, struct record_struct *r2)
 	else return(0);
 }
 
-void quicksort_database(struct database_struct *db, int left, int right){
-	struct record_struct *pivot;
-	int l_hold, r_hold;
+// sort_database() is an LSD radix sort of db->record on the key (replica_number, sequence_number), which is stable
+// so that the earliest of several records with the same key comes first. Only the digits that differ between
+// records are sorted on. With more than one thread each thread takes a share of the records and the buckets
+// are filled thread by thread, which keeps the sort stable.
+#define SORT_RADIX_BITS 11
+#define SORT_RADIX_BUCKETS (1<<SORT_RADIX_BITS)
+#define SORT_PARALLEL_MIN_RECORDS 1000000
+#define SORT_MAX_THREADS 16
+
+struct sort_item_struct{
+	unsigned long long key;
+	struct record_struct *record;
+};
+
+struct sort_thread_struct{
+	pthread_t handle;
+	const struct database_struct *db;
+	struct sort_item_struct *from;
+	struct sort_item_struct *to;
+	unsigned int begin;
+	unsigned int end;
+	unsigned int shift;
+	unsigned long long differing;           //bits in which the keys of this share differ from the first key
+	unsigned int count[SORT_RADIX_BUCKETS];
+};
+
+unsigned long long sort_key(const struct record_struct *r){
+	// replica numbers are signed; flipping the sign bit keeps their order as unsigned numbers
+	return( (((unsigned long long)((unsigned int)r->replica_number ^ 0x80000000u))<<32) | r->sequence_number );
+}
+
+void *sort_make_keys(void *arg){
+	struct sort_thread_struct *t=(struct sort_thread_struct *)arg;
+	unsigned long long first=sort_key(t->db->record[0]);
+	unsigned long long differing=0;
+	unsigned int i;
+
+	for(i=t->begin;i<t->end;i++){
+		t->from[i].record=t->db->record[i];
+		t->from[i].key=sort_key(t->from[i].record);
+		differing|=t->from[i].key^first;
+	}
+	t->differing=differing;
+	return(NULL);
+}
+
+void *sort_count_digits(void *arg){
+	struct sort_thread_struct *t=(struct sort_thread_struct *)arg;
+	unsigned int i;
+
+	memset(t->count,0,sizeof(t->count));
+	for(i=t->begin;i<t->end;i++) t->count[(t->from[i].key>>t->shift)&(SORT_RADIX_BUCKETS-1)]++;
+	return(NULL);
+}
+
+void *sort_scatter(void *arg){
+	struct sort_thread_struct *t=(struct sort_thread_struct *)arg;
+	unsigned int i;
+
+	for(i=t->begin;i<t->end;i++) t->to[t->count[(t->from[i].key>>t->shift)&(SORT_RADIX_BUCKETS-1)]++]=t->from[i];
+	return(NULL);
+}
+
+// runs f on every share; the first share is done by this thread
+void sort_run_threads(struct sort_thread_struct *t, int Nthreads, void *(*f)(void *)){
+	int i;
+	bool started[SORT_MAX_THREADS];
 
-	l_hold = left;
-	r_hold = right;
-	pivot = db->record[left];
-	while (left < right){
-		while ((compare_records(db->record[right],pivot) >= 0) && (left < right)) right--;
-		if (left != right){
-			db->record[left] = db->record[right];
-			left++;
+	for(i=1;i<Nthreads;i++){
+		started[i]=(pthread_create(&(t[i].handle),NULL,f,t+i)==0);
+		if(!started[i]) f(t+i);
+	}
+	f(t);
+	for(i=1;i<Nthreads;i++) if(started[i]) pthread_join(t[i].handle,NULL);
+}
+
+int sort_database(struct database_struct *db, int Nthreads){
+	struct sort_item_struct *items;
+	struct sort_item_struct *swap;
+	struct sort_thread_struct *t;
+	unsigned long long differing=0;
+	unsigned int shift,position,d,i;
+	int j;
+
+	if(db->Nrecords<2) return 0;
+	if(Nthreads<1 || db->Nrecords<SORT_PARALLEL_MIN_RECORDS) Nthreads=1;
+	if(Nthreads>SORT_MAX_THREADS) Nthreads=SORT_MAX_THREADS;
+	items=(struct sort_item_struct *)malloc(2*(size_t)db->Nrecords*sizeof(struct sort_item_struct));
+	t=(struct sort_thread_struct *)malloc(Nthreads*sizeof(struct sort_thread_struct));
+	if(items==NULL || t==NULL){
+		fprintf(stderr,"Error: cannot allocate memory to sort the database\n");
+		return 1;
+	}
+	for(j=0;j<Nthreads;j++){
+		t[j].db=db;
+		t[j].from=items;
+		t[j].to=items+db->Nrecords;
+		t[j].begin=(unsigned int)(((unsigned long long)db->Nrecords*j)/Nthreads);
+		t[j].end=(unsigned int)(((unsigned long long)db->Nrecords*(j+1))/Nthreads);
+	}
+	sort_run_threads(t,Nthreads,sort_make_keys);
+	for(j=0;j<Nthreads;j++) differing|=t[j].differing;
+
+	for(shift=0;shift<64;shift+=SORT_RADIX_BITS){
+		if(((differing>>shift)&(SORT_RADIX_BUCKETS-1))==0) continue;
+		for(j=0;j<Nthreads;j++) t[j].shift=shift;
+		sort_run_threads(t,Nthreads,sort_count_digits);
+		position=0;
+		for(d=0;d<SORT_RADIX_BUCKETS;d++){
+			for(j=0;j<Nthreads;j++){
+				i=t[j].count[d];
+				t[j].count[d]=position;
+				position+=i;
+			}
 		}
-		while ((compare_records(db->record[left],pivot) <= 0) && (left < right)) left++;
-		if (left != right){
-			db->record[right] = db->record[left];
-			right--;
+		sort_run_threads(t,Nthreads,sort_scatter);
+		for(j=0;j<Nthreads;j++){
+			swap=t[j].from;
+			t[j].from=t[j].to;
+			t[j].to=swap;
 		}
 	}
-	db->record[left] = pivot;
-	right = r_hold;
-	r_hold = left;
-	left = l_hold;
-	if (left < r_hold)  quicksort_database(db, left, r_hold-1);
-	if (right > r_hold) quicksort_database(db, r_hold+1, right);
+
+	for(i=0;i<db->Nrecords;i++) db->record[i]=t[0].from[i].record;
+	free(items);
+	free(t);
+	return 0;
 }
 
 struct record_struct* rec(unsigned int record_number,const struct database_struct *db){
@@ -2102,6 +2405,9 @@ int read_in_database(const struct analysis_option_struct *opt, const struct scri
 	class force_database_class *database;
 	int i,j;
 	unsigned long size;
+	long indexed;
+	unsigned int k,Nduplicates,Nbeyond_limit,Nread;
+	struct record_struct *previous;
 	
 
 	database=new force_database_class(opt->title,1);
@@ -2134,54 +2440,100 @@ int read_in_database(const struct analysis_option_struct *opt, const struct scri
 	}
 	*/
 	
-	if( (db->unsorted_record=(struct record_struct*)malloc(db->Nrecords*db->record_size))==NULL ){
+	if( (db->record=(struct record_struct**)malloc((db->Nrecords+1)*sizeof(struct record_struct *)))==NULL ){
 		fprintf(stderr,"Error: cannot allocated enough memory for the database\n");
 		return 1;
 	}
 
-	if( (db->record=(struct record_struct**)malloc((db->Nrecords+1)*sizeof(struct record_struct *)))==NULL ){
-		fprintf(stderr,"Error: cannot allocated enough memory for the database\n");
-		return 1;
+	// the records are used in place in a read-only mapping of the file; a columnar file is decoded a chunk at a time,
+	// and reading them in one by one is the fallback
+	if( (db->unsorted_record=database->map_records(&(db->mapped_size)))!=NULL ){
+		fprintf(stderr,"Mapped the records of the database\n");
+		for(i=0;i<db->Nrecords;i++) db->record[i]=rec(i,db);
+	}else if(database->is_columnar()){
+		db->mapped_size=0;
+		if( (db->unsorted_record=(struct record_struct*)malloc(db->Nrecords*db->record_size))==NULL ){
+			fprintf(stderr,"Error: cannot allocated enough memory for the database\n");
+			return 1;
+		}
+
+		fprintf(stderr,"Decoding %u chunks",database->get_number_of_chunks());
+		for(k=0,i=0;k<database->get_number_of_chunks();k++){
+			i+=database->read_chunk_records(k,rec(i,db));
+			fprintf(stderr,"."); fflush(stderr);
+		}
+		fprintf(stderr,"\n");
+		for(i=0;i<db->Nrecords;i++) db->record[i]=rec(i,db);
+	}else{
+		db->mapped_size=0;
+		if( (db->unsorted_record=(struct record_struct*)malloc(db->Nrecords*db->record_size))==NULL ){
+			fprintf(stderr,"Error: cannot allocated enough memory for the database\n");
+			return 1;
+		}
+
+		fprintf(stderr,"Reading records");
+		for(i=0;i<db->Nrecords;i++){
+			database->read_record_to_given_memory(i,rec(i,db));
+			db->record[i]=rec(i,db);
+			if( (i%1000)==999 ) fprintf(stderr,"."); fflush(stderr);
+		}
+		fprintf(stderr,"\n");
 	}
 
-	fprintf(stderr,"Reading records");
-	for(i=0;i<db->Nrecords;i++){
-		database->read_record_to_given_memory(i,rec(i,db));
-		db->record[i]=rec(i,db);
-		if( (i%1000)==999 ) fprintf(stderr,"."); fflush(stderr);
+	// the statistics of a columnar file cover every record in it; they are dropped below if any record is
+	if(database->is_columnar()){
+		if( (db->column_min=(double *)malloc(2*database->get_number_of_columns()*sizeof(double)))==NULL ){
+			fprintf(stderr,"Error: cannot allocated enough memory for the column statistics\n");
+			return 1;
+		}
+		db->column_max=db->column_min+database->get_number_of_columns();
+		for(k=0;k<database->get_number_of_columns();k++) database->get_column_bounds(k,db->column_min+k,db->column_max+k);
+	}
+
+	// the index that the server keeps next to the database has the records sorted and without duplicates already
+	Nread=db->Nrecords;
+	indexed=database->get_sorted_records(db->unsorted_record,db->record,db->Nrecords);
+	delete database;
+	if(indexed>=0){
+		fprintf(stderr,"Using the index of the database: %ld records, %u duplicate records removed\n",indexed,db->Nrecords-(unsigned int)indexed);
+		db->Nrecords=indexed;
+	}else{
+		fprintf(stderr,"Sorting database... ");
+		if(sort_database(db,opt->Nthreads)!=0) return 1;
+		fprintf(stderr,"done.\n");
 	}
-	fprintf(stderr,"\n");
-	
-	fprintf(stderr,"Quicksorting database... ");
-	quicksort_database(db, 0, db->Nrecords-1);
-	fprintf(stderr,"done.\n");
 
+	// one stable pass drops the duplicates (the earliest record is kept) and the records beyond the sequence number limit
 	fprintf(stderr,"Removing duplicate records... ");
-	for(i=0;i<db->Nrecords-1;i++){
-		if(compare_records(db->record[i],db->record[i+1])==0){
-			//void *memmove(void *s1, const void *s2, size_t n);
-			//copies n bytes from the object pointed to by s2 into the object pointed to by s1
-			//Therefore this method copies over the second instance
-			//There is an assumption that it is the first instance that was used... is this true?
-			fprintf(stderr, "\nEliminating duplicate record at position %d   ",i);
-			memmove(db->record+i+1, db->record+i+2, ((int)db->Nrecords-i-2)*sizeof(struct record_struct *));
-			i--;
-			db->Nrecords--;
+	previous=NULL;
+	Nduplicates=0;
+	Nbeyond_limit=0;
+	db->max_sequence_number=0;
+	for(i=0,k=0;i<db->Nrecords;i++){
+		if(previous!=NULL && compare_records(previous,db->record[i])==0){
+			Nduplicates++;
+			continue;
+		}
+		previous=db->record[i];
+		if(opt->sequence_number_limit>=0 && db->record[i]->sequence_number>opt->sequence_number_limit){
+			Nbeyond_limit++;
+			continue;
 		}
+		if(db->record[i]->sequence_number>db->max_sequence_number) db->max_sequence_number=db->record[i]->sequence_number;
+		db->record[k++]=db->record[i];
 	}
-	fprintf(stderr,"done.\n");
-
+	if(k!=Nread){
+		free(db->column_min);
+		db->column_min=db->column_max=(double *)NULL;
+	}
+	db->Nrecords=k;
+	fprintf(stderr,"removed %u records.\n",Nduplicates);
 	if(opt->sequence_number_limit>=0){
-		unsigned int count;
-		fprintf(stderr,"Removing records with sequence numbers beyond the limit... ");
-		for(i=0;i<db->Nrecords;i++)
-			if(db->record[i]->sequence_number>opt->sequence_number_limit){
-				memmove(db->record+i, db->record+i+1, ((int)db->Nrecords-i-1)*sizeof(struct record_struct *));
-				i--;
-				db->Nrecords--;
-				count++;
-			}
-		fprintf(stderr,"removed %u records.\n",count);
+		fprintf(stderr,"Removed %u records with sequence numbers beyond the limit.\n",Nbeyond_limit);
+	}
+	if(db->Nrecords==0){
+		fprintf(stderr,"Error: no records are left\n");
+		return 1;
 	}
 
 	fprintf(stderr,"Confirming new order... ");
@@ -2207,7 +2559,7 @@ int read_in_database(const struct analysis_option_struct *opt, const struct scri
 			return 1;
 		}
 		for(i=0;i<db->Nrecords;i++){
-			fprintf(f,"record: replica#: %d   sequence#: %u   w: %f   w_nominal: %d\n",db->record[i]->replica_number,db->record[i]->sequence_number,db->record[i]->w,find_bin_from_w(db->record[i]->w,0,nominal,script));
+			fprintf(f,"record: replica#: %d   sequence#: %u   w: %f   w_nominal: %d\n",db->record[i]->replica_number,db->record[i]->sequence_number,db->record[i]->w,find_bin_from_w(db->record[i]->w,0,script));
 			if(opt->writeDatabaseFull){
 				for(j=0;j<db->Nforces*db->Nligands;j+=db->Nligands){
 					db->record[i]->generic_data[j];
@@ -2231,131 +2583,372 @@ int read_in_database(const struct analysis_option_struct *opt, const struct scri
 	return 0;
 }
 
-char get_next_force(float w[2], float force[2], float *rc, int whichRC, unsigned int *time, int *replica_number, unsigned short *sequence_number, const struct database_struct *db){
-	static unsigned int recordN=0;
-	static unsigned int sampleN=0;
+// Number of force samples taken from each record; every record gives the same number
+unsigned int samples_per_record(const struct database_struct *db){
+	unsigned int s=1;
+
+//BUG ALERT:
+//C. Neale is sure that this won't work with 2 ligands now that all of
+//the data from both ligands (not just 1st half) is stored in the forcedatabase
+//as per the changes that C. Neale introduced in what he believes was a 'correction'
+	while(s*db->Nligands+1<db->Nforces) s++;
+	return s;
+}
 
-	if(recordN>=db->Nrecords){
-		recordN=0;
-		return('f');
+struct analysis_schedule_struct{
+	pthread_mutex_t mutex;
+	pthread_cond_t merged;
+	unsigned int Nblocks;
+	unsigned int next_block;        //next block to hand out
+	unsigned int next_merge;        //next block to be merged into the results
+};
+
+struct analysis_thread_struct{
+	pthread_t handle;
+	struct analysis_pass_struct *pass;
+	const struct accumulator_struct *acc;
+	int Nacc;
+	struct analysis_schedule_struct *schedule;
+	struct analysis_part_struct part;
+	char *memory;
+};
+
+int allocate_umbrella_samples(struct umbrella_samples_struct *u, unsigned long N){
+	u->N=0;
+	u->x=(float *)malloc(N*sizeof(float));
+	u->window=(int *)malloc(N*sizeof(int));
+	u->block=(unsigned char *)malloc(N*sizeof(unsigned char));
+	if(u->x==NULL || u->window==NULL || u->block==NULL){
+		fprintf(stderr,"Error: unable to allocate memory for %lu samples for WHAM/MBAR\n",N);
+		return 1;
 	}
-	
-	w[0]=db->record[recordN]->w;
-	force[0]=0.0;
-	force[1]=0.0;
+	return 0;
+}
 
-	//BUG ALERT:
-	//C. Neale doesn't think that this handles two ligands correctly
-	if(db->Nforces>0){
-		force[0]=db->record[recordN]->generic_data[sampleN*db->Nligands];
-		if(whichRC>0){
-			*rc=db->record[recordN]->generic_data[sampleN+db->Nforces*(db->Nligands+whichRC-1)];
-		}
-		if(db->Nligands==2){
-			force[1]=db->record[recordN]->generic_data[sampleN*db->Nligands+1];
+void free_umbrella_samples(struct umbrella_samples_struct *u){
+	free(u->x);
+	free(u->window);
+	free(u->block);
+	u->x=(float *)NULL;
+	u->window=(int *)NULL;
+	u->block=(unsigned char *)NULL;
+	u->N=0;
+}
+
+int allocate_analysis_part(struct analysis_thread_struct *t){
+	const struct analysis_pass_struct *pass=t->pass;
+	size_t Ngraph=(size_t)pass->script->Nreplicas*N_FORCE_POINTS;
+	size_t Nseq=(size_t)(pass->script->Nreplicas+1)*(pass->script->Nreplicas+1);
+	size_t Nsd=(size_t)(pass->script->Nreplicas+1)*(pass->sampleDensity->Ncol+1);
+	size_t Npmf=pass->pmf->Ncol+1;
+	char *m;
+
+	t->part.umbrella.N=0;
+	t->part.umbrella.x=(float *)NULL;
+	t->part.umbrella.window=(int *)NULL;
+	t->part.umbrella.block=(unsigned char *)NULL;
+	t->memory=(char *)calloc(1,(3*Ngraph+pass->script->Nreplicas)*sizeof(double)+(Nseq+Nsd+Npmf)*sizeof(unsigned int)+Npmf*sizeof(float));
+	if(t->memory==NULL) return 1;
+	m=t->memory;
+	t->part.weight_sum=(double *)m;                 m+=Ngraph*sizeof(double);
+	t->part.force_sum[0]=(double *)m;               m+=Ngraph*sizeof(double);
+	t->part.force_sum[1]=(double *)m;               m+=Ngraph*sizeof(double);
+	t->part.samples=(double *)m;                    m+=pass->script->Nreplicas*sizeof(double);
+	t->part.sequenceDensity=(unsigned int *)m;      m+=Nseq*sizeof(unsigned int);
+	t->part.sampleDensity=(unsigned int *)m;        m+=Nsd*sizeof(unsigned int);
+	t->part.pmf_n=(unsigned int *)m;                m+=Npmf*sizeof(unsigned int);
+	t->part.pmf_f=(float *)m;
+	t->part.have_sample=0;
+	if(pass->umbrella!=NULL){
+		if(allocate_umbrella_samples(&(t->part.umbrella),(unsigned long)ANALYSIS_BLOCK_RECORDS*pass->script->Nsamples_per_run)!=0) return 1;
+	}
+	return 0;
+}
+
+void *analysis_worker(void *arg){
+	struct analysis_thread_struct *t=(struct analysis_thread_struct *)arg;
+	struct analysis_schedule_struct *schedule=t->schedule;
+	const struct database_struct *db=t->pass->db;
+	unsigned int b,i,end;
+	int a;
+
+	while(1){
+		pthread_mutex_lock(&(schedule->mutex));
+		b=schedule->next_block++;
+		pthread_mutex_unlock(&(schedule->mutex));
+		if(b>=schedule->Nblocks) break;
+
+		end=(b+1)*ANALYSIS_BLOCK_RECORDS;
+		if(end>db->Nrecords) end=db->Nrecords;
+		for(i=b*ANALYSIS_BLOCK_RECORDS;i<end;i++){
+			for(a=0;a<t->Nacc;a++) t->acc[a].record(t->pass,&(t->part),db->record[i]);
+		}
+
+		// only the thread holding block next_merge touches the results, so the merge itself needs no lock
+		pthread_mutex_lock(&(schedule->mutex));
+		while(schedule->next_merge!=b) pthread_cond_wait(&(schedule->merged),&(schedule->mutex));
+		pthread_mutex_unlock(&(schedule->mutex));
+		for(a=0;a<t->Nacc;a++) t->acc[a].merge(t->pass,&(t->part));
+		pthread_mutex_lock(&(schedule->mutex));
+		schedule->next_merge++;
+		pthread_cond_broadcast(&(schedule->merged));
+		pthread_mutex_unlock(&(schedule->mutex));
+	}
+	return(NULL);
+}
+
+// One pass over the sorted records feeds every accumulator that main() registered
+int run_analysis_pass(struct analysis_pass_struct *pass, const struct accumulator_struct *acc, int Nacc){
+	struct analysis_schedule_struct schedule;
+	struct analysis_thread_struct t[ANALYSIS_MAX_THREADS];
+	bool started[ANALYSIS_MAX_THREADS];
+	int Nthreads=pass->Nthreads;
+	int i,a;
+
+	schedule.Nblocks=(pass->db->Nrecords+ANALYSIS_BLOCK_RECORDS-1)/ANALYSIS_BLOCK_RECORDS;
+	schedule.next_block=0;
+	schedule.next_merge=0;
+	if(Nthreads>ANALYSIS_MAX_THREADS) Nthreads=ANALYSIS_MAX_THREADS;
+	if(Nthreads>(int)schedule.Nblocks) Nthreads=schedule.Nblocks;
+	if(Nthreads<1) Nthreads=1;
+	pthread_mutex_init(&(schedule.mutex),NULL);
+	pthread_cond_init(&(schedule.merged),NULL);
+
+	for(i=0;i<Nthreads;i++){
+		t[i].pass=pass;
+		t[i].acc=acc;
+		t[i].Nacc=Nacc;
+		t[i].schedule=&schedule;
+		if(allocate_analysis_part(t+i)!=0){
+			fprintf(stderr,"Error: unable to allocate memory for the analysis of thread %d\n",i);
+			for(;i>=0;i--){
+				free(t[i].memory);
+				free_umbrella_samples(&(t[i].part.umbrella));
+			}
+			return 1;
 		}
 	}
-	*replica_number=db->record[recordN]->replica_number-db->replica_offset;
-	*sequence_number=db->record[recordN]->sequence_number;
-	*time=db->Nforces * (*sequence_number) + sampleN;
-		
-	sampleN++;
+	// a thread that cannot be started is no loss: the others take its blocks
+	for(i=1;i<Nthreads;i++) started[i]=(pthread_create(&(t[i].handle),NULL,analysis_worker,t+i)==0);
+	analysis_worker(t);
+	for(i=1;i<Nthreads;i++) if(started[i]) pthread_join(t[i].handle,NULL);
 
-//BUG ALERT:
-//C. Neale is sure that this won't work with 2 ligands now that all of
-//the data from both ligands (not just 1st half) is stored in the forcedatabase
-//as per the changes that C. Neale introduced in what he believes was a 'correction'
-	if(sampleN*db->Nligands+1>=db->Nforces){
-		sampleN=0;
-		recordN++;
+	for(i=0;i<Nthreads;i++){
+		free(t[i].memory);
+		free_umbrella_samples(&(t[i].part.umbrella));
+	}
+	pthread_mutex_destroy(&(schedule.mutex));
+	pthread_cond_destroy(&(schedule.merged));
+
+	for(a=0;a<Nacc;a++){
+		if(acc[a].finish!=NULL) acc[a].finish(pass);
+	}
+	return 0;
+}
+
+void sample_bounds_record(const struct analysis_pass_struct *pass, struct analysis_part_struct *part, const struct record_struct *r){
+	const struct script_struct *script=pass->script;
+	int j;
+
+	for(j=script->Nsamples_per_run*(pass->whichData); j<script->Nsamples_per_run*(pass->whichData+1); j++){
+		if(r->generic_data[j]<part->sample_min||!part->have_sample)part->sample_min=r->generic_data[j];
+		if(r->generic_data[j]>part->sample_max||!part->have_sample)part->sample_max=r->generic_data[j];
+		part->have_sample=1;
 	}
-	return('p');
 }
 
+void sample_bounds_merge(struct analysis_pass_struct *pass, struct analysis_part_struct *part){
+	if(!part->have_sample) return;
+	if(part->sample_min<pass->sample_min||!pass->have_sample_bounds)pass->sample_min=part->sample_min;
+	if(part->sample_max>pass->sample_max||!pass->have_sample_bounds)pass->sample_max=part->sample_max;
+	pass->have_sample_bounds=1;
+	part->have_sample=0;
+}
+
+// Takes the bounds of the sampled data from the column statistics of a columnar file. Returns non-zero, leaving
+// the bounds unknown, if there are none or the sampled values are not whole columns
+int column_sample_bounds(struct analysis_pass_struct *pass){
+	const struct database_struct *db=pass->db;
+	struct header_struct h;
+	unsigned int c,first,width,Ncovered=0;
+	unsigned int from=pass->script->Nsamples_per_run*pass->whichData;
+	unsigned int to=from+pass->script->Nsamples_per_run;
+	size_t offset;
+
+	if(db->column_min==NULL) return 1;
+	h.Nligands=db->Nligands;
+	h.Nforces_per_record=db->Nforces;
+	h.Nenergies_per_record=db->Nenergies;
+	for(c=ColumnForces;c<ColumnAdditional+db->Nadditional_data;c++){
+		columnar_column_layout(&h,c,&width,&offset);
+		first=(offset-sizeof(struct record_struct))/sizeof(float);
+		if(width==0 || first+width<=from || first>=to) continue;
+		if(first<from || first+width>to) return 1;
+		if(Ncovered==0 || db->column_min[c]<pass->sample_min) pass->sample_min=db->column_min[c];
+		if(Ncovered==0 || db->column_max[c]>pass->sample_max) pass->sample_max=db->column_max[c];
+		Ncovered+=width;
+	}
+	if(Ncovered!=to-from) return 1;
+	pass->have_sample_bounds=1;
+	return 0;
+}
+
+// The bounds of the sampled data, found once and shared by the sample density and the PMF. The histograms need
+// them before their own pass, so they come from the column statistics of a columnar file or else a pass of their own
+int get_sample_bounds(struct analysis_pass_struct *pass, float *min, float *max){
+	struct accumulator_struct bounds={sample_bounds_record,sample_bounds_merge,NULL};
+
+	if(!pass->have_sample_bounds){
+		if(column_sample_bounds(pass)==0) fprintf(stderr,"Took the bounds of the sampled data from the column statistics\n");
+		else if(run_analysis_pass(pass,&bounds,1)!=0) return 1;
+	}
+	*min=pass->sample_min;
+	*max=pass->sample_max;
+	return 0;
+}
+
+// Both follow from read_in_database(), which has already seen every sequence number
 void get_data_statistics(struct stats_struct *stats, const struct database_struct *db){
-	float w[2];
-	float force[2];
-	unsigned int time;
-	unsigned short sequence_number;
-	int replica_number;
-	int dummy;
+	stats->max_sequence_number=db->max_sequence_number;
+	stats->max_time=db->Nforces*db->max_sequence_number+samples_per_record(db)-1;
+}
 
-	stats->max_time=0;
-	
-	while(1){
-		if(get_next_force(w,force,(float *)NULL,0,&time,&replica_number,&sequence_number,db)=='f') break;
-		if(time>stats->max_time) stats->max_time=time;
-		if(sequence_number>stats->max_sequence_number) stats->max_sequence_number=sequence_number;
+// One replica x sequence number matrix for each of replica_position and rc_position, sized from the database;
+// each replica's row is contiguous since the trajectory plots walk a replica at a time
+float *allocate_positions(struct graph_struct *graph, const struct script_struct *script, const struct stats_struct *stats){
+	size_t Ncol=(size_t)stats->max_sequence_number+1;
+	float *positions;
+	unsigned int i;
+
+	positions=(float *)malloc(2*(size_t)script->Nreplicas*Ncol*sizeof(float));
+	if(positions==NULL) return((float *)NULL);
+	for(i=0;i<script->Nreplicas;i++){
+		graph[i].replica_position=positions+i*Ncol;
+		graph[i].rc_position=positions+(script->Nreplicas+i)*Ncol;
 	}
+	return(positions);
 }
 
-void condense_forces(unsigned int N_values_to_average, struct nominal_struct *nominal, struct graph_struct *graph, const struct script_struct *script, const analysis_option_struct *opt, struct stats_struct *stats, const struct database_struct *db){
+void condense_forces_begin(struct analysis_pass_struct *pass){
+	const struct script_struct *script=pass->script;
+	struct graph_struct *graph=pass->graph;
 	unsigned int i,j;
-	unsigned char l;
-	float w[2];
-	int replicaN;
-	float force[2];
-	float rc;
-	float wa,wb;
-	float fraction_a,fraction_b;
-	unsigned int time;
-	double weight_sum;
-	unsigned short sequence_number;
 
 	for(i=0;i<script->Nreplicas;i++){
-		graph[i].w[0]=nominal[i].w[0];
-		graph[i].w[1]=nominal[i].w[1];
+		graph[i].w[0]=pass->nominal[i].w[0];
+		graph[i].w[1]=pass->nominal[i].w[1];
 		memset(graph[i].weight_sum,0,sizeof(graph[i].weight_sum));
-		if(opt->verbose)fprintf(stderr,"Adding: Nreplicas: %u   w: %lf   w2: %lf\n",i,graph[i].w[0],graph[i].w[1]);
+		memset(graph[i].point,0,sizeof(graph[i].point));
+		if(pass->opt->verbose)fprintf(stderr,"Adding: Nreplicas: %u   w: %lf   w2: %lf\n",i,graph[i].w[0],graph[i].w[1]);
 	}
 
 	for(i=0;i<script->Nreplicas;i++){
-		for(j=0;j<=stats->max_sequence_number;j++){	
+		for(j=0;j<=pass->stats->max_sequence_number;j++){	
 			graph[i].replica_position[j]=graph[i].rc_position[j]=1e20;
 		}
 		graph[i].samples=0.0;
 	}
 	
 	fprintf(stderr,"Number of discrete w positions: %u\n",script->Nreplicas);
-	fprintf(stderr,"max time is: %u\n",stats->max_time);
+	fprintf(stderr,"max time is: %u\n",pass->stats->max_time);
+}
 
-	while(1){
-		if(get_next_force(w,force,&rc,opt->additionalDataWithSampling,&time,&replicaN,&sequence_number,db)=='f') break;
-		graph[replicaN].replica_position[sequence_number]=w[0];
-		graph[replicaN].rc_position[sequence_number]=rc;
+// The forces are summed with their weights here and condense_forces_finish() divides by the weight sums
+void condense_forces_record(const struct analysis_pass_struct *pass, struct analysis_part_struct *part, const struct record_struct *r){
+	const struct database_struct *db=pass->db;
+	const struct script_struct *script=pass->script;
+	struct graph_struct *graph=pass->graph;
+	unsigned int i,s;
+	unsigned char l;
+	float w;
+	int replicaN;
+	float force[2];
+	float rc=0.0;
+	float wa,wb;
+	float fraction_a,fraction_b;
+	unsigned int time;
+
+	w=r->w;
+	replicaN=r->replica_number-db->replica_offset;
+	force[0]=0.0;
+	force[1]=0.0;
 
-		time/=N_values_to_average;
+	for(s=0;s<pass->Nsamples;s++){
+		//BUG ALERT:
+		//C. Neale doesn't think that this handles two ligands correctly
+		if(db->Nforces>0){
+			force[0]=r->generic_data[s*db->Nligands];
+			if(pass->whichRC>0){
+				rc=r->generic_data[s+db->Nforces*(db->Nligands+pass->whichRC-1)];
+			}
+			if(db->Nligands==2){
+				force[1]=r->generic_data[s*db->Nligands+1];
+			}
+		}
+		graph[replicaN].replica_position[r->sequence_number]=w;
+		graph[replicaN].rc_position[r->sequence_number]=rc;
+
+		time=(db->Nforces*r->sequence_number+s)/pass->N_values_to_average;
 
 		for(i=0;i<script->Nreplicas;i++){
-			if(graph[i].w[0]>w[0]) break;
+			if(graph[i].w[0]>w) break;
 		}
 
 		if(i==0)            wa=graph[0].w[0]-(graph[1].w[0]-graph[0].w[0]);
 		else                wa=graph[i-1].w[0];
 		if(i==script->Nreplicas) wb=graph[script->Nreplicas-1].w[0]+(graph[script->Nreplicas-1].w[0]-graph[script->Nreplicas-2].w[0]);
 		else                wb=graph[i].w[0];
-		fraction_b=(w[0]-wa)/(wb-wa);
+		fraction_b=(w-wa)/(wb-wa);
 		fraction_a=(double)1.0-fraction_b;
 		if( (fraction_a>=-1e-5) && (fraction_a<=1.0+1e-5) ){
 			if(i>0){
-				graph[i-1].weight_sum[time]+=fraction_a;
-				graph[i-1].samples+=fraction_a;
+				part->weight_sum[(i-1)*N_FORCE_POINTS+time]+=fraction_a;
+				part->samples[i-1]+=fraction_a;
+				for(l=0;l<script->Nligands;l++) part->force_sum[l][(i-1)*N_FORCE_POINTS+time]+=force[l]*fraction_a;
 			}
 			if(i<script->Nreplicas){
-				graph[i].weight_sum[time]+=fraction_b;
-				graph[i].samples+=fraction_b;
+				part->weight_sum[i*N_FORCE_POINTS+time]+=fraction_b;
+				part->samples[i]+=fraction_b;
+				for(l=0;l<script->Nligands;l++) part->force_sum[l][i*N_FORCE_POINTS+time]+=force[l]*fraction_b;
 			}
+		}
+	}
+}
 
-			for(l=0;l<script->Nligands;l++){
-				if(i>0){
-					weight_sum=graph[i-1].weight_sum[time];
-					if(weight_sum>1e-5) graph[i-1].point[l][time]=graph[i-1].point[l][time]*(1.0-fraction_a/weight_sum)+force[l]*(fraction_a/weight_sum);
-				}
+void condense_forces_merge(struct analysis_pass_struct *pass, struct analysis_part_struct *part){
+	struct graph_struct *graph=pass->graph;
+	unsigned int i,j,k;
+	unsigned char l;
 
-				if(i<script->Nreplicas){
-					weight_sum=graph[i].weight_sum[time];
-					if(weight_sum>1e-5) graph[i].point[l][time]=graph[i].point[l][time]*(1.0-fraction_b/weight_sum)+force[l]*(fraction_b/weight_sum);
-				}
+	for(i=0;i<pass->script->Nreplicas;i++){
+		graph[i].samples+=part->samples[i];
+		part->samples[i]=0.0;
+		for(j=0;j<N_FORCE_POINTS;j++){
+			k=i*N_FORCE_POINTS+j;
+			graph[i].weight_sum[j]+=part->weight_sum[k];
+			part->weight_sum[k]=0.0;
+			for(l=0;l<pass->script->Nligands;l++){
+				graph[i].point[l][j]+=part->force_sum[l][k];
+				part->force_sum[l][k]=0.0;
+			}
+		}
+	}
+}
+
+void condense_forces_finish(struct analysis_pass_struct *pass){
+	const struct script_struct *script=pass->script;
+	struct graph_struct *graph=pass->graph;
+	struct stats_struct *stats=pass->stats;
+	unsigned int i,j;
+	unsigned char l;
+	float force[2];
+	double weight_sum;
+
+	for(i=0;i<script->Nreplicas;i++){
+		for(j=0;j<N_FORCE_POINTS;j++){
+			for(l=0;l<script->Nligands;l++){
+				if(graph[i].weight_sum[j]>1e-5) graph[i].point[l][j]/=graph[i].weight_sum[j];
+				else graph[i].point[l][j]=0.0;
 			}
 		}
 	}
@@ -2377,7 +2970,7 @@ void condense_forces(unsigned int N_values_to_average, struct nominal_struct *no
 			for(j=0;j<N_FORCE_POINTS;j++) 
 				if(graph[i].weight_sum[j]>1.0e-5) max_force_points=j;
 
-			for(j=(unsigned int)((float)max_force_points*opt->equilFraction);j<N_FORCE_POINTS;j++){
+			for(j=(unsigned int)((float)max_force_points*pass->opt->equilFraction);j<N_FORCE_POINTS;j++){
 				force[l]=graph[i].point[l][j];
 				if(graph[i].weight_sum[j]>1.0e-5){
 					//fprintf(stderr,"force is %f\n",force[l]);
@@ -2399,7 +2992,6 @@ void condense_forces(unsigned int N_values_to_average, struct nominal_struct *no
 	}
 }
 
-
 exact_struct * getExactFromFile(const char *title, exact_struct *exact, const struct script_struct *script){
 	char command[500];
 	char linein[1000];
@@ -2523,28 +3115,9 @@ int getCancellationFromLog(const char *title, float *cancel, const struct script
 	return 0;
 }
 
-//Copied directly from DR_server.cpp (C. Neale Oct 17 2007)
-int find_bin_from_w(double w, int l, const struct nominal_struct *nominal, const struct script_struct *script){
-	double left_space, right_space;
-	double left_limit, right_limit;
-	int i;
-
-	if(script->Nreplicas==1) return(0);
-
-	for(i=0;i<script->Nreplicas;i++)
-	{
-		if(i>0)                   left_space=nominal[i].w[l]-nominal[i-1].w[l];
-		if(i<script->Nreplicas-1) right_space=nominal[i+1].w[l]-nominal[i].w[l];
-
-		if(i==0)                        left_space=right_space;
-		else if(i==script->Nreplicas-1) right_space=left_space;
-
-		left_limit=nominal[i].w[l]-left_space*0.5;
-		right_limit=nominal[i].w[l]+right_space*0.5;
-
-		if( (w>=left_limit) && (w<=right_limit) ) return(i);
-	}
-	return(-1);
+//Same as find_bin_from_w() in DR_server.cpp; nominal_grid[l] is built from nominal[].w[l] in main()
+int find_bin_from_w(double w, int l, const struct script_struct *script){
+	return(nominal_grid_bin(&nominal_grid[l],w));
 }
 
 int round_up(float x)
@@ -2611,25 +3184,44 @@ void setup_regular(unsigned char *current_page){
 //*********************************************************************
 
 
-void calcSequenceDensity(unsigned int **sequenceDensity, const struct database_struct *db, const struct nominal_struct *nominal, const struct script_struct *script, const analysis_option_struct *opt, const struct stats_struct *stats){
+void calcSequenceDensity_begin(struct analysis_pass_struct *pass){
 // sequenceDensity[replica][sampling position]
 // sequenceDensity[][0 to Nreplicas-1] stores values, [][Nreplicas] stores max value
 // sequenceDensity[0 to Nreplicas-1][] stores individual replicas, [Nreplicas][] stores summation
-	int i,j,bin;
+	int i,j;
 
-	for(i=0;i<=script->Nreplicas; i++){
-		for(j=0;j<=script->Nreplicas; j++){
-			sequenceDensity[i][j]=0;
+	for(i=0;i<=pass->script->Nreplicas; i++){
+		for(j=0;j<=pass->script->Nreplicas; j++){
+			pass->sequenceDensity[i][j]=0;
 		}
 	}
+}
 
-	for(i=0;i<db->Nrecords;i++){
-		if(db->record[i]->sequence_number<(unsigned int)(opt->equilFraction*stats->max_sequence_number)){
-			continue;
+void calcSequenceDensity_record(const struct analysis_pass_struct *pass, struct analysis_part_struct *part, const struct record_struct *r){
+	int bin;
+
+	if(r->sequence_number<pass->equil_sequence_number) return;
+	bin=find_bin_from_w(r->w,0,pass->script);
+	if(bin<0) return;
+	++part->sequenceDensity[r->replica_number*(pass->script->Nreplicas+1)+bin];
+}
+
+void calcSequenceDensity_merge(struct analysis_pass_struct *pass, struct analysis_part_struct *part){
+	int i,j,k;
+
+	for(i=0,k=0;i<=pass->script->Nreplicas; i++){
+		for(j=0;j<=pass->script->Nreplicas; j++,k++){
+			pass->sequenceDensity[i][j]+=part->sequenceDensity[k];
+			part->sequenceDensity[k]=0;
 		}
-		bin=find_bin_from_w(db->record[i]->w,0,nominal,script);
-		++sequenceDensity[db->record[i]->replica_number][bin];
 	}
+}
+
+void calcSequenceDensity_finish(struct analysis_pass_struct *pass){
+	unsigned int **sequenceDensity=pass->sequenceDensity;
+	const struct script_struct *script=pass->script;
+	int i,j;
+
 	for(i=0;i<script->Nreplicas; i++){
 		for(j=0;j<script->Nreplicas; j++){
 			if(sequenceDensity[i][j]>sequenceDensity[i][script->Nreplicas])sequenceDensity[i][script->Nreplicas]=sequenceDensity[i][j];
@@ -2639,25 +3231,7 @@ void calcSequenceDensity(unsigned int **sequenceDensity, const struct database_s
 	}
 }
 
-void getMinMaxSampleDensity(float *min, float *max, unsigned int whichData, unsigned int whichReplica, const struct database_struct *db, const struct nominal_struct *nominal, const struct script_struct *script){
-	//whichReplica == Nreplicas is a flag to get global min and max
-	int i,j,bin;
-	bool first=true;
-
-	//Might be able to speed this up significantly since they are ordered
-	//But I only use whichReplica=Nreplica flag so don't worry
-	for(i=0;i<db->Nrecords;i++){
-		bin=find_bin_from_w(db->record[i]->w,0,nominal,script);
-		if(whichReplica!=script->Nreplicas && bin!=whichReplica)continue;
-		for(j=script->Nsamples_per_run*(whichData); j<script->Nsamples_per_run*(whichData+1); j++){
-			if(db->record[i]->generic_data[j]<*min||first)*min=db->record[i]->generic_data[j];
-			if(db->record[i]->generic_data[j]>*max||first)*max=db->record[i]->generic_data[j];
-			first=false;
-		}
-	}
-}
-
-int calcSampleDensity(struct sampleDensity_struct *sd, unsigned int whichData, const struct graph_struct *graph, const struct database_struct *db, const struct nominal_struct *nominal, const struct script_struct *script, const struct analysis_option_struct *opt, const struct stats_struct *stats){
+int calcSampleDensity_begin(struct analysis_pass_struct *pass){
 // sd->b[replica][histogram bin]
 // sd->b[][0 to Nhisto-1] stores values, [][Nhisto] stores max value
 // sd->b[0 to Nreplicas-1][] stores individual replicas, 
@@ -2666,8 +3240,10 @@ int calcSampleDensity(struct sampleDensity_struct *sd, unsigned int whichData, c
 // Use whichData == 1 for first additional data
 // Data must be allocated for sd->b on [Nreplicas+1][sd->Ncol+1]
 
+	struct sampleDensity_struct *sd=pass->sampleDensity;
+	const struct script_struct *script=pass->script;
+	const struct graph_struct *graph=pass->graph;
 	int i,j;
-	float val;
 	float range;
 
 	//Initialize sd->b and determine min and max 'sample' values
@@ -2676,29 +3252,54 @@ int calcSampleDensity(struct sampleDensity_struct *sd, unsigned int whichData, c
 			sd->b[i][j]=0;
 		}
 	}
-	if(opt->discardOutside&&(script->coordinate_type==Spatial||script->coordinate_type==Umbrella)){
+	if(pass->opt->discardOutside&&(script->coordinate_type==Spatial||script->coordinate_type==Umbrella)){
 		range=graph[script->Nreplicas-1].w[0]-graph[0].w[0];
 		sd->min=graph[0].w[0]-(range/sd->Ncol/2.0);
 		sd->max=graph[script->Nreplicas-1].w[0]+(range/sd->Ncol/2.0);
 	}else{
-		getMinMaxSampleDensity(&(sd->min),&(sd->max),whichData,script->Nreplicas,db,nominal,script);
+		if(get_sample_bounds(pass,&(sd->min),&(sd->max))!=0) return 1;
 	}
 	if(sd->max==sd->min){
 		fprintf(stderr,"Error: sample max (%f) == sample min (%f). Exiting to avoid div by 0\n",sd->max,sd->min);
 		return 1;
 	}
 	sd->binWidth=(sd->max-sd->min)/sd->Ncol;
-	
-	for(i=0;i<db->Nrecords;i++){
-		for(j=script->Nsamples_per_run*(whichData); j<script->Nsamples_per_run*(whichData+1); j++){
-			if(db->record[i]->sequence_number<(unsigned int)(opt->equilFraction*stats->max_sequence_number)){
-				continue;
-			}
-			val=db->record[i]->generic_data[j];
-			if(val<sd->min||val>sd->max)continue; //will only ocur if values are discarded
-			++sd->b[db->record[i]->replica_number][(int)floor((val-sd->min)/sd->binWidth)];
+	return 0;
+}
+
+void calcSampleDensity_record(const struct analysis_pass_struct *pass, struct analysis_part_struct *part, const struct record_struct *r){
+	const struct sampleDensity_struct *sd=pass->sampleDensity;
+	const struct script_struct *script=pass->script;
+	unsigned int *b;
+	int j;
+	float val;
+
+	if(r->sequence_number<pass->equil_sequence_number) return;
+	b=part->sampleDensity+r->replica_number*(sd->Ncol+1);
+	for(j=script->Nsamples_per_run*(pass->whichData); j<script->Nsamples_per_run*(pass->whichData+1); j++){
+		val=r->generic_data[j];
+		if(val<sd->min||val>sd->max)continue; //will only ocur if values are discarded
+		++b[(int)floor((val-sd->min)/sd->binWidth)];
+	}
+}
+
+void calcSampleDensity_merge(struct analysis_pass_struct *pass, struct analysis_part_struct *part){
+	struct sampleDensity_struct *sd=pass->sampleDensity;
+	int i,j,k;
+
+	for(i=0,k=0;i<=pass->script->Nreplicas; i++){
+		for(j=0;j<=sd->Ncol; j++,k++){
+			sd->b[i][j]+=part->sampleDensity[k];
+			part->sampleDensity[k]=0;
 		}
 	}
+}
+
+void calcSampleDensity_finish(struct analysis_pass_struct *pass){
+	struct sampleDensity_struct *sd=pass->sampleDensity;
+	const struct script_struct *script=pass->script;
+	int i,j;
+
 	for(i=0;i<script->Nreplicas; i++){
 		//Dump max value down to bin below
 		sd->b[i][sd->Ncol-1]+=sd->b[i][sd->Ncol];
@@ -2715,18 +3316,19 @@ int calcSampleDensity(struct sampleDensity_struct *sd, unsigned int whichData, c
 			if(sd->b[i][j]>sd->b[i][sd->Ncol])sd->b[i][sd->Ncol]=sd->b[i][j];
 		}
 	}
-	return 0;
 }
 
-int calcPMF(struct pmf_struct *pmf, unsigned int whichData, const struct graph_struct *graph, const struct database_struct *db, const struct nominal_struct *nominal, const struct script_struct *script, const struct analysis_option_struct *opt){
+int calcPMF_begin(struct analysis_pass_struct *pass){
 // pmf->f[histogram bin]
 // pmf->f[0 to Nhisto-1] stores values
 // Use whichData == 1 for first additional data
 // Data must be allocated for pmf->f and pmf->n on [pmf->Ncol+1]
 //Important note: this is not going to be perfect for temperature since it includes all data without kB factor
 
-	int i,j,k;
-	float val;
+	struct pmf_struct *pmf=pass->pmf;
+	const struct script_struct *script=pass->script;
+	const struct graph_struct *graph=pass->graph;
+	int i;
 	float range;
 
 	//Initialize pmf->f and determine min and max 'sample' values
@@ -2734,13 +3336,13 @@ int calcPMF(struct pmf_struct *pmf, unsigned int whichData, const struct graph_s
 		pmf->f[i]=0.0;
 		pmf->n[i]=0;
 	}
-	if(opt->discardOutside&&(script->coordinate_type==Spatial||script->coordinate_type==Umbrella)){
+	if(pass->opt->discardOutside&&(script->coordinate_type==Spatial||script->coordinate_type==Umbrella)){
 		range=graph[script->Nreplicas-1].w[0]-graph[0].w[0];
 		pmf->min=graph[0].w[0]-(range/(pmf->Ncol-1)/2.0);
 		pmf->max=graph[script->Nreplicas-1].w[0]+(range/(pmf->Ncol-1)/2.0);
 		fprintf(stderr,"PMF RANGE = %f (%f to %f)\n",range,pmf->min,pmf->max);
 	}else{
-		getMinMaxSampleDensity(&(pmf->min),&(pmf->max),whichData,script->Nreplicas,db,nominal,script);
+		if(get_sample_bounds(pass,&(pmf->min),&(pmf->max))!=0) return 1;
 		fprintf(stderr,"PMF RANGE = (%f to %f)\n",pmf->min,pmf->max);
 	}
 	if(floatEqual(pmf->max,pmf->min)){
@@ -2748,15 +3350,40 @@ int calcPMF(struct pmf_struct *pmf, unsigned int whichData, const struct graph_s
 		return 1;
 	}
 	pmf->binWidth=(pmf->max-pmf->min)/pmf->Ncol;
-	
-	for(i=0;i<db->Nrecords;i++){
-		for(j=script->Nsamples_per_run*(whichData),k=0; j<script->Nsamples_per_run*(whichData+1); j++,k++){
-			val=db->record[i]->generic_data[j];
-			if(val<pmf->min||val>pmf->max)continue; //will only ocur if values are discarded
-			pmf->f[(int)floor((val-pmf->min)/pmf->binWidth)]+=db->record[i]->generic_data[k];
-			++pmf->n[(int)floor((val-pmf->min)/pmf->binWidth)];
-		}
+	return 0;
+}
+
+void calcPMF_record(const struct analysis_pass_struct *pass, struct analysis_part_struct *part, const struct record_struct *r){
+	const struct pmf_struct *pmf=pass->pmf;
+	const struct script_struct *script=pass->script;
+	int j,k,bin;
+	float val;
+
+	for(j=script->Nsamples_per_run*(pass->whichData),k=0; j<script->Nsamples_per_run*(pass->whichData+1); j++,k++){
+		val=r->generic_data[j];
+		if(val<pmf->min||val>pmf->max)continue; //will only ocur if values are discarded
+		bin=(int)floor((val-pmf->min)/pmf->binWidth);
+		part->pmf_f[bin]+=r->generic_data[k];
+		++part->pmf_n[bin];
+	}
+}
+
+void calcPMF_merge(struct analysis_pass_struct *pass, struct analysis_part_struct *part){
+	struct pmf_struct *pmf=pass->pmf;
+	int i;
+
+	for(i=0;i<=pmf->Ncol; i++){
+		pmf->f[i]+=part->pmf_f[i];
+		pmf->n[i]+=part->pmf_n[i];
+		part->pmf_f[i]=0.0;
+		part->pmf_n[i]=0;
 	}
+}
+
+void calcPMF_finish(struct analysis_pass_struct *pass){
+	struct pmf_struct *pmf=pass->pmf;
+	int i;
+
 	//Dump max value down to bin below
 	pmf->f[pmf->Ncol-1]+=pmf->f[pmf->Ncol];
 	pmf->n[pmf->Ncol-1]+=pmf->n[pmf->Ncol];
@@ -2768,6 +3395,185 @@ int calcPMF(struct pmf_struct *pmf, unsigned int whichData, const struct graph_s
 			pmf->f[i]/=(float)pmf->n[i];
 		}
 	}
+}
+
+// Keeps the sampled values within the PMF range for WHAM and MBAR, in the window that find_bin_from_w() gives the
+// record, as extractDatabase did for the external WHAM
+void umbrella_samples_record(const struct analysis_pass_struct *pass, struct analysis_part_struct *part, const struct record_struct *r){
+	const struct pmf_struct *pmf=pass->pmf;
+	const struct script_struct *script=pass->script;
+	struct umbrella_samples_struct *u=&(part->umbrella);
+	unsigned char block;
+	int j,window;
+	float val;
+
+	if(r->sequence_number<pass->equil_sequence_number) return;
+	window=find_bin_from_w(r->w,0,script);
+	if(window<0) return;
+	block=(unsigned char)(((unsigned long long)(r->sequence_number-pass->equil_sequence_number)*FREE_ENERGY_BLOCKS)/(pass->stats->max_sequence_number+1-pass->equil_sequence_number));
+	for(j=script->Nsamples_per_run*(pass->whichData); j<script->Nsamples_per_run*(pass->whichData+1); j++){
+		val=r->generic_data[j];
+		if(val<pmf->min||val>pmf->max)continue;
+		u->x[u->N]=val;
+		u->window[u->N]=window;
+		u->block[u->N]=block;
+		u->N++;
+	}
+}
+
+void umbrella_samples_merge(struct analysis_pass_struct *pass, struct analysis_part_struct *part){
+	struct umbrella_samples_struct *u=pass->umbrella;
+
+	memcpy(u->x+u->N,part->umbrella.x,part->umbrella.N*sizeof(float));
+	memcpy(u->window+u->N,part->umbrella.window,part->umbrella.N*sizeof(int));
+	memcpy(u->block+u->N,part->umbrella.block,part->umbrella.N*sizeof(unsigned char));
+	u->N+=part->umbrella.N;
+	part->umbrella.N=0;
+}
+
+// Solves for the window free energies and the PMF with WHAM (method 1) or MBAR (method 2) on the samples of the
+// given error block, or on all of them for block<0
+int solve_free_energies(int method, int block, const struct umbrella_struct *u, const struct umbrella_samples_struct *samples, const struct pmf_struct *pmf, float *x, double *f, double *p, int *iterations){
+	unsigned long *Nk;
+	double *count,*center;
+	unsigned long n,N;
+	int i,check;
+
+	Nk=(unsigned long *)calloc(u->K,sizeof(unsigned long));
+	count=(double *)calloc(pmf->Ncol,sizeof(double));
+	center=(double *)malloc(pmf->Ncol*sizeof(double));
+	if(Nk==NULL || count==NULL || center==NULL){
+		fprintf(stderr,"Error: unable to allocate memory for WHAM/MBAR\n");
+		return 1;
+	}
+	for(i=0;i<pmf->Ncol;i++) center[i]=pmf->min+(i+0.5)*pmf->binWidth;
+	for(n=0,N=0;n<samples->N;n++){
+		if(block>=0 && samples->block[n]!=block) continue;
+		Nk[samples->window[n]]++;
+		if(method==1){
+			i=(int)floor((samples->x[n]-pmf->min)/pmf->binWidth);
+			if(i==pmf->Ncol) i--;
+			count[i]+=1.0;
+		}else{
+			x[N]=samples->x[n];
+		}
+		N++;
+	}
+	if(N==0){
+		check=1;
+	}else if(method==1){
+		check=solve_wham(u,Nk,pmf->Ncol,center,count,f,p,iterations);
+	}else{
+		check=solve_mbar(u,Nk,N,x,pmf->Ncol,pmf->min,pmf->binWidth,f,p,iterations);
+	}
+	free(Nk);
+	free(count);
+	free(center);
+	return check;
+}
+
+// Writes the window free energies and the PMF in kcal/mol to ./tt.wham or ./tt.mbar. The errors are the standard
+// errors over FREE_ENERGY_BLOCKS blocks of sequence numbers, with each block's PMF shifted to 0 where the PMF of
+// all the samples has its minimum and each block's free energies relative to the first sampled window.
+int write_free_energies(int method, const struct analysis_option_struct *opt, const struct script_struct *script, const struct nominal_struct *nominal, const struct pmf_struct *pmf, const struct umbrella_samples_struct *samples){
+	struct umbrella_struct u;
+	char filename[100];
+	FILE *out;
+	float *x=(float *)NULL;
+	double *f,*p,*fb,*pb;
+	double mean,var,d,shift;
+	int b,i,k,n,iterations,block_iterations,ref_bin,ref_window;
+	bool ok[FREE_ENERGY_BLOCKS];
+	const char *name=(method==1?"WHAM":"MBAR");
+
+	u.K=script->Nreplicas;
+	u.beta=1.0/(BOLTZMANN_CONSTANT*script->temperature);
+	u.circular=script->circular_replica_coordinate;
+	u.period=script->circular_equality_distance;
+	u.Nthreads=opt->Nthreads;
+	u.center=(double *)malloc(u.K*sizeof(double));
+	u.force=(double *)malloc(u.K*sizeof(double));
+	f=(double *)malloc(u.K*sizeof(double));
+	p=(double *)malloc(pmf->Ncol*sizeof(double));
+	fb=(double *)malloc(FREE_ENERGY_BLOCKS*u.K*sizeof(double));
+	pb=(double *)malloc(FREE_ENERGY_BLOCKS*pmf->Ncol*sizeof(double));
+	if(method==2) x=(float *)malloc(samples->N*sizeof(float));
+	if(u.center==NULL || u.force==NULL || f==NULL || p==NULL || fb==NULL || pb==NULL || (method==2 && x==NULL)){
+		fprintf(stderr,"Error: unable to allocate memory for %s\n",name);
+		return 1;
+	}
+	for(k=0;k<u.K;k++){
+		u.center[k]=nominal[k].w[0];
+		u.force[k]=nominal[k].force;
+	}
+
+	fprintf(stderr,"%s: %lu samples in %d windows\n",name,samples->N,u.K);
+	if(solve_free_energies(method,-1,&u,samples,pmf,x,f,p,&iterations)!=0){
+		fprintf(stderr,"Error: %s did not find the free energies\n",name);
+		return 1;
+	}
+	fprintf(stderr,"%s converged in %d iterations\n",name,iterations);
+	for(b=0;b<FREE_ENERGY_BLOCKS;b++){
+		ok[b]=(solve_free_energies(method,b,&u,samples,pmf,x,fb+b*u.K,pb+b*pmf->Ncol,&block_iterations)==0);
+		if(!ok[b]) fprintf(stderr,"Warning: %s failed on error block %d, which is left out of the errors\n",name,b);
+	}
+
+	ref_bin=-1;
+	for(i=0;i<pmf->Ncol;i++) if(!isnan(p[i]) && p[i]==0.0){ ref_bin=i; break; }
+	ref_window=-1;
+	for(k=0;k<u.K;k++) if(!isnan(f[k])){ ref_window=k; break; }
+
+	sprintf(filename,"./%s.%s",opt->title,(method==1?"wham":"mbar"));
+	out=fopen(filename,"w");
+	if(out==NULL){
+		fprintf(stderr,"Error: unable to open %s for output\n",filename);
+		return 1;
+	}
+	fprintf(out,"# %s free energies along additional data %d at %f K from %lu samples, converged in %d iterations\n",name,opt->additionalDataWithSampling,script->temperature,samples->N,iterations);
+	fprintf(out,"# energies in kcal/mol; errors are standard errors over %d blocks of sequence numbers\n",FREE_ENERGY_BLOCKS);
+	for(k=0;k<u.K;k++){
+		mean=var=0.0;
+		n=0;
+		for(b=0;b<FREE_ENERGY_BLOCKS;b++){
+			if(!ok[b] || isnan(fb[b*u.K+k]) || isnan(fb[b*u.K+ref_window])) continue;
+			mean+=fb[b*u.K+k]-fb[b*u.K+ref_window];
+			n++;
+		}
+		if(n>0) mean/=n;
+		for(b=0;b<FREE_ENERGY_BLOCKS;b++){
+			if(!ok[b] || isnan(fb[b*u.K+k]) || isnan(fb[b*u.K+ref_window])) continue;
+			d=fb[b*u.K+k]-fb[b*u.K+ref_window]-mean;
+			var+=d*d;
+		}
+		fprintf(out,"window: %d   w: %f   force: %f   f: %f   error: %f\n",k,u.center[k],u.force[k],f[k]/u.beta,(n>1?sqrt(var/(n*(n-1.0)))/u.beta:NAN));
+	}
+	for(i=0;i<pmf->Ncol;i++){
+		mean=var=0.0;
+		n=0;
+		for(b=0;b<FREE_ENERGY_BLOCKS;b++){
+			if(!ok[b] || ref_bin<0 || isnan(pb[b*pmf->Ncol+i]) || isnan(pb[b*pmf->Ncol+ref_bin])) continue;
+			mean+=pb[b*pmf->Ncol+i]-pb[b*pmf->Ncol+ref_bin];
+			n++;
+		}
+		if(n>0) mean/=n;
+		for(b=0;b<FREE_ENERGY_BLOCKS;b++){
+			if(!ok[b] || ref_bin<0 || isnan(pb[b*pmf->Ncol+i]) || isnan(pb[b*pmf->Ncol+ref_bin])) continue;
+			shift=pb[b*pmf->Ncol+ref_bin];
+			d=pb[b*pmf->Ncol+i]-shift-mean;
+			var+=d*d;
+		}
+		fprintf(out,"pmf: %f   %f   %f\n",pmf->min+(i+0.5)*pmf->binWidth,p[i],(n>1?sqrt(var/(n*(n-1.0))):NAN));
+	}
+	fclose(out);
+	fprintf(stderr,"%s free energies and PMF written to %s\n",name,filename);
+
+	free(u.center);
+	free(u.force);
+	free(f);
+	free(p);
+	free(fb);
+	free(pb);
+	free(x);
 	return 0;
 }
 
@@ -0,0 +1,129 @@
+/*
+ *  This file is part of Distributed Replica.
+ *  Copyright May 9 2009
+ *
+ *  Distributed Replica manages a series of simulations that separately sample phase space
+ *  and coordinates their efforts under the Distributed Replica Potential Energy Function.
+ *  See, for example T. Rodinger, P.L. Howell, and R. Pomès, "Distributed Replica Sampling"    
+ *  J. Chem. Theory Comput., 2:725 (2006).
+ *
+ *  Distributed Replica is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Distributed Replica is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Distributed Replica.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Converts a force database between the row format that the server appends to and the columnar format
+ * (see force_database_class.h). Either format can be given to analyse_force_database.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "force_database_class.h"
+
+#define CONVERT_BATCH_RECORDS 4096
+
+void showUsage(const char *c){
+	fprintf(stderr,"Usage: %s [-r] [-z level] <from database> <to database>\n",c);
+	fprintf(stderr,"       converts a force database to the columnar format (the file may be converted in place)\n");
+	fprintf(stderr,"       -r write the row format instead, e.g. so that the server can add to the database again\n");
+	fprintf(stderr,"          (the file to write must not exist)\n");
+	fprintf(stderr,"       -z [int] zlib compression level 0-9 for the columns; 0 stores them as they are (default = 1)\n");
+}
+
+int main(int argc, char *argv[]){
+	class force_database_class *from;
+	class force_database_class *to_rows=NULL;
+	class columnar_writer_class *to_columns=NULL;
+	struct database_struct db=EMPTY_DATABASE_STRUCT;
+	struct record_struct *records;
+	char *buffer;
+	unsigned int i,j,N,record_size;
+	int rows=0;
+	int level=1;
+	int c;
+
+	while( (c=getopt(argc,argv,"rz:"))!=-1 ){
+		switch(c){
+			case 'r': rows=1; break;
+			case 'z': level=atoi(optarg); break;
+			default: showUsage(argv[0]); exit(1);
+		}
+	}
+	if(argc-optind!=2 || level<0 || level>9){
+		showUsage(argv[0]);
+		exit(1);
+	}
+	if(access(argv[optind],R_OK)!=0){
+		fprintf(stderr,"Error: cannot read %s\n",argv[optind]);
+		exit(1);
+	}
+	if(rows && access(argv[optind+1],F_OK)==0){
+		fprintf(stderr,"Error: %s exists already\n",argv[optind+1]);
+		exit(1);
+	}
+
+	from=new force_database_class(argv[optind],1);
+	if(!from->header_exists){
+		fprintf(stderr,"Error: %s is not a force database\n",argv[optind]);
+		exit(1);
+	}
+	from->get_header_information(&db);
+	record_size=from->get_record_size();
+
+	if(rows){
+		to_rows=new force_database_class(argv[optind+1],0);
+		if(!to_rows->set_header_information(&db)){
+			fprintf(stderr,"Error: cannot write the header of %s\n",argv[optind+1]);
+			exit(1);
+		}
+	}else{
+		to_columns=new columnar_writer_class(argv[optind+1],&db,level);
+	}
+
+	// a row database is used in place; columnar records are decoded a batch at a time
+	if( (records=from->map_records(&(db.mapped_size)))!=NULL ){
+		db.unsorted_record=records;
+		buffer=NULL;
+	}else if( (buffer=(char *)malloc((size_t)CONVERT_BATCH_RECORDS*record_size))==NULL ){
+		fprintf(stderr,"Error: cannot allocate memory for the conversion\n");
+		exit(1);
+	}
+	for(i=0;i<db.Nrecords;i+=N){
+		N=db.Nrecords-i;
+		if(N>CONVERT_BATCH_RECORDS) N=CONVERT_BATCH_RECORDS;
+		if(buffer!=NULL){
+			for(j=0;j<N;j++) from->read_record_to_given_memory(i+j,(struct record_struct *)(buffer+(size_t)j*record_size));
+			records=(struct record_struct *)buffer;
+		}else{
+			records=(struct record_struct *)(((char *)db.unsorted_record)+(size_t)i*record_size);
+		}
+		if(rows) to_rows->append_records(records,N);
+		else to_columns->add_records(records,N);
+	}
+
+	if(rows){
+		to_rows->sync();
+		delete to_rows;
+	}else{
+		to_columns->finish();
+		delete to_columns;
+	}
+	if(buffer!=NULL) free(buffer);
+	free_database_records(&db);
+	delete from;
+	fprintf(stderr,"Converted %u records from %s to %s in the %s format\n",db.Nrecords,argv[optind],argv[optind+1],rows ? "row" : "columnar");
+	return(0);
+}
@@ -0,0 +1,97 @@
+/*
+ *  This file is part of Distributed Replica.
+ *  Copyright May 9 2009
+ *
+ *  Distributed Replica manages a series of simulations that separately sample phase space
+ *  and coordinates their efforts under the Distributed Replica Potential Energy Function.
+ *  See, for example T. Rodinger, P.L. Howell, and R. Pomès, "Distributed Replica Sampling"    
+ *  J. Chem. Theory Comput., 2:725 (2006).
+ *
+ *  Distributed Replica is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Distributed Replica is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Distributed Replica.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// CRC32C (Castagnoli) checksums for the sectioned snapshot format.
+// Call crc32c_init() once, before any thread uses crc32c_update(). A checksum is built by starting from
+// CRC32C_START, passing every piece of data through crc32c_update() and finishing with crc32c_final().
+// With SSE4.2 available at compile time (e.g. -msse4.2 or -xSSE4.2) the crc32 instruction is used.
+
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLYNOMIAL 0x82F63B78u   //reflected Castagnoli polynomial
+#define CRC32C_START 0xFFFFFFFFu
+
+uint32_t crc32c_table[8][256];
+
+void crc32c_init(void){
+	uint32_t c;
+
+	for(int i=0;i<256;i++){
+		c=i;
+		for(int k=0;k<8;k++) c=(c&1)?(c>>1)^CRC32C_POLYNOMIAL:(c>>1);
+		crc32c_table[0][i]=c;
+	}
+	for(int i=0;i<256;i++){
+		c=crc32c_table[0][i];
+		for(int t=1;t<8;t++){
+			c=crc32c_table[0][c&0xFF]^(c>>8);
+			crc32c_table[t][i]=c;
+		}
+	}
+}
+
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t length){
+	const unsigned char *p=(const unsigned char *)data;
+
+#if defined(__SSE4_2__)
+	while(length>0 && ((uintptr_t)p&7)!=0){
+		crc=_mm_crc32_u8(crc,*p++);
+		length--;
+	}
+#if defined(__x86_64__)
+	for(;length>=8;length-=8,p+=8) crc=(uint32_t)_mm_crc32_u64(crc,*(const uint64_t *)p);
+#endif
+	for(;length>=4;length-=4,p+=4) crc=_mm_crc32_u32(crc,*(const uint32_t *)p);
+	for(;length>0;length--) crc=_mm_crc32_u8(crc,*p++);
+#else
+	uint32_t lo,hi;
+
+	// slicing by 8; the words are assembled bytewise so this is endian and alignment safe
+	for(;length>=8;length-=8,p+=8){
+		lo=crc^((uint32_t)p[0]|((uint32_t)p[1]<<8)|((uint32_t)p[2]<<16)|((uint32_t)p[3]<<24));
+		hi=(uint32_t)p[4]|((uint32_t)p[5]<<8)|((uint32_t)p[6]<<16)|((uint32_t)p[7]<<24);
+		crc=crc32c_table[7][lo&0xFF]^crc32c_table[6][(lo>>8)&0xFF]^crc32c_table[5][(lo>>16)&0xFF]^crc32c_table[4][lo>>24]^
+		    crc32c_table[3][hi&0xFF]^crc32c_table[2][(hi>>8)&0xFF]^crc32c_table[1][(hi>>16)&0xFF]^crc32c_table[0][hi>>24];
+	}
+	for(;length>0;length--) crc=crc32c_table[0][(crc^*p++)&0xFF]^(crc>>8);
+#endif
+	return(crc);
+}
+
+uint32_t crc32c_final(uint32_t crc){
+	return(crc^0xFFFFFFFFu);
+}
+
+uint32_t crc32c(const void *data, size_t length){
+	return(crc32c_final(crc32c_update(CRC32C_START,data,length)));
+}
+
+#endif
@@ -24,6 +24,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <zlib.h>
 
 struct header_struct
 {
@@ -54,13 +56,331 @@ struct database_struct{
 	int replica_offset;
 	struct record_struct *unsorted_record;
 	struct record_struct **record;
+	size_t mapped_size;             //non-zero if unsorted_record points into a mapping of the file (see map_records())
+	unsigned int max_sequence_number;       //largest sequence number in record[], found while read_in_database() removes duplicates
+	double *column_min,*column_max;         //of each column over record[], from the statistics of a columnar file; NULL if unknown
+};
+#define EMPTY_DATABASE_STRUCT {0,0,0,0,0,0,0,(struct record_struct *)NULL,(struct record_struct **)NULL,0,0,(double *)NULL,(double *)NULL}
+
+// Releases db->unsorted_record whether it was read into memory or mapped, and the column statistics
+void free_database_records(struct database_struct *db)
+{
+	free(db->column_min);
+	db->column_min=db->column_max=(double *)NULL;
+	if(db->unsorted_record==NULL) return;
+	if(db->mapped_size) munmap(((char *)db->unsorted_record)-sizeof(struct header_struct),db->mapped_size);
+	else free(db->unsorted_record);
+	db->unsorted_record=NULL;
+	db->mapped_size=0;
+}
+
+// The index next to the database (<database file>.index) lists (replica_number, sequence_number, record_number)
+// for every record: first Nsorted entries sorted by replica and sequence number without duplicates (the earliest
+// record is kept), then Ntail entries in the order the records were appended. The program that appends to the
+// database adds to the tail and merges it into the sorted part once it has grown to a quarter of it.
+#define INDEX_MAGIC "DRix"
+#define INDEX_MIN_TAIL_TO_MERGE 4096
+#define INDEX_READ_CHUNK 1048576        //bytes of the database read at once when the index is rebuilt
+
+struct index_header_struct
+{
+	char magic[4];
+	unsigned int Nrecords;          //records of the database that are in the index
+	unsigned int Nsorted;
+	unsigned int Ntail;
+};
+
+struct index_entry_struct
+{
+	int replica_number;
+	unsigned int sequence_number;
+	unsigned int record_number;
+};
+
+int compare_index_entries(const void *a, const void *b)
+{
+	const struct index_entry_struct *e1=(const struct index_entry_struct *)a;
+	const struct index_entry_struct *e2=(const struct index_entry_struct *)b;
+
+	if     (e1->replica_number  != e2->replica_number)  return(e1->replica_number  > e2->replica_number  ? 1 : -1);
+	else if(e1->sequence_number != e2->sequence_number) return(e1->sequence_number > e2->sequence_number ? 1 : -1);
+	else if(e1->record_number   != e2->record_number)   return(e1->record_number   > e2->record_number   ? 1 : -1);
+	return(0);
+}
+
+// The columnar format (written by convert_force_database) holds the same records column by column, in chunks of
+// chunk_records records. The columns are the replica numbers, the sequence numbers, w, the forces, the move data
+// and each type of additional data. Each column of a chunk has its min and max and is stored either as is or
+// byte-shuffled and deflated with zlib. A directory with the position of every chunk follows the chunks.
+// force_database_class reads both formats but only appends to the row format.
+#define COLUMNAR_MAGIC "DRcl"
+#define COLUMNAR_VERSION 1
+#define COLUMNAR_CHUNK_BYTES 4194304            //uncompressed size of a chunk; chunk_records follows from it
+
+enum columnar_column_enum {ColumnReplica, ColumnSequence, ColumnW, ColumnForces, ColumnEnergies, ColumnAdditional};
+enum columnar_compression_enum {ColumnStored, ColumnShuffledDeflate};
+
+struct columnar_header_struct
+{
+	char magic[4];
+	unsigned int version;
+	struct header_struct header;
+	unsigned int chunk_records;
+	unsigned int Nchunks;
+	unsigned int Ncolumns;          //ColumnAdditional+NadditionalColumns_per_record
+	unsigned int unused;
+	unsigned long long directory_offset;
+};
+
+struct columnar_column_struct
+{
+	unsigned int compression;
+	unsigned int crc;               //zlib crc32() of the uncompressed column
+	unsigned long long offset;
+	unsigned int stored_size;
+	unsigned int raw_size;
+	double min;
+	double max;
+};
+
+struct columnar_chunk_struct
+{
+	unsigned long long offset;      //of the chunk's Ncolumns columnar_column_struct, which precede its data
+	unsigned int first_record;
+	unsigned int Nrecords;
+};
+
+// width of column c in 4-byte values per record, and where those values are in a record
+void columnar_column_layout(const struct header_struct *h, unsigned int c, unsigned int *width, size_t *offset)
+{
+	size_t generic=sizeof(struct record_struct);
+
+	switch(c)
+	{
+		case ColumnReplica:  *width=1; *offset=0; break;
+		case ColumnSequence: *width=1; *offset=sizeof(int); break;
+		case ColumnW:        *width=1; *offset=sizeof(int)+sizeof(unsigned int); break;
+		case ColumnForces:   *width=h->Nforces_per_record*h->Nligands; *offset=generic; break;
+		case ColumnEnergies: *width=h->Nenergies_per_record; *offset=generic+h->Nforces_per_record*h->Nligands*sizeof(float); break;
+		default:
+			*width=h->Nforces_per_record;
+			*offset=generic+(h->Nforces_per_record*h->Nligands+h->Nenergies_per_record+(c-ColumnAdditional)*h->Nforces_per_record)*sizeof(float);
+	}
+}
+
+// the n-th byte of every 4-byte value goes to the n-th quarter; floats of one column then deflate much better
+void shuffle_bytes(const unsigned char *in, unsigned char *out, size_t Nvalues)
+{
+	size_t i;
+	int b;
+
+	for(b=0;b<4;b++) for(i=0;i<Nvalues;i++) out[b*Nvalues+i]=in[4*i+b];
+}
+
+void unshuffle_bytes(const unsigned char *in, unsigned char *out, size_t Nvalues)
+{
+	size_t i;
+	int b;
+
+	for(b=0;b<4;b++) for(i=0;i<Nvalues;i++) out[4*i+b]=in[b*Nvalues+i];
+}
+
+void *columnar_allocate(void *p, size_t size)
+{
+	if( (p=realloc(p,size>0 ? size : 1))==NULL )
+	{
+		fprintf(stderr,"Error: cannot allocate memory for the columnar database\n");
+		exit(1);
+	}
+	return(p);
+}
+
+// Writes a database in the columnar format: records are added in row form and stored a chunk at a time.
+// The file is written under a temporary name and renamed by finish().
+class columnar_writer_class
+{
+private:
+	int fd;
+	char *filename;
+	char *tmpname;
+	struct columnar_header_struct h;
+	unsigned int record_size;
+	int level;                      //zlib level; 0 stores the columns as they are
+	unsigned char *rows;
+	unsigned int Nrows;
+	unsigned char *raw;
+	unsigned char *shuffled;
+	unsigned char *stored;
+	struct columnar_chunk_struct *directory;
+	unsigned long long position;
+
+	void write_at(const void *p, size_t size, unsigned long long where)
+	{
+		if(pwrite(fd,p,size,where)!=(ssize_t)size)
+		{
+			fprintf(stderr,"Error: write of the columnar database %s failed\n",tmpname);
+			exit(1);
+		}
+	}
+
+	void write_chunk(void)
+	{
+		struct columnar_column_struct *columns;
+		unsigned long long data=position+h.Ncolumns*sizeof(struct columnar_column_struct);
+		unsigned int c,i,width;
+		size_t offset,Nvalues;
+		uLongf size;
+		const unsigned char *out;
+		double v;
+
+		columns=(struct columnar_column_struct *)columnar_allocate(NULL,h.Ncolumns*sizeof(struct columnar_column_struct));
+		for(c=0;c<h.Ncolumns;c++)
+		{
+			columnar_column_layout(&h.header,c,&width,&offset);
+			Nvalues=(size_t)Nrows*width;
+			memset(columns+c,0,sizeof(struct columnar_column_struct));
+			columns[c].raw_size=Nvalues*4;
+			for(i=0;i<Nrows;i++) memcpy(raw+(size_t)i*width*4,rows+(size_t)i*record_size+offset,width*4);
+			for(i=0;i<Nvalues;i++)
+			{
+				if(c==ColumnReplica)       v=((int *)raw)[i];
+				else if(c==ColumnSequence) v=((unsigned int *)raw)[i];
+				else                       v=((float *)raw)[i];
+				if(i==0 || v<columns[c].min) columns[c].min=v;
+				if(i==0 || v>columns[c].max) columns[c].max=v;
+			}
+			columns[c].crc=crc32(0L,raw,columns[c].raw_size);
+			columns[c].compression=ColumnStored;
+			out=raw;
+			columns[c].stored_size=columns[c].raw_size;
+			if(level>0 && Nvalues>0)
+			{
+				shuffle_bytes(raw,shuffled,Nvalues);
+				size=compressBound(columns[c].raw_size);
+				stored=(unsigned char *)columnar_allocate(stored,size);
+				if(compress2(stored,&size,shuffled,columns[c].raw_size,level)==Z_OK && size<columns[c].raw_size)
+				{
+					columns[c].compression=ColumnShuffledDeflate;
+					columns[c].stored_size=size;
+					out=stored;
+				}
+			}
+			columns[c].offset=data;
+			write_at(out,columns[c].stored_size,data);
+			data+=columns[c].stored_size;
+		}
+		write_at(columns,h.Ncolumns*sizeof(struct columnar_column_struct),position);
+		free(columns);
+
+		directory=(struct columnar_chunk_struct *)columnar_allocate(directory,(h.Nchunks+1)*sizeof(struct columnar_chunk_struct));
+		directory[h.Nchunks].offset=position;
+		directory[h.Nchunks].first_record=h.header.Nrecords;
+		directory[h.Nchunks].Nrecords=Nrows;
+		h.Nchunks++;
+		h.header.Nrecords+=Nrows;
+		position=data;
+		Nrows=0;
+	}
+
+public:
+	columnar_writer_class(const char *filename_p, const struct database_struct *db, int level_p)
+	{
+		memcpy(h.magic,COLUMNAR_MAGIC,4);
+		h.version=COLUMNAR_VERSION;
+		h.header.Nrecords=0;
+		h.header.Nligands=db->Nligands;
+		h.header.Nforces_per_record=db->Nforces;
+		h.header.Nenergies_per_record=db->Nenergies;
+		h.header.NadditionalColumns_per_record=db->Nadditional_data;
+		record_size=sizeof(record_struct)+(db->Nforces*db->Nligands+db->Nenergies+db->Nforces*db->Nadditional_data)*sizeof(float);
+		h.chunk_records=COLUMNAR_CHUNK_BYTES/record_size;
+		if(h.chunk_records==0) h.chunk_records=1;
+		h.Nchunks=0;
+		h.Ncolumns=ColumnAdditional+db->Nadditional_data;
+		h.unused=0;
+		h.directory_offset=0;
+		level=level_p;
+
+		filename=(char *)columnar_allocate(NULL,strlen(filename_p)+1);
+		strcpy(filename,filename_p);
+		tmpname=(char *)columnar_allocate(NULL,strlen(filename_p)+sizeof(".tmp"));
+		sprintf(tmpname,"%s.tmp",filename_p);
+		if( (fd=open(tmpname,O_RDWR|O_CREAT|O_TRUNC,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH))==-1 )
+		{
+			fprintf(stderr,"Error: cannot open %s for writing\n",tmpname);
+			exit(1);
+		}
+		rows=(unsigned char *)columnar_allocate(NULL,(size_t)h.chunk_records*record_size);
+		raw=(unsigned char *)columnar_allocate(NULL,(size_t)h.chunk_records*record_size);
+		shuffled=(unsigned char *)columnar_allocate(NULL,(size_t)h.chunk_records*record_size);
+		stored=NULL;
+		directory=NULL;
+		Nrows=0;
+		position=sizeof(h);
+	}
+
+	~columnar_writer_class()
+	{
+		if(fd!=-1)
+		{
+			close(fd);
+			unlink(tmpname);
+		}
+		free(filename);
+		free(tmpname);
+		free(rows);
+		free(raw);
+		free(shuffled);
+		if(stored!=NULL) free(stored);
+		if(directory!=NULL) free(directory);
+	}
+
+	void add_records(const void *records, unsigned int N)
+	{
+		unsigned int n;
+
+		while(N>0)
+		{
+			n=h.chunk_records-Nrows;
+			if(n>N) n=N;
+			memcpy(rows+(size_t)Nrows*record_size,records,(size_t)n*record_size);
+			Nrows+=n;
+			records=((const char *)records)+(size_t)n*record_size;
+			N-=n;
+			if(Nrows==h.chunk_records) write_chunk();
+		}
+	}
+
+	// writes the last chunk, the directory and the header, and gives the file its name
+	void finish(void)
+	{
+		if(Nrows>0) write_chunk();
+		h.directory_offset=position;
+		write_at(directory,h.Nchunks*sizeof(struct columnar_chunk_struct),position);
+		write_at(&h,sizeof(h),0);
+		if(fsync(fd)!=0 || close(fd)!=0 || rename(tmpname,filename)!=0)
+		{
+			fprintf(stderr,"Error: cannot complete the columnar database %s\n",filename);
+			exit(1);
+		}
+		fd=-1;
+	}
 };
-#define EMPTY_DATABASE_STRUCT {0,0,0,0,0,0,0,(struct record_struct *)NULL,(struct record_struct **)NULL}
 
 class force_database_class
 {
 private:
 	int fd;
+	char *filename;
+	int index_fd;
+	struct index_header_struct index_header;
+	unsigned char columnar;
+	struct columnar_header_struct columnar_header;
+	struct columnar_chunk_struct *directory;
+	unsigned char *chunk_rows;      //the records of chunk_in_rows
+	unsigned int chunk_in_rows;
+	unsigned char *column_buffer;
+	unsigned char *stored_buffer;
 	struct header_struct header;
 	unsigned char verbose;
 
@@ -134,6 +454,209 @@ private:
 		}
 	}
 	
+	void row_format_check(void)
+	{
+		if(columnar)
+		{
+			fprintf(stderr,"Error: cannot add to a database in the columnar format; convert it back to rows with convert_force_database -r\n");
+			exit(1);
+		}
+	}
+
+	void open_columnar(long filesize)
+	{
+		size_t size;
+		unsigned int n;
+		unsigned long long Nrecords=0;
+
+		if( filesize<(long)sizeof(columnar_header) || pread(fd,&columnar_header,sizeof(columnar_header),0)!=sizeof(columnar_header) ||
+		    columnar_header.version!=COLUMNAR_VERSION )
+		{
+			fprintf(stderr,"Error: cannot read the header of the columnar database\n");
+			exit(1);
+		}
+		header=columnar_header.header;
+		size=(size_t)columnar_header.Nchunks*sizeof(struct columnar_chunk_struct);
+		directory=(struct columnar_chunk_struct *)columnar_allocate(NULL,size);
+		if(pread(fd,directory,size,columnar_header.directory_offset)!=(ssize_t)size)
+		{
+			fprintf(stderr,"Error: cannot read the chunk directory of the columnar database\n");
+			exit(1);
+		}
+		// columnar_record() finds the chunk of a record by division, so every chunk but the last must be full
+		if(columnar_header.chunk_records==0 || columnar_header.Ncolumns!=ColumnAdditional+header.NadditionalColumns_per_record)
+		{
+			fprintf(stderr,"Error: the header of the columnar database is corrupt\n");
+			exit(1);
+		}
+		for(n=0;n<columnar_header.Nchunks;n++)
+		{
+			if( directory[n].first_record!=(unsigned long long)n*columnar_header.chunk_records || directory[n].Nrecords>columnar_header.chunk_records ||
+			    (n+1<columnar_header.Nchunks && directory[n].Nrecords!=columnar_header.chunk_records) )
+			{
+				fprintf(stderr,"Error: the chunk directory of the columnar database is corrupt at chunk %u\n",n);
+				exit(1);
+			}
+			Nrecords+=directory[n].Nrecords;
+		}
+		if(Nrecords!=header.Nrecords)
+		{
+			fprintf(stderr,"Error: the chunk directory of the columnar database holds %llu records, not %u\n",Nrecords,header.Nrecords);
+			exit(1);
+		}
+		columnar=1;
+	}
+
+	// puts the records of chunk n into chunk_rows
+	void decode_chunk(unsigned int n)
+	{
+		if(n==chunk_in_rows) return;
+		if(chunk_rows==NULL) chunk_rows=(unsigned char *)columnar_allocate(NULL,(size_t)columnar_header.chunk_records*record_size);
+		read_chunk_records(n,chunk_rows);
+		chunk_in_rows=n;
+	}
+
+	const struct record_struct *columnar_record(unsigned int record_number)
+	{
+		unsigned int n=record_number/columnar_header.chunk_records;
+
+		decode_chunk(n);
+		return((const struct record_struct *)(chunk_rows+(size_t)(record_number-directory[n].first_record)*record_size));
+	}
+
+	char *index_filename(void)
+	{
+		char *name=(char *)malloc(strlen(filename)+sizeof(".index"));
+		if(name==NULL)
+		{
+			fprintf(stderr,"Error: cannot allocate memory for the index filename\n");
+			exit(1);
+		}
+		sprintf(name,"%s.index",filename);
+		return(name);
+	}
+
+	void write_index_header(void)
+	{
+		if(pwrite(index_fd,&index_header,sizeof(index_header),0)!=sizeof(index_header))
+		{
+			fprintf(stderr,"Error: write of the index header failed\n");
+			exit(1);
+		}
+	}
+
+	void append_index_entries(const struct index_entry_struct *entries, unsigned int N)
+	{
+		unsigned long int position=(unsigned long int)sizeof(index_header)+(unsigned long int)(index_header.Nsorted+index_header.Ntail)*sizeof(struct index_entry_struct);
+		size_t size=(size_t)N*sizeof(struct index_entry_struct);
+
+		if(N==0) return;
+		if(pwrite(index_fd,entries,size,position)!=(ssize_t)size)
+		{
+			fprintf(stderr,"Error: write of the index failed\n");
+			exit(1);
+		}
+		index_header.Ntail+=N;
+		index_header.Nrecords+=N;
+		write_index_header();
+	}
+
+	// adds the N records that start at records (record_number first) to the index
+	void index_records(const void *records, unsigned int first, unsigned int N)
+	{
+		struct index_entry_struct *entries;
+		const struct record_struct *r;
+		unsigned int i;
+
+		if(index_fd==-1 || N==0) return;
+		if( (entries=(struct index_entry_struct *)malloc((size_t)N*sizeof(struct index_entry_struct)))==NULL )
+		{
+			fprintf(stderr,"Error: cannot allocate memory for the index\n");
+			exit(1);
+		}
+		for(i=0;i<N;i++)
+		{
+			r=(const struct record_struct *)(((const char *)records)+(size_t)i*record_size);
+			entries[i].replica_number=r->replica_number;
+			entries[i].sequence_number=r->sequence_number;
+			entries[i].record_number=first+i;
+		}
+		append_index_entries(entries,N);
+		free(entries);
+		if(index_header.Ntail>=INDEX_MIN_TAIL_TO_MERGE && index_header.Ntail*4>=index_header.Nsorted) merge_index();
+	}
+
+	// adds the records from index_header.Nrecords to header.Nrecords, reading them from the database
+	void catch_up_index(void)
+	{
+		unsigned int chunk=INDEX_READ_CHUNK/record_size;
+		unsigned int N;
+		char *buffer;
+
+		if(chunk==0) chunk=1;
+		if( (buffer=(char *)malloc((size_t)chunk*record_size))==NULL )
+		{
+			fprintf(stderr,"Error: cannot allocate memory for the index\n");
+			exit(1);
+		}
+		while(index_header.Nrecords<header.Nrecords)
+		{
+			N=header.Nrecords-index_header.Nrecords;
+			if(N>chunk) N=chunk;
+			if(pread(fd,buffer,(size_t)N*record_size,sizeof(header)+(unsigned long int)index_header.Nrecords*record_size)!=(ssize_t)((size_t)N*record_size))
+			{
+				fprintf(stderr,"Error: read of records for the index failed\n");
+				exit(1);
+			}
+			index_records(buffer,index_header.Nrecords,N);
+		}
+		free(buffer);
+	}
+
+	// rewrites the index with the tail merged into the sorted part
+	void merge_index(void)
+	{
+		struct index_entry_struct *entries;
+		struct index_header_struct new_header;
+		unsigned int N;
+		char *name;
+		char *tmpname;
+		int new_fd;
+
+		if( (entries=read_index(index_fd,&index_header,index_header.Nrecords,&N))==NULL )
+		{
+			fprintf(stderr,"Error: cannot read the index to merge it\n");
+			exit(1);
+		}
+		memcpy(new_header.magic,INDEX_MAGIC,4);
+		new_header.Nrecords=index_header.Nrecords;
+		new_header.Nsorted=N;
+		new_header.Ntail=0;
+
+		name=index_filename();
+		tmpname=(char *)malloc(strlen(name)+sizeof(".tmp"));
+		if(tmpname==NULL)
+		{
+			fprintf(stderr,"Error: cannot allocate memory for the index filename\n");
+			exit(1);
+		}
+		sprintf(tmpname,"%s.tmp",name);
+		if( (new_fd=open(tmpname,O_RDWR|O_CREAT|O_TRUNC,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH))==-1 ||
+		    write(new_fd,&new_header,sizeof(new_header))!=sizeof(new_header) ||
+		    write(new_fd,entries,(size_t)N*sizeof(struct index_entry_struct))!=(ssize_t)((size_t)N*sizeof(struct index_entry_struct)) ||
+		    rename(tmpname,name)!=0 )
+		{
+			fprintf(stderr,"Error: cannot write the index file %s\n",tmpname);
+			exit(1);
+		}
+		close(index_fd);
+		index_fd=new_fd;
+		index_header=new_header;
+		free(entries);
+		free(tmpname);
+		free(name);
+	}
+
 	void print_header_information(void)
 	{
 		fprintf(stderr,"Header information:\n");
@@ -153,14 +676,27 @@ public:
 	force_database_class(const char *title, unsigned char verbose_p)
 	{
 		#define DATABASE_FILENAME "%s.forcedatabase"
-		char temp[sizeof(DATABASE_FILENAME)];
+		char *temp;
 		header_exists=0;
+		index_fd=-1;
+		columnar=0;
+		directory=NULL;
+		chunk_rows=NULL;
+		chunk_in_rows=(unsigned int)-1;
+		column_buffer=NULL;
+		stored_buffer=NULL;
 		record=NULL;
 		Nforces=0;
 		Nenergies=0;
 		Nadditionals=0;
 		verbose=verbose_p;
 
+		if( (temp=(char *)malloc(strlen(title)+sizeof(DATABASE_FILENAME)))==NULL )
+		{
+			fprintf(stderr,"Error: cannot allocate memory for the database filename\n");
+			exit(1);
+		}
+		filename=temp;
 		if(strlen(title)==2)
 			sprintf(temp,DATABASE_FILENAME,title);
 		else
@@ -186,6 +722,7 @@ public:
 				fprintf(stderr,"Error: read of the header failed\n");
 				exit(1);
 			}
+			if(memcmp(&header,COLUMNAR_MAGIC,4)==0) open_columnar(filesize);
 			if(verbose) print_header_information();
 			header_exists=1;
 			initialise_record();
@@ -197,8 +734,18 @@ public:
 
 	~force_database_class()
 	{
+		if(index_fd!=-1)
+		{
+			if(index_header.Ntail>0) merge_index();
+			close(index_fd);
+		}
 		close(fd);
 		if(record!=NULL) free(record);
+		free(filename);
+		if(directory!=NULL) free(directory);
+		if(chunk_rows!=NULL) free(chunk_rows);
+		if(column_buffer!=NULL) free(column_buffer);
+		if(stored_buffer!=NULL) free(stored_buffer);
 	}
 
 	unsigned char set_header_information(const struct database_struct *db)
@@ -226,6 +773,7 @@ public:
 	
 	void set_number_of_records(unsigned int Nrecords)
 	{
+		row_format_check();
 		if(!header_exists)
 		{
 			fprintf(stderr,"Error: cannot set the number of records because a header doesn't exist\n");
@@ -297,10 +845,11 @@ public:
  * End of functions that C. Neale commented out
  */
 	
-	unsigned char write_record(void)
+	unsigned char check_record(void)
 	{
 		unsigned char r=1;
 		header_existence_check();
+		row_format_check();
 		if(record->replica_number<0)
 		{
 			fprintf(stderr,"Error: attempt to write a record with no record header information\n");
@@ -321,6 +870,12 @@ public:
 			fprintf(stderr,"         Nadditionals=%d and header.Nforces_per_record*header.NadditionalColumns_per_record=(%d*%d)=%d\n",Nadditionals,header.Nforces_per_record,header.NadditionalColumns_per_record,header.Nforces_per_record*header.NadditionalColumns_per_record);
 			r=0;
 		}
+		return(r);
+	}
+
+	unsigned char write_record(void)
+	{
+		unsigned char r=check_record();
 
 		if(r)
 		{
@@ -335,11 +890,188 @@ public:
 			}
 
 			increment_number_of_records();
+			index_records(record,header.Nrecords-1,1);
 		}
 		initialise_record();
 		return(r);
 	}
 
+	// Write-behind: take_record() does the checks of write_record() but copies the record (get_record_size() bytes)
+	// to destination instead of writing it; the caller later writes many at once with append_records()
+	unsigned char take_record(void *destination)
+	{
+		unsigned char r=check_record();
+
+		if(r) memcpy(destination,record,record_size);
+		initialise_record();
+		return(r);
+	}
+
+	unsigned int get_record_size(void)
+	{
+		header_existence_check();
+		return(record_size);
+	}
+
+	// appends N records with one write and then updates the count in the header, so that a reader
+	// never counts a record that is not completely in the file
+	void append_records(const void *records, unsigned int N)
+	{
+		unsigned long int record_position=(unsigned long int)sizeof(header)+(unsigned long int)header.Nrecords*record_size;
+		size_t size=(size_t)N*record_size;
+
+		header_existence_check();
+		row_format_check();
+		if(N==0) return;
+		if(pwrite(fd,records,size,record_position)!=(ssize_t)size)
+		{
+			fprintf(stderr,"Error: write of records failed\n");
+			exit(1);
+		}
+		header.Nrecords+=N;
+		if(pwrite(fd,&header.Nrecords,sizeof(header.Nrecords),0)!=sizeof(header.Nrecords))
+		{
+			fprintf(stderr,"Error: cannot update number of records in database (write failed)\n");
+			exit(1);
+		}
+		index_records(records,header.Nrecords-N,N);
+	}
+
+	// For the program that appends to the database, after recover_number_of_records(): opens the index and keeps it
+	// up to date from now on. An index that is missing or does not fit the database is rebuilt from the records.
+	void open_index(void)
+	{
+		char *name=index_filename();
+		long filesize;
+
+		header_existence_check();
+		row_format_check();
+		if( (index_fd=open(name,O_RDWR|O_CREAT,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH))==-1 )
+		{
+			fprintf(stderr,"Error: cannot open the index file %s\n",name);
+			exit(1);
+		}
+		filesize=lseek(index_fd,0,SEEK_END);
+		if( filesize<(long)sizeof(index_header) || pread(index_fd,&index_header,sizeof(index_header),0)!=sizeof(index_header) ||
+		    memcmp(index_header.magic,INDEX_MAGIC,4)!=0 || index_header.Nrecords>header.Nrecords ||
+		    index_header.Nsorted+index_header.Ntail>index_header.Nrecords ||
+		    filesize<(long)(sizeof(index_header)+(unsigned long int)(index_header.Nsorted+index_header.Ntail)*sizeof(struct index_entry_struct)) )
+		{
+			if(header.Nrecords>0) fprintf(stderr,"Building the index of the database from its %u records\n",header.Nrecords);
+			memcpy(index_header.magic,INDEX_MAGIC,4);
+			index_header.Nrecords=0;
+			index_header.Nsorted=0;
+			index_header.Ntail=0;
+			if(ftruncate(index_fd,0)!=0)
+			{
+				fprintf(stderr,"Error: cannot truncate the index file %s\n",name);
+				exit(1);
+			}
+			write_index_header();
+		}
+		catch_up_index();
+		free(name);
+	}
+
+	// Reads the index open on fd and returns its entries for the first Nrecords records of the database, sorted
+	// and without duplicates (the earliest record is kept); *N is set to their number. Returns NULL if the index
+	// is not usable or does not cover Nrecords records.
+	static struct index_entry_struct *read_index(int fd, struct index_header_struct *h, unsigned int Nrecords, unsigned int *N)
+	{
+		struct index_entry_struct *entries;
+		struct index_entry_struct *merged;
+		unsigned int Nentries;
+		unsigned int i,j,k;
+		size_t size;
+
+		if(pread(fd,h,sizeof(*h),0)!=sizeof(*h) || memcmp(h->magic,INDEX_MAGIC,4)!=0 || h->Nrecords<Nrecords) return(NULL);
+		Nentries=h->Nsorted+h->Ntail;
+		size=(size_t)Nentries*sizeof(struct index_entry_struct);
+		if( (entries=(struct index_entry_struct *)malloc(size+sizeof(struct index_entry_struct)))==NULL ) return(NULL);
+		if( (merged=(struct index_entry_struct *)malloc(size+sizeof(struct index_entry_struct)))==NULL ||
+		    pread(fd,entries,size,sizeof(*h))!=(ssize_t)size )
+		{
+			free(entries);
+			if(merged!=NULL) free(merged);
+			return(NULL);
+		}
+		// the tail only holds records that came after those in the sorted part, so for equal keys i wins over j
+		qsort(entries+h->Nsorted,h->Ntail,sizeof(struct index_entry_struct),compare_index_entries);
+		i=0;
+		j=h->Nsorted;
+		k=0;
+		while(i<h->Nsorted || j<Nentries)
+		{
+			struct index_entry_struct *e;
+			if(j>=Nentries || (i<h->Nsorted && compare_index_entries(entries+i,entries+j)<=0)) e=entries+i++;
+			else e=entries+j++;
+			if(e->record_number>=Nrecords) continue;
+			if(k>0 && merged[k-1].replica_number==e->replica_number && merged[k-1].sequence_number==e->sequence_number) continue;
+			merged[k++]=*e;
+		}
+		free(entries);
+		*N=k;
+		return(merged);
+	}
+
+	// For readers: fills sorted[] with pointers to the first Nrecords records (record i at records+i*record_size),
+	// sorted by replica and sequence number and without duplicates, using the index. Returns how many were placed,
+	// or -1 if there is no index that covers the Nrecords records.
+	long get_sorted_records(struct record_struct *records, struct record_struct **sorted, unsigned int Nrecords)
+	{
+		struct index_header_struct h;
+		struct index_entry_struct *entries;
+		unsigned int N,i;
+		char *name=index_filename();
+		int ifd;
+
+		header_existence_check();
+		ifd=open(name,O_RDONLY);
+		free(name);
+		if(ifd==-1) return(-1);
+		entries=read_index(ifd,&h,Nrecords,&N);
+		close(ifd);
+		if(entries==NULL) return(-1);
+		for(i=0;i<N;i++) sorted[i]=(struct record_struct *)(((char *)records)+(size_t)entries[i].record_number*record_size);
+		free(entries);
+		return(N);
+	}
+
+	void sync(void)
+	{
+		if(fdatasync(fd)!=0) perror("Warning: fdatasync of the database failed");
+	}
+
+	// Crash recovery, for the program that appends to the database and before it appends anything:
+	// the number of records is however many complete records the file holds. Records that were appended
+	// before the header count was updated are kept, a partial record at the end is cut off, and a count
+	// that is larger than the file is lowered. Returns the count that the header had.
+	unsigned int recover_number_of_records(void)
+	{
+		unsigned int header_Nrecords=header.Nrecords;
+		long filesize;
+		unsigned long int complete;
+
+		header_existence_check();
+		row_format_check();
+		filesize=lseek(fd,0,SEEK_END);
+		complete=(filesize-(long)sizeof(header))/record_size;
+		if(filesize!=(long)(sizeof(header)+complete*record_size))
+		{
+			if(ftruncate(fd,sizeof(header)+complete*record_size)!=0)
+			{
+				fprintf(stderr,"Error: cannot remove the partial record at the end of the database\n");
+				exit(1);
+			}
+		}
+		if(complete!=header.Nrecords)
+		{
+			header.Nrecords=complete;
+			write_header();
+		}
+		return(header_Nrecords);
+	}
+
 	void add_all_forces_at_once(void *buffer)
 	{
 		Nforces=header.Nforces_per_record;
@@ -358,6 +1090,11 @@ public:
 		header_existence_check();
 		
 		if(record_number>=header.Nrecords) return(0);
+		if(columnar)
+		{
+			memcpy(record,columnar_record(record_number),record_size);
+			return(1);
+		}
 
 		unsigned long int record_position=(unsigned long int)sizeof(header)+(unsigned long int)record_number*record_size;
 		
@@ -376,6 +1113,11 @@ public:
 		header_existence_check();
 		
 		if(record_number>=header.Nrecords) return(0);
+		if(columnar)
+		{
+			memcpy(rec,columnar_record(record_number),record_size);
+			return(1);
+		}
 
 		unsigned long int record_position=(unsigned long int)sizeof(header)+(unsigned long int)record_number*record_size;
 		
@@ -389,6 +1131,140 @@ public:
 		return(1);
 	}
 	
+	// Maps the file read-only and returns a pointer to the first record, record i being record_size*i bytes further on.
+	// Nothing is copied; pages are read in as the records are used. The mapping stays valid after this object is
+	// deleted and is released with free_database_records() (db->mapped_size=*mapped_size). Returns NULL if the file
+	// cannot be mapped, in which case the caller can fall back on read_record_to_given_memory().
+	struct record_struct *map_records(size_t *mapped_size)
+	{
+		struct stat info;
+		size_t size;
+		void *p;
+
+		header_existence_check();
+		if(columnar) return(NULL);
+		size=sizeof(header)+(size_t)header.Nrecords*record_size;
+		if(fstat(fd,&info)!=0) return(NULL);
+		if((size_t)info.st_size<size)
+		{
+			fprintf(stderr,"Error: the database file is shorter than its %u records\n",header.Nrecords);
+			exit(1);
+		}
+		p=mmap(NULL,size,PROT_READ,MAP_SHARED,fd,0);
+		if(p==MAP_FAILED) return(NULL);
+		madvise(p,size,MADV_SEQUENTIAL);
+		*mapped_size=size;
+		return((struct record_struct *)(((char *)p)+sizeof(header)));
+	}
+
+	unsigned char is_columnar(void)
+	{
+		return(columnar);
+	}
+
+	unsigned int get_number_of_chunks(void)
+	{
+		return(columnar ? columnar_header.Nchunks : 0);
+	}
+
+	unsigned int get_number_of_columns(void)
+	{
+		return(ColumnAdditional+header.NadditionalColumns_per_record);
+	}
+
+	// Columnar format only: the min and max of column c over every record, from the statistics of its chunks
+	void get_column_bounds(unsigned int c, double *min, double *max)
+	{
+		unsigned int n;
+		double chunk_min,chunk_max;
+
+		for(n=0;n<columnar_header.Nchunks;n++)
+		{
+			read_column(n,c,NULL,&chunk_min,&chunk_max);
+			if(n==0 || chunk_min<*min) *min=chunk_min;
+			if(n==0 || chunk_max>*max) *max=chunk_max;
+		}
+	}
+
+	// Columnar format only: puts the records of chunk n at destination in row form, record_size bytes apart, and
+	// returns their number. Reading a whole database this way decodes each chunk once.
+	unsigned int read_chunk_records(unsigned int n, void *destination)
+	{
+		unsigned int c,i,width,Nrecords=0;
+		size_t offset;
+
+		if(column_buffer==NULL) column_buffer=(unsigned char *)columnar_allocate(NULL,(size_t)columnar_header.chunk_records*record_size);
+		for(c=0;c<columnar_header.Ncolumns;c++)
+		{
+			Nrecords=read_column(n,c,column_buffer,NULL,NULL);
+			columnar_column_layout(&header,c,&width,&offset);
+			for(i=0;i<Nrecords;i++) memcpy((unsigned char *)destination+(size_t)i*record_size+offset,column_buffer+(size_t)i*width*4,width*4);
+		}
+		return(Nrecords);
+	}
+
+	// Columnar format only: reads column c (see columnar_column_enum) of chunk n into destination, the 4-byte values
+	// of one record after the other, and returns the number of records in the chunk. min and max, unless NULL, get
+	// the column's statistics, which can be had without reading the column by passing a NULL destination.
+	unsigned int read_column(unsigned int n, unsigned int c, void *destination, double *min, double *max)
+	{
+		struct columnar_column_struct column;
+		unsigned int width;
+		size_t offset;
+		uLongf size;
+
+		if(!columnar || n>=columnar_header.Nchunks || c>=columnar_header.Ncolumns)
+		{
+			fprintf(stderr,"Error: there is no column %u in chunk %u of the database\n",c,n);
+			exit(1);
+		}
+		if(pread(fd,&column,sizeof(column),directory[n].offset+c*sizeof(column))!=sizeof(column))
+		{
+			fprintf(stderr,"Error: read of the columnar database failed\n");
+			exit(1);
+		}
+		// the sizes come from the file; destination only has room for the chunk's records
+		columnar_column_layout(&header,c,&width,&offset);
+		if( column.raw_size!=(unsigned long long)directory[n].Nrecords*width*4 || column.stored_size>column.raw_size ||
+		    (column.compression==ColumnStored && column.stored_size!=column.raw_size) ||
+		    (column.compression!=ColumnStored && column.compression!=ColumnShuffledDeflate) )
+		{
+			fprintf(stderr,"Error: column %u of chunk %u of the columnar database is corrupt (bad sizes)\n",c,n);
+			exit(1);
+		}
+		if(min!=NULL) *min=column.min;
+		if(max!=NULL) *max=column.max;
+		if(destination==NULL || column.raw_size==0) return(directory[n].Nrecords);
+
+		if(column.compression==ColumnStored)
+		{
+			if(pread(fd,destination,column.raw_size,column.offset)!=(ssize_t)column.raw_size)
+			{
+				fprintf(stderr,"Error: read of the columnar database failed\n");
+				exit(1);
+			}
+		}
+		else
+		{
+			// stored_buffer holds the deflated data and then, after it, the shuffled bytes
+			stored_buffer=(unsigned char *)columnar_allocate(stored_buffer,(size_t)column.stored_size+column.raw_size);
+			size=column.raw_size;
+			if(pread(fd,stored_buffer,column.stored_size,column.offset)!=(ssize_t)column.stored_size ||
+			   uncompress(stored_buffer+column.stored_size,&size,stored_buffer,column.stored_size)!=Z_OK || size!=column.raw_size)
+			{
+				fprintf(stderr,"Error: cannot read column %u of chunk %u of the columnar database\n",c,n);
+				exit(1);
+			}
+			unshuffle_bytes(stored_buffer+column.stored_size,(unsigned char *)destination,column.raw_size/4);
+		}
+		if(crc32(0L,(const Bytef *)destination,column.raw_size)!=column.crc)
+		{
+			fprintf(stderr,"Error: column %u of chunk %u of the columnar database is corrupt (checksum mismatch)\n",c,n);
+			exit(1);
+		}
+		return(directory[n].Nrecords);
+	}
+
 	void print_record(FILE *f)
 	{
 		unsigned int i,j;
@@ -10,6 +10,9 @@ int read_in_database(const struct analysis_option_struct *opt, const struct scri
 	class force_database_class *database;
 	int i,j;
 	unsigned long size;
+	long indexed;
+	unsigned int k,Nduplicates,Nbeyond_limit;
+	struct record_struct *previous;
 	
 
 	database=new force_database_class(opt->title,1);
@@ -42,54 +45,70 @@ int read_in_database(const struct analysis_option_struct *opt, const struct scri
 	}
 	*/
 	
-	if( (db->unsorted_record=(struct record_struct*)malloc(db->Nrecords*db->record_size))==NULL ){
+	if( (db->record=(struct record_struct**)malloc((db->Nrecords+1)*sizeof(struct record_struct *)))==NULL ){
 		fprintf(stderr,"Error: cannot allocated enough memory for the database\n");
 		return 1;
 	}
 
-	if( (db->record=(struct record_struct**)malloc((db->Nrecords+1)*sizeof(struct record_struct *)))==NULL ){
-		fprintf(stderr,"Error: cannot allocated enough memory for the database\n");
-		return 1;
+	// the records are used in place in a read-only mapping of the file; reading them in is the fallback
+	if( (db->unsorted_record=database->map_records(&(db->mapped_size)))!=NULL ){
+		fprintf(stderr,"Mapped the records of the database\n");
+		for(i=0;i<db->Nrecords;i++) db->record[i]=rec(i,db);
+	}else{
+		db->mapped_size=0;
+		if( (db->unsorted_record=(struct record_struct*)malloc(db->Nrecords*db->record_size))==NULL ){
+			fprintf(stderr,"Error: cannot allocated enough memory for the database\n");
+			return 1;
+		}
+
+		fprintf(stderr,"Reading records");
+		for(i=0;i<db->Nrecords;i++){
+			database->read_record_to_given_memory(i,rec(i,db));
+			db->record[i]=rec(i,db);
+			if( (i%1000)==999 ) fprintf(stderr,"."); fflush(stderr);
+		}
+		fprintf(stderr,"\n");
 	}
 
-	fprintf(stderr,"Reading records");
-	for(i=0;i<db->Nrecords;i++){
-		database->read_record_to_given_memory(i,rec(i,db));
-		db->record[i]=rec(i,db);
-		if( (i%1000)==999 ) fprintf(stderr,"."); fflush(stderr);
+	// the index that the server keeps next to the database has the records sorted and without duplicates already
+	indexed=database->get_sorted_records(db->unsorted_record,db->record,db->Nrecords);
+	delete database;
+	if(indexed>=0){
+		fprintf(stderr,"Using the index of the database: %ld records, %u duplicate records removed\n",indexed,db->Nrecords-(unsigned int)indexed);
+		db->Nrecords=indexed;
+	}else{
+		fprintf(stderr,"Sorting database... ");
+		if(sort_database(db,sysconf(_SC_NPROCESSORS_ONLN))!=0) return 1;
+		fprintf(stderr,"done.\n");
 	}
-	fprintf(stderr,"\n");
-	
-	fprintf(stderr,"Quicksorting database... ");
-	quicksort_database(db, 0, db->Nrecords-1);
-	fprintf(stderr,"done.\n");
 
+	// one stable pass drops the duplicates (the earliest record is kept) and the records beyond the sequence number limit
 	fprintf(stderr,"Removing duplicate records... ");
-	for(i=0;i<db->Nrecords-1;i++){
-		if(compare_records(db->record[i],db->record[i+1])==0){
-			//void *memmove(void *s1, const void *s2, size_t n);
-			//copies n bytes from the object pointed to by s2 into the object pointed to by s1
-			//Therefore this method copies over the second instance
-			//There is an assumption that it is the first instance that was used... is this true?
-			fprintf(stderr, "\nEliminating duplicate record at position %d   ",i);
-			memmove(db->record+i+1, db->record+i+2, ((int)db->Nrecords-i-2)*sizeof(struct record_struct *));
-			i--;
-			db->Nrecords--;
+	previous=NULL;
+	Nduplicates=0;
+	Nbeyond_limit=0;
+	db->max_sequence_number=0;
+	for(i=0,k=0;i<db->Nrecords;i++){
+		if(previous!=NULL && compare_records(previous,db->record[i])==0){
+			Nduplicates++;
+			continue;
+		}
+		previous=db->record[i];
+		if(opt->sequence_number_limit>=0 && db->record[i]->sequence_number>opt->sequence_number_limit){
+			Nbeyond_limit++;
+			continue;
 		}
+		if(db->record[i]->sequence_number>db->max_sequence_number) db->max_sequence_number=db->record[i]->sequence_number;
+		db->record[k++]=db->record[i];
 	}
-	fprintf(stderr,"done.\n");
-
+	db->Nrecords=k;
+	fprintf(stderr,"removed %u records.\n",Nduplicates);
 	if(opt->sequence_number_limit>=0){
-		unsigned int count;
-		fprintf(stderr,"Removing records with sequence numbers beyond the limit... ");
-		for(i=0;i<db->Nrecords;i++)
-			if(db->record[i]->sequence_number>opt->sequence_number_limit){
-				memmove(db->record+i, db->record+i+1, ((int)db->Nrecords-i-1)*sizeof(struct record_struct *));
-				i--;
-				db->Nrecords--;
-				count++;
-			}
-		fprintf(stderr,"removed %u records.\n",count);
+		fprintf(stderr,"Removed %u records with sequence numbers beyond the limit.\n",Nbeyond_limit);
+	}
+	if(db->Nrecords==0){
+		fprintf(stderr,"Error: no records are left\n");
+		return 1;
 	}
 
 	fprintf(stderr,"Confirming new order... ");
@@ -0,0 +1,170 @@
+/*
+ *  This file is part of Distributed Replica.
+ *  Copyright May 9 2009
+ *
+ *  Distributed Replica manages a series of simulations that separately sample phase space
+ *  and coordinates their efforts under the Distributed Replica Potential Energy Function.
+ *  See, for example T. Rodinger, P.L. Howell, and R. Pomès, "Distributed Replica Sampling"    
+ *  J. Chem. Theory Comput., 2:725 (2006).
+ *
+ *  Distributed Replica is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Distributed Replica is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Distributed Replica.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Index over the nominal positions of the replicas, shared by DR_server and analyse_force_database.
+// Fill w[] after allocate_nominal_grid() and then call index_nominal_grid().
+// Queries return exactly what the old linear scans over w_nominal returned; on a strictly ascending
+// grid they bisect, or on a uniform grid they start from a directly computed guess and step to the answer.
+
+#ifndef _NOMINAL_GRID_H
+#define _NOMINAL_GRID_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+struct nominal_grid_struct{
+	int N;
+	float *w;                //nominal positions
+	double *left_limit;      //edges of the bin around each nominal position, as find_bin_from_w() defines them
+	double *right_limit;
+	bool ascending;          //strictly ascending; otherwise queries fall back to the linear scans
+	bool uniform;            //evenly spaced; queries then start from a direct guess
+	double origin;
+	double spacing;
+};
+
+void allocate_nominal_grid(struct nominal_grid_struct *grid, int N){
+	grid->N=N;
+	grid->w=(float *)malloc(N*sizeof(float));
+	grid->left_limit=(double *)malloc(N*sizeof(double));
+	grid->right_limit=(double *)malloc(N*sizeof(double));
+	if(grid->w==NULL || grid->left_limit==NULL || grid->right_limit==NULL){
+		fprintf(stderr,"Error: unable to allocate memory for the nominal grid\n");
+		exit(1);
+	}
+	grid->ascending=false;
+	grid->uniform=false;
+	grid->origin=0.0;
+	grid->spacing=0.0;
+}
+
+void free_nominal_grid(struct nominal_grid_struct *grid){
+	free(grid->w);
+	free(grid->left_limit);
+	free(grid->right_limit);
+	grid->w=NULL;
+	grid->left_limit=grid->right_limit=NULL;
+	grid->N=0;
+}
+
+// computes the bin limits and the grid type once w[] has been filled
+void index_nominal_grid(struct nominal_grid_struct *grid){
+	float left_space, right_space;   // float, as in the scans this replaces
+	int i;
+	int N=grid->N;
+
+	for(i=0;i<N;i++){
+		if(i>0)   left_space=grid->w[i]-grid->w[i-1];
+		if(i<N-1) right_space=grid->w[i+1]-grid->w[i];
+		if(N==1)               left_space=right_space=0.0;
+		else if(i==0)          left_space=right_space;
+		else if(i==N-1)        right_space=left_space;
+		grid->left_limit[i]=grid->w[i]-left_space*0.5;
+		grid->right_limit[i]=grid->w[i]+right_space*0.5;
+	}
+
+	grid->ascending=true;
+	for(i=1;i<N;i++){
+		if(!(grid->w[i]>grid->w[i-1])) grid->ascending=false;
+	}
+
+	grid->uniform=false;
+	if(grid->ascending && N>2){
+		grid->origin=grid->w[0];
+		grid->spacing=((double)grid->w[N-1]-(double)grid->w[0])/(N-1);
+		grid->uniform=true;
+		for(i=1;i<N-1;i++){
+			if(fabs((double)grid->w[i]-(grid->origin+i*grid->spacing))>1.0e-3*grid->spacing) grid->uniform=false;
+		}
+	}
+}
+
+// index of the nominal position nearest to w on a uniform grid; only a starting point for the searches below
+int nominal_grid_guess(const struct nominal_grid_struct *grid, double w){
+	double x=(w-grid->origin)/grid->spacing+0.5;
+	if(!(x>0.0)) return(0);
+	if(x>=(double)(grid->N-1)) return(grid->N-1);
+	return((int)x);
+}
+
+// the first i for which w<w[i], or N if there is none
+// (this is the loop that replica_linearizing_function() and friends used to run)
+int nominal_grid_upper(const struct nominal_grid_struct *grid, double w){
+	int i,lo,hi;
+
+	if(!grid->ascending){
+		for(i=0;i<grid->N;i++){
+			if(w<grid->w[i]) break;
+		}
+		return(i);
+	}
+	if(grid->uniform && !isnan(w)){
+		i=nominal_grid_guess(grid,w);
+		while(i>0 && w<grid->w[i-1]) i--;
+		while(i<grid->N && !(w<grid->w[i])) i++;
+		return(i);
+	}
+	lo=0;
+	hi=grid->N;
+	while(lo<hi){
+		i=(lo+hi)/2;
+		if(w<grid->w[i]) hi=i;
+		else lo=i+1;
+	}
+	return(lo);
+}
+
+// the nominal position whose bin contains w, or -1 if there is none
+// (this is find_bin_from_w(); ties between neighbouring bins go to the lower one)
+int nominal_grid_bin(const struct nominal_grid_struct *grid, double w){
+	int i,lo,hi;
+
+	if(grid->N==1) return(0);
+
+	if(!grid->ascending){
+		for(i=0;i<grid->N;i++){
+			if( (w>=grid->left_limit[i]) && (w<=grid->right_limit[i]) ) return(i);
+		}
+		return(-1);
+	}
+	// both limits are ascending here, so the answer can only be the first bin whose right limit reaches w
+	if(grid->uniform && !isnan(w)){
+		i=nominal_grid_guess(grid,w);
+		while(i>0 && grid->right_limit[i-1]>=w) i--;
+		while(i<grid->N && !(grid->right_limit[i]>=w)) i++;
+	}else{
+		lo=0;
+		hi=grid->N;
+		while(lo<hi){
+			i=(lo+hi)/2;
+			if(grid->right_limit[i]>=w) hi=i;
+			else lo=i+1;
+		}
+		i=lo;
+	}
+	if(i==grid->N || !(w>=grid->left_limit[i])) return(-1);
+	return(i);
+}
+
+#endif
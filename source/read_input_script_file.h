@@ -38,6 +38,7 @@
 
 enum coordinate_type_enum {CoordinateTypeUndefined,Spatial,Temperature,Umbrella};
 enum replica_move_type_enum {MoveTypeUndefined,MonteCarlo,BoltzmannJumping,Continuous,NoMoves,vRE};
+enum cancellation_method_enum {ForceIntegration,WHAMCancellation};
 
 struct buffer_struct{
 	unsigned char *data;
@@ -87,6 +88,7 @@ struct script_struct{
 	unsigned int node_time;
 	unsigned int replica_change_time;
 	unsigned int snapshot_save_interval;
+	int database_sync_interval;  //seconds between fdatasync() of the force database; 0 is every write, <0 is never
 	unsigned int job_timeout;
 	unsigned int port;
 	float replica_potential_scalar1;
@@ -94,6 +96,10 @@ struct script_struct{
 	float replica_potential_scalar1_after_threshold;
 	float replica_potential_scalar2_after_threshold;
 	unsigned int cancellation_threshold;
+	enum cancellation_method_enum cancellation_method;
+	unsigned int cancellation_update_interval;  //seconds between WHAM solutions once cancellation is active
+	unsigned int cancellation_rounds;           //force integration rounds; 1 is a single round, 0 is no limit
+	float cancellation_round_tolerance;         //kcal/mol; the rounds stop once the adopted energies are this precise
 	float replica_step_fraction;
 	bool need_sample_data;
 	bool need_coordinate_data;
@@ -112,6 +118,9 @@ struct script_struct{
 	long int vRE_initial_noMoves;
 	long int vRE_initial_noSave;
 	long int vRE_secvre_size;
+	long int vRE_primary_size;
+	long int vRE_memory_limit;   //megabytes; <=0 is no limit
+	bool vRE_evict_random;
 	bool allow_requeue;
 	unsigned int allotted_time_for_server;
 	bool defineStartPos;
@@ -259,6 +268,7 @@ public:
 		script->node_time=0;
 		script->replica_change_time=0;
 		script->snapshot_save_interval=0;
+		script->database_sync_interval=60;
 		script->job_timeout=0;
 		script->port=0;
 		script->replica_potential_scalar1=-1.0;
@@ -266,6 +276,10 @@ public:
 		script->replica_potential_scalar1_after_threshold=0.0;
 		script->replica_potential_scalar2_after_threshold=0.0;
 		script->cancellation_threshold=0;
+		script->cancellation_method=ForceIntegration;
+		script->cancellation_update_interval=300;
+		script->cancellation_rounds=1;
+		script->cancellation_round_tolerance=0.0;
 		script->replica_step_fraction=-1.0;
 		script->need_sample_data=false;
 		script->need_coordinate_data=false;
@@ -284,6 +298,9 @@ public:
 		script->vRE_initial_noMoves=0;
 		script->vRE_initial_noSave=0;
 		script->vRE_secvre_size=-1;
+		script->vRE_primary_size=-1;
+		script->vRE_memory_limit=-1;
+		script->vRE_evict_random=false;
 		script->allow_requeue=false;
 		script->allotted_time_for_server=0;
 		script->defineStartPos=false;
@@ -327,6 +344,14 @@ public:
 				sscanf(buffer,"%*s %f %f",&(script->replica_potential_scalar1), &(script->replica_potential_scalar2));
 			}else if(strcasecmp(command,"CANCELLATION")==0){
 				sscanf(buffer,"%*s %f %f %u",&(script->replica_potential_scalar1_after_threshold), &(script->replica_potential_scalar2_after_threshold), &(script->cancellation_threshold));
+			}else if(strcasecmp(command,"CANCELLATIONMETHOD")==0){
+				parse_line(buffer, 1, param);
+				if(strcasecmp(param,"force")==0) script->cancellation_method=ForceIntegration;
+				else if(strcasecmp(param,"wham")==0) script->cancellation_method=WHAMCancellation;
+				else error_quit("CANCELLATIONMETHOD must be FORCE or WHAM");
+				sscanf(buffer,"%*s %*s %u",&(script->cancellation_update_interval));
+			}else if(strcasecmp(command,"CANCELLATIONROUNDS")==0){
+				sscanf(buffer,"%*s %u %f",&(script->cancellation_rounds),&(script->cancellation_round_tolerance));
 			}else if(strcasecmp(command,"NODETIME")==0){
 				sscanf(buffer,"%*s %d",&(script->node_time));
 				spec_node_time=true;
@@ -336,6 +361,8 @@ public:
 			}else if(strcasecmp(command,"SNAPSHOTTIME")==0){
 				sscanf(buffer,"%*s %d",&(script->snapshot_save_interval));
 				spec_snapshot_save_interval=true;
+			}else if(strcasecmp(command,"DATABASESYNCTIME")==0){
+				sscanf(buffer,"%*s %d",&(script->database_sync_interval));
 			}else if(strcasecmp(command,"TIMEOUT")==0){
 				sscanf(buffer,"%*s %d",&(script->job_timeout));
 				spec_job_timeout=true;
@@ -365,6 +392,15 @@ public:
                                 sscanf(buffer,"%*s %ld",&(script->vRE_initial_noSave));
 			}else if(strcasecmp(command,"VRE_SECONDARY_LIST_LENGTH")==0){
                                 sscanf(buffer,"%*s %ld",&(script->vRE_secvre_size));
+			}else if(strcasecmp(command,"VRE_PRIMARY_LIST_LENGTH")==0){
+				sscanf(buffer,"%*s %ld",&(script->vRE_primary_size));
+			}else if(strcasecmp(command,"VRE_MEMORY_LIMIT")==0){
+				sscanf(buffer,"%*s %ld",&(script->vRE_memory_limit));
+			}else if(strcasecmp(command,"VRE_EVICTION")==0){
+				parse_line(buffer, 1, param);
+				if(strcasecmp(param,"drop")==0) script->vRE_evict_random=false;
+				else if(strcasecmp(param,"random")==0) script->vRE_evict_random=true;
+				else error_quit("VRE_EVICTION must be DROP or RANDOM");
 			}else if(strcasecmp(command,"ALLOW_REQUEUE")==0){
 				script->allow_requeue=true;
 			}else if(strcasecmp(command,"ALLOTTED_TIME_FOR_SERVER")==0){
@@ -491,6 +527,9 @@ public:
 		if(script->vRE_initial_noMoves!=0&&script->replica_move_type!=vRE) error_quit("the ""vRE_initial_nomoves"" option is only compatible with a ""vRE"" simulation.\n");
                 if(script->vRE_initial_noSave!=0&&script->replica_move_type!=vRE) error_quit("the ""vRE_initial_save"" option is only compatible with a ""vRE"" simulation.\n");
                 if(script->vRE_secvre_size!=-1&&script->replica_move_type!=vRE) error_quit("the ""vRE_secvre_size"" option is only compatible with a ""vRE"" simulation.\n");
+		if(script->vRE_primary_size!=-1&&script->replica_move_type!=vRE) error_quit("the ""VRE_PRIMARY_LIST_LENGTH"" option is only compatible with a ""vRE"" simulation.\n");
+		if(script->vRE_memory_limit!=-1&&script->replica_move_type!=vRE) error_quit("the ""VRE_MEMORY_LIMIT"" option is only compatible with a ""vRE"" simulation.\n");
+		if(script->vRE_evict_random&&script->replica_move_type!=vRE) error_quit("the ""VRE_EVICTION"" option is only compatible with a ""vRE"" simulation.\n");
 		if(script->replica_move_type==vRE && script->defineStartPos){
 			fprintf(stderr,"Warning: using vRE and defineStartPos together will require you to load in an initial VRE list or else a replica will never be able to move occupy a previously unoccupied nominal position!\n");
 		}
@@ -499,6 +538,22 @@ public:
 		if( (script->replica_potential_scalar1<0) || (script->replica_potential_scalar2<0) ) error_quit("must specify two potential scalars both greater than or equat to 0");
 		if( (script->replica_potential_scalar1_after_threshold<0) || (script->replica_potential_scalar2_after_threshold<0) ) error_quit("invalid 'after threshold' potential scalars");
 		if( (script->cancellation_threshold>0) && (script->coordinate_type==Spatial) && !(script->need_sample_data) ) error_quit("cannot do energy cancellation without sample data; please specify NEEDSAMPLEDATA in the script file");
+		if(script->cancellation_method==WHAMCancellation){
+			if(script->cancellation_threshold==0) error_quit("CANCELLATIONMETHOD WHAM needs a threshold from CANCELLATION");
+			if(script->coordinate_type!=Umbrella) error_quit("CANCELLATIONMETHOD WHAM is only compatible with an ""Umbrella"" simulation");
+			if(!script->need_sample_data) error_quit("CANCELLATIONMETHOD WHAM needs the umbrella forces; please specify NEEDSAMPLEDATA in the script file");
+			if(Nreplicas<2) error_quit("CANCELLATIONMETHOD WHAM needs at least two replicas");
+			if(script->cancellation_update_interval==0) error_quit("the update interval of CANCELLATIONMETHOD WHAM must be at least one second");
+			if(!(script->replica[0].force>0.0)) error_quit("CANCELLATIONMETHOD WHAM needs a FORCE greater than zero");
+			for(int i=1;i<Nreplicas;i++){
+				if(script->replica[i].force!=script->replica[0].force) error_quit("CANCELLATIONMETHOD WHAM needs the same FORCE for every replica");
+			}
+		}
+		if(script->cancellation_rounds!=1){
+			if(script->cancellation_method!=ForceIntegration) error_quit("CANCELLATIONROUNDS is for CANCELLATIONMETHOD FORCE; WHAM refines its cancellation energies continuously");
+			if(script->cancellation_threshold<2) error_quit("CANCELLATIONROUNDS needs a threshold of at least 2 from CANCELLATION to estimate errors");
+			if(script->cancellation_round_tolerance<0.0) error_quit("the error tolerance of CANCELLATIONROUNDS cannot be negative");
+		}
 		if(!spec_node_time || !spec_replica_change_time || !spec_snapshot_save_interval || !spec_job_timeout) error_quit("must specify node time, replica change time, snapshot save interval, and job timeout");
 		if(script->circular_replica_coordinate){
 			if(script->coordinate_type==Temperature) error_quit("Circular replica coordinate is nonsensical with temperature replicas");
@@ -0,0 +1,138 @@
+/*
+ *  This file is part of Distributed Replica.
+ *  Copyright May 9 2009
+ *
+ *  Distributed Replica manages a series of simulations that separately sample phase space
+ *  and coordinates their efforts under the Distributed Replica Potential Energy Function.
+ *  See, for example T. Rodinger, P.L. Howell, and R. Pomès, "Distributed Replica Sampling"
+ *  J. Chem. Theory Comput., 2:725 (2006).
+ *
+ *  Distributed Replica is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Distributed Replica is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Distributed Replica.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Binary delta of one restart file against another, for TakeRestartDelta (see DR_protocol.h). DR_server encodes
+// and DR_client_comm decodes.
+// The restart is XORed with the base (zeros past the end of the base), so whatever the two files share becomes
+// zero. Restarts of neighbouring replicas share their layout, and their floats share sign, exponent and leading
+// mantissa bits. The result is taken 8 bytes at a time. A group is a mask byte, with bit k set if byte k is not
+// zero, followed by those bytes. A mask of 0 is followed by a varint count of the all-zero groups after it. The
+// last group may be short. There is no entropy coding, so both directions run close to memory speed.
+
+#ifndef _RESTART_DELTA_H
+#define _RESTART_DELTA_H
+
+#include <stdint.h>
+#include <string.h>
+
+// largest possible delta of a restart of size bytes
+unsigned int restart_delta_bound(unsigned int size){
+	return(size+(size+7)/8+8);
+}
+
+unsigned char *restart_delta_put_varint(unsigned char *p, unsigned int value){
+	while(value>=0x80){
+		*(p++)=(unsigned char)(value|0x80);
+		value>>=7;
+	}
+	*(p++)=(unsigned char)value;
+	return(p);
+}
+
+// returns 0 if the varint runs past end
+unsigned char restart_delta_get_varint(const unsigned char **p, const unsigned char *end, unsigned int *value){
+	unsigned int shift=0;
+
+	*value=0;
+	while(*p<end && shift<32){
+		*value|=(unsigned int)(**p&0x7F)<<shift;
+		if((*((*p)++)&0x80)==0) return(1);
+		shift+=7;
+	}
+	return(0);
+}
+
+// Writes the delta of the size bytes of data against the base_size bytes of base to out, which must hold
+// restart_delta_bound(size) bytes; returns the size of the delta
+unsigned int restart_delta_encode(const unsigned char *data, unsigned int size, const unsigned char *base, unsigned int base_size, unsigned char *out){
+	unsigned char *o=out;
+	unsigned char g[8], mask;
+	unsigned int i=0, n, k, run;
+	uint64_t a, b;
+
+	while(i<size){
+		n=(size-i<8)?size-i:8;
+		if(n==8 && i+8<=base_size){
+			memcpy(&a,data+i,8);
+			memcpy(&b,base+i,8);
+			a^=b;
+			memcpy(g,&a,8);
+		}else{
+			for(k=0;k<n;k++) g[k]=data[i+k]^((i+k<base_size)?base[i+k]:0);
+		}
+		mask=0;
+		for(k=0;k<n;k++) mask|=(unsigned char)((g[k]!=0)<<k);
+		*(o++)=mask;
+		i+=n;
+		if(mask==0){
+			for(run=0;i+8<=size && i+8<=base_size;i+=8,run++){
+				memcpy(&a,data+i,8);
+				memcpy(&b,base+i,8);
+				if(a!=b) break;
+			}
+			o=restart_delta_put_varint(o,run);
+		}else{
+			for(k=0;k<n;k++){
+				*o=g[k];
+				o+=(g[k]!=0);
+			}
+		}
+	}
+	return(o-out);
+}
+
+// Rebuilds the size bytes of a restart in out from its delta against base; returns 0 if the delta is malformed
+unsigned char restart_delta_decode(const unsigned char *delta, unsigned int delta_size, const unsigned char *base, unsigned int base_size, unsigned char *out, unsigned int size){
+	const unsigned char *p=delta, *end=delta+delta_size;
+	unsigned int i=0, n, k, run;
+	unsigned char mask, bit;
+
+	while(i<size){
+		n=(size-i<8)?size-i:8;
+		if(p>=end) return(0);
+		mask=*(p++);
+		if(n<8 && (mask>>n)!=0) return(0);
+		if(mask==0){
+			if(!restart_delta_get_varint(&p,end,&run) || run>(size-i-n)/8) return(0);
+			memset(out+i,0,n+8*run);
+			i+=n+8*run;
+		}else{
+			if(end-p>=8){
+				for(k=0;k<n;k++){
+					bit=(mask>>k)&1;
+					out[i+k]=*p&(unsigned char)(0-bit);
+					p+=bit;
+				}
+			}else{
+				if((unsigned int)(end-p)<(unsigned int)__builtin_popcount(mask)) return(0);
+				for(k=0;k<n;k++) out[i+k]=((mask>>k)&1)?*(p++):0;
+			}
+			i+=n;
+		}
+	}
+	n=(size<base_size)?size:base_size;
+	for(i=0;i<n;i++) out[i]^=base[i];
+	return(p==end);
+}
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ *  This file is part of Distributed Replica.
+ *  Copyright May 9 2009
+ *
+ *  Distributed Replica manages a series of simulations that separately sample phase space
+ *  and coordinates their efforts under the Distributed Replica Potential Energy Function.
+ *  See, for example T. Rodinger, P.L. Howell, and R. Pomès, "Distributed Replica Sampling"
+ *  J. Chem. Theory Comput., 2:725 (2006).
+ *
+ *  Distributed Replica is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Distributed Replica is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Distributed Replica.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Content-addressed store for the restart files that DR_server holds. A restart is cut into chunks where a rolling
+// gear hash of the preceding bytes hits a pattern, so the cuts move with the content and regions that several
+// restarts share (topology, box, ...) become identical chunks. Each distinct chunk is kept once with a count of
+// its uses. A restart is a recipe, its size and its list of chunks. Recipes never change once made and are shared
+// by counting references, so a restart that goes to a client, a snapshot or another replica is never copied.
+// Chunks are told apart by crc32c and size and compared byte for byte before they are shared.
+// Call restart_store_init() once, after crc32c_init() and before any thread uses the store. Every function may be
+// called from any thread; the store's mutex is never held while another lock is taken.
+
+#ifndef _RESTART_STORE_H
+#define _RESTART_STORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "crc32c.h"
+
+#define RESTART_CHUNK_MIN 2048
+#define RESTART_CHUNK_MAX 65536
+#define RESTART_CHUNK_BOUNDARY 0xFFF8000000000000ULL   //13 bits of the gear hash; 8 KB average beyond the minimum
+#define RESTART_STORE_BUCKETS 4096                     //initial size of the chunk table; it doubles as needed
+
+struct restart_chunk_struct{
+	uint32_t hash;                      //crc32c of the data
+	unsigned int size;
+	unsigned int refcount;              //uses by recipes; guarded by the store's mutex
+	unsigned int mark;                  //for one user at a time, such as the snapshot writer
+	struct restart_chunk_struct *next;  //in its bucket
+	unsigned char *data;                //follows the structure in the same allocation
+};
+
+struct restart_recipe_struct{
+	unsigned int refcount;              //guarded by the store's mutex
+	unsigned int size;
+	int Nchunks;
+	struct restart_chunk_struct **chunk;
+};
+
+struct restart_store_struct{
+	pthread_mutex_t mutex;
+	uint64_t gear[256];
+	struct restart_chunk_struct **bucket;
+	size_t Nbuckets;
+	size_t Nchunks;
+	unsigned long long stored_bytes;      //in distinct chunks
+	unsigned long long restart_bytes;     //in the restarts of the live recipes
+	unsigned long long Nrecipes;
+};
+struct restart_store_struct restart_store;
+
+void restart_store_init(void){
+	uint64_t x=0x9E3779B97F4A7C15ULL;
+	uint64_t z;
+
+	pthread_mutex_init(&restart_store.mutex,NULL);
+	// splitmix64 gives the fixed random byte values of the gear hash
+	for(int i=0;i<256;i++){
+		z=(x+=0x9E3779B97F4A7C15ULL);
+		z=(z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+		z=(z^(z>>27))*0x94D049BB133111EBULL;
+		restart_store.gear[i]=z^(z>>31);
+	}
+	restart_store.Nbuckets=RESTART_STORE_BUCKETS;
+	restart_store.bucket=(struct restart_chunk_struct **)calloc(restart_store.Nbuckets,sizeof(struct restart_chunk_struct *));
+	if(restart_store.bucket==NULL){
+		fprintf(stderr,"Error: unable to allocate memory for the restart store\n");
+		exit(1);
+	}
+	restart_store.Nchunks=0;
+	restart_store.stored_bytes=0;
+	restart_store.restart_bytes=0;
+	restart_store.Nrecipes=0;
+}
+
+// length of the chunk that starts at data
+unsigned int restart_chunk_length(const unsigned char *data, unsigned int left){
+	uint64_t h=0;
+	unsigned int i;
+	unsigned int end=(left<RESTART_CHUNK_MAX)?left:RESTART_CHUNK_MAX;
+
+	if(left<=RESTART_CHUNK_MIN) return(left);
+	// the hash covers the last 64 bytes, so it is primed just before the first possible cut
+	for(i=RESTART_CHUNK_MIN-64;i<RESTART_CHUNK_MIN;i++) h=(h<<1)+restart_store.gear[data[i]];
+	for(;i<end;i++){
+		h=(h<<1)+restart_store.gear[data[i]];
+		if((h&RESTART_CHUNK_BOUNDARY)==0) return(i+1);
+	}
+	return(end);
+}
+
+// must be called with the store's mutex on
+void restart_store_grow(void){
+	size_t Nbuckets=restart_store.Nbuckets*2;
+	struct restart_chunk_struct **bucket;
+	struct restart_chunk_struct *c, *next;
+
+	if((bucket=(struct restart_chunk_struct **)calloc(Nbuckets,sizeof(struct restart_chunk_struct *)))==NULL) return;
+	for(size_t b=0;b<restart_store.Nbuckets;b++){
+		for(c=restart_store.bucket[b];c!=NULL;c=next){
+			next=c->next;
+			c->next=bucket[c->hash%Nbuckets];
+			bucket[c->hash%Nbuckets]=c;
+		}
+	}
+	free(restart_store.bucket);
+	restart_store.bucket=bucket;
+	restart_store.Nbuckets=Nbuckets;
+}
+
+// another reference to r, for a client, a snapshot or a replica
+struct restart_recipe_struct *restart_store_share(struct restart_recipe_struct *r){
+	if(r==NULL) return(NULL);
+	pthread_mutex_lock(&restart_store.mutex);
+	r->refcount++;
+	pthread_mutex_unlock(&restart_store.mutex);
+	return(r);
+}
+
+// hands back one reference to r; the last one frees it and every chunk that no other recipe uses
+void restart_store_release(struct restart_recipe_struct *r){
+	struct restart_chunk_struct *c, **p;
+
+	if(r==NULL) return;
+	pthread_mutex_lock(&restart_store.mutex);
+	if(--r->refcount>0){
+		pthread_mutex_unlock(&restart_store.mutex);
+		return;
+	}
+	for(int k=0;k<r->Nchunks;k++){
+		c=r->chunk[k];
+		if(--c->refcount>0) continue;
+		for(p=&restart_store.bucket[c->hash%restart_store.Nbuckets];*p!=c;p=&(*p)->next);
+		*p=c->next;
+		restart_store.Nchunks--;
+		restart_store.stored_bytes-=c->size;
+		free(c);
+	}
+	restart_store.Nrecipes--;
+	restart_store.restart_bytes-=r->size;
+	pthread_mutex_unlock(&restart_store.mutex);
+	free(r->chunk);
+	free(r);
+}
+
+// Cuts size bytes of data into chunks, shares those that the store already has and returns a new recipe with one
+// reference, which the caller hands back with restart_store_release(); NULL if memory runs out
+struct restart_recipe_struct *restart_store_add(const unsigned char *data, unsigned int size){
+	struct restart_recipe_struct *r;
+	unsigned int *length;
+	uint32_t *hash;
+	unsigned int offset;
+	int Nchunks=0;
+	struct restart_chunk_struct *c;
+	size_t b;
+
+	if((r=(struct restart_recipe_struct *)malloc(sizeof(struct restart_recipe_struct)))==NULL) return(NULL);
+	r->refcount=1;
+	r->size=size;
+	r->chunk=(struct restart_chunk_struct **)malloc((size/RESTART_CHUNK_MIN+1)*sizeof(struct restart_chunk_struct *));
+	length=(unsigned int *)malloc((size/RESTART_CHUNK_MIN+1)*sizeof(unsigned int));
+	hash=(uint32_t *)malloc((size/RESTART_CHUNK_MIN+1)*sizeof(uint32_t));
+	if(r->chunk==NULL || length==NULL || hash==NULL){
+		free(r->chunk);
+		free(length);
+		free(hash);
+		free(r);
+		return(NULL);
+	}
+	// the cutting and hashing are done before the store is locked
+	for(offset=0;offset<size;offset+=length[Nchunks++]){
+		length[Nchunks]=restart_chunk_length(data+offset,size-offset);
+		hash[Nchunks]=crc32c(data+offset,length[Nchunks]);
+	}
+	r->Nchunks=Nchunks;
+
+	pthread_mutex_lock(&restart_store.mutex);
+	offset=0;
+	for(int k=0;k<Nchunks;offset+=length[k++]){
+		b=hash[k]%restart_store.Nbuckets;
+		for(c=restart_store.bucket[b];c!=NULL;c=c->next){
+			if(c->hash==hash[k] && c->size==length[k] && memcmp(c->data,data+offset,length[k])==0) break;
+		}
+		if(c==NULL){
+			if((c=(struct restart_chunk_struct *)malloc(sizeof(struct restart_chunk_struct)+length[k]))==NULL){
+				// hand back what was taken so far
+				r->Nchunks=k;
+				r->size=offset;
+				restart_store.Nrecipes++;
+				restart_store.restart_bytes+=offset;
+				pthread_mutex_unlock(&restart_store.mutex);
+				restart_store_release(r);
+				free(length);
+				free(hash);
+				return(NULL);
+			}
+			c->hash=hash[k];
+			c->size=length[k];
+			c->refcount=0;
+			c->mark=0;
+			c->data=(unsigned char *)(c+1);
+			memcpy(c->data,data+offset,length[k]);
+			c->next=restart_store.bucket[b];
+			restart_store.bucket[b]=c;
+			restart_store.Nchunks++;
+			restart_store.stored_bytes+=length[k];
+		}
+		c->refcount++;
+		r->chunk[k]=c;
+	}
+	restart_store.Nrecipes++;
+	restart_store.restart_bytes+=size;
+	if(restart_store.Nchunks>2*restart_store.Nbuckets) restart_store_grow();
+	pthread_mutex_unlock(&restart_store.mutex);
+
+	free(length);
+	free(hash);
+	return(r);
+}
+
+// writes the restart of r to data, which must hold r->size bytes
+void restart_store_copy(const struct restart_recipe_struct *r, unsigned char *data){
+	for(int k=0;k<r->Nchunks;k++){
+		memcpy(data,r->chunk[k]->data,r->chunk[k]->size);
+		data+=r->chunk[k]->size;
+	}
+}
+
+void restart_store_usage(size_t *Nchunks, unsigned long long *stored_bytes, unsigned long long *restart_bytes, unsigned long long *Nrecipes){
+	pthread_mutex_lock(&restart_store.mutex);
+	*Nchunks=restart_store.Nchunks;
+	*stored_bytes=restart_store.stored_bytes;
+	*restart_bytes=restart_store.restart_bytes;
+	*Nrecipes=restart_store.Nrecipes;
+	pthread_mutex_unlock(&restart_store.mutex);
+}
+
+#endif
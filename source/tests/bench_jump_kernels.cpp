@@ -0,0 +1,247 @@
+/*
+ *  This file is part of Distributed Replica.
+ *  Copyright May 9 2009
+ *
+ *  Distributed Replica manages a series of simulations that separately sample phase space
+ *  and coordinates their efforts under the Distributed Replica Potential Energy Function.
+ *  See, for example T. Rodinger, P.L. Howell, and R. Pomès, "Distributed Replica Sampling"    
+ *  J. Chem. Theory Comput., 2:725 (2006).
+ *
+ *  Distributed Replica is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Distributed Replica is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Distributed Replica.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Benchmark of the Boltzmann and continuous jump kernels at 128, 512 and 2048 umbrella replicas. Each move is
+// drawn by the current kernels and by the per-element versions that they replaced (reference_* below, as they
+// were before jump_kernel, without their debug output), from the same drand48() stream and the same replica
+// configuration. Exits with 1 if the two choose different positions.
+
+#define main DR_server_main
+#include "../DR_server.cpp"
+#undef main
+
+float reference_boltzmann_jump(struct client_struct *client, int replicaN, const float *energy_data, const struct script_struct *script, const struct server_variable_struct *var){
+	int i;
+	double new_coor;
+	double DRPE, system_energy, probability;
+	float total_energy[script->Nreplicas];
+	float energy_min;
+	double random_number;
+	double probability_sum;
+
+	begin_replica_potential_trials(replicaN,script);
+	energy_min=1e20;
+	for(i=0;i<script->Nreplicas;i++){
+		if(i<var->min_running_replica || i>var->max_running_replica){
+			total_energy[i]=1e20;
+		}else{
+			new_coor=script->replica[i].w_nominal;
+			DRPE=replica_potential_trial(new_coor,script);
+			system_energy=0.5*script->replica[i].force*sqr(energy_data[0]-new_coor);
+			system_energy+=script->replica[i].cancellation_energy;
+			total_energy[i]=var->beta*(DRPE+system_energy);
+		}
+		if(total_energy[i]<energy_min) energy_min=total_energy[i];
+	}
+	for(i=0;i<script->Nreplicas;i++) total_energy[i]-=energy_min;
+	probability_sum=0.0;
+	for(i=0;i<script->Nreplicas;i++){
+		probability=exp(-total_energy[i]);
+		probability_sum+=probability;
+		total_energy[i]=probability;
+	}
+	for(i=0;i<script->Nreplicas;i++) total_energy[i]/=probability_sum;
+
+	client_printf(client,"Boltzmann jump possibilities:");
+	for(i=0;i<script->Nreplicas;i++){
+		if(total_energy[i]>0.001) client_printf(client," (%d:%0.3f)",i,total_energy[i]);
+	}
+	client_printf(client,"\n");
+
+	probability_sum=0.0;
+	random_number=drand48();
+	for(i=0;i<script->Nreplicas;i++){
+		probability_sum+=total_energy[i];
+		if(probability_sum>=random_number) break;
+	}
+	if(i==script->Nreplicas) i--;
+	return(script->replica[i].w_nominal);
+}
+
+float reference_continuous(struct client_struct *client, int replicaN, const float *energy_data, const struct script_struct *script, const struct server_variable_struct *var){
+	int i,ii,j;
+	int index;
+	float left_w, right_w, division;
+	double right_micro_w,left_micro_w;
+	float new_coor;
+	double DRPE, system_energy, cancellation_energy, total_dimensionless_energy, probability;
+	double random_number=drand48();
+	double *total_energy=new double[script->Nreplicas*REPLICA_MICRODIVISIONS];
+	double probability_sum=0.0;
+	float energy_min=1.0e20;
+	unsigned char first=1;
+
+	begin_replica_potential_trials(replicaN,script);
+	for(i=0;i<script->Nreplicas;i++){
+		ii=i;
+		if(ii>=script->Nreplicas-1) ii--;
+		left_w=script->replica[ii].w_nominal;
+		right_w=script->replica[ii+1].w_nominal;
+		division=(right_w-left_w)/REPLICA_MICRODIVISIONS;
+		float cancellation_energy_division=(script->replica[ii+1].cancellation_energy-script->replica[ii].cancellation_energy)/REPLICA_MICRODIVISIONS;
+		for(j=0;j<REPLICA_MICRODIVISIONS;j++){
+			index=i*REPLICA_MICRODIVISIONS+j;
+			if( (i<var->min_running_replica) || (i>var->max_running_replica) ){
+				total_energy[index]=1e20;
+			}else{
+				new_coor=script->replica[i].w_nominal+(j-(REPLICA_MICRODIVISIONS-1)/2)*division;
+				DRPE=replica_potential_trial(new_coor,script);
+				cancellation_energy=script->replica[i].cancellation_energy+(j-(REPLICA_MICRODIVISIONS-1)/2)*cancellation_energy_division;
+				system_energy=0.5*script->replica[i].force*sqr(energy_data[0]-new_coor);
+				total_dimensionless_energy=var->beta*(DRPE+system_energy+cancellation_energy);
+				if(total_dimensionless_energy<energy_min) energy_min=total_dimensionless_energy;
+				total_energy[index]=total_dimensionless_energy;
+			}
+		}
+	}
+	for(index=0;index<script->Nreplicas*REPLICA_MICRODIVISIONS;index++){
+		total_energy[index]=exp(-(total_energy[index]-energy_min));
+	}
+	for(i=0;i<script->Nreplicas;i++){
+		ii=i;
+		if(ii>=script->Nreplicas-1) ii--;
+		division=(script->replica[ii+1].w_nominal-script->replica[ii].w_nominal)/REPLICA_MICRODIVISIONS;
+		for(j=0;j<REPLICA_MICRODIVISIONS;j++){
+			index=i*REPLICA_MICRODIVISIONS+j;
+			right_micro_w=script->replica[i].w_nominal+(j-(REPLICA_MICRODIVISIONS-1)/2)*division;
+			if(!first) probability_sum+=(right_micro_w-left_micro_w)*(total_energy[index-1]+total_energy[index])/2;
+			left_micro_w=right_micro_w;
+			first=0;
+		}
+	}
+	for(index=0;index<script->Nreplicas*REPLICA_MICRODIVISIONS;index++) total_energy[index]/=probability_sum;
+
+	double probability_sum2=0.0;
+	first=1;
+	for(i=0;i<script->Nreplicas;i++){
+		ii=i;
+		if(ii>=script->Nreplicas-1) ii--;
+		division=(script->replica[ii+1].w_nominal-script->replica[ii].w_nominal)/REPLICA_MICRODIVISIONS;
+		for(j=0;j<REPLICA_MICRODIVISIONS;j++){
+			index=i*REPLICA_MICRODIVISIONS+j;
+			right_micro_w=script->replica[i].w_nominal+(j-(REPLICA_MICRODIVISIONS-1)/2)*division;
+			if(!first){
+				probability=(right_micro_w-left_micro_w)*(total_energy[index-1]+total_energy[index])/2;
+				probability_sum2+=probability;
+				if(probability_sum2>=random_number) goto done_loop;
+			}
+			left_micro_w=right_micro_w;
+			first=0;
+		}
+	}
+	done_loop:
+	double fraction=random_number-(probability_sum2-probability);
+	double m=(total_energy[index]-total_energy[index-1])/(right_micro_w-left_micro_w);
+	double b=total_energy[index-1]-m*left_micro_w;
+	double a=m*0.5;
+	double c=-m*0.5*left_micro_w*left_micro_w-b*left_micro_w-fraction;
+	new_coor=(a==0.0)?left_micro_w+fraction/b:(-b+sqrt(b*b-4*a*c))/(2*a);
+	client_printf(client,"Boltzmann jump to new beta: %lf\n",new_coor);
+	delete[] total_energy;
+	return(new_coor);
+}
+
+double seconds(void){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return(t.tv_sec+t.tv_nsec*1.0e-9);
+}
+
+int main(int argc, char *argv[]){
+	int sizes[3]={128,512,2048};
+	struct script_struct script;
+	struct server_variable_struct var=DEFAULT_SERVER_VARIABLE_STRUCT;
+	struct client_struct client;
+	float energy_data[1];
+	float *w_saved;
+	int N, Nmoves, replicaN, mismatches=0;
+	unsigned short state[3]={0,0,0};
+	double t_reference, t_kernel, t0;
+
+	memset(&script,0,sizeof(script));
+	memset(&client,0,sizeof(client));
+	acquire_client_log(&client);
+	script.coordinate_type=Umbrella;
+	script.replica_potential_scalar1=0.01;
+	script.replica_potential_scalar2=0.0;
+	var.beta=1.0/(0.0019872*300.0);
+	srand48(77);
+
+	for(int s=0;s<3;s++){
+		N=sizes[s];
+		script.Nreplicas=N;
+		script.replica=new replica_struct[N];
+		for(int i=0;i<N;i++){
+			script.replica[i].w_nominal=0.1*i;
+			script.replica[i].force=50.0;
+			script.replica[i].cancellation_energy=2.0*sin(0.05*i);
+			script.replica[i].w=0.1*N*drand48();
+		}
+		allocate_nominal_grid(&nominal_grid,N);
+		for(int i=0;i<N;i++) nominal_grid.w[i]=script.replica[i].w_nominal;
+		index_nominal_grid(&nominal_grid);
+		var.min_running_replica=0;
+		var.max_running_replica=N-1;
+		w_saved=new float[N];
+		for(int i=0;i<N;i++) w_saved[i]=script.replica[i].w;
+
+		for(int scheme=0;scheme<2;scheme++){
+			Nmoves=(scheme==0)?256000/N:25600/N;
+			t_reference=t_kernel=0.0;
+			srand48(1000+s);
+			for(int m=0;m<Nmoves;m++){
+				// the two are timed alternately, from the same drand48() state, so that drift in the machine's speed hits both
+				float w_reference, w;
+				memcpy(state,seed48(state),sizeof(state));
+				seed48(state);
+				replicaN=(m*7919)%N;
+				energy_data[0]=script.replica[(m*104729)%N].w_nominal+0.05;
+				client.ptr=client.log;
+				t0=seconds();
+				w_reference=(scheme==0)?reference_boltzmann_jump(&client,replicaN,energy_data,&script,&var):reference_continuous(&client,replicaN,energy_data,&script,&var);
+				t_reference+=seconds()-t0;
+				script.replica[replicaN].w=w_saved[replicaN];
+				seed48(state);
+				client.ptr=client.log;
+				t0=seconds();
+				w=(scheme==0)?determine_new_replica_position_boltzmann_jump(&client,replicaN,energy_data,&script,&var):determine_new_replica_position_continuous(&client,replicaN,energy_data,&script,&var);
+				t_kernel+=seconds()-t0;
+				script.replica[replicaN].w=w_saved[replicaN];
+				if(fabs(w-w_reference)>1.0e-4*(fabs(w_reference)+1.0)){
+					if(mismatches<10) fprintf(stderr,"%d replicas, %s move %d: reference %f, kernel %f\n",N,(scheme==0)?"Boltzmann":"continuous",m,w_reference,w);
+					mismatches++;
+				}
+			}
+			printf("bench_jump_kernels: %4d replicas %-10s per move: reference %9.1f us, kernel %9.1f us\n",N,(scheme==0)?"Boltzmann":"continuous",
+				t_reference*1.0e6/Nmoves,t_kernel*1.0e6/Nmoves);
+		}
+		delete[] w_saved;
+		free_nominal_grid(&nominal_grid);
+		delete[] script.replica;
+	}
+	if(mismatches>0){
+		fprintf(stderr,"bench_jump_kernels: %d moves differ from the reference kernels\n",mismatches);
+		return(1);
+	}
+	return(0);
+}
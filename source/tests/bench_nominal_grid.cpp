@@ -0,0 +1,111 @@
+/*
+ *  This file is part of Distributed Replica.
+ *  Copyright May 9 2009
+ *
+ *  Distributed Replica manages a series of simulations that separately sample phase space
+ *  and coordinates their efforts under the Distributed Replica Potential Energy Function.
+ *  See, for example T. Rodinger, P.L. Howell, and R. Pomès, "Distributed Replica Sampling"    
+ *  J. Chem. Theory Comput., 2:725 (2006).
+ *
+ *  Distributed Replica is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Distributed Replica is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Distributed Replica.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Microbenchmark of the nominal_grid.h lookups against the linear scans that they replaced in find_bin_from_w()
+// and replica_linearizing_function(), on uniform and uneven grids of 16, 256 and 4096 nominal positions.
+// Every lookup is also compared with the scan; exits with 1 on a mismatch.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "../nominal_grid.h"
+
+#define BENCH_QUERIES 200000
+
+// find_bin_from_w() before nominal_grid.h
+int scan_bin(const float *w_nominal, int N, double w){
+	double left_space, right_space;
+	double left_limit, right_limit;
+	int i;
+
+	if(N==1) return(0);
+	for(i=0;i<N;i++){
+		if(i>0) left_space=w_nominal[i]-w_nominal[i-1];
+		if(i<N-1) right_space=w_nominal[i+1]-w_nominal[i];
+		if(i==0) left_space=right_space;
+		else if(i==N-1) right_space=left_space;
+		left_limit=w_nominal[i]-left_space*0.5;
+		right_limit=w_nominal[i]+right_space*0.5;
+		if( (w>=left_limit) && (w<=right_limit) ) return(i);
+	}
+	return(-1);
+}
+
+// the bracketing loop of replica_linearizing_function() before nominal_grid.h
+int scan_upper(const float *w_nominal, int N, double w){
+	int i;
+	for(i=0;i<N;i++){
+		if(w<w_nominal[i]) break;
+	}
+	return(i);
+}
+
+double seconds(void){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return(t.tv_sec+t.tv_nsec*1.0e-9);
+}
+
+int main(int argc, char *argv[]){
+	int sizes[3]={16,256,4096};
+	struct nominal_grid_struct grid;
+	double *query=new double[BENCH_QUERIES];
+	double t0,t1,t2;
+	long sum_scan,sum_grid;
+	int N,mismatches=0;
+
+	srand48(4);
+	for(int s=0;s<3;s++){
+		for(int uneven=0;uneven<2;uneven++){
+			N=sizes[s];
+			allocate_nominal_grid(&grid,N);
+			grid.w[0]=0.0;
+			for(int i=1;i<N;i++) grid.w[i]=grid.w[i-1]+(uneven?0.5+drand48():1.0);
+			index_nominal_grid(&grid);
+			for(int q=0;q<BENCH_QUERIES;q++) query[q]=grid.w[0]-2.0+(grid.w[N-1]-grid.w[0]+4.0)*drand48();
+
+			for(int q=0;q<BENCH_QUERIES;q++){
+				if(scan_bin(grid.w,N,query[q])!=nominal_grid_bin(&grid,query[q])) mismatches++;
+				if(scan_upper(grid.w,N,query[q])!=nominal_grid_upper(&grid,query[q])) mismatches++;
+			}
+
+			sum_scan=sum_grid=0;
+			t0=seconds();
+			for(int q=0;q<BENCH_QUERIES;q++) sum_scan+=scan_bin(grid.w,N,query[q]);
+			t1=seconds();
+			for(int q=0;q<BENCH_QUERIES;q++) sum_grid+=nominal_grid_bin(&grid,query[q]);
+			t2=seconds();
+			printf("bench_nominal_grid: %4d %-7s bin lookup: scan %8.1f ns, grid %6.1f ns\n",N,uneven?"uneven":"uniform",
+				(t1-t0)*1.0e9/BENCH_QUERIES,(t2-t1)*1.0e9/BENCH_QUERIES);
+			if(sum_scan!=sum_grid) mismatches++;
+			free_nominal_grid(&grid);
+		}
+	}
+	delete[] query;
+	if(mismatches>0){
+		fprintf(stderr,"bench_nominal_grid: %d lookups differ from the linear scans\n",mismatches);
+		return(1);
+	}
+	return(0);
+}
@@ -0,0 +1,143 @@
+/*
+ *  This file is part of Distributed Replica.
+ *  Copyright May 9 2009
+ *
+ *  Distributed Replica manages a series of simulations that separately sample phase space
+ *  and coordinates their efforts under the Distributed Replica Potential Energy Function.
+ *  See, for example T. Rodinger, P.L. Howell, and R. Pomès, "Distributed Replica Sampling"    
+ *  J. Chem. Theory Comput., 2:725 (2006).
+ *
+ *  Distributed Replica is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Distributed Replica is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Distributed Replica.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Drives conclude_cancellation_round() through a first round and then one round down each of its branches: a round
+// that agrees with the adopted energies is combined with them by inverse variance, a disagreeing round that is more
+// precise replaces them and a disagreeing round that is less precise is rejected. Checks the adopted energies and
+// errors, the published cancellation energies and the reset of the round. Exits with 1 on the first failure.
+
+#define main DR_server_main
+#include "../DR_server.cpp"
+#undef main
+
+#define TEST_REPLICAS 4
+#define TEST_TOLERANCE 1.0e-12
+
+int failures=0;
+
+void expect(const char *what, int i, double value, double expected){
+	if(fabs(value-expected)<=TEST_TOLERANCE*(fabs(expected)+1.0)) return;
+	fprintf(stderr,"%s at nominal position %d: %.15g, expected %.15g\n",what,i,value,expected);
+	failures++;
+}
+
+// concludes a round with the given estimate as conditionally_activate_energy_cancellation() would, after putting
+// something into the accumulators to check that the round resets them
+void conclude(struct script_struct *script, struct server_variable_struct *var, const double *energy, const double *error){
+	for(int i=0;i<TEST_REPLICAS;i++){
+		script->replica[i].cancellation_accumulator[0]=1.0;
+		script->replica[i].cancellation_count=script->cancellation_threshold;
+		cancellation_rounds.sum_of_squares[2*i]=1.0;
+	}
+	conclude_cancellation_round(script,var,energy,error);
+	for(int i=0;i<TEST_REPLICAS;i++){
+		if(script->replica[i].cancellation_accumulator[0]!=0.0 || script->replica[i].cancellation_count!=0 || cancellation_rounds.sum_of_squares[2*i]!=0.0){
+			fprintf(stderr,"round %d did not reset the accumulators of nominal position %d\n",cancellation_rounds.round,i);
+			failures++;
+		}
+	}
+}
+
+// the adopted energies and errors, and the energies that the replicas use (which are floats)
+void expect_adopted(const struct script_struct *script, const double *energy, const double *error){
+	for(int i=0;i<TEST_REPLICAS;i++){
+		expect("adopted energy",i,cancellation_rounds.energy[i],energy[i]);
+		expect("adopted error",i,cancellation_rounds.error[i],error[i]);
+		expect("cancellation energy",i,script->replica[i].cancellation_energy,(float)energy[i]);
+	}
+}
+
+int main(int argc, char *argv[]){
+	struct script_struct script;
+	struct server_variable_struct var;
+	// position 0 is where the energies are measured from, so it is exact
+	const double first[TEST_REPLICAS]={0.0,1.0,2.0,3.0};
+	const double first_error[TEST_REPLICAS]={0.0,0.1,0.1,0.2};
+	const double agreeing[TEST_REPLICAS]={0.0,1.1,1.9,3.2};
+	const double agreeing_error[TEST_REPLICAS]={0.0,0.1,0.2,0.2};
+	const double precise[TEST_REPLICAS]={0.0,2.0,2.0,3.0};
+	const double precise_error[TEST_REPLICAS]={0.0,0.01,0.01,0.01};
+	const double imprecise[TEST_REPLICAS]={0.0,5.0,2.0,3.0};
+	const double imprecise_error[TEST_REPLICAS]={0.0,0.5,0.5,0.5};
+	double combined[TEST_REPLICAS], combined_error[TEST_REPLICAS], w1, w2;
+
+	strcpy(logFile_globalVar,"/dev/null");
+	memset(&script,0,sizeof(script));
+	memset(&var,0,sizeof(var));
+	script.Nreplicas=TEST_REPLICAS;
+	script.replica=new replica_struct[TEST_REPLICAS];
+	memset(script.replica,0,TEST_REPLICAS*sizeof(replica_struct));
+	for(int i=0;i<TEST_REPLICAS;i++) script.replica[i].w_nominal=i;
+	script.cancellation_threshold=10;
+	script.cancellation_rounds=4;
+	var.energy_cancellation_status=Pending;
+	allocate_cancellation_rounds(&script);
+	if(!cancellation_rounds.active){
+		fprintf(stderr,"allocate_cancellation_rounds() did not activate the rounds\n");
+		return(1);
+	}
+
+	// round 1 is adopted as it is
+	conclude(&script,&var,first,first_error);
+	expect_adopted(&script,first,first_error);
+	if(var.energy_cancellation_status!=Active){
+		fprintf(stderr,"round 1 did not activate the energy cancellation\n");
+		failures++;
+	}
+
+	// round 2 is within 1 standard error everywhere, so the two are combined by inverse variance
+	for(int i=0;i<TEST_REPLICAS;i++){
+		if(first_error[i]==0.0){
+			combined[i]=agreeing[i];
+			combined_error[i]=0.0;
+			continue;
+		}
+		w1=1.0/(first_error[i]*first_error[i]);
+		w2=1.0/(agreeing_error[i]*agreeing_error[i]);
+		combined[i]=(w1*first[i]+w2*agreeing[i])/(w1+w2);
+		combined_error[i]=1.0/sqrt(w1+w2);
+	}
+	conclude(&script,&var,agreeing,agreeing_error);
+	expect_adopted(&script,combined,combined_error);
+
+	// round 3 is far off at position 1 but more precise than the combined energies, so it replaces them
+	conclude(&script,&var,precise,precise_error);
+	expect_adopted(&script,precise,precise_error);
+
+	// round 4 is far off at position 1 and less precise, so it is rejected; it is also the last round
+	conclude(&script,&var,imprecise,imprecise_error);
+	expect_adopted(&script,precise,precise_error);
+	if(cancellation_rounds.round!=4 || cancellation_rounds.collecting){
+		fprintf(stderr,"after round 4 of 4: round %d, %s\n",cancellation_rounds.round,cancellation_rounds.collecting?"still collecting":"done");
+		failures++;
+	}
+
+	free_cancellation_rounds();
+	delete[] script.replica;
+	if(failures>0){
+		fprintf(stderr,"test_cancellation_rounds: %d failures\n",failures);
+		return(1);
+	}
+	printf("test_cancellation_rounds: the first, combined, replacing and rejected rounds adopt the expected energies\n");
+	return(0);
+}
@@ -0,0 +1,140 @@
+/*
+ *  This file is part of Distributed Replica.
+ *  Copyright May 9 2009
+ *
+ *  Distributed Replica manages a series of simulations that separately sample phase space
+ *  and coordinates their efforts under the Distributed Replica Potential Energy Function.
+ *  See, for example T. Rodinger, P.L. Howell, and R. Pomès, "Distributed Replica Sampling"    
+ *  J. Chem. Theory Comput., 2:725 (2006).
+ *
+ *  Distributed Replica is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Distributed Replica is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Distributed Replica.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Feeds the WHAM cancellation histogram (allocate_cancellation_wham(), add_cancellation_wham_samples()) with umbrella
+// samples drawn exactly from a harmonic potential of mean force, lets the cancellation_solver() thread solve it and
+// checks the cancellation energies that it publishes against the analytic free energies of the umbrellas.
+// Exits with 1 if any nominal position is off by more than TEST_TOLERANCE.
+
+#define main DR_server_main
+#include "../DR_server.cpp"
+#undef main
+
+#define TEST_REPLICAS 11
+#define TEST_SPACING 0.5
+#define TEST_UMBRELLA_FORCE 10.0        //kcal/mol per unit squared, the force of every umbrella
+#define TEST_PMF_FORCE 2.0              //the PMF is 0.5*TEST_PMF_FORCE*(x-TEST_PMF_CENTER)^2
+#define TEST_PMF_CENTER 2.5
+#define TEST_TEMPERATURE 300.0
+#define TEST_RUNS 4000                  //runs at the nominal positions; as many again at random bin centers
+#define TEST_SAMPLES_PER_RUN 50
+#define TEST_TOLERANCE 0.05             //kcal/mol
+#define TEST_TIMEOUT 30                 //seconds to wait for the solver
+
+double gaussian(void){
+	return(sqrt(-2.0*log(1.0-drand48()))*cos(2.0*M_PI*drand48()));
+}
+
+// samples one run of the umbrella at w: with both potentials harmonic, x is normal
+void add_run(struct script_struct *script, double beta, double w){
+	float force_data[TEST_SAMPLES_PER_RUN];
+	double stiffness=TEST_PMF_FORCE+TEST_UMBRELLA_FORCE;
+	double mean=(TEST_PMF_FORCE*TEST_PMF_CENTER+TEST_UMBRELLA_FORCE*w)/stiffness;
+	double sigma=1.0/sqrt(beta*stiffness);
+	double x;
+
+	for(int j=0;j<TEST_SAMPLES_PER_RUN;j++){
+		x=mean+sigma*gaussian();
+		force_data[j]=TEST_UMBRELLA_FORCE*(x-w);
+	}
+	add_cancellation_wham_samples(script,w,TEST_UMBRELLA_FORCE,force_data);
+}
+
+int main(int argc, char *argv[]){
+	struct script_struct script;
+	struct server_variable_struct var;
+	struct client_bundle B;
+	double beta, A0, expected, deviation, largest_deviation=0.0;
+	int i, failures=0;
+	time_t start;
+
+	strcpy(logFile_globalVar,"/dev/null");
+	memset(&script,0,sizeof(script));
+	memset(&var,0,sizeof(var));
+	memset(&B,0,sizeof(B));
+	script.Nreplicas=TEST_REPLICAS;
+	script.replica=new replica_struct[TEST_REPLICAS];
+	memset(script.replica,0,TEST_REPLICAS*sizeof(replica_struct));
+	for(i=0;i<TEST_REPLICAS;i++){
+		script.replica[i].w_nominal=i*TEST_SPACING;
+		script.replica[i].w=script.replica[i].w_nominal;
+		script.replica[i].force=TEST_UMBRELLA_FORCE;
+		script.replica[i].cancellation_count=1;
+	}
+	script.Nsamples_per_run=TEST_SAMPLES_PER_RUN;
+	script.cancellation_method=WHAMCancellation;
+	script.cancellation_threshold=1;
+	script.cancellation_update_interval=1;
+	script.replica_potential_scalar1_after_threshold=1.0;
+	beta=1.0/(TEST_TEMPERATURE*BOLTZMANN_CONSTANT);
+	var.beta=beta;
+	var.energy_cancellation_status=Pending;
+	B.script=&script;
+	B.var=&var;
+
+	allocate_cancellation_wham(&script);
+	srand48(2718);
+	for(int r=0;r<TEST_RUNS;r++){
+		add_run(&script,beta,script.replica[r%TEST_REPLICAS].w_nominal);
+		// DR moves the umbrella between the nominal positions as well; these runs are at the centers of WHAM bins
+		add_run(&script,beta,cancellation_wham.min+(floor(drand48()*(CANCELLATION_WHAM_BINS_PER_WINDOW*(TEST_REPLICAS-1)+1))+
+		                                            CANCELLATION_WHAM_BINS_PER_WINDOW*CANCELLATION_WHAM_MARGIN_WINDOWS+0.5)*cancellation_wham.bin_width);
+	}
+
+	start_cancellation_solver(&B);
+	start=time(NULL);
+	while(1){
+		pthread_mutex_lock(&replica_mutex);
+		if(var.energy_cancellation_status==Active || time(NULL)-start>TEST_TIMEOUT) break;
+		pthread_mutex_unlock(&replica_mutex);
+		usleep(100000);
+	}
+	pthread_mutex_unlock(&replica_mutex);
+	stop_cancellation_solver();
+	if(var.energy_cancellation_status!=Active){
+		fprintf(stderr,"test_cancellation_wham: the solver did not publish cancellation energies within %d seconds\n",TEST_TIMEOUT);
+		return(1);
+	}
+
+	// the umbrella at w on the PMF is a harmonic potential of stiffness TEST_PMF_FORCE+TEST_UMBRELLA_FORCE, so
+	// A(w)=0.5*TEST_PMF_FORCE*TEST_UMBRELLA_FORCE/(TEST_PMF_FORCE+TEST_UMBRELLA_FORCE)*(w-TEST_PMF_CENTER)^2+constant
+	A0=0.5*TEST_PMF_FORCE*TEST_UMBRELLA_FORCE/(TEST_PMF_FORCE+TEST_UMBRELLA_FORCE)*(script.replica[0].w_nominal-TEST_PMF_CENTER)*(script.replica[0].w_nominal-TEST_PMF_CENTER);
+	for(i=0;i<TEST_REPLICAS;i++){
+		expected=-(0.5*TEST_PMF_FORCE*TEST_UMBRELLA_FORCE/(TEST_PMF_FORCE+TEST_UMBRELLA_FORCE)*
+		           (script.replica[i].w_nominal-TEST_PMF_CENTER)*(script.replica[i].w_nominal-TEST_PMF_CENTER)-A0);
+		deviation=fabs(script.replica[i].cancellation_energy-expected);
+		if(deviation>largest_deviation) largest_deviation=deviation;
+		if(deviation>TEST_TOLERANCE){
+			fprintf(stderr,"nominal position %d (w=%f): cancellation energy %f, analytic %f\n",i,script.replica[i].w_nominal,script.replica[i].cancellation_energy,expected);
+			failures++;
+		}
+	}
+	free_cancellation_wham();
+	delete[] script.replica;
+	if(failures>0){
+		fprintf(stderr,"test_cancellation_wham: %d nominal positions disagree with the analytic free energies\n",failures);
+		return(1);
+	}
+	printf("test_cancellation_wham: %d nominal positions within %.3f kcal/mol of the analytic free energies (largest deviation %.4f)\n",TEST_REPLICAS,TEST_TOLERANCE,largest_deviation);
+	return(0);
+}
@@ -0,0 +1,89 @@
+/*
+ *  This file is part of Distributed Replica.
+ *  Copyright May 9 2009
+ *
+ *  Distributed Replica manages a series of simulations that separately sample phase space
+ *  and coordinates their efforts under the Distributed Replica Potential Energy Function.
+ *  See, for example T. Rodinger, P.L. Howell, and R. Pomès, "Distributed Replica Sampling"    
+ *  J. Chem. Theory Comput., 2:725 (2006).
+ *
+ *  Distributed Replica is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Distributed Replica is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Distributed Replica.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks the moment-sum DRPE (replica_potential_trial() and replica_potential()) against the brute-force
+// replica_potential_pairwise() over random replica configurations and random trial moves, on uniform and
+// non-uniform nominal grids. Exits with 1 on the first disagreement.
+
+#define main DR_server_main
+#include "../DR_server.cpp"
+#undef main
+
+#define TEST_CONFIGURATIONS 200
+#define TEST_MOVES 50
+#define TEST_TOLERANCE 1.0e-5   //relative; replica_potential_pairwise() sums in float differences
+
+unsigned char drpe_agrees(double a, double reference){
+	return(fabs(a-reference)<=TEST_TOLERANCE*(fabs(reference)+1.0));
+}
+
+int main(int argc, char *argv[]){
+	struct script_struct script;
+	double trial, full, pairwise;
+	float w, span;
+	int N, replicaN, failures=0;
+
+	memset(&script,0,sizeof(script));
+	srand48(12345);
+	for(int c=0;c<TEST_CONFIGURATIONS;c++){
+		N=2+(int)(drand48()*80);
+		script.Nreplicas=N;
+		script.replica=new replica_struct[N];
+		script.replica_potential_scalar1=0.1+drand48();
+		script.replica_potential_scalar2=drand48();
+		// every other configuration has an uneven spacing, which the nominal grid indexes differently
+		script.replica[0].w_nominal=-5.0;
+		for(int i=1;i<N;i++){
+			script.replica[i].w_nominal=script.replica[i-1].w_nominal+((c&1)?0.2+drand48():0.5);
+		}
+		allocate_nominal_grid(&nominal_grid,N);
+		for(int i=0;i<N;i++) nominal_grid.w[i]=script.replica[i].w_nominal;
+		index_nominal_grid(&nominal_grid);
+		span=script.replica[N-1].w_nominal-script.replica[0].w_nominal;
+		for(int i=0;i<N;i++){
+			script.replica[i].w=script.replica[0].w_nominal-0.1*span+1.2*span*drand48();
+		}
+
+		for(int m=0;m<TEST_MOVES;m++){
+			replicaN=(int)(drand48()*N);
+			w=script.replica[0].w_nominal-0.1*span+1.2*span*drand48();
+			begin_replica_potential_trials(replicaN,&script);
+			trial=replica_potential_trial(w,&script);
+			script.replica[replicaN].w=w;
+			pairwise=replica_potential_pairwise(&script);
+			full=replica_potential(&script);
+			if(!drpe_agrees(trial,pairwise) || !drpe_agrees(full,pairwise)){
+				fprintf(stderr,"configuration %d move %d (N=%d): trial %.10g full %.10g pairwise %.10g\n",c,m,N,trial,full,pairwise);
+				failures++;
+			}
+		}
+		free_nominal_grid(&nominal_grid);
+		delete[] script.replica;
+	}
+	if(failures>0){
+		fprintf(stderr,"test_drpe: %d disagreements\n",failures);
+		return(1);
+	}
+	printf("test_drpe: %d configurations of %d moves agree with the pairwise DRPE\n",TEST_CONFIGURATIONS,TEST_MOVES);
+	return(0);
+}
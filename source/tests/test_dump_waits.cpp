@@ -0,0 +1,140 @@
+/*
+ *  This file is part of Distributed Replica.
+ *  Copyright May 9 2009
+ *
+ *  Distributed Replica manages a series of simulations that separately sample phase space
+ *  and coordinates their efforts under the Distributed Replica Potential Energy Function.
+ *  See, for example T. Rodinger, P.L. Howell, and R. Pomès, "Distributed Replica Sampling"    
+ *  J. Chem. Theory Comput., 2:725 (2006).
+ *
+ *  Distributed Replica is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Distributed Replica is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Distributed Replica.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Parks more than CLIENT_WORKER_THREADS_MAX workers in drop_one_old_node() at once, as when that many new clients
+// each wait for an old node to be dumped, and checks that the stall check in wait_for_clients() still lets the
+// pool start a worker for the queued check-ins that they wait for. Then lets the dumped nodes check in and checks
+// that every wait returns and that the cap applies again. Exits with 1 on the first failure.
+
+#define main DR_server_main
+#include "../DR_server.cpp"
+#undef main
+
+#define TEST_WAITS (CLIENT_WORKER_THREADS_MAX+6)
+#define TEST_TIMEOUT 30         //seconds
+
+struct script_struct script;
+struct node_struct node[TEST_WAITS];
+int Ndumped=0;
+
+// one worker of the pool that has taken a new client and waits for an old node to be dumped for it
+void *dump_wait(void *arg){
+	struct client_struct client;
+
+	memset(&client,0,sizeof(client));
+	acquire_client_log(&client);
+	pthread_mutex_lock(&client_queue_mutex);
+	Nclient_workers++;
+	pthread_mutex_unlock(&client_queue_mutex);
+	pthread_mutex_lock(&replica_mutex);
+	if(drop_one_old_node(&client,&script,node)>=0) Ndumped++;
+	pthread_mutex_unlock(&replica_mutex);
+	pthread_mutex_lock(&client_queue_mutex);
+	Nclient_workers--;
+	pthread_mutex_unlock(&client_queue_mutex);
+	release_client_log(client.log_buffer,client.log_allocated);
+	return(NULL);
+}
+
+int main(int argc, char *argv[]){
+	pthread_t handle[TEST_WAITS];
+	struct client_struct checkin;
+	struct client_bundle queued;
+	time_t start;
+	int i, Nfree, Nparked, failures=0;
+
+	strcpy(logFile_globalVar,"/dev/null");
+	pthread_mutex_init(&replica_mutex,NULL);
+	pthread_mutex_init(&client_queue_mutex,NULL);
+	pthread_cond_init(&client_queue_cond,NULL);
+	memset(&script,0,sizeof(script));
+	script.Nreplicas=TEST_WAITS;
+	script.replica=new replica_struct[TEST_WAITS];
+	memset(script.replica,0,TEST_WAITS*sizeof(replica_struct));
+	script.Nsamesystem_uncoupled=1;
+	script.node_time=100;
+	script.cycleClients=0.5;
+	for(i=0;i<TEST_WAITS;i++){
+		script.replica[i].status='R';
+		script.replica[i].nodeSlot=i;
+		node[i].active=true;
+		node[i].awaitingDump=false;
+		node[i].start_time=time(NULL)-1000+i;
+		strcpy(node[i].ip,"test");
+	}
+
+	for(i=0;i<TEST_WAITS;i++){
+		if(pthread_create(handle+i,NULL,dump_wait,NULL)!=0){
+			fprintf(stderr,"test_dump_waits: pthread_create failed\n");
+			return(1);
+		}
+	}
+	start=time(NULL);
+	do{
+		usleep(10000);
+		pthread_mutex_lock(&client_queue_mutex);
+		Nparked=Nclient_workers_parked;
+		pthread_mutex_unlock(&client_queue_mutex);
+	}while(Nparked<TEST_WAITS && time(NULL)-start<TEST_TIMEOUT);
+	if(Nparked!=TEST_WAITS){
+		fprintf(stderr,"only %d of %d workers reached the dump wait\n",Nparked,TEST_WAITS);
+		return(1);
+	}
+
+	// the check-in of a dumped node, queued since before the stall time
+	memset(&checkin,0,sizeof(checkin));
+	memset(&queued,0,sizeof(queued));
+	checkin.last_activity=time(NULL)-CLIENT_QUEUE_STALL_SECONDS;
+	queued.client=&checkin;
+	client_queue_head=client_queue_tail=&queued;
+	if(!client_queue_stalled(time(NULL),&Nfree)){
+		fprintf(stderr,"with %d workers parked in dump waits (%d free), the stall check starts no worker for the check-in\n",TEST_WAITS,Nfree);
+		failures++;
+	}
+
+	// the check-ins arrive; every wait must return
+	pthread_mutex_lock(&replica_mutex);
+	for(i=0;i<TEST_WAITS;i++) node[i].active=false;
+	pthread_mutex_unlock(&replica_mutex);
+	for(i=0;i<TEST_WAITS;i++) pthread_join(handle[i],NULL);
+	if(Ndumped!=TEST_WAITS || Nclient_workers_parked!=0){
+		fprintf(stderr,"%d of %d dump waits returned a node; %d workers are still parked\n",Ndumped,TEST_WAITS,Nclient_workers_parked);
+		failures++;
+	}
+
+	// without dump waits, a pool at the cap does not grow
+	Nclient_workers=CLIENT_WORKER_THREADS_MAX;
+	if(client_queue_stalled(time(NULL),&Nfree)){
+		fprintf(stderr,"the stall check starts a worker beyond CLIENT_WORKER_THREADS_MAX\n");
+		failures++;
+	}
+	Nclient_workers=0;
+	client_queue_head=client_queue_tail=NULL;
+	delete[] script.replica;
+	if(failures>0){
+		fprintf(stderr,"test_dump_waits: %d failures\n",failures);
+		return(1);
+	}
+	printf("test_dump_waits: %d simultaneous dump waits leave the pool room for the check-ins\n",TEST_WAITS);
+	return(0);
+}
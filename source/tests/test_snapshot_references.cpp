@@ -0,0 +1,139 @@
+/*
+ *  This file is part of Distributed Replica.
+ *  Copyright May 9 2009
+ *
+ *  Distributed Replica manages a series of simulations that separately sample phase space
+ *  and coordinates their efforts under the Distributed Replica Potential Energy Function.
+ *  See, for example T. Rodinger, P.L. Howell, and R. Pomès, "Distributed Replica Sampling"    
+ *  J. Chem. Theory Comput., 2:725 (2006).
+ *
+ *  Distributed Replica is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Distributed Replica is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Distributed Replica.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Writes a full snapshot, changes one replica and writes a second one, which must refer to the first for the
+// coordinate data of the others, and loads the second into a fresh script to check that every replica comes
+// back. Then checks that every SNAPSHOT_FULL_INTERVAL-th snapshot, and one written by save_snapshot(), is written
+// in full again.
+// Runs in a temporary directory. Exits with 1 on the first failure.
+
+#define main DR_server_main
+#include "../DR_server.cpp"
+#undef main
+
+#define TEST_REPLICAS 6
+#define TEST_ATOMS 2000
+
+off_t file_size(const char *name){
+	struct stat st;
+	return( (stat(name,&st)==0)?st.st_size:-1 );
+}
+
+void take_snapshot(struct script_struct *script, struct server_variable_struct *var, struct server_option_struct *opt, int n){
+	capture_snapshot(script,var,opt);
+	sprintf(snapshot.filename,"t.%d.snapshot",n);   // the captures all fall within one second
+	write_snapshot(false);
+}
+
+int main(int argc, char *argv[]){
+	struct script_struct script, loaded;
+	struct server_variable_struct var=DEFAULT_SERVER_VARIABLE_STRUCT;
+	struct server_option_struct opt=DEFAULT_SERVER_OPTION_STRUCT;
+	char dir[]="/tmp/test_snapshot_referencesXXXXXX";
+	char name[40];
+	off_t full_size, size;
+
+	strcpy(logFile_globalVar,"/dev/null");
+	if(mkdtemp(dir)==NULL || chdir(dir)!=0){
+		fprintf(stderr,"test_snapshot_references: cannot make a temporary directory\n");
+		return(1);
+	}
+	crc32c_init();
+	restart_store_init();
+	pthread_mutex_init(&log_mutex,NULL);
+	for(int i=0;i<REPLICA_DATA_LOCK_SHARDS;i++) pthread_mutex_init(&replica_data_mutex[i],NULL);
+	srand48(3);
+
+	memset(&script,0,sizeof(script));
+	script.Nreplicas=TEST_REPLICAS;
+	script.replica=new replica_struct[TEST_REPLICAS];
+	memset(script.replica,0,TEST_REPLICAS*sizeof(replica_struct));
+	var.Natoms=TEST_ATOMS;
+	strcpy(opt.title,"t");
+	for(int i=0;i<TEST_REPLICAS;i++){
+		script.replica[i].w_nominal=i;
+		script.replica[i].status='N';
+		script.replica[i].atom=new atom_struct[TEST_ATOMS];
+		for(int k=0;k<TEST_ATOMS;k++){
+			script.replica[i].atom[k].x=drand48();
+			script.replica[i].atom[k].y=drand48();
+			script.replica[i].atom[k].z=drand48();
+			script.replica[i].atom[k].weight=k;
+		}
+		script.replica[i].presence=new unsigned int[N_PRESENCE_BITS/32];
+		for(int k=0;k<N_PRESENCE_BITS/32;k++) script.replica[i].presence[k]=lrand48();
+	}
+	allocate_replica_restarts(&script);
+	allocate_snapshot(&script);
+
+	take_snapshot(&script,&var,&opt,0);
+	full_size=file_size("t.0.snapshot");
+	script.replica[2].atom[7].x+=1.0;
+	script.replica[2].presence[3]^=1;
+	snapshot_mark_dirty(2);
+	take_snapshot(&script,&var,&opt,1);
+	size=file_size("t.1.snapshot");
+	if(size<0 || size>full_size-(TEST_REPLICAS-2)*(off_t)(TEST_ATOMS*sizeof(struct atom_struct))){
+		fprintf(stderr,"test_snapshot_references: the second snapshot has %ld bytes, the first %ld\n",(long)size,(long)full_size);
+		return(1);
+	}
+
+	memset(&loaded,0,sizeof(loaded));
+	loaded.Nreplicas=TEST_REPLICAS;
+	delete[] replica_restart;
+	allocate_replica_restarts(&loaded);
+	load_snapshot((char *)"t.1.snapshot",&loaded,&var);
+	for(int i=0;i<TEST_REPLICAS;i++){
+		if(loaded.replica[i].atom==NULL || memcmp(loaded.replica[i].atom,script.replica[i].atom,TEST_ATOMS*sizeof(struct atom_struct))!=0 ||
+		   memcmp(loaded.replica[i].presence,script.replica[i].presence,N_PRESENCE_BITS/8)!=0){
+			fprintf(stderr,"test_snapshot_references: replica %d does not load back from t.1.snapshot\n",i);
+			return(1);
+		}
+	}
+
+	for(int n=2;n<=SNAPSHOT_FULL_INTERVAL;n++){
+		take_snapshot(&script,&var,&opt,n);
+		sprintf(name,"t.%d.snapshot",n);
+		size=file_size(name);
+		if( (n==SNAPSHOT_FULL_INTERVAL)!=(size==full_size) ){
+			fprintf(stderr,"test_snapshot_references: snapshot %d has %ld bytes, a full one %ld\n",n,(long)size,(long)full_size);
+			return(1);
+		}
+	}
+
+	capture_snapshot(&script,&var,&opt);
+	strcpy(snapshot.filename,"t.final.snapshot");
+	write_snapshot(true);
+	if(file_size("t.final.snapshot")!=full_size){
+		fprintf(stderr,"test_snapshot_references: a snapshot written in full has %ld bytes, the first %ld\n",(long)file_size("t.final.snapshot"),(long)full_size);
+		return(1);
+	}
+
+	unlink("t.final.snapshot");
+	for(int n=0;n<=SNAPSHOT_FULL_INTERVAL;n++){
+		sprintf(name,"t.%d.snapshot",n);
+		unlink(name);
+	}
+	if(chdir("/")==0) rmdir(dir);
+	return(0);
+}
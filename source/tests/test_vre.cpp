@@ -0,0 +1,120 @@
+/*
+ *  This file is part of Distributed Replica.
+ *  Copyright May 9 2009
+ *
+ *  Distributed Replica manages a series of simulations that separately sample phase space
+ *  and coordinates their efforts under the Distributed Replica Potential Energy Function.
+ *  See, for example T. Rodinger, P.L. Howell, and R. Pomès, "Distributed Replica Sampling"    
+ *  J. Chem. Theory Comput., 2:725 (2006).
+ *
+ *  Distributed Replica is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Distributed Replica is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Distributed Replica.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks popVRE() against the scan it replaced (the newest entry not from the popping replica, swapped with the
+// newest entry), over random pushes and pops from a few replicas with and without EvictRandom, and checks run[]
+// at the end of every run after each call. Then pops past a run of 100000 entries from the popping replica
+// 100000 times, which the scan could not do in the time of a test. Exits with 1 on the first failure.
+
+#define main DR_server_main
+#include "../DR_server.cpp"
+#undef main
+
+#define TEST_POOLS 3
+#define TEST_CALLS 200000
+#define TEST_RUN 100000
+
+// whether run[] is right at the end of every run of pool i
+bool runs_valid(int i){
+	struct vre_struct *v=&(vre[i]);
+	long int k,start=0;
+
+	for(k=0;k<=v->nlastused;k++){
+		if(k>0 && v->n[k].source!=v->n[k-1].source) start=k;
+		if(vre_run_end(v,k) && v->run[k]!=k-start) return(false);
+	}
+	return(true);
+}
+
+int main(int argc, char *argv[]){
+	struct vre_item_struct *model[TEST_POOLS];
+	long int nmodel[TEST_POOLS];
+	long int k;
+	float popped;
+	int source, check, i, rep, failures=0;
+
+	strcpy(logFile_globalVar,"/dev/null");
+	srand48(5);
+	for(int eviction=0;eviction<2;eviction++){
+		set_vre_size(eviction?50:-1);
+		set_secvre_size(-1);
+		set_vre_eviction(eviction?EvictRandom:DropNewest);
+		set_vre_seed(11);
+		if(allocateVRE(TEST_POOLS,-1)!=0){
+			fprintf(stderr,"test_vre: allocateVRE() failed\n");
+			return(1);
+		}
+		for(i=0;i<TEST_POOLS;i++){
+			model[i]=new struct vre_item_struct[TEST_CALLS+1];
+			nmodel[i]=0;
+		}
+		for(int call=0;call<TEST_CALLS && failures==0;call++){
+			i=(int)(drand48()*TEST_POOLS);
+			rep=(int)(drand48()*3);
+			if(drand48()<0.55){
+				pushVRE(i,rep,(float)call);
+				//EvictRandom writes over an entry that the model can not predict, so the model follows the pool
+				for(k=0;k<=vre[i].nlastused;k++) model[i][k]=vre[i].n[k];
+				nmodel[i]=vre[i].nlastused+1;
+			}else{
+				for(k=nmodel[i]-1;k>=0 && model[i][k].source==rep;k--);
+				check=popVRE(i,rep,&popped,&source);
+				if(k>=0){
+					if(check!=0 || popped!=model[i][k].val || source!=model[i][k].source){
+						fprintf(stderr,"test_vre: pool %d, replica %d popped %f from %d, the scan pops %f from %d\n",i,rep,popped,source,model[i][k].val,model[i][k].source);
+						failures++;
+					}
+					model[i][k]=model[i][nmodel[i]-1];
+					nmodel[i]--;
+				}else if(source!=-1 && check==0){
+					fprintf(stderr,"test_vre: pool %d, replica %d popped %f from %d, the scan finds nothing\n",i,rep,popped,source);
+					failures++;
+				}
+			}
+			if(vre[i].nlastused+1!=nmodel[i] || !runs_valid(i)){
+				fprintf(stderr,"test_vre: pool %d is out of step after call %d (%s)\n",i,call,eviction?"EvictRandom":"DropNewest");
+				failures++;
+			}
+		}
+		for(i=0;i<TEST_POOLS;i++) delete[] model[i];
+		if(failures>0) return(1);
+	}
+
+	//TEST_RUN entries from replica 0 on top of TEST_RUN from replica 1; replica 0 gets replica 1's newest each time
+	set_vre_size(-1);
+	set_vre_eviction(DropNewest);
+	allocateVRE(1,-1);
+	for(k=0;k<TEST_RUN;k++) pushVRE(0,1,(float)k);
+	for(k=0;k<TEST_RUN;k++) pushVRE(0,0,-1.0);
+	for(k=TEST_RUN-1;k>=0;k--){
+		if(popVRE(0,0,&popped,&source)!=0 || source!=1 || popped!=(float)k){
+			fprintf(stderr,"test_vre: pop %ld past the run returned %f from %d\n",TEST_RUN-1-k,popped,source);
+			return(1);
+		}
+	}
+	if(popVRE(0,0,&popped,&source)!=0 || source!=-1){
+		fprintf(stderr,"test_vre: a pool holding only replica 0's entries did not fall back to the secondary list\n");
+		return(1);
+	}
+	return(0);
+}
@@ -4,20 +4,40 @@
 
 #define DEFAULT_NUMSAVES_PRIMARY 100000
 #define DEFAULT_NUMSAVES_SECONDARY 1000
+//lists start this small and double as they fill, up to their maximum length
+#define VRE_INITIAL_ALLOCATION 1024
 
+// Each nominal position is a separate pool, vre[i] and secv[i], with its own erand48() stream, which leaves the
+// drand48() stream to the move code. There are no locks in here: DR_server only calls these functions with the
+// replica_mutex on.
+
+// What pushVRE() does with a value when the primary list of a pool can not grow any further
+enum vre_eviction_enum {DropNewest, EvictRandom};
+
+long int actual_numsaves_primary=DEFAULT_NUMSAVES_PRIMARY;
 long int actual_numsaves_secondary=DEFAULT_NUMSAVES_SECONDARY;
+long int vre_memory_limit=-1;                  //bytes for all lists together; <0 is no limit
+long int vre_memory_used=0;
+enum vre_eviction_enum vre_eviction=DropNewest;
+long int vre_seed=0;                           //the pool streams are derived from this; see set_vre_seed()
 
 // Begin vre Primary data storage ---------------------------
 
 struct vre_item_struct{
 	float val;
-	int source; 
+	int source;
 };
 
 struct vre_struct{
 	struct vre_item_struct *n;
 	long int nallocated;
 	long int nlastused;
+	long int nmax;                  //the list never grows past this many entries
+	long int ndropped;              //values that pushVRE() could not store
+	long int nevicted;              //stored values that pushVRE() overwrote to make room
+	unsigned short rng[3];          //erand48() state of this pool
+	int *run;                       //the run of entries from n[i].source that ends at n[i] starts at n[i-run[i]]. Only
+	                                //kept for the last entry of each run; beside n[] so that snapshots keep their format
 };
 
 static struct vre_struct *vre;
@@ -31,6 +51,8 @@ struct secondary_vre_struct{
 	long int nallocated;
 	long int nlastused;
 	long int nrecyclepush;
+	long int nmax;
+	long int nrecycled;             //values written over an older one because the list was at nmax
 };
 
 static struct secondary_vre_struct *secv;
@@ -41,16 +63,24 @@ void save_vre_pointers(int numnominal, long int *nallocated, long int *nlastused
 void load_vre_pointers(int numnominal, long int **nallocated, long int **nlastused, struct vre_item_struct ***item);
 void save_secvre_pointers(int numnominal, long int *nallocated, long int *nlastused, long int *nrecyclepush, float **val);
 void load_secvre_pointers(int numnominal, long int **nallocated, long int **nlastused, long int **nrecyclepush, float ***val);
+void get_vre_counts(int numnominal, long int *nstored, long int *nsecondary, long int *ndropped, long int *nevicted, long int *nrecycled);
+int reserve_vre_memory(long int bytes, bool force);
+long int vre_fallback_size(long int nallocated, long int needed, long int itemsize);
+int growVRE_primary(int numnominal, long int needed, bool force);
+int growVRE_secondary(int numnominal, long int needed, bool force);
 int allocateVRE_primary(int numnominal, int numsaves);
 int allocateVRE_secondary(int numnominal, int numsaves);
 int allocateVRE(int numnominal, int numsaves);
+void indexVREruns(int numnominal);
 int popVRE(int moveto, int thisrep, float *popped, int *source);
 void pushVRE(int thisnominal, int thisrep, float pushed);
-long int getVREallocationLevel(int numReplicas);
-long int getSECVREallocationLevel(int numReplicas);
 void showVRE(int numReplicas, FILE *f);
 int loadFileIntoVREforStartup(int replicaN, const char *fnam);
+void set_vre_size(long int val);
 void set_secvre_size(long int val);
+void set_vre_memory_limit(long int megabytes);
+void set_vre_eviction(enum vre_eviction_enum eviction);
+void set_vre_seed(long int seed);
 
 void save_vre_pointers(int numnominal, long int *nallocated, long int *nlastused, struct vre_item_struct **item){
 	*nallocated=vre[numnominal].nallocated;
@@ -58,6 +88,7 @@ void save_vre_pointers(int numnominal, long int *nallocated, long int *nlastused
 	*item=vre[numnominal].n;
 }
 
+// the caller must make room with growVRE_primary() before reading entries into *item
 void load_vre_pointers(int numnominal, long int **nallocated, long int **nlastused, struct vre_item_struct ***item){
 	*nallocated=&(vre[numnominal].nallocated);
 	*nlastused=&(vre[numnominal].nlastused);
@@ -71,6 +102,7 @@ void save_secvre_pointers(int numnominal, long int *nallocated, long int *nlastu
 	*val=secv[numnominal].val;
 }
 
+// the caller must make room with growVRE_secondary() before reading values into *val
 void load_secvre_pointers(int numnominal, long int **nallocated, long int **nlastused, long int **nrecyclepush, float ***val){
 	*nallocated=&(secv[numnominal].nallocated);
 	*nlastused=&(secv[numnominal].nlastused);
@@ -78,39 +110,148 @@ void load_secvre_pointers(int numnominal, long int **nallocated, long int **nlas
 	*val=&(secv[numnominal].val);
 }
 
+void get_vre_counts(int numnominal, long int *nstored, long int *nsecondary, long int *ndropped, long int *nevicted, long int *nrecycled){
+	*nstored=vre[numnominal].nlastused+1;
+	*nsecondary=secv[numnominal].nlastused+1;
+	*ndropped=vre[numnominal].ndropped;
+	*nevicted=vre[numnominal].nevicted;
+	*nrecycled=secv[numnominal].nrecycled;
+}
+
+// accounts for bytes more (or, if negative, fewer) of list storage. Returns -1 if that would pass
+// vre_memory_limit, unless force is set (for data that must be kept, such as a snapshot being loaded)
+int reserve_vre_memory(long int bytes, bool force){
+	int check=0;
+
+	if(bytes>0 && !force && vre_memory_limit>=0 && vre_memory_used+bytes>vre_memory_limit){
+		check=-1;
+	}else{
+		vre_memory_used+=bytes;
+	}
+	return check;
+}
+
+// the size to grow a list to when doubling it would pass vre_memory_limit: half of what is left of the budget,
+// but at least needed, so that filling the budget takes O(log) reallocations instead of one per push
+long int vre_fallback_size(long int nallocated, long int needed, long int itemsize){
+	long int size;
+
+	size=nallocated+(vre_memory_limit-vre_memory_used)/2/itemsize;
+	if(size<needed) size=needed;
+	return size;
+}
+
+// makes room for at least 'needed' entries in the primary list, doubling its size so that pushes stay
+// amortized O(1). Only force may go past nmax or vre_memory_limit
+int growVRE_primary(int numnominal, long int needed, bool force){
+	struct vre_struct *v=&(vre[numnominal]);
+	struct vre_item_struct *n;
+	int *run;
+	long int size;
+	long int entry_size=(long int)(sizeof(struct vre_item_struct)+sizeof(int));
+
+	if(needed<=v->nallocated) return 0;
+	if(!force && needed>v->nmax) return -1;
+	size=v->nallocated*2;
+	if(size<VRE_INITIAL_ALLOCATION) size=VRE_INITIAL_ALLOCATION;
+	if(size>v->nmax) size=v->nmax;
+	if(size<needed) size=needed;
+	if(reserve_vre_memory((size-v->nallocated)*entry_size,force)!=0){
+		size=vre_fallback_size(v->nallocated,needed,entry_size);
+		if(reserve_vre_memory((size-v->nallocated)*entry_size,force)!=0) return -1;
+	}
+	n=(struct vre_item_struct *)realloc(v->n,size*sizeof(struct vre_item_struct));
+	if(n!=NULL) v->n=n;
+	run=(int *)realloc(v->run,size*sizeof(int));
+	if(run!=NULL) v->run=run;
+	if(n==NULL || run==NULL){
+		//if only one of them grew, it is just bigger than it needs to be
+		reserve_vre_memory(-(size-v->nallocated)*entry_size,true);
+		return -1;
+	}
+	v->nallocated=size;
+	return 0;
+}
+
+// as growVRE_primary(), for the secondary list
+int growVRE_secondary(int numnominal, long int needed, bool force){
+	struct secondary_vre_struct *s=&(secv[numnominal]);
+	float *val;
+	long int size;
+
+	if(needed<=s->nallocated) return 0;
+	if(!force && needed>s->nmax) return -1;
+	size=s->nallocated*2;
+	if(size<VRE_INITIAL_ALLOCATION) size=VRE_INITIAL_ALLOCATION;
+	if(size>s->nmax) size=s->nmax;
+	if(size<needed) size=needed;
+	if(reserve_vre_memory((size-s->nallocated)*(long int)sizeof(float),force)!=0){
+		size=vre_fallback_size(s->nallocated,needed,(long int)sizeof(float));
+		if(reserve_vre_memory((size-s->nallocated)*(long int)sizeof(float),force)!=0) return -1;
+	}
+	val=(float *)realloc(s->val,size*sizeof(float));
+	if(val==NULL){
+		reserve_vre_memory(-(size-s->nallocated)*(long int)sizeof(float),true);
+		return -1;
+	}
+	s->val=val;
+	s->nallocated=size;
+	return 0;
+}
+
+// numsaves is the maximum length of each list; <0 uses set_vre_size()
 int allocateVRE_primary(int numnominal, int numsaves){
 	int i;
-	if(numsaves<0)numsaves=DEFAULT_NUMSAVES_PRIMARY;
+	unsigned long long seed;
+	long int nmax=numsaves;
+	if(nmax<0)nmax=actual_numsaves_primary;
 
 	vre=(struct vre_struct *)malloc(numnominal*sizeof(struct vre_struct));
 	if(vre==NULL){
 		return -1;
 	}
 	for(i=0;i<numnominal;i++){
-		vre[i].nallocated=numsaves;
+		vre[i].n=NULL;
+		vre[i].run=NULL;
+		vre[i].nallocated=0;
 		vre[i].nlastused=-1;
-		vre[i].n=(struct vre_item_struct *)malloc(numsaves*sizeof(struct vre_item_struct));
-		if(vre[i].n==NULL){
+		vre[i].nmax=nmax;
+		vre[i].ndropped=0;
+		vre[i].nevicted=0;
+		if(growVRE_primary(i,(nmax<VRE_INITIAL_ALLOCATION)?nmax:VRE_INITIAL_ALLOCATION,false)!=0){
 			return -1;
 		}
+		//derived from the logged seed, so a run is still reproducible from it, without drawing from the
+		//drand48() stream of the move code. The splitmix64 finalizer keeps neighbouring pools uncorrelated
+		seed=(unsigned long long)vre_seed+(unsigned long long)(i+1)*0x9E3779B97F4A7C15ULL;
+		seed=(seed^(seed>>30))*0xBF58476D1CE4E5B9ULL;
+		seed=(seed^(seed>>27))*0x94D049BB133111EBULL;
+		seed^=seed>>31;
+		vre[i].rng[0]=(unsigned short)(seed&0xFFFF);
+		vre[i].rng[1]=(unsigned short)((seed>>16)&0xFFFF);
+		vre[i].rng[2]=(unsigned short)((seed>>32)&0xFFFF);
 	}
 	return 0;
 }
 
+// numsaves is the maximum length of each list; <0 uses set_secvre_size()
 int allocateVRE_secondary(int numnominal, int numsaves){
 	int i;
-	if(numsaves<0)numsaves=DEFAULT_NUMSAVES_SECONDARY;
+	long int nmax=numsaves;
+	if(nmax<0)nmax=actual_numsaves_secondary;
 
 	secv=(struct secondary_vre_struct *)malloc(numnominal*sizeof(struct secondary_vre_struct));
 	if(secv==NULL){
 		return -1;
 	}
 	for(i=0;i<numnominal;i++){
-		secv[i].nallocated=numsaves;
+		secv[i].val=NULL;
+		secv[i].nallocated=0;
 		secv[i].nlastused=-1;
 		secv[i].nrecyclepush=-1;
-		secv[i].val=(float *)malloc(numsaves*sizeof(float));
-		if(secv[i].val==NULL){
+		secv[i].nmax=nmax;
+		secv[i].nrecycled=0;
+		if(growVRE_secondary(i,(nmax<VRE_INITIAL_ALLOCATION)?nmax:VRE_INITIAL_ALLOCATION,false)!=0){
 			return -1;
 		}
 	}
@@ -126,8 +267,31 @@ int allocateVRE(int numnominal, int numsaves){
   return (checka||checkb);
 }
 
+// whether n[i] is the last entry of its run: the newest entry, or followed by one from another source
+static inline bool vre_run_end(const struct vre_struct *v, long int i){
+	return(i==v->nlastused || v->n[i+1].source!=v->n[i].source);
+}
+
+// sets run[] of entries from..to from the entries before them; run[from-1] must be valid if n[from-1]
+// has the source of n[from]
+static void vre_mark_runs(struct vre_struct *v, long int from, long int to){
+	long int i;
+
+	for(i=from;i<=to;i++){
+		if(i>0 && v->n[i-1].source==v->n[i].source) v->run[i]=v->run[i-1]+1;
+		else v->run[i]=0;
+	}
+}
+
+// rebuilds vre[].run after n[] has been filled directly (e.g. by load_snapshot())
+void indexVREruns(int numnominal){
+	int i;
+
+	for(i=0;i<numnominal;i++) vre_mark_runs(&(vre[i]),0,vre[i].nlastused);
+}
+
 int popVRE(int moveto, int thisrep, float *popped, int *source){
-/* popVRE finds a cancelation value and removes it from the list 
+/* popVRE finds a cancelation value and removes it from the list
  *  - moveto is the nominal index to which a move may be made
  *  - thisrep is the replica index of the current sampling
  *  - popped is used to return the cancellation value
@@ -135,33 +299,44 @@ int popVRE(int moveto, int thisrep, float *popped, int *source){
  *    This is not necessary for execution, but allows more information to be output.
  *    source will be set to -1 when the popped value was from the secondary list.
  */
-	long int vp,svp;
-
-	for(vp=vre[moveto].nlastused;vp>=0 && vre[moveto].n[vp].source==thisrep; vp--);
+	struct vre_struct *v=&(vre[moveto]);
+	long int vp,svp,top;
+
+	//the newest entry that did not come from thisrep: the newest entry itself, or the one just below the
+	//run of entries from thisrep that ends at the newest entry
+	top=v->nlastused;
+	vp=top;
+	if(vp>=0 && v->n[vp].source==thisrep) vp-=v->run[vp]+1;
 	if(vp>=0){
 		/* Success:
 		 * Return the popped value via a pointer
 		 * Put the popped value into the secondary data structure,
 		 * Replace the popped value by the one at the end of the list
 		 * Reduce the number of entries by one.
-		 */ 
-		*popped=vre[moveto].n[vp].val;
-		*source=vre[moveto].n[vp].source;
-		if(++(secv[moveto].nlastused)<secv[moveto].nallocated){
-			secv[moveto].val[secv[moveto].nlastused]=*popped;
-		}else{
+		 */
+		*popped=v->n[vp].val;
+		*source=v->n[vp].source;
+		if(growVRE_secondary(moveto,secv[moveto].nlastused+2,false)==0){
+			secv[moveto].val[++(secv[moveto].nlastused)]=*popped;
+		}else if(secv[moveto].nlastused>=0){
 			//secv structure is full
-			secv[moveto].nlastused--;
 			//New code for v2.1.2 to cycle about used values
 			if(secv[moveto].nrecyclepush==-1||secv[moveto].nrecyclepush>secv[moveto].nlastused){
 				secv[moveto].nrecyclepush=0;
 			}
 			secv[moveto].val[secv[moveto].nrecyclepush]=*popped;
 			secv[moveto].nrecyclepush++;
+			secv[moveto].nrecycled++;
+		}
+		//n[vp] ends its run; an entry below it with the same source now ends that run instead
+		if(v->run[vp]>0) v->run[vp-1]=v->run[vp]-1;
+		if(vp<top){
+			//n[vp..top-1] become one run from thisrep, joined to the run below vp if that is from thisrep too
+			v->n[vp]=v->n[top];
+			v->run[top-1]=top-1-vp;
+			if(vp>0 && v->n[vp-1].source==thisrep) v->run[top-1]+=v->run[vp-1]+1;
 		}
-		vre[moveto].n[vp].val=vre[moveto].n[vre[moveto].nlastused].val;
-		vre[moveto].n[vp].source=vre[moveto].n[vre[moveto].nlastused].source;
-		vre[moveto].nlastused--;
+		v->nlastused--;
 		return 0;
 	}
 	//Did not find an unused entry. Now randomly pick one from the secondary array.
@@ -169,11 +344,11 @@ int popVRE(int moveto, int thisrep, float *popped, int *source){
 		//There are absolutely no values available
 		return -1;
 	}
-	//CN CHECK LATER THAT THIS drand48 IS RANDOMIZED BY MAIN srand48 CALL
-	svp=(long int)ceil(drand48()*(double)secv[moveto].nlastused);
+	svp=(long int)(erand48(vre[moveto].rng)*(double)(secv[moveto].nlastused+1));
+	if(svp>secv[moveto].nlastused) svp=secv[moveto].nlastused;
 	*popped=secv[moveto].val[svp];
 	*source=-1;
-	return 0; 
+	return 0;
 }
 
 void pushVRE(int thisnominal, int thisrep, float pushed){
@@ -181,42 +356,35 @@ void pushVRE(int thisnominal, int thisrep, float pushed){
  *  - thisnominal is the current nominal index of the replica
  *  - thisrep is the replica index of the current sampling
  *  - pushed carries the cancellation value
+ * If the list is at its maximum length (or the memory limit is reached), the value
+ * is dropped or, with EvictRandom, written over a randomly chosen stored value.
  */
-
-	if(++(vre[thisnominal].nlastused)<vre[thisnominal].nallocated){
-		vre[thisnominal].n[vre[thisnominal].nlastused].source=thisrep;
-		vre[thisnominal].n[vre[thisnominal].nlastused].val=pushed;
+	struct vre_struct *v=&(vre[thisnominal]);
+	long int vp,end;
+
+	if(growVRE_primary(thisnominal,v->nlastused+2,false)==0){
+		v->nlastused++;
+		v->n[v->nlastused].source=thisrep;
+		v->n[v->nlastused].val=pushed;
+		vre_mark_runs(v,v->nlastused,v->nlastused);
+	}else if(vre_eviction==EvictRandom && v->nlastused>=0){
+		vp=(long int)(erand48(v->rng)*(double)(v->nlastused+1));
+		if(vp>v->nlastused) vp=v->nlastused;
+		//this splits the run through n[vp] and may join it to its neighbours, so run[] is rebuilt from vp to the
+		//end of the run after the one through n[vp]. The entry below, if it had the same source, now ends its run
+		for(end=vp;!vre_run_end(v,end);end++);
+		if(vp>0 && v->n[vp-1].source==v->n[vp].source) v->run[vp-1]=v->run[end]-(end-vp)-1;
+		v->n[vp].source=thisrep;
+		v->n[vp].val=pushed;
+		for(end++;end<v->nlastused && !vre_run_end(v,end);end++);
+		vre_mark_runs(v,vp,(end<v->nlastused)?end:v->nlastused);
+		v->nevicted++;
 	}else{
 		//there is no space left in the array. Not really an error. There may be more space later
-		vre[thisnominal].nlastused--;
+		v->ndropped++;
 	}
 }
 
-long int getVREallocationLevel(int numReplicas){
-	int i;
-	long int minAllocated;
-
-	minAllocated=vre[0].nallocated;
-	for(i=0;i<numReplicas;i++){
-		if(vre[i].nallocated<minAllocated) minAllocated=vre[i].nallocated;
-	}
-
-	return minAllocated;
-}
-
-long int getSECVREallocationLevel(int numReplicas){
-        int i;
-        long int minAllocated;
-
-        minAllocated=secv[0].nallocated;
-        for(i=0;i<numReplicas;i++){
-                if(secv[i].nallocated<minAllocated) minAllocated=secv[i].nallocated;
-        }
-
-        return minAllocated;
-}
-
-
 void showVRE(int numReplicas, FILE *f){
 	int i,j;
 
@@ -225,6 +393,8 @@ void showVRE(int numReplicas, FILE *f){
 		fprintf(f,"Nominal position %d\n",i);
 		fprintf(f,"Nallocated %ld\n",vre[i].nallocated);
 		fprintf(f,"NlastUsed  %ld\n",vre[i].nlastused);
+		fprintf(f,"Ndropped  %ld\n",vre[i].ndropped);
+		fprintf(f,"Nevicted  %ld\n",vre[i].nevicted);
 		for(j=0;j<=vre[i].nlastused;j++){
 			fprintf(f,"%f %d\n",vre[i].n[j].val,vre[i].n[j].source);
 		}
@@ -235,6 +405,7 @@ void showVRE(int numReplicas, FILE *f){
 		fprintf(f,"Nallocated %ld\n",secv[i].nallocated);
 		fprintf(f,"NlastUsed  %ld\n",secv[i].nlastused);
 		fprintf(f,"NrecyclePush  %ld\n",secv[i].nrecyclepush);
+		fprintf(f,"Nrecycled  %ld\n",secv[i].nrecycled);
 		for(j=0;j<=secv[i].nlastused;j++){
 			fprintf(f,"%f\n",secv[i].val[j]);
 		}
@@ -252,19 +423,28 @@ int loadFileIntoVREforStartup(int replicaN, const char *fnam){
 	if(f==NULL)return 1;
 	while(fgets(linein,100,f)!=NULL){
 		if(sscanf(linein,"%f",&val)!=1)continue;
-		if(++(vre[replicaN].nlastused)>=vre[replicaN].nallocated){
-			--vre[replicaN].nlastused;
+		if(growVRE_primary(replicaN,vre[replicaN].nlastused+2,false)!=0){
 			fclose(f);
 			return 1;
 		}
+		++(vre[replicaN].nlastused);
 		vre[replicaN].n[vre[replicaN].nlastused].val=val;
 		vre[replicaN].n[vre[replicaN].nlastused].source=-9;
+		vre_mark_runs(&(vre[replicaN]),vre[replicaN].nlastused,vre[replicaN].nlastused);
 	}
 
 	fclose(f);
 	return 0;
 }
 
+void set_vre_size(long int val){
+	if(val<0){
+		actual_numsaves_primary=DEFAULT_NUMSAVES_PRIMARY;
+	}else{
+		actual_numsaves_primary=val;
+	}
+}
+
 void set_secvre_size(long int val){
         if(val<0){
                 actual_numsaves_secondary=DEFAULT_NUMSAVES_SECONDARY;
@@ -273,3 +453,19 @@ void set_secvre_size(long int val){
         }
 }
 
+void set_vre_memory_limit(long int megabytes){
+	if(megabytes<=0){
+		vre_memory_limit=-1;
+	}else{
+		vre_memory_limit=megabytes*1024*1024;
+	}
+}
+
+void set_vre_eviction(enum vre_eviction_enum eviction){
+	vre_eviction=eviction;
+}
+
+// the seed of the server's drand48() stream; must be called before allocateVRE()
+void set_vre_seed(long int seed){
+	vre_seed=seed;
+}
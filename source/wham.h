@@ -0,0 +1,520 @@
+/*
+ *  This file is part of Distributed Replica.
+ *  Copyright May 9 2009
+ *
+ *  Distributed Replica manages a series of simulations that separately sample phase space
+ *  and coordinates their efforts under the Distributed Replica Potential Energy Function.
+ *  See, for example T. Rodinger, P.L. Howell, and R. Pomès, "Distributed Replica Sampling"
+ *  J. Chem. Theory Comput., 2:725 (2006).
+ *
+ *  Distributed Replica is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Distributed Replica is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Distributed Replica.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Free energies of umbrella windows for analyse_force_database, by WHAM over a histogram or by MBAR over the samples.
+// Window k biases the sampled value x by 0.5*force[k]*(x-center[k])^2 (nearest periodic image on a circular
+// coordinate), the umbrella energy of DR_server, in kcal/mol; beta converts it to kT. Both solvers iterate their
+// self-consistent equations for the window free energies f[k] (in kT, the first sampled window at 0) and
+// accelerate the iteration with DIIS over the last WHAM_DIIS_DEPTH iterates. Windows without samples get f=NAN.
+// MBAR passes over the samples in blocks of MBAR_BLOCK_SAMPLES on up to Nthreads threads; the sums of the blocks
+// are added in block order so the results do not depend on the number of threads.
+
+#ifndef _WHAM_H
+#define _WHAM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#define WHAM_DIIS_DEPTH 6
+#define WHAM_TOLERANCE 1.0e-8           //largest change of any f[k] between iterations, in kT
+#define WHAM_MAX_ITERATIONS 100000
+#define MBAR_BLOCK_SAMPLES 65536
+#define MBAR_MAX_THREADS 64
+
+struct umbrella_struct{
+	int K;                  //windows
+	double *center;
+	double *force;          //kcal/mol per unit of x squared
+	double beta;            //1/kT in mol/kcal
+	bool circular;
+	double period;
+	int Nthreads;
+};
+
+// The active windows (those with samples), with the constants of the biases in kT
+struct active_windows_struct{
+	int K;
+	int *k;                 //index into umbrella_struct
+	double *center;
+	double *half_beta_force;
+	double *logN;
+};
+
+int get_active_windows(struct active_windows_struct *a, const struct umbrella_struct *u, const unsigned long *Nk){
+	int k;
+
+	a->K=0;
+	a->k=(int *)malloc(u->K*sizeof(int));
+	a->center=(double *)malloc(u->K*sizeof(double));
+	a->half_beta_force=(double *)malloc(u->K*sizeof(double));
+	a->logN=(double *)malloc(u->K*sizeof(double));
+	if(a->k==NULL || a->center==NULL || a->half_beta_force==NULL || a->logN==NULL){
+		fprintf(stderr,"Error: unable to allocate memory for the umbrella windows\n");
+		return 1;
+	}
+	for(k=0;k<u->K;k++){
+		if(Nk[k]==0) continue;
+		a->k[a->K]=k;
+		a->center[a->K]=u->center[k];
+		a->half_beta_force[a->K]=0.5*u->beta*u->force[k];
+		a->logN[a->K]=log((double)Nk[k]);
+		a->K++;
+	}
+	if(a->K==0){
+		fprintf(stderr,"Error: none of the umbrella windows has samples\n");
+		return 1;
+	}
+	return 0;
+}
+
+void free_active_windows(struct active_windows_struct *a){
+	free(a->k);
+	free(a->center);
+	free(a->half_beta_force);
+	free(a->logN);
+}
+
+// t[j]=logN[j]+f[j]-(bias of window j at x in kT); returns log(sum_j exp(t[j]))
+double umbrella_log_denominator(const struct umbrella_struct *u, const struct active_windows_struct *a, const double *f, double x, double *t){
+	double d,m,s;
+	int j;
+
+	if(u->circular){
+		for(j=0;j<a->K;j++){
+			d=x-a->center[j];
+			d-=u->period*rint(d/u->period);
+			t[j]=a->logN[j]+f[j]-a->half_beta_force[j]*d*d;
+		}
+	}else{
+		for(j=0;j<a->K;j++){
+			d=x-a->center[j];
+			t[j]=a->logN[j]+f[j]-a->half_beta_force[j]*d*d;
+		}
+	}
+	m=t[0];
+	for(j=1;j<a->K;j++) if(t[j]>m) m=t[j];
+	s=0.0;
+	for(j=0;j<a->K;j++) s+=exp(t[j]-m);
+	return(m+log(s));
+}
+
+// Solves the bordered system of DIIS, sum_j B[i][j]c[j]=lambda and sum_j c[j]=1, by elimination with pivoting
+int diis_coefficients(int n, double B[WHAM_DIIS_DEPTH][WHAM_DIIS_DEPTH], double *c){
+	double A[WHAM_DIIS_DEPTH+1][WHAM_DIIS_DEPTH+2];
+	double scale,p;
+	int i,j,r,best;
+
+	scale=0.0;
+	for(i=0;i<n;i++) if(B[i][i]>scale) scale=B[i][i];
+	if(scale<=0.0) return 1;
+	for(i=0;i<n;i++){
+		for(j=0;j<n;j++) A[i][j]=B[i][j]/scale;
+		A[i][n]=-1.0;
+		A[i][n+1]=0.0;
+	}
+	for(j=0;j<n;j++) A[n][j]=1.0;
+	A[n][n]=0.0;
+	A[n][n+1]=1.0;
+
+	for(i=0;i<=n;i++){
+		best=i;
+		for(r=i+1;r<=n;r++) if(fabs(A[r][i])>fabs(A[best][i])) best=r;
+		if(fabs(A[best][i])<1.0e-14) return 1;
+		if(best!=i){
+			for(j=0;j<=n+1;j++){ p=A[i][j]; A[i][j]=A[best][j]; A[best][j]=p; }
+		}
+		for(r=0;r<=n;r++){
+			if(r==i || A[r][i]==0.0) continue;
+			p=A[r][i]/A[i][i];
+			for(j=i;j<=n+1;j++) A[r][j]-=p*A[i][j];
+		}
+	}
+	for(i=0;i<n;i++) c[i]=A[i][n+1]/A[i][i];
+	return 0;
+}
+
+// Iterates f=map(f) from the given f until no element changes by more than WHAM_TOLERANCE. The next f is the
+// combination of the last iterates whose residuals (map(f)-f) combine to the smallest residual; the plain
+// step is taken, and the history forgotten, when that combination cannot be found or the residual grows.
+int solve_fixed_point(int (*map)(void *context, const double *f, double *g), void *context, int K, double *f, int *iterations){
+	double *memory;
+	double *g[WHAM_DIIS_DEPTH],*r[WHAM_DIIS_DEPTH];
+	double B[WHAM_DIIS_DEPTH][WHAM_DIIS_DEPTH];
+	double c[WHAM_DIIS_DEPTH];
+	double norm,best_norm=HUGE_VAL;
+	int n=0,next=0,it,i,j,k;
+
+	memory=(double *)malloc(2*WHAM_DIIS_DEPTH*K*sizeof(double));
+	if(memory==NULL){
+		fprintf(stderr,"Error: unable to allocate memory for the free energy iteration\n");
+		return 1;
+	}
+	for(i=0;i<WHAM_DIIS_DEPTH;i++){
+		g[i]=memory+2*i*K;
+		r[i]=memory+(2*i+1)*K;
+	}
+
+	for(it=1;it<=WHAM_MAX_ITERATIONS;it++){
+		if(map(context,f,g[next])!=0){
+			free(memory);
+			return 1;
+		}
+		norm=0.0;
+		for(k=0;k<K;k++){
+			r[next][k]=g[next][k]-f[k];
+			if(fabs(r[next][k])>norm) norm=fabs(r[next][k]);
+		}
+		if(!(norm<HUGE_VAL)){
+			fprintf(stderr,"Error: the free energy iteration diverged\n");
+			free(memory);
+			return 1;
+		}
+		if(norm<WHAM_TOLERANCE){
+			memcpy(f,g[next],K*sizeof(double));
+			*iterations=it;
+			free(memory);
+			return 0;
+		}
+		if(norm>10.0*best_norm){
+			// DIIS has led away from the solution; restart it from the plain step
+			memcpy(g[0],g[next],K*sizeof(double));
+			memcpy(r[0],r[next],K*sizeof(double));
+			n=1;
+			next=1;
+			best_norm=norm;
+			memcpy(f,g[0],K*sizeof(double));
+			continue;
+		}
+		if(norm<best_norm) best_norm=norm;
+		if(n<WHAM_DIIS_DEPTH) n++;
+		for(i=0;i<n;i++){
+			for(j=0;j<=i;j++){
+				B[i][j]=0.0;
+				for(k=0;k<K;k++) B[i][j]+=r[i][k]*r[j][k];
+				B[j][i]=B[i][j];
+			}
+		}
+		if(n>1 && diis_coefficients(n,B,c)==0){
+			for(k=0;k<K;k++){
+				f[k]=0.0;
+				for(i=0;i<n;i++) f[k]+=c[i]*g[i][k];
+			}
+		}else{
+			memcpy(f,g[next],K*sizeof(double));
+			if(n>1){
+				memcpy(g[0],g[next],K*sizeof(double));
+				memcpy(r[0],r[next],K*sizeof(double));
+				n=1;
+				next=0;
+			}
+		}
+		next=(next+1)%WHAM_DIIS_DEPTH;
+	}
+	fprintf(stderr,"Error: the free energy iteration did not converge in %d iterations\n",WHAM_MAX_ITERATIONS);
+	free(memory);
+	return 1;
+}
+
+//*********************************************************************
+// WHAM: count[i] samples in the bin centred on bin_center[i]
+
+struct wham_context_struct{
+	const struct active_windows_struct *a;
+	int Nbins;
+	const double *count;
+	double *bias;           //[j*Nbins+i], bias of active window j at the centre of bin i in kT
+	double *logP;
+};
+
+double log_sum_exp(const double *v, int n){
+	double m,s;
+	int i;
+
+	m=-HUGE_VAL;
+	for(i=0;i<n;i++) if(v[i]>m) m=v[i];
+	if(m==-HUGE_VAL) return(m);
+	s=0.0;
+	for(i=0;i<n;i++) s+=exp(v[i]-m);
+	return(m+log(s));
+}
+
+// logP[i] of each bin for the window free energies f; t[] has room for the larger of K and Nbins
+void wham_log_probabilities(struct wham_context_struct *w, const double *f, double *t){
+	int i,j;
+
+	for(i=0;i<w->Nbins;i++){
+		if(w->count[i]<=0.0){
+			w->logP[i]=-HUGE_VAL;
+			continue;
+		}
+		for(j=0;j<w->a->K;j++) t[j]=w->a->logN[j]+f[j]-w->bias[j*w->Nbins+i];
+		w->logP[i]=log(w->count[i])-log_sum_exp(t,w->a->K);
+	}
+}
+
+int wham_map(void *context, const double *f, double *g){
+	struct wham_context_struct *w=(struct wham_context_struct *)context;
+	double *t=w->logP+w->Nbins;
+	int i,j;
+
+	wham_log_probabilities(w,f,t);
+	for(j=0;j<w->a->K;j++){
+		for(i=0;i<w->Nbins;i++) t[i]=w->logP[i]-w->bias[j*w->Nbins+i];
+		g[j]=-log_sum_exp(t,w->Nbins);
+	}
+	for(j=w->a->K-1;j>=0;j--) g[j]-=g[0];
+	return 0;
+}
+
+// Window free energies f[u->K] and the PMF of each bin in kcal/mol (NAN for empty bins, minimum at 0)
+int solve_wham(const struct umbrella_struct *u, const unsigned long *Nk, int Nbins, const double *bin_center, const double *count, double *f, double *pmf, int *iterations){
+	struct active_windows_struct a;
+	struct wham_context_struct w;
+	double *fa;
+	double d,low;
+	int i,j,check;
+
+	if(get_active_windows(&a,u,Nk)!=0) return 1;
+	fa=(double *)calloc(a.K,sizeof(double));
+	w.bias=(double *)malloc((size_t)a.K*Nbins*sizeof(double));
+	w.logP=(double *)malloc((Nbins+(a.K>Nbins?a.K:Nbins))*sizeof(double));
+	if(fa==NULL || w.bias==NULL || w.logP==NULL){
+		fprintf(stderr,"Error: unable to allocate memory for WHAM\n");
+		return 1;
+	}
+	w.a=&a;
+	w.Nbins=Nbins;
+	w.count=count;
+	for(j=0;j<a.K;j++){
+		for(i=0;i<Nbins;i++){
+			d=bin_center[i]-a.center[j];
+			if(u->circular) d-=u->period*rint(d/u->period);
+			w.bias[j*Nbins+i]=a.half_beta_force[j]*d*d;
+		}
+	}
+
+	check=solve_fixed_point(wham_map,&w,a.K,fa,iterations);
+	if(check==0){
+		for(i=0;i<u->K;i++) f[i]=NAN;
+		for(j=0;j<a.K;j++) f[a.k[j]]=fa[j];
+		wham_log_probabilities(&w,fa,w.logP+Nbins);
+		low=HUGE_VAL;
+		for(i=0;i<Nbins;i++){
+			if(count[i]>0.0 && -w.logP[i]<low) low=-w.logP[i];
+		}
+		for(i=0;i<Nbins;i++){
+			if(count[i]>0.0) pmf[i]=(-w.logP[i]-low)/u->beta;
+			else pmf[i]=NAN;
+		}
+	}
+	free(fa);
+	free(w.bias);
+	free(w.logP);
+	free_active_windows(&a);
+	return check;
+}
+
+//*********************************************************************
+// MBAR: N samples x[], Nk[k] of them from window k
+
+struct mbar_context_struct{
+	const struct umbrella_struct *u;
+	const struct active_windows_struct *a;
+	unsigned long N;
+	const float *x;
+	const double *f;
+	int Nblocks;
+	int next_block;
+	pthread_mutex_t mutex;
+	// with bin_width==0 each block sums exp(t[j]-log denominator) over its samples into sum[block*K+j];
+	// otherwise it keeps a running log-sum-exp of -log denominator for each bin in max[] and sum[]
+	double min,bin_width;
+	int Nbins;
+	double *sum;
+	double *max;
+};
+
+struct mbar_thread_struct{
+	pthread_t handle;
+	struct mbar_context_struct *c;
+	double *t;
+};
+
+void *mbar_worker(void *arg){
+	struct mbar_thread_struct *th=(struct mbar_thread_struct *)arg;
+	struct mbar_context_struct *c=th->c;
+	const struct active_windows_struct *a=c->a;
+	unsigned long n,end;
+	double logden,v,*sum,*max;
+	int b,j,bin;
+
+	while(1){
+		pthread_mutex_lock(&(c->mutex));
+		b=c->next_block++;
+		pthread_mutex_unlock(&(c->mutex));
+		if(b>=c->Nblocks) break;
+		end=(unsigned long)(b+1)*MBAR_BLOCK_SAMPLES;
+		if(end>c->N) end=c->N;
+
+		if(c->bin_width==0.0){
+			sum=c->sum+(size_t)b*a->K;
+			for(j=0;j<a->K;j++) sum[j]=0.0;
+			for(n=(unsigned long)b*MBAR_BLOCK_SAMPLES;n<end;n++){
+				logden=umbrella_log_denominator(c->u,a,c->f,c->x[n],th->t);
+				for(j=0;j<a->K;j++) sum[j]+=exp(th->t[j]-logden);
+			}
+		}else{
+			sum=c->sum+(size_t)b*c->Nbins;
+			max=c->max+(size_t)b*c->Nbins;
+			for(j=0;j<c->Nbins;j++){
+				sum[j]=0.0;
+				max[j]=-HUGE_VAL;
+			}
+			for(n=(unsigned long)b*MBAR_BLOCK_SAMPLES;n<end;n++){
+				bin=(int)floor((c->x[n]-c->min)/c->bin_width);
+				if(bin<0 || bin>c->Nbins) continue;
+				if(bin==c->Nbins) bin--;
+				v=-umbrella_log_denominator(c->u,a,c->f,c->x[n],th->t);
+				if(v>max[bin]){
+					sum[bin]=sum[bin]*exp(max[bin]-v)+1.0;
+					max[bin]=v;
+				}else{
+					sum[bin]+=exp(v-max[bin]);
+				}
+			}
+		}
+	}
+	return(NULL);
+}
+
+int mbar_run_blocks(struct mbar_context_struct *c){
+	struct mbar_thread_struct th[MBAR_MAX_THREADS];
+	bool started[MBAR_MAX_THREADS];
+	int Nthreads=c->u->Nthreads;
+	int i;
+
+	if(Nthreads>MBAR_MAX_THREADS) Nthreads=MBAR_MAX_THREADS;
+	if(Nthreads>c->Nblocks) Nthreads=c->Nblocks;
+	if(Nthreads<1) Nthreads=1;
+	c->next_block=0;
+	for(i=0;i<Nthreads;i++){
+		th[i].c=c;
+		th[i].t=(double *)malloc(c->a->K*sizeof(double));
+		if(th[i].t==NULL){
+			fprintf(stderr,"Error: unable to allocate memory for MBAR\n");
+			while(--i>=0) free(th[i].t);
+			return 1;
+		}
+	}
+	for(i=1;i<Nthreads;i++) started[i]=(pthread_create(&(th[i].handle),NULL,mbar_worker,th+i)==0);
+	mbar_worker(th);
+	for(i=1;i<Nthreads;i++) if(started[i]) pthread_join(th[i].handle,NULL);
+	for(i=0;i<Nthreads;i++) free(th[i].t);
+	return 0;
+}
+
+int mbar_map(void *context, const double *f, double *g){
+	struct mbar_context_struct *c=(struct mbar_context_struct *)context;
+	const struct active_windows_struct *a=c->a;
+	double s;
+	int b,j;
+
+	c->f=f;
+	if(mbar_run_blocks(c)!=0) return 1;
+	for(j=0;j<a->K;j++){
+		s=0.0;
+		for(b=0;b<c->Nblocks;b++) s+=c->sum[(size_t)b*a->K+j];
+		// s converges to N[j]
+		g[j]=a->logN[j]+f[j]-log(s);
+	}
+	for(j=a->K-1;j>=0;j--) g[j]-=g[0];
+	return 0;
+}
+
+// Window free energies f[u->K] and the PMF in Nbins bins of bin_width from min, in kcal/mol (NAN for empty bins,
+// minimum at 0); samples outside the bins count for the free energies but not for the PMF
+int solve_mbar(const struct umbrella_struct *u, const unsigned long *Nk, unsigned long N, const float *x, int Nbins, double min, double bin_width, double *f, double *pmf, int *iterations){
+	struct active_windows_struct a;
+	struct mbar_context_struct c;
+	double *fa;
+	double m,s,low;
+	int i,b,check;
+	size_t size;
+
+	if(get_active_windows(&a,u,Nk)!=0) return 1;
+	c.u=u;
+	c.a=&a;
+	c.N=N;
+	c.x=x;
+	c.Nblocks=(int)((N+MBAR_BLOCK_SAMPLES-1)/MBAR_BLOCK_SAMPLES);
+	c.bin_width=0.0;
+	c.Nbins=Nbins;
+	c.min=min;
+	size=(size_t)c.Nblocks*(a.K>Nbins?a.K:Nbins);
+	fa=(double *)calloc(a.K,sizeof(double));
+	c.sum=(double *)malloc(size*sizeof(double));
+	c.max=(double *)malloc(size*sizeof(double));
+	if(fa==NULL || c.sum==NULL || c.max==NULL){
+		fprintf(stderr,"Error: unable to allocate memory for MBAR\n");
+		return 1;
+	}
+	pthread_mutex_init(&(c.mutex),NULL);
+
+	check=solve_fixed_point(mbar_map,&c,a.K,fa,iterations);
+	if(check==0){
+		for(i=0;i<u->K;i++) f[i]=NAN;
+		for(i=0;i<a.K;i++) f[a.k[i]]=fa[i];
+
+		// the unbiased weight of each sample is exp(-log denominator)
+		c.f=fa;
+		c.bin_width=bin_width;
+		check=mbar_run_blocks(&c);
+	}
+	if(check==0){
+		low=HUGE_VAL;
+		for(i=0;i<Nbins;i++){
+			m=-HUGE_VAL;
+			for(b=0;b<c.Nblocks;b++) if(c.max[(size_t)b*Nbins+i]>m) m=c.max[(size_t)b*Nbins+i];
+			if(m==-HUGE_VAL){
+				pmf[i]=NAN;
+				continue;
+			}
+			s=0.0;
+			for(b=0;b<c.Nblocks;b++) s+=c.sum[(size_t)b*Nbins+i]*exp(c.max[(size_t)b*Nbins+i]-m);
+			pmf[i]=-(m+log(s));
+			if(pmf[i]<low) low=pmf[i];
+		}
+		for(i=0;i<Nbins;i++) pmf[i]=(pmf[i]-low)/u->beta;
+	}
+	pthread_mutex_destroy(&(c.mutex));
+	free(fa);
+	free(c.sum);
+	free(c.max);
+	free_active_windows(&a);
+	return check;
+}
+
+#endif